@@ -0,0 +1,166 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#ifndef FOILS_HID_CAPTURE_H_
+#define FOILS_HID_CAPTURE_H_
+
+/**
+   @file
+   @module {HID report capture}
+   @short Report stream recording
+
+   A capture is an append-only, memory-mapped file where every report
+   going through the client is recorded along with a monotonic
+   timestamp.  Recording takes no lock and does no allocation, it may
+   stay enabled in production.
+
+   The file starts with a @ref foils_hid_capture_header, followed by
+   a sequence of @ref foils_hid_capture_record, each one followed by
+   its payload.  Records are 8-byte aligned.  All fields are in host
+   byte order.
+*/
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define FOILS_HID_CAPTURE_MAGIC "FHIDCAP"
+#define FOILS_HID_CAPTURE_VERSION 1
+
+/**
+   @this is the recorded event type.
+ */
+enum foils_hid_capture_type
+{
+    /** Record space is reserved, but record is not written yet */
+    FOILS_HID_CAPTURE_NONE = 0,
+    /** Input report sent by a device */
+    FOILS_HID_CAPTURE_INPUT = 1,
+    /** Feature report sent by a device */
+    FOILS_HID_CAPTURE_FEATURE_SENT = 2,
+    /** Output report received from server */
+    FOILS_HID_CAPTURE_OUTPUT = 3,
+    /** Feature report received from server */
+    FOILS_HID_CAPTURE_FEATURE_RECEIVED = 4,
+    /** Report grabbed by server */
+    FOILS_HID_CAPTURE_GRAB = 5,
+    /** Report released by server */
+    FOILS_HID_CAPTURE_RELEASE = 6,
+    /** Feature report sollicited by server */
+    FOILS_HID_CAPTURE_SOLLICIT = 7,
+    /** Device announced to server.  Payload is the device version
+        on 16 bits, its name, NUL terminated, then its report
+        descriptor. */
+    FOILS_HID_CAPTURE_DEVICE = 8,
+};
+
+/** Set in @ref foils_hid_capture_record::type for reliable reports */
+#define FOILS_HID_CAPTURE_RELIABLE 0x80
+#define FOILS_HID_CAPTURE_TYPE_MASK 0x7f
+
+/**
+   @this is the capture file header.
+ */
+struct foils_hid_capture_header
+{
+    char magic[8];
+    uint32_t version;
+    /** Offset of first record */
+    uint32_t header_size;
+    /** Total file size */
+    uint64_t size;
+    /** Bytes of records after header, updated atomically */
+    uint64_t used;
+    /** Count of records lost for lack of space */
+    uint64_t dropped;
+    /** CLOCK_MONOTONIC at capture creation, in nanoseconds */
+    uint64_t origin;
+};
+
+/**
+   @this is a record header.  Payload follows.
+ */
+struct foils_hid_capture_record
+{
+    /** CLOCK_MONOTONIC, in nanoseconds */
+    uint64_t timestamp;
+    uint32_t device_id;
+    /** Payload size */
+    uint16_t size;
+    uint8_t report_id;
+    /** @ref foils_hid_capture_type, with reliable flag.  Written
+        last, when the record is complete. */
+    uint8_t type;
+};
+
+/**
+   @this returns the space taken by a record with a given payload
+   size.
+ */
+static inline
+size_t foils_hid_capture_record_size(size_t payload_size)
+{
+    return (sizeof(struct foils_hid_capture_record) + payload_size + 7)
+        & ~(size_t)7;
+}
+
+/**
+   @this is a capture file writer context.
+
+   @hidecontent
+ */
+struct foils_hid_capture
+{
+    struct foils_hid_capture_header *map;
+    size_t size;
+    int fd;
+};
+
+/**
+   @this creates a capture file.  Whole file is allocated and mapped
+   upfront.  Once full, records are dropped and accounted in
+   @ref foils_hid_capture_header::dropped.
+
+   @param capture Capture context
+   @param path File path, truncated if it exists
+   @param size File size
+
+   @returns 0 when done, or an error taken from errno(7)
+ */
+int foils_hid_capture_open(
+    struct foils_hid_capture *capture,
+    const char *path,
+    size_t size);
+
+/**
+   @this records an event.  This may be called from any thread.
+
+   @param capture Capture context
+   @param type Event type, may be or-ed with @tt FOILS_HID_CAPTURE_RELIABLE
+   @param device_id Device index
+   @param report_id Report index
+   @param data Report data, may be NULL if datalen is 0
+   @param datalen Report data size
+ */
+void foils_hid_capture_record(
+    struct foils_hid_capture *capture,
+    uint8_t type,
+    uint32_t device_id, uint8_t report_id,
+    const void *data, size_t datalen);
+
+/**
+   @this closes a capture file.  File is truncated to its used size.
+
+   @param capture Capture context
+ */
+void foils_hid_capture_close(
+    struct foils_hid_capture *capture);
+
+#endif
@@ -0,0 +1,107 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#ifndef FOILS_COMPACT_HEADER_H_
+#define FOILS_COMPACT_HEADER_H_
+
+/**
+   @file
+   @module {HID rudp client}
+   @short Compact report header codec
+
+   Compact headers replace the 8-byte fixed report header when @ref
+   FOILS_HID_FEATURE_COMPACT is enabled.  They are made of:
+   @list
+     @item a varint of @tt {device_id << 1 | timestamp_flag}: 7 bits
+       per byte, least significant first, top bit set on all bytes but
+       the last one,
+     @item the report id, on one byte.
+   @end list
+
+   Devices 0 to 63 take a 2-byte header.  When the timestamp flag is
+   set, the same 32-bit big-endian timestamp as in fixed headers
+   follows.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** Longest compact header, for a 32-bit device id */
+#define FOILS_HID_COMPACT_HEADER_MAX 6
+
+/** Set in compact header flags when a timestamp follows */
+#define FOILS_HID_COMPACT_TIMESTAMP 1
+
+/**
+   @this encodes a compact header.
+
+   @param buf Output buffer, at least @ref FOILS_HID_COMPACT_HEADER_MAX
+          bytes
+   @param device_id Device index
+   @param report_id Report index
+   @param flags @ref FOILS_HID_COMPACT_TIMESTAMP or 0
+   @returns the header size
+ */
+static inline
+size_t foils_hid_compact_header_encode(
+    uint8_t *buf,
+    uint32_t device_id, uint8_t report_id,
+    unsigned int flags)
+{
+    uint64_t v = (uint64_t)device_id << 1 | (flags & 1);
+    size_t len = 0;
+
+    while (v >= 0x80) {
+        buf[len++] = v | 0x80;
+        v >>= 7;
+    }
+    buf[len++] = v;
+    buf[len++] = report_id;
+
+    return len;
+}
+
+/**
+   @this decodes a compact header.
+
+   @param buf Packet data
+   @param size Packet size
+   @param device_id Decoded device index
+   @param report_id Decoded report index
+   @param flags Decoded flags
+   @returns the header size, or 0 if malformed
+ */
+static inline
+size_t foils_hid_compact_header_decode(
+    const uint8_t *buf, size_t size,
+    uint32_t *device_id, uint8_t *report_id,
+    unsigned int *flags)
+{
+    uint64_t v = 0;
+    size_t len = 0;
+
+    do {
+        if (len == size || len == FOILS_HID_COMPACT_HEADER_MAX - 1)
+            return 0;
+        v |= (uint64_t)(buf[len] & 0x7f) << (7 * len);
+    } while (buf[len++] & 0x80);
+
+    if (len == size || v >> 33)
+        return 0;
+
+    *device_id = v >> 1;
+    *flags = v & 1;
+    *report_id = buf[len++];
+
+    return len;
+}
+
+#endif
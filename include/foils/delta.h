@@ -0,0 +1,66 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#ifndef FOILS_DELTA_H_
+#define FOILS_DELTA_H_
+
+/**
+   @file
+   @module {HID rudp client}
+   @short Report delta codec
+
+   When @ref FOILS_HID_FEATURE_DELTA is in use, large reports may be
+   sent as a difference to a reference report, the last keyframe.
+
+   A delta is the XOR of the report with the reference, run-length
+   encoded as a sequence of runs.  Each run is a count of unchanged
+   bytes to skip, on one byte, a count of changed bytes, on one byte,
+   then the changed bytes XOR the reference.  Bytes past the last run
+   are unchanged.  An empty delta is an unchanged report.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+   @this encodes the difference between two reports.
+
+   @param ref Reference report
+   @param cur Report to encode
+   @param size Size of both reports
+   @param out Output buffer
+   @param out_size Output buffer size
+   @param out_len Encoded delta size
+
+   @returns 0 when done, or EMSGSIZE if delta does not fit in
+   out_size bytes.
+ */
+int foils_hid_delta_encode(
+    const uint8_t *ref, const uint8_t *cur, size_t size,
+    uint8_t *out, size_t out_size, size_t *out_len);
+
+/**
+   @this rebuilds a report from its reference and a delta.
+
+   @param ref Reference report
+   @param size Reference report size
+   @param delta Encoded delta
+   @param delta_len Encoded delta size
+   @param out Rebuilt report, size bytes
+
+   @returns 0 when done, or EINVAL if delta is malformed.
+ */
+int foils_hid_delta_decode(
+    const uint8_t *ref, size_t size,
+    const uint8_t *delta, size_t delta_len,
+    uint8_t *out);
+
+#endif
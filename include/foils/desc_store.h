@@ -0,0 +1,122 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#ifndef FOILS_DESC_STORE_H_
+#define FOILS_DESC_STORE_H_
+
+/**
+   @file
+   @module {HID rudp client}
+   @short Shared device descriptor store
+
+   Processes running many clients usually announce the same few
+   devices over and over.  A store keeps the announce packet of each
+   distinct descriptor once, built and ready to send, whatever the
+   count of clients and devices using it.
+
+   Descriptors are looked up by identity: two descriptors with the
+   same name and version, and the same blobs at the same addresses,
+   share an entry.  Blobs are not read on lookup, a lookup hitting an
+   entry builds and allocates nothing.  Blobs must not change while
+   an entry built from them is referenced.  Entries are reference
+   counted, the last release frees them.
+
+   Packets are sent as they are kept, with the device id written in
+   their header, the only copy made is the one kept by the
+   transport.
+
+   A store is not locked, it must be used from one thread.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <foils/hid_device.h>
+
+struct foils_hid_desc;
+
+/**
+   @this is the descriptor store state.
+
+   @hidecontent
+ */
+struct foils_hid_desc_store
+{
+    struct foils_hid_desc **bucket;
+    size_t bucket_count;
+    size_t count;
+};
+
+/**
+   @this initializes an empty store.
+
+   @param store Store state
+ */
+void foils_hid_desc_store_init(struct foils_hid_desc_store *store);
+
+/**
+   @this releases the store.  All entries should have been released
+   before, entries left are freed anyway.
+
+   @param store Store state
+ */
+void foils_hid_desc_store_deinit(struct foils_hid_desc_store *store);
+
+/**
+   @this takes a reference to the entry of a descriptor, creating it
+   if no descriptor with the same name, version and blobs is in the
+   store yet.
+
+   @param store Store state
+   @param desc Device descriptor, its blobs are referenced by the entry
+   @param entry Returned entry
+   @returns 0 when done, or ENOMEM
+ */
+int foils_hid_desc_get(
+    struct foils_hid_desc_store *store,
+    const struct foils_hid_device_descriptor *desc,
+    struct foils_hid_desc **entry);
+
+/**
+   @this releases a reference to an entry taken with @ref
+   foils_hid_desc_get.
+
+   @param store Store the entry comes from
+   @param entry Entry
+ */
+void foils_hid_desc_put(
+    struct foils_hid_desc_store *store,
+    struct foils_hid_desc *entry);
+
+/**
+   @this returns the announce packet of an entry, as built by @ref
+   rudp_hid_device_new_build, to be sent with @ref
+   rudp_hid_device_new_send.
+
+   @param entry Entry
+   @param size Returned packet size
+   @returns the packet, valid as long as the entry is referenced
+ */
+void *foils_hid_desc_packet(
+    struct foils_hid_desc *entry,
+    size_t *size);
+
+/**
+   @this returns the count of distinct descriptors in the store.
+
+   @param store Store state
+ */
+static inline
+size_t foils_hid_desc_store_count(const struct foils_hid_desc_store *store)
+{
+    return store->count;
+}
+
+#endif
@@ -21,6 +21,7 @@
 #include <rudp/rudp.h>
 #include <rudp/client.h>
 #include <foils/rudp_hid_client.h>
+#include <foils/desc_store.h>
 
 struct foils_hid;
 
@@ -37,6 +38,62 @@ enum foils_hid_state
     FOILS_HID_DROPPED,
 };
 
+/** Reports sent per text pacing interval, by default */
+#define FOILS_HID_TEXT_PACE_REPORTS 128
+/** Text pacing interval by default, in microseconds */
+#define FOILS_HID_TEXT_PACE_INTERVAL 2000
+
+/** Smallest report sent as delta, smaller ones are sent whole */
+#define FOILS_HID_DELTA_MIN_SIZE 8
+/** Deltas sent between two keyframes of a report, at most */
+#define FOILS_HID_DELTA_KEYFRAME_INTERVAL 64
+
+/** Previous reports sent along with an unreliable one, at most */
+#define FOILS_HID_REDUNDANCY_MAX 7
+
+/**
+   @this is a set of counters of the client, see @ref
+   foils_hid_stats_get.
+ */
+struct foils_hid_stats
+{
+    /** Input reports submitted while connected and grabbed */
+    uint64_t input_reports;
+    /** Reliable ones among them */
+    uint64_t input_reliable;
+    /** Reliable ones not sent, being the same as the previous one,
+        see @ref foils_hid_dedup_enable */
+    uint64_t input_duplicates;
+    /** Queued for being over rate limit, see @ref
+        foils_hid_rate_limit_set */
+    uint64_t input_deferred;
+    /** Merged into a queued one */
+    uint64_t input_merged;
+    /** Dropped for being over rate limit, or replaced by a newer one
+        while queued */
+    uint64_t input_dropped;
+    /** Latest state sent again on grab, also counted in
+        input_reports, see @ref foils_hid_resync_enable */
+    uint64_t input_resynced;
+};
+
+/**
+   @this is what happens to an input report over rate limit, see
+   @ref foils_hid_rate_limit_set.
+ */
+enum foils_hid_rate_policy
+{
+    /** Report is queued, replacing the one already queued, if any */
+    FOILS_HID_RATE_DROP_OLDEST,
+    /** Report is merged into the queued one through @ref
+        foils_hid_handler::merge, or queued as for @ref
+        FOILS_HID_RATE_DROP_OLDEST */
+    FOILS_HID_RATE_MERGE,
+    /** Report is dropped, and user code is told to stop sending
+        through @ref foils_hid_handler::flow */
+    FOILS_HID_RATE_BLOCK,
+};
+
 /**
    @this is a set of callbacks from the client state to user code.
  */
@@ -88,6 +145,65 @@ struct foils_hid_handler
     void (*feature_report_sollicit)(
         struct foils_hid *client,
         uint32_t device_id, uint8_t report_id);
+
+    /**
+       @this is called when the server acknowledges optional
+       protocol features.  It may be left NULL.
+
+       @param client The client context
+       @param features Features now in use, a mask of @ref
+              foils_hid_feature values
+     */
+    void (*features)(
+        struct foils_hid *client,
+        uint32_t features);
+
+    /**
+       @this is called to merge an input report into the one queued
+       for the same report, when over rate limit with @ref
+       FOILS_HID_RATE_MERGE policy.  It may be left NULL.
+
+       @param client The client context
+       @param device_id The device index in the declared array
+       @param report_id The report id in the device
+       @param pending Queued report, to be updated
+       @param data New report
+       @param datalen Size of both reports
+       @returns 0 if merged, or anything else for the new report to
+       replace the queued one
+     */
+    int (*merge)(
+        struct foils_hid *client,
+        uint32_t device_id, uint8_t report_id,
+        void *pending, const void *data, size_t datalen);
+
+    /**
+       @this is called when a device gets over rate limit with a
+       report having @ref FOILS_HID_RATE_BLOCK policy, and when it
+       may send again.  It may be left NULL.
+
+       @param client The client context
+       @param device_id The device index in the declared array
+       @param blocked Whether reports of the device get dropped
+     */
+    void (*flow)(
+        struct foils_hid *client,
+        uint32_t device_id, int blocked);
+
+    /**
+       @this is called when a delivery acknowledgement requested with
+       @ref foils_hid_ack_request completes.  It may be left NULL.
+
+       @param client The client context
+       @param token Token returned by the request
+       @param status 0 when acknowledged, or ECONNRESET if the server
+              was lost before
+       @param rtt Time from request to acknowledgement, in
+              nanoseconds, 0 on failure
+     */
+    void (*ack)(
+        struct foils_hid *client,
+        uint32_t token, int status, uint64_t rtt);
 };
 
 /**
@@ -101,11 +217,23 @@ struct foils_hid
     const struct foils_hid_handler *handler;
     struct rudp rudp;
     struct ela_el *el;
-    uint32_t enable;
+    uint8_t *enable;
     struct foils_grab_accountant *ga;
+    struct foils_hid_text *text;
+    struct foils_hid_report_cache **cache;
+    struct foils_hid_stats stats;
+    struct foils_hid_rate *rate;
     int state;
-    const struct foils_hid_device_descriptor *descriptor;
+    /* Device slots, NULL when free */
+    const struct foils_hid_device_descriptor **descriptor;
     size_t descriptor_count;
+    /* Removed slots not reusable until the server acknowledges the
+       drop, with the acknowledgement waited for */
+    uint8_t *held;
+    uint32_t *held_token;
+    struct foils_hid_desc_store *desc_store;
+    /* Announce packets from desc_store, NULL until first announce */
+    struct foils_hid_desc **shared;
 };
 
 /**
@@ -114,8 +242,9 @@ struct foils_hid
    @param rlh The client state
    @param el A valid event loop abstraction handle
    @param handler The user-provided handler function structure
-   @param device A device array
-   @param device_count Count of devices in the array, limited to 32.
+   @param device A device array, taking the first slots.  It must
+          outlive the client state.
+   @param device_count Count of devices in the array
 
    @returns 0 when done, or an error taken from errno(7)
  */
@@ -144,6 +273,61 @@ void foils_hid_device_enable(struct foils_hid *rlh, size_t index);
  */
 void foils_hid_device_disable(struct foils_hid *rlh, size_t index);
 
+/**
+   @this adds a device at runtime, and enables it.  It takes the
+   lowest free slot, that of a removed device or a new one.  When
+   connected, only this device gets announced.
+
+   @param rlh The client state
+   @param device Device descriptor, it must outlive the device
+   @param index Returned device index
+   @returns 0 when done, or ENOMEM
+ */
+int foils_hid_device_add(
+    struct foils_hid *rlh,
+    const struct foils_hid_device_descriptor *device,
+    size_t *index);
+
+/**
+   @this removes a device, disabling it first.  Its reports queued
+   for pacing or rate limits are dropped, and its modes and limits
+   are forgotten, the slot may be reused by @ref
+   foils_hid_device_add.
+
+   Server may still be sending grabs or feature requests for the
+   removed device until it handles the drop.  When connected and
+   @ref FOILS_HID_FEATURE_ACK is in use, the slot is held back until
+   the server acknowledges the drop, or the connection goes.
+   Otherwise, or with @ref RUDP_HID_ACK_MAX acknowledgements already
+   waited for, the slot is free at once and a device added right
+   away may get requests meant for the removed one.
+
+   Devices given to @ref foils_hid_init may be removed as well.
+
+   @param rlh The client state
+   @param index Device index
+   @returns 0 when done, or ENOENT if the slot is free
+ */
+int foils_hid_device_remove(struct foils_hid *rlh, size_t index);
+
+/**
+   @this makes the client announce devices from packets shared in a
+   store, built once for all clients using the store, instead of
+   building them on each announce.  Packets are taken from the store
+   on first announce and released on removal.  Descriptors are
+   matched by name, version and blob addresses, so clients should be
+   given the same descriptor blobs to share packets.
+
+   Store must outlive the client, or be replaced before it goes.
+   Passing NULL stops using a store.
+
+   @param rlh The client state
+   @param store Descriptor store, or NULL
+ */
+void foils_hid_desc_store_use(
+    struct foils_hid *rlh,
+    struct foils_hid_desc_store *store);
+
 /**
    @this sends an input report from a given device.
 
@@ -163,6 +347,221 @@ void foils_hid_input_report_send(
     int reliable,
     const void *data, size_t datalen);
 
+/**
+   @this sends an input report from a given device, along with the
+   time it was captured at.
+
+   Timestamp is only transmitted when @ref FOILS_HID_FEATURE_TIMESTAMP
+   is enabled, then it lets the server tell capture time from arrival
+   time.  Reports sent through @ref foils_hid_input_report_send are
+   stamped with the time of the call.
+
+   @param rlh The client state
+   @param device_index Device index in the array
+   @param report_id Report index
+   @param reliable Whether this report may be lost in transport
+   @param timestamp Capture time, CLOCK_MONOTONIC in nanoseconds
+   @param data Report data
+   @param datalen Report data size
+ */
+void foils_hid_input_report_timed_send(
+    struct foils_hid *rlh,
+    size_t device_index, uint8_t report_id,
+    int reliable,
+    uint64_t timestamp,
+    const void *data, size_t datalen);
+
+/**
+   @this enables delta encoding of a device's input reports.
+
+   When @ref FOILS_HID_FEATURE_DELTA is in use, input reports of at
+   least @ref FOILS_HID_DELTA_MIN_SIZE bytes are sent as a difference
+   to the last keyframe of the same report.  A keyframe is sent
+   reliably for the first report, when report size changes, when the
+   delta would take more than half the report, and after @ref
+   FOILS_HID_DELTA_KEYFRAME_INTERVAL deltas.
+
+   This suits devices with large reports changing a few bytes at a
+   time, like gamepads or digitizers.
+
+   @param rlh The client state
+   @param device_index Device index in the array
+   @returns 0 when done, EINVAL if no device is at index, or ENOMEM
+ */
+int foils_hid_delta_enable(struct foils_hid *rlh, size_t device_index);
+
+/**
+   @this disables delta encoding of a device's input reports.
+
+   @param rlh The client state
+   @param device_index Device index in the array
+ */
+void foils_hid_delta_disable(struct foils_hid *rlh, size_t device_index);
+
+/**
+   @this enables suppression of duplicate reliable input reports of a
+   device.
+
+   The last payload sent reliably is kept for each report.  Reliable
+   input reports identical to it are not sent, sparing a packet, its
+   ack and its retransmission buffer.  Reports sent after a grab or a
+   reconnection always go through.
+
+   This only suits reports carrying absolute state.  Identical
+   consecutive reports of relative motion, like a mouse moving at
+   constant speed, are real input and would be dropped.
+
+   @param rlh The client state
+   @param device_index Device index in the array
+   @returns 0 when done, EINVAL if no device is at index, or ENOMEM
+ */
+int foils_hid_dedup_enable(struct foils_hid *rlh, size_t device_index);
+
+/**
+   @this disables suppression of duplicate reliable input reports of
+   a device.
+
+   @param rlh The client state
+   @param device_index Device index in the array
+ */
+void foils_hid_dedup_disable(struct foils_hid *rlh, size_t device_index);
+
+/**
+   @this enables state resynchronization of a device's input reports.
+
+   The latest payload of each report is kept, including those
+   submitted while not connected or not grabbed, which are not sent.
+   When the server grabs a report, its latest payload is sent right
+   away, reliably, so that the server has the current key, LED or
+   axis state after a reconnection instead of after the next user
+   input.
+
+   This only suits reports carrying absolute state.  Reports of
+   relative motion would be replayed.
+
+   @param rlh The client state
+   @param device_index Device index in the array
+   @returns 0 when done, EINVAL if no device is at index, or ENOMEM
+ */
+int foils_hid_resync_enable(struct foils_hid *rlh, size_t device_index);
+
+/**
+   @this disables state resynchronization of a device's input
+   reports, and forgets the kept payloads.
+
+   @param rlh The client state
+   @param device_index Device index in the array
+ */
+void foils_hid_resync_disable(struct foils_hid *rlh, size_t device_index);
+
+/**
+   @this limits the rate of input reports of a device, with a token
+   bucket.  Reports over the limit are handled as the policy of
+   their report says, see @ref foils_hid_rate_policy_set.  Queued
+   reports of all devices are sent in turn as budgets refill.
+
+   @param rlh The client state
+   @param device_index Device index in the array
+   @param rate Reports per second, 0 for no limit
+   @param burst Reports that may be sent at once after an idle time
+   @returns 0 when done, EINVAL, or ENOMEM
+ */
+int foils_hid_rate_limit_set(
+    struct foils_hid *rlh, size_t device_index,
+    unsigned int rate, unsigned int burst);
+
+/**
+   @this limits the rate of input reports of all devices on the
+   connection, as @ref foils_hid_rate_limit_set does for a device.
+   Reports must fit in both limits.
+
+   @param rlh The client state
+   @param rate Reports per second, 0 for no limit
+   @param burst Reports that may be sent at once after an idle time
+   @returns 0 when done, or EINVAL
+ */
+int foils_hid_connection_rate_limit_set(
+    struct foils_hid *rlh,
+    unsigned int rate, unsigned int burst);
+
+/**
+   @this sets what happens to input reports over rate limit, @ref
+   FOILS_HID_RATE_DROP_OLDEST by default.
+
+   @param rlh The client state
+   @param device_index Device index in the array
+   @param report_id Report index
+   @param policy Policy for this report
+   @returns 0 when done, EINVAL if no device is at index, or ENOMEM
+ */
+int foils_hid_rate_policy_set(
+    struct foils_hid *rlh, size_t device_index, uint8_t report_id,
+    enum foils_hid_rate_policy policy);
+
+/**
+   @this sets how many previous reports are sent again along with
+   each unreliable input report of a device.
+
+   When @ref FOILS_HID_FEATURE_REDUNDANT is in use, the server
+   recovers up to @tt count consecutive lost packets from the next
+   one, without waiting for retransmission.  This suits relative
+   reports, like mouse motion, on lossy links.  Reports taking more
+   than @ref RUDP_HID_BATCH_MAX_SIZE with their history are sent
+   alone.
+
+   @param rlh The client state
+   @param device_index Device index in the array
+   @param count Count of previous reports to send, 0 disables,
+          at most @ref FOILS_HID_REDUNDANCY_MAX
+   @returns 0 when done, EINVAL, or ENOMEM
+ */
+int foils_hid_redundancy_set(
+    struct foils_hid *rlh, size_t device_index,
+    unsigned int count);
+
+/**
+   @this computes the redundancy needed on a link, assuming
+   independent packet losses.
+
+   @param loss Measured packet loss ratio, from 0 to 1
+   @param target Acceptable report loss ratio
+   @returns the smallest count of previous reports to send so that
+   reports are lost at most at the target ratio, capped to @ref
+   FOILS_HID_REDUNDANCY_MAX
+ */
+unsigned int foils_hid_redundancy_for_loss(double loss, double target);
+
+/**
+   @this asks the server to acknowledge delivery of the reliable
+   reports sent so far.  Calling it after a reliable report tracks
+   that report, completion comes through @ref
+   foils_hid_handler::ack.  Producers may keep a bounded count of
+   reports waiting for acknowledgement instead of guessing.
+
+   Reports still queued for text pacing or rate limits are not
+   covered.  Device removals take requests from the same window, see
+   @ref foils_hid_device_remove.
+
+   @param rlh The client state
+   @param token Returned token identifying this request
+   @returns 0 when done, ENOTCONN if not connected, EOPNOTSUPP if the
+   server does not support @ref FOILS_HID_FEATURE_ACK, EAGAIN if
+   @ref RUDP_HID_ACK_MAX requests are already waited for
+ */
+int foils_hid_ack_request(struct foils_hid *rlh, uint32_t *token);
+
+/**
+   @this retrieves the client counters.  They are never reset.
+
+   @param rlh The client state
+   @returns the client counters
+ */
+static inline
+const struct foils_hid_stats *foils_hid_stats_get(const struct foils_hid *rlh)
+{
+    return &rlh->stats;
+}
+
 /**
    @this sends a feature report from a given device.
 
@@ -182,6 +581,131 @@ void foils_hid_feature_report_send(
     int reliable,
     const void *data, size_t datalen);
 
+/**
+   @this sets the optional protocol features offered to the server on
+   connection, @ref FOILS_HID_FEATURES_ALL by default.  Features are
+   only used once the server acknowledges them, legacy servers get
+   the base protocol.
+
+   @param rlh The client state
+   @param features A mask of @ref foils_hid_feature values
+ */
+void foils_hid_features_set(struct foils_hid *rlh, uint32_t features);
+
+/**
+   @this retrieves the optional protocol features in use.
+
+   @param rlh The client state
+   @returns a mask of @ref foils_hid_feature values
+ */
+static inline
+uint32_t foils_hid_features_get(const struct foils_hid *rlh)
+{
+    return rlh->client.features;
+}
+
+/**
+   @this sets text sending pace.  At most @tt reports reports are
+   sent every @tt interval microseconds, the first ones are sent
+   immediately.
+
+   @param rlh The client state
+   @param reports Count of reports sent per interval
+   @param interval Pacing interval, in microseconds
+ */
+void foils_hid_text_pace_set(
+    struct foils_hid *rlh,
+    size_t reports, unsigned int interval);
+
+/**
+   @this paces report batches and feature reports, which then share
+   a byte budget and give way to input reports, see @ref
+   rudp_hid_client_scheduler_enable.  Pacing is off until this is
+   called.
+
+   Budget only helps when it is under the link rate, about 80% of it
+   in priority_bench.  Over the link rate, queues build up in
+   transport and pacing only delays batches.
+
+   @param rlh The client state
+   @param budget Bytes per interval, 0 for no limit
+   @param interval Budget interval, in microseconds
+   @param hold Time batches and feature reports are held back after
+          a reliable input report, in microseconds
+   @param starve Time after which a waiting packet is sent anyway,
+          in microseconds
+   @returns 0 when done, or ENOMEM
+ */
+int foils_hid_send_pace_set(
+    struct foils_hid *rlh,
+    size_t budget, unsigned int interval,
+    unsigned int hold, unsigned int starve);
+
+/**
+   @this stops pacing set by @ref foils_hid_send_pace_set.  Queued
+   packets are sent right away.
+
+   @param rlh The client state
+ */
+void foils_hid_send_pace_clear(struct foils_hid *rlh);
+
+/**
+   @this sends a sequence of Unicode characters from a given device.
+
+   Report must be a single 32-bit Unicode usage, as in a Unicode page
+   "Usage (00h)" variable input.  Each character is sent as a press
+   and a release report, reliably.  Reports are queued and sent at
+   the pace set by @ref foils_hid_text_pace_set, packed in batches
+   when @ref FOILS_HID_FEATURE_BATCH is enabled.  Other reports sent
+   meanwhile may overtake queued text.
+
+   Queued reports are dropped if the report gets released by the
+   server or if the connection is lost.
+
+   @param rlh The client state
+   @param device_index Device index in the array
+   @param report_id Report index
+   @param codes Unicode code points
+   @param count Count of code points
+
+   @returns 0 when queued, ENOTCONN if report is not grabbed, or
+   ENOMEM.
+ */
+int foils_hid_unicode_send(
+    struct foils_hid *rlh,
+    size_t device_index, uint8_t report_id,
+    const uint32_t *codes, size_t count);
+
+/**
+   @this sends an UTF-8 string from a given device, as in @ref
+   foils_hid_unicode_send.  Invalid sequences are sent as U+FFFD.
+
+   @param rlh The client state
+   @param device_index Device index in the array
+   @param report_id Report index
+   @param text UTF-8 text, need not be nul-terminated
+   @param len Text length, in bytes
+
+   @returns 0 when queued, ENOTCONN if report is not grabbed, or
+   ENOMEM.
+ */
+int foils_hid_unicode_text_send(
+    struct foils_hid *rlh,
+    size_t device_index, uint8_t report_id,
+    const char *text, size_t len);
+
+/**
+   @this starts or stops recording of the client's report stream.
+   Device announces are recorded too, starting before connection
+   gets a capture that can be played back on its own.
+
+   @param rlh The client state
+   @param capture An open capture, or NULL to stop recording
+ */
+void foils_hid_capture_set(
+    struct foils_hid *rlh,
+    struct foils_hid_capture *capture);
+
 /**
    @this releases all context of the client.
 
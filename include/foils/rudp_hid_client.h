@@ -22,6 +22,8 @@
 */
 
 #include <foils/hid_device.h>
+#include <foils/capture.h>
+#include <foils/send_sched.h>
 #include <rudp/client.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -29,6 +31,50 @@
 #include <netinet/in.h>
 
 struct rudp_hid_client;
+struct rudp_hid_scheduler;
+struct ela_el;
+
+/**
+   @this is a set of optional protocol features.  They are offered to
+   the server on connection, and only those it acknowledges get used.
+ */
+enum foils_hid_feature
+{
+    /** Many input reports with the same id in one packet */
+    FOILS_HID_FEATURE_BATCH = 1 << 0,
+    /** Input reports carry their capture time */
+    FOILS_HID_FEATURE_TIMESTAMP = 1 << 1,
+    /** Input reports have a compact header, see @ref
+        foils_hid_compact_header_encode */
+    FOILS_HID_FEATURE_COMPACT = 1 << 2,
+    /** Input reports may be sent as keyframes and deltas, see @ref
+        foils_hid_delta_encode */
+    FOILS_HID_FEATURE_DELTA = 1 << 3,
+    /** Unreliable input reports may carry the previous ones, see
+        @ref rudp_hid_input_report_redundant_send */
+    FOILS_HID_FEATURE_REDUNDANT = 1 << 4,
+    /** Server acknowledges delivery on demand, see @ref
+        rudp_hid_ack_request */
+    FOILS_HID_FEATURE_ACK = 1 << 5,
+};
+
+/** All features implemented by this client */
+#define FOILS_HID_FEATURES_ALL \
+    (FOILS_HID_FEATURE_BATCH | FOILS_HID_FEATURE_TIMESTAMP \
+     | FOILS_HID_FEATURE_COMPACT | FOILS_HID_FEATURE_DELTA \
+     | FOILS_HID_FEATURE_REDUNDANT | FOILS_HID_FEATURE_ACK)
+
+/** Protocol version sent in capability negotiation */
+#define FOILS_HID_PROTOCOL_VERSION 1
+
+/**
+   Maximum report payload of a batch, keeps datagrams below usual
+   path MTU.
+ */
+#define RUDP_HID_BATCH_MAX_SIZE 1024
+
+/** Maximum count of delivery acknowledgements waited for at once */
+#define RUDP_HID_ACK_MAX 64
 
 /**
    @this defines the possible client callbacks.
@@ -134,6 +180,45 @@ struct rudp_hid_client_handler
     void (*feature_report_sollicit)(
         struct rudp_hid_client *client,
         uint32_t device_id, uint8_t report_id);
+
+    /**
+       @this is called when the server acknowledges capability
+       negotiation.  Legacy servers never do, then no optional
+       feature gets used.  It may be left NULL.
+
+       @param client The client context
+       @param features Features now in use, a mask of @ref
+              foils_hid_feature values
+     */
+    void (*features)(
+        struct rudp_hid_client *client,
+        uint32_t features);
+
+    /**
+       @this is called when a delivery acknowledgement requested with
+       @ref rudp_hid_ack_request completes.  It may be left NULL.
+
+       @param client The client context
+       @param token Token returned by the request
+       @param status 0 when acknowledged, or ECONNRESET if the server
+              was lost before
+       @param rtt Time from request to acknowledgement, in
+              nanoseconds, 0 on failure
+     */
+    void (*ack)(
+        struct rudp_hid_client *client,
+        uint32_t token, int status, uint64_t rtt);
+};
+
+/**
+   A delivery acknowledgement waited for
+
+   @hidecontent
+ */
+struct rudp_hid_ack_pending
+{
+    uint32_t token;
+    uint64_t sent;
 };
 
 /**
@@ -145,6 +230,19 @@ struct rudp_hid_client
 {
     struct rudp_client base;
     const struct rudp_hid_client_handler *handler;
+    struct foils_hid_capture *capture;
+    /* Offered on connection */
+    uint32_t offered;
+    /* Acknowledged by server */
+    uint32_t features;
+    /* NULL when packets are sent directly */
+    struct rudp_hid_scheduler *scheduler;
+    /* Acknowledgements waited for, oldest first, allocated on first
+       request */
+    struct rudp_hid_ack_pending *ack;
+    size_t ack_first;
+    size_t ack_count;
+    uint32_t ack_token;
 };
 
 /**
@@ -163,6 +261,95 @@ int rudp_hid_client_init(
     struct rudp *rudp,
     const struct rudp_hid_client_handler *handler);
 
+/**
+   @mgroup {Client context management}
+
+   @this attaches a capture file to the client.  Every report sent
+   and every event received is recorded in it, as well as device
+   announces.  Attach it before connecting for the capture to hold
+   the descriptors of all devices.
+
+   @param client Client context
+   @param capture An open capture, or NULL to stop recording
+ */
+static inline
+void rudp_hid_client_capture_set(
+    struct rudp_hid_client *client,
+    struct foils_hid_capture *capture)
+{
+    client->capture = capture;
+}
+
+/**
+   @mgroup {Client context management}
+
+   @this sets the optional protocol features offered to the server,
+   @ref FOILS_HID_FEATURES_ALL by default.  This takes effect on next
+   connection.
+
+   @param client Client context
+   @param features A mask of @ref foils_hid_feature values
+ */
+static inline
+void rudp_hid_client_features_offer(
+    struct rudp_hid_client *client,
+    uint32_t features)
+{
+    client->offered = features & FOILS_HID_FEATURES_ALL;
+}
+
+/**
+   @mgroup {Client context management}
+
+   @this makes the client send packets through a @ref foils_hid_sched
+   scheduler.  Input reports are interactive, report batches are
+   bulk, and feature reports are background traffic.  Device
+   announces and capability negotiation are always sent directly.
+   Input reports may overtake queued batches of other reports, never
+   those of their own report.
+
+   Without a scheduler, every packet goes to librudp as soon as it
+   is sent, and a burst of bulk traffic delays key events queued
+   behind it.
+
+   @param client Client context
+   @param el Event loop running the scheduler timer
+   @returns 0 when done, or ENOMEM
+ */
+int rudp_hid_client_scheduler_enable(
+    struct rudp_hid_client *client,
+    struct ela_el *el);
+
+/**
+   @mgroup {Client context management}
+
+   @this sends all packets queued in the scheduler, and makes the
+   client send packets directly again.
+
+   @param client Client context
+ */
+void rudp_hid_client_scheduler_disable(
+    struct rudp_hid_client *client);
+
+/**
+   @mgroup {Client context management}
+
+   @this sets the scheduler pace, see @ref foils_hid_sched_pace_set.
+   Times are in microseconds.
+
+   @param client Client context
+   @param budget Bulk and background bytes per interval, 0 for no limit
+   @param interval Budget interval
+   @param hold Time bulk and background packets are held back after a
+          reliable input report
+   @param starve Time after which a waiting packet is sent anyway
+   @returns 0 when done, or EINVAL if scheduler is not enabled
+ */
+int rudp_hid_client_scheduler_pace_set(
+    struct rudp_hid_client *client,
+    size_t budget, unsigned int interval,
+    unsigned int hold, unsigned int starve);
+
 /**
    @mgroup {Connection management}
 
@@ -315,12 +502,62 @@ int rudp_hid_device_new(
     const struct foils_hid_device_descriptor *desc,
     uint32_t device_id);
 
+/**
+   @mgroup {Protocol handlers}
+
+   @this returns the size of the device announce packet built by
+   @ref rudp_hid_device_new_build.
+
+   @param desc Device descriptor
+ */
+size_t rudp_hid_device_new_size(
+    const struct foils_hid_device_descriptor *desc);
+
+/**
+   @mgroup {Protocol handlers}
+
+   @this serializes a device announce packet once, to be sent as many
+   times as needed with @ref rudp_hid_device_new_send.  Equal
+   descriptors build equal packets.
+
+   @param desc Device descriptor
+   @param packet Buffer of @ref rudp_hid_device_new_size bytes
+ */
+void rudp_hid_device_new_build(
+    const struct foils_hid_device_descriptor *desc,
+    void *packet);
+
+/**
+   @mgroup {Protocol handlers}
+
+   @this sends a device announce packet built by @ref
+   rudp_hid_device_new_build, as @ref rudp_hid_device_new would.
+
+   @param rlh Client context
+   Device id is written in the packet header, the packet is sent
+   from where it is without any copy but the transport's own.
+
+   @param rlh Client context
+   @param packet Built packet
+   @param size Built packet size
+   @param device_id Device index
+   @returns 0 when sent, EINVAL if packet is too short, or an error
+   from transport
+ */
+int rudp_hid_device_new_send(
+    struct rudp_hid_client *client,
+    void *packet, size_t size,
+    uint32_t device_id);
+
 /**
    @mgroup {Protocol handlers}
 
    @this sends a message to the server signalling disapperance of a
    device.
 
+   Reports of the device still queued in the scheduler are dropped,
+   none goes out after the message.
+
    @param rlh Client context
    @param device_id Device index
  */
@@ -372,4 +609,166 @@ int rudp_hid_input_report_send(
     int reliable,
     const void *data, size_t datalen);
 
+/**
+   @mgroup {Protocol handlers}
+
+   @this sends an input report from a given device, along with the
+   time it was captured at.
+
+   Server must support timestamps, see @ref
+   FOILS_HID_FEATURE_TIMESTAMP.
+
+   @param client Client state
+   @param device_id Device index
+   @param report_id Report index
+   @param reliable Whether this report may be lost in transport
+   @param timestamp Capture time, CLOCK_MONOTONIC in nanoseconds
+   @param data Report data
+   @param datalen Report data size
+ */
+int rudp_hid_input_report_timed_send(
+    struct rudp_hid_client *client,
+    uint32_t device_id,
+    uint8_t report_id,
+    int reliable,
+    uint64_t timestamp,
+    const void *data, size_t datalen);
+
+/**
+   @mgroup {Protocol handlers}
+
+   @this sends an input report from a given device, reliably, as the
+   new reference for following deltas.
+
+   Server must support deltas, see @ref FOILS_HID_FEATURE_DELTA.
+
+   @param client Client state
+   @param device_id Device index
+   @param report_id Report index
+   @param seq Keyframe sequence number, deltas refer to it
+   @param timestamp Capture time, CLOCK_MONOTONIC in nanoseconds, or
+          0 to send none
+   @param data Report data
+   @param datalen Report data size
+ */
+int rudp_hid_input_report_keyframe_send(
+    struct rudp_hid_client *client,
+    uint32_t device_id,
+    uint8_t report_id,
+    uint8_t seq,
+    uint64_t timestamp,
+    const void *data, size_t datalen);
+
+/**
+   @mgroup {Protocol handlers}
+
+   @this sends an input report from a given device as a delta to a
+   keyframe.  Server drops deltas to keyframes it did not receive.
+
+   @param client Client state
+   @param device_id Device index
+   @param report_id Report index
+   @param reliable Whether this report may be lost in transport
+   @param seq Sequence number of the reference keyframe
+   @param timestamp Capture time, CLOCK_MONOTONIC in nanoseconds, or
+          0 to send none
+   @param keyframe Reference keyframe data, datalen bytes
+   @param data Report data
+   @param datalen Report data size
+
+   @returns 0 when done, EMSGSIZE when the delta would take more
+   than half the report, nothing is sent then.  Other errors are
+   taken from errno(7).
+ */
+int rudp_hid_input_report_delta_send(
+    struct rudp_hid_client *client,
+    uint32_t device_id,
+    uint8_t report_id,
+    int reliable,
+    uint8_t seq,
+    uint64_t timestamp,
+    const void *keyframe,
+    const void *data, size_t datalen);
+
+/**
+   @mgroup {Protocol handlers}
+
+   @this sends a sequence of input reports from a given device in a
+   single packet.  All reports have the same id and size, and are
+   delivered in order.
+
+   Server must support batches, see @ref FOILS_HID_FEATURE_BATCH.
+
+   @param client Client state
+   @param device_id Device index
+   @param report_id Report index
+   @param reliable Whether these reports may be lost in transport
+   @param data Reports data, back to back
+   @param report_size Size of one report
+   @param report_count Count of reports in data
+
+   @returns 0 when done, or an error from errno(7).  @tt EINVAL is
+   returned if reports take more than @ref RUDP_HID_BATCH_MAX_SIZE.
+ */
+int rudp_hid_input_report_batch_send(
+    struct rudp_hid_client *client,
+    uint32_t device_id,
+    uint8_t report_id,
+    int reliable,
+    const void *data, size_t report_size, size_t report_count);
+
+/**
+   @mgroup {Protocol handlers}
+
+   @this sends an input report unreliably, along with the reports
+   sent before it.  Server delivers reports it did not get yet, in
+   order, so that a packet loss is recovered by the next packet.
+
+   Server must support it, see @ref FOILS_HID_FEATURE_REDUNDANT.
+
+   @param client Client state
+   @param device_id Device index
+   @param report_id Report index
+   @param seq Sequence number of the newest report
+   @param timestamp Capture time of the newest report,
+          CLOCK_MONOTONIC in nanoseconds, or 0 to send none
+   @param data Reports data, back to back, oldest first
+   @param report_size Size of one report
+   @param report_count Count of reports in data
+
+   @returns 0 when done, or an error from errno(7).  @tt EINVAL is
+   returned if reports take more than @ref RUDP_HID_BATCH_MAX_SIZE.
+ */
+int rudp_hid_input_report_redundant_send(
+    struct rudp_hid_client *client,
+    uint32_t device_id,
+    uint8_t report_id,
+    uint16_t seq,
+    uint64_t timestamp,
+    const void *data, size_t report_size, size_t report_count);
+
+/**
+   @mgroup {Protocol handlers}
+
+   @this asks the server to acknowledge delivery of every reliable
+   packet sent before this call.  Calling it after each reliable
+   input report tracks them one by one.  Completion is told to @ref
+   rudp_hid_client_handler::ack, in request order.
+
+   With a scheduler, the request goes out once every packet queued
+   before it is sent, so that it covers them as well.
+
+   Server must support it, see @ref FOILS_HID_FEATURE_ACK.
+
+   @param client Client state
+   @param token Returned token identifying this request
+   @returns 0 when done, or an error from errno(7).  @tt EOPNOTSUPP
+   is returned if the server does not support acknowledgements, @tt
+   EAGAIN if @ref RUDP_HID_ACK_MAX requests are already waited for,
+   @tt ENOMEM if the first request cannot get its window.
+ */
+int rudp_hid_ack_request(
+    struct rudp_hid_client *client,
+    uint32_t *token);
+
 #endif
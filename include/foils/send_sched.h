@@ -0,0 +1,212 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#ifndef FOILS_SEND_SCHED_H_
+#define FOILS_SEND_SCHED_H_
+
+/**
+   @file
+   @module {HID rudp client}
+   @short Packet send scheduler
+
+   Packets are sent in priority classes.  Interactive packets are
+   sent right away.  Bulk and background packets share a byte budget
+   per interval, so that few of them wait in transport queues ahead
+   of interactive ones, and they are held back for a while after each
+   reliable interactive packet.  Background packets only go when no
+   bulk packet waits.
+
+   Starvation is guarded against: a packet waiting for longer than
+   the starvation delay is sent regardless of hold and class, as
+   budget allows.
+
+   Packets of a flow, like reports of a device report, never overtake
+   each other: a packet goes behind a queued packet of its flow, in
+   the lower class of the two.
+
+   Barrier packets, like delivery acknowledgement requests, go after
+   every packet queued before them, whatever its class and flow.
+
+   Scheduler does not read any clock, all times are passed by the
+   caller, in nanoseconds.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+   @this is a priority class, from highest to lowest.
+ */
+enum foils_hid_priority
+{
+    /** Key and button events, pointer motion */
+    FOILS_HID_PRIORITY_INTERACTIVE,
+    /** Text bursts */
+    FOILS_HID_PRIORITY_BULK,
+    /** Feature reports */
+    FOILS_HID_PRIORITY_BACKGROUND,
+};
+
+#define FOILS_HID_PRIORITY_COUNT 3
+
+/**
+   Bulk and background bytes per interval by default, about
+   5.6 Mbit/s.  Budget should stay under the link rate, otherwise
+   bulk packets queue up in transport, where interactive ones cannot
+   overtake them.
+ */
+#define FOILS_HID_SCHED_BUDGET 1400
+/** Budget interval by default, in nanoseconds */
+#define FOILS_HID_SCHED_INTERVAL 2000000
+/** Hold time after a reliable interactive packet by default */
+#define FOILS_HID_SCHED_HOLD 2000000
+/** Starvation delay by default */
+#define FOILS_HID_SCHED_STARVE 20000000
+
+/**
+   @this sends a packet out of the scheduler.
+
+   @param opaque Opaque pointer given to @ref foils_hid_sched_init
+   @param reliable Whether packet must be sent reliably
+   @param command Packet command
+   @param data Packet data
+   @param size Packet size
+ */
+typedef void foils_hid_sched_send_func_t(
+    void *opaque, int reliable, int command,
+    const void *data, size_t size);
+
+struct foils_hid_sched_packet;
+
+/**
+   @this is a queue of packets of a priority class.
+
+   @hidecontent
+ */
+struct foils_hid_sched_queue
+{
+    struct foils_hid_sched_packet *head;
+    struct foils_hid_sched_packet **tail;
+};
+
+/**
+   @this is the scheduler state.
+
+   @hidecontent
+ */
+struct foils_hid_sched
+{
+    foils_hid_sched_send_func_t *send;
+    void *opaque;
+    struct foils_hid_sched_queue queue[FOILS_HID_PRIORITY_COUNT];
+    struct foils_hid_sched_queue barrier;
+    uint64_t seq;
+    int64_t budget;
+    uint64_t interval;
+    uint64_t hold;
+    uint64_t starve;
+    int64_t credit;
+    uint64_t refill;
+    uint64_t held_until;
+};
+
+/**
+   @this initializes a scheduler with default pace.
+
+   @param sched Scheduler state
+   @param send Function sending packets out
+   @param opaque Opaque pointer for send
+ */
+void foils_hid_sched_init(
+    struct foils_hid_sched *sched,
+    foils_hid_sched_send_func_t *send, void *opaque);
+
+/**
+   @this drops all queued packets.
+
+   @param sched Scheduler state
+ */
+void foils_hid_sched_clear(struct foils_hid_sched *sched);
+
+/**
+   @this sets the scheduler pace.
+
+   @param sched Scheduler state
+   @param budget Bulk and background bytes per interval, 0 for no limit
+   @param interval Budget interval
+   @param hold Time bulk and background packets are held back after a
+          reliable interactive packet
+   @param starve Time after which a waiting packet is sent anyway
+ */
+void foils_hid_sched_pace_set(
+    struct foils_hid_sched *sched,
+    size_t budget, uint64_t interval,
+    uint64_t hold, uint64_t starve);
+
+/**
+   @this sends a packet, or queues it.
+
+   @param sched Scheduler state
+   @param now Current time
+   @param priority Priority class of the packet
+   @param flow Flow the packet belongs to, kept in order
+   @param reliable Whether packet must be sent reliably
+   @param command Packet command
+   @param data Packet data
+   @param size Packet size
+   @returns 0 when sent or queued, or ENOMEM
+ */
+int foils_hid_sched_send(
+    struct foils_hid_sched *sched, uint64_t now,
+    enum foils_hid_priority priority, uint64_t flow,
+    int reliable, int command,
+    const void *data, size_t size);
+
+/**
+   @this sends a barrier packet once all packets queued before it are
+   sent, or right away if none is.  Barrier packets take no budget.
+
+   @param sched Scheduler state
+   @param now Current time
+   @param reliable Whether packet must be sent reliably
+   @param command Packet command
+   @param data Packet data
+   @param size Packet size
+   @returns 0 when sent or queued, or ENOMEM
+ */
+int foils_hid_sched_barrier_send(
+    struct foils_hid_sched *sched, uint64_t now,
+    int reliable, int command,
+    const void *data, size_t size);
+
+/**
+   @this drops queued packets of some flows, those whose flow masked
+   with @tt mask equals @tt flow.  Barriers waiting for them only
+   may go.
+
+   @param sched Scheduler state
+   @param flow Flow bits to match
+   @param mask Flow bits compared
+ */
+void foils_hid_sched_discard(
+    struct foils_hid_sched *sched, uint64_t flow, uint64_t mask);
+
+/**
+   @this sends queued packets that may go.
+
+   @param sched Scheduler state
+   @param now Current time
+   @returns the time it should run again at, or 0 if nothing is
+   queued
+ */
+uint64_t foils_hid_sched_run(struct foils_hid_sched *sched, uint64_t now);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <foils/capture.h>
+
+static inline
+uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int foils_hid_capture_open(
+    struct foils_hid_capture *capture,
+    const char *path,
+    size_t size)
+{
+    struct foils_hid_capture_header *header;
+    int err;
+
+    memset(capture, 0, sizeof(*capture));
+    capture->fd = -1;
+
+    if (size < sizeof(*header))
+        return EINVAL;
+
+    capture->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (capture->fd < 0)
+        return errno;
+
+    /* Allocate blocks now, so that hot path never faults on ENOSPC */
+    err = posix_fallocate(capture->fd, 0, size);
+    if (err == EINVAL || err == EOPNOTSUPP)
+        err = ftruncate(capture->fd, size) ? errno : 0;
+    if (err)
+        goto close;
+
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, capture->fd, 0);
+    if (header == MAP_FAILED) {
+        err = errno;
+        goto close;
+    }
+
+    memcpy(header->magic, FOILS_HID_CAPTURE_MAGIC,
+           sizeof(FOILS_HID_CAPTURE_MAGIC));
+    header->version = FOILS_HID_CAPTURE_VERSION;
+    header->header_size = sizeof(*header);
+    header->size = size;
+    header->used = 0;
+    header->dropped = 0;
+    header->origin = monotonic_ns();
+
+    capture->map = header;
+    capture->size = size;
+
+    return 0;
+
+close:
+    close(capture->fd);
+    capture->fd = -1;
+    return err;
+}
+
+void foils_hid_capture_record(
+    struct foils_hid_capture *capture,
+    uint8_t type,
+    uint32_t device_id, uint8_t report_id,
+    const void *data, size_t datalen)
+{
+    struct foils_hid_capture_header *header = capture->map;
+    struct foils_hid_capture_record *record;
+    size_t capacity = capture->size - sizeof(*header);
+    size_t record_size;
+    uint64_t used, next;
+
+    if (header == NULL)
+        return;
+
+    if (datalen > UINT16_MAX)
+        datalen = UINT16_MAX;
+
+    record_size = foils_hid_capture_record_size(datalen);
+
+    /* Reserve space, without ever overshooting the end of file */
+    used = __atomic_load_n(&header->used, __ATOMIC_RELAXED);
+    do {
+        next = used + record_size;
+        if (next > capacity) {
+            __atomic_fetch_add(&header->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&header->used, &used, next, 1,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    record = (struct foils_hid_capture_record *)
+        ((uint8_t *)header + sizeof(*header) + used);
+
+    record->timestamp = monotonic_ns();
+    record->device_id = device_id;
+    record->size = datalen;
+    record->report_id = report_id;
+    if (datalen)
+        memcpy(record + 1, data, datalen);
+
+    /* Publish: readers consider a record valid once type is set */
+    __atomic_store_n(&record->type, type, __ATOMIC_RELEASE);
+}
+
+void foils_hid_capture_close(
+    struct foils_hid_capture *capture)
+{
+    struct foils_hid_capture_header *header = capture->map;
+    off_t used;
+
+    if (header == NULL)
+        return;
+
+    used = sizeof(*header)
+        + __atomic_load_n(&header->used, __ATOMIC_ACQUIRE);
+
+    /* Header stays within the truncated size, it is safe to update */
+    if (ftruncate(capture->fd, used) == 0)
+        header->size = used;
+
+    munmap(header, capture->size);
+    close(capture->fd);
+
+    capture->map = NULL;
+    capture->fd = -1;
+}
@@ -0,0 +1,126 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <foils/delta.h>
+
+#define RUN_MAX 255
+
+static inline
+uint64_t load64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline
+void store64(uint8_t *p, uint64_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+/* XORs a run, a word at a time */
+static inline
+void xor_run(uint8_t *out, const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8)
+        store64(out + i, load64(a + i) ^ load64(b + i));
+    for (; i < len; ++i)
+        out[i] = a[i] ^ b[i];
+}
+
+int foils_hid_delta_encode(
+    const uint8_t *ref, const uint8_t *cur, size_t size,
+    uint8_t *out, size_t out_size, size_t *out_len)
+{
+    size_t pos = 0, prev = 0, o = 0;
+
+    while (pos < size) {
+        size_t start, end, gap;
+
+        /* Unchanged bytes are skipped a word at a time */
+        while (pos + 8 <= size && load64(ref + pos) == load64(cur + pos))
+            pos += 8;
+        while (pos < size && ref[pos] == cur[pos])
+            pos++;
+        if (pos == size)
+            break;
+
+        /*
+          A lone unchanged byte costs less inside a run than a new run
+          header, runs end on two unchanged bytes.
+         */
+        start = pos;
+        end = pos + 1;
+        while (end < size && end - start < RUN_MAX) {
+            if (ref[end] != cur[end])
+                end++;
+            else if (end + 1 < size && ref[end + 1] != cur[end + 1]
+                     && end + 2 - start <= RUN_MAX)
+                end += 2;
+            else
+                break;
+        }
+
+        for (gap = start - prev; gap > RUN_MAX; gap -= RUN_MAX) {
+            if (o + 2 > out_size)
+                return EMSGSIZE;
+            out[o++] = RUN_MAX;
+            out[o++] = 0;
+        }
+
+        if (o + 2 + (end - start) > out_size)
+            return EMSGSIZE;
+
+        out[o++] = gap;
+        out[o++] = end - start;
+        xor_run(out + o, ref + start, cur + start, end - start);
+        o += end - start;
+
+        prev = pos = end;
+    }
+
+    *out_len = o;
+    return 0;
+}
+
+int foils_hid_delta_decode(
+    const uint8_t *ref, size_t size,
+    const uint8_t *delta, size_t delta_len,
+    uint8_t *out)
+{
+    size_t pos = 0, i = 0, len;
+
+    memcpy(out, ref, size);
+
+    while (i < delta_len) {
+        if (i + 2 > delta_len)
+            return EINVAL;
+
+        pos += delta[i];
+        len = delta[i + 1];
+        i += 2;
+
+        if (pos + len > size || i + len > delta_len)
+            return EINVAL;
+
+        xor_run(out + pos, out + pos, delta + i, len);
+        pos += len;
+        i += len;
+    }
+
+    return 0;
+}
@@ -0,0 +1,196 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <foils/desc_store.h>
+#include <foils/rudp_hid_client.h>
+
+#define BUCKET_COUNT_MIN 16
+
+struct foils_hid_desc
+{
+    struct foils_hid_desc *next;
+    uint64_t hash;
+    unsigned int refcount;
+    /* Descriptor the packet was built from, blobs by address */
+    struct foils_hid_device_descriptor key;
+    size_t size;
+    uint8_t packet[];
+};
+
+/* FNV-1a, plenty for a few distinct descriptors */
+static
+uint64_t hash_update(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    size_t i;
+
+    for (i = 0; i < size; ++i) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/* Only the name is read, blobs count by address and size */
+static
+uint64_t desc_hash(const struct foils_hid_device_descriptor *desc)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    hash = hash_update(hash, desc->name, strnlen(desc->name, DEVICE_NAME_LEN));
+    hash = hash_update(hash, &desc->version, sizeof(desc->version));
+    hash = hash_update(hash, &desc->descriptor, sizeof(desc->descriptor));
+    hash = hash_update(hash, &desc->descriptor_size,
+                       sizeof(desc->descriptor_size));
+    hash = hash_update(hash, &desc->physical, sizeof(desc->physical));
+    hash = hash_update(hash, &desc->physical_size,
+                       sizeof(desc->physical_size));
+    hash = hash_update(hash, &desc->strings, sizeof(desc->strings));
+    hash = hash_update(hash, &desc->strings_size,
+                       sizeof(desc->strings_size));
+
+    return hash;
+}
+
+static
+int desc_equal(const struct foils_hid_device_descriptor *a,
+               const struct foils_hid_device_descriptor *b)
+{
+    return !strncmp(a->name, b->name, DEVICE_NAME_LEN)
+        && a->version == b->version
+        && a->descriptor == b->descriptor
+        && a->descriptor_size == b->descriptor_size
+        && a->physical == b->physical
+        && a->physical_size == b->physical_size
+        && a->strings == b->strings
+        && a->strings_size == b->strings_size;
+}
+
+static
+int bucket_grow(struct foils_hid_desc_store *store)
+{
+    size_t count = store->bucket_count
+        ? store->bucket_count * 2 : BUCKET_COUNT_MIN;
+    struct foils_hid_desc **bucket, *entry, *next;
+    size_t i;
+
+    bucket = calloc(count, sizeof(*bucket));
+    if (bucket == NULL)
+        return ENOMEM;
+
+    for (i = 0; i < store->bucket_count; ++i) {
+        for (entry = store->bucket[i]; entry; entry = next) {
+            next = entry->next;
+            entry->next = bucket[entry->hash & (count - 1)];
+            bucket[entry->hash & (count - 1)] = entry;
+        }
+    }
+
+    free(store->bucket);
+    store->bucket = bucket;
+    store->bucket_count = count;
+    return 0;
+}
+
+void foils_hid_desc_store_init(struct foils_hid_desc_store *store)
+{
+    memset(store, 0, sizeof(*store));
+}
+
+void foils_hid_desc_store_deinit(struct foils_hid_desc_store *store)
+{
+    struct foils_hid_desc *entry, *next;
+    size_t i;
+
+    for (i = 0; i < store->bucket_count; ++i) {
+        for (entry = store->bucket[i]; entry; entry = next) {
+            next = entry->next;
+            free(entry);
+        }
+    }
+
+    free(store->bucket);
+    memset(store, 0, sizeof(*store));
+}
+
+int foils_hid_desc_get(
+    struct foils_hid_desc_store *store,
+    const struct foils_hid_device_descriptor *desc,
+    struct foils_hid_desc **entry)
+{
+    uint64_t hash = desc_hash(desc);
+    struct foils_hid_desc *e;
+    size_t size;
+
+    if (store->bucket_count) {
+        for (e = store->bucket[hash & (store->bucket_count - 1)];
+             e; e = e->next) {
+            if (e->hash == hash && desc_equal(&e->key, desc)) {
+                e->refcount++;
+                *entry = e;
+                return 0;
+            }
+        }
+    }
+
+    if (store->count >= store->bucket_count && bucket_grow(store))
+        return ENOMEM;
+
+    size = rudp_hid_device_new_size(desc);
+    e = malloc(sizeof(*e) + size);
+    if (e == NULL)
+        return ENOMEM;
+
+    rudp_hid_device_new_build(desc, e->packet);
+    e->hash = hash;
+    e->refcount = 1;
+    e->key = *desc;
+    e->size = size;
+    e->next = store->bucket[hash & (store->bucket_count - 1)];
+    store->bucket[hash & (store->bucket_count - 1)] = e;
+    store->count++;
+
+    *entry = e;
+    return 0;
+}
+
+void foils_hid_desc_put(
+    struct foils_hid_desc_store *store,
+    struct foils_hid_desc *entry)
+{
+    struct foils_hid_desc **e;
+
+    if (--entry->refcount)
+        return;
+
+    for (e = &store->bucket[entry->hash & (store->bucket_count - 1)];
+         *e; e = &(*e)->next) {
+        if (*e == entry) {
+            *e = entry->next;
+            break;
+        }
+    }
+
+    store->count--;
+    free(entry);
+}
+
+void *foils_hid_desc_packet(
+    struct foils_hid_desc *entry,
+    size_t *size)
+{
+    *size = entry->size;
+    return entry->packet;
+}
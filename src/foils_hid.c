@@ -11,12 +11,21 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <foils/rudp_hid_client.h>
 #include <foils/hid.h>
 
 static const struct rudp_hid_client_handler client_handler;
 
+static
+void input_report_emit(
+    struct foils_hid *fh,
+    size_t device_index, uint8_t report_id,
+    int reliable, uint64_t timestamp,
+    const void *data, size_t datalen);
+
 struct foils_grab_accountant
 {
     uint32_t grab[256/32];
@@ -25,7 +34,7 @@ struct foils_grab_accountant
 static
 int is_grabbed(const struct foils_grab_accountant *ga, uint8_t report_id)
 {
-    return (ga->grab[report_id/8] >> (report_id % 8)) & 1;
+    return (ga->grab[report_id/32] >> (report_id % 32)) & 1;
 }
 
 static
@@ -37,18 +46,1010 @@ void grab_reset(struct foils_grab_accountant *ga)
 }
 
 static
-void grab(struct foils_grab_accountant *ga, uint8_t report_id)
+void grab(struct foils_grab_accountant *ga, uint8_t report_id)
+{
+    ga->grab[report_id/32] |= 1u << (report_id % 32);
+}
+
+static
+void release(struct foils_grab_accountant *ga, uint8_t report_id)
+{
+    ga->grab[report_id/32] &= ~(1u << (report_id % 32));
+}
+
+enum foils_hid_cache_mode
+{
+    CACHE_DELTA = 1,
+    CACHE_DEDUP = 2,
+    CACHE_REDUNDANT = 4,
+    CACHE_RESYNC = 8,
+};
+
+/*
+  Cached state of a report.  Keyframe is the last report sent
+  reliably, deltas are relative to it.  A size of 0 forces next
+  report to be a keyframe.  Last is the last report sent, if it was
+  sent reliably, a last_size of 0 means unknown.  History holds the
+  last unreliable reports, oldest first, for redundant sending.
+  Latest is the last report submitted, sent or not, for resync, it
+  outlives connections.
+ */
+struct foils_hid_report_state
+{
+    uint8_t *keyframe;
+    size_t size;
+    uint32_t deltas;
+    uint8_t seq;
+    uint8_t *last;
+    size_t last_size;
+    uint8_t *history;
+    size_t history_size;
+    size_t history_report_size;
+    size_t history_count;
+    uint16_t history_seq;
+    uint8_t *latest;
+    size_t latest_size;
+};
+
+struct foils_hid_report_cache
+{
+    unsigned int modes;
+    unsigned int redundancy;
+    struct foils_hid_report_state *report[256];
+};
+
+static
+void report_state_reset(struct foils_hid_report_state *r)
+{
+    /* Sequence numbers go on, stale deltas never match */
+    r->size = 0;
+    r->last_size = 0;
+    r->history_count = 0;
+}
+
+static
+void cache_reset(struct foils_hid_report_cache *cache)
+{
+    size_t i;
+
+    if (cache == NULL)
+        return;
+
+    for (i = 0; i < 256; ++i)
+        if (cache->report[i])
+            report_state_reset(cache->report[i]);
+}
+
+static
+void cache_free(struct foils_hid_report_cache *cache)
+{
+    size_t i;
+
+    if (cache == NULL)
+        return;
+
+    for (i = 0; i < 256; ++i) {
+        if (!cache->report[i])
+            continue;
+        free(cache->report[i]->keyframe);
+        free(cache->report[i]->last);
+        free(cache->report[i]->history);
+        free(cache->report[i]->latest);
+        free(cache->report[i]);
+    }
+    free(cache);
+}
+
+static
+void cache_latest_forget(struct foils_hid_report_cache *cache)
+{
+    size_t i;
+
+    if (cache == NULL)
+        return;
+
+    for (i = 0; i < 256; ++i)
+        if (cache->report[i])
+            cache->report[i]->latest_size = 0;
+}
+
+/* Whether a device is added at index */
+static
+int device_valid(const struct foils_hid *fh, size_t device_index)
+{
+    return device_index < fh->descriptor_count
+        && fh->descriptor[device_index] != NULL;
+}
+
+static
+int cache_mode_enable(struct foils_hid *fh, size_t device_index,
+                      unsigned int mode)
+{
+    struct foils_hid_report_cache *cache;
+
+    if (!device_valid(fh, device_index))
+        return EINVAL;
+
+    cache = fh->cache[device_index];
+    if (cache == NULL) {
+        cache = calloc(1, sizeof(*cache));
+        if (cache == NULL)
+            return ENOMEM;
+        fh->cache[device_index] = cache;
+    }
+
+    cache->modes |= mode;
+    return 0;
+}
+
+static
+void cache_mode_disable(struct foils_hid *fh, size_t device_index,
+                        unsigned int mode)
+{
+    struct foils_hid_report_cache *cache;
+
+    if (!device_valid(fh, device_index))
+        return;
+
+    cache = fh->cache[device_index];
+    if (cache == NULL)
+        return;
+
+    cache->modes &= ~mode;
+    cache_reset(cache);
+    if (mode & CACHE_RESYNC)
+        cache_latest_forget(cache);
+
+    if (cache->modes)
+        return;
+
+    cache_free(cache);
+    fh->cache[device_index] = NULL;
+}
+
+static
+struct foils_hid_report_state *report_state_get(
+    struct foils_hid_report_cache *cache, uint8_t report_id)
+{
+    if (cache->report[report_id] == NULL)
+        cache->report[report_id] = calloc(1, sizeof(*cache->report[0]));
+
+    return cache->report[report_id];
+}
+
+/* Buffer reallocation, size is to be set by caller */
+static
+int report_buffer_fit(uint8_t **buffer, size_t *size, size_t needed)
+{
+    uint8_t *b;
+
+    if (*size == needed)
+        return 0;
+
+    *size = 0;
+    b = realloc(*buffer, needed);
+    if (b == NULL && needed)
+        return ENOMEM;
+
+    *buffer = b;
+    return 0;
+}
+
+/*
+  Tells whether a reliable report is the same as the last one sent,
+  and remembers it otherwise.
+ */
+static
+int report_duplicate(
+    struct foils_hid_report_state *r,
+    int reliable, const void *data, size_t datalen)
+{
+    if (!reliable || !datalen) {
+        r->last_size = 0;
+        return 0;
+    }
+
+    if (r->last_size == datalen && !memcmp(r->last, data, datalen))
+        return 1;
+
+    if (report_buffer_fit(&r->last, &r->last_size, datalen))
+        return 0;
+
+    memcpy(r->last, data, datalen);
+    r->last_size = datalen;
+    return 0;
+}
+
+/* Keeps the report for resync, whether it gets sent or not */
+static
+void report_latest_keep(
+    struct foils_hid *fh,
+    size_t device_index, uint8_t report_id,
+    const void *data, size_t datalen)
+{
+    struct foils_hid_report_cache *cache = fh->cache[device_index];
+    struct foils_hid_report_state *r;
+
+    if (cache == NULL || !(cache->modes & CACHE_RESYNC))
+        return;
+
+    r = report_state_get(cache, report_id);
+    if (r == NULL
+        || report_buffer_fit(&r->latest, &r->latest_size, datalen))
+        return;
+
+    memcpy(r->latest, data, datalen);
+    r->latest_size = datalen;
+}
+
+static
+int redundant_send(
+    struct foils_hid *fh,
+    struct foils_hid_report_state *r, size_t redundancy,
+    size_t device_index, uint8_t report_id,
+    uint64_t timestamp,
+    const void *data, size_t datalen)
+{
+    size_t needed = (redundancy + 1) * datalen;
+
+    if (!datalen || needed > RUDP_HID_BATCH_MAX_SIZE)
+        return EMSGSIZE;
+
+    if (r->history_report_size != datalen || r->history_size != needed) {
+        r->history_count = 0;
+        r->history_report_size = datalen;
+        if (report_buffer_fit(&r->history, &r->history_size, needed))
+            return ENOMEM;
+        r->history_size = needed;
+    }
+
+    if (r->history_count > redundancy) {
+        memmove(r->history, r->history + datalen, redundancy * datalen);
+        r->history_count = redundancy;
+    }
+
+    memcpy(r->history + r->history_count * datalen, data, datalen);
+    r->history_count++;
+    r->history_seq++;
+
+    rudp_hid_input_report_redundant_send(
+        &fh->client, device_index, report_id,
+        r->history_seq, timestamp,
+        r->history, datalen, r->history_count);
+    return 0;
+}
+
+/*
+  Sends a report as delta, or as keyframe when no delta applies.
+  State only moves on once the packet is sent, a failed send leaves it
+  as the server has it.
+ */
+static
+int delta_send(
+    struct foils_hid *fh,
+    struct foils_hid_report_state *r,
+    size_t device_index, uint8_t report_id,
+    int reliable, uint64_t timestamp,
+    const void *data, size_t datalen)
+{
+    int err;
+
+    if (r->size == datalen && r->deltas < FOILS_HID_DELTA_KEYFRAME_INTERVAL) {
+        err = rudp_hid_input_report_delta_send(
+            &fh->client, device_index, report_id, reliable,
+            r->seq, timestamp, r->keyframe, data, datalen);
+        if (!err)
+            r->deltas++;
+        if (err != EMSGSIZE)
+            return err;
+    }
+
+    err = rudp_hid_input_report_keyframe_send(
+        &fh->client, device_index, report_id,
+        r->seq + 1, timestamp, data, datalen);
+    if (err)
+        return err;
+
+    r->seq++;
+    r->deltas = 0;
+
+    /* Size is left 0 on failure, next report is a keyframe again */
+    if (report_buffer_fit(&r->keyframe, &r->size, datalen))
+        return 0;
+
+    memcpy(r->keyframe, data, datalen);
+    r->size = datalen;
+    return 0;
+}
+
+struct foils_hid_text_report
+{
+    uint32_t device_index;
+    uint32_t usage;
+    uint8_t report_id;
+};
+
+/*
+  Queue of pending text reports, sent by the pacing timer.  Entries
+  before head are already sent.
+ */
+struct foils_hid_text
+{
+    struct ela_event_source *timer;
+    struct foils_hid_text_report *queue;
+    size_t head;
+    size_t tail;
+    size_t size;
+    size_t pace_reports;
+    struct timeval pace_interval;
+    int scheduled;
+};
+
+static
+void text_clear(struct foils_hid *fh)
+{
+    struct foils_hid_text *text = fh->text;
+
+    if (text->scheduled)
+        ela_remove(fh->el, text->timer);
+    text->scheduled = 0;
+    text->head = text->tail = 0;
+}
+
+/* Forgets queued text of a removed device */
+static
+void text_device_drop(struct foils_hid *fh, size_t device_index)
+{
+    struct foils_hid_text *text = fh->text;
+    size_t i, kept = text->head;
+
+    for (i = text->head; i < text->tail; ++i)
+        if (text->queue[i].device_index != device_index)
+            text->queue[kept++] = text->queue[i];
+
+    text->tail = kept;
+}
+
+/* Sends count reports of the same device and report */
+static
+void text_run_send(
+    struct foils_hid *fh,
+    const struct foils_hid_text_report *r, size_t count)
+{
+    uint8_t data[RUDP_HID_BATCH_MAX_SIZE];
+    size_t i;
+
+    if (!(fh->state == FOILS_HID_CONNECTED))
+        return;
+    if (!is_grabbed(fh->ga + r->device_index, r->report_id))
+        return;
+
+    /* Text bypasses the report cache, what server last got is unknown */
+    if (fh->cache[r->device_index]
+        && fh->cache[r->device_index]->report[r->report_id])
+        report_state_reset(fh->cache[r->device_index]->report[r->report_id]);
+
+    /* HID reports are little-endian */
+    for (i = 0; i < count; ++i) {
+        data[i * 4] = r[i].usage;
+        data[i * 4 + 1] = r[i].usage >> 8;
+        data[i * 4 + 2] = r[i].usage >> 16;
+        data[i * 4 + 3] = r[i].usage >> 24;
+    }
+
+    if (count > 1)
+        rudp_hid_input_report_batch_send(
+            &fh->client, r->device_index, r->report_id,
+            1, data, 4, count);
+    else
+        rudp_hid_input_report_send(
+            &fh->client, r->device_index, r->report_id,
+            1, data, 4);
+}
+
+static
+void text_flush(struct foils_hid *fh)
+{
+    struct foils_hid_text *text = fh->text;
+    size_t budget = text->pace_reports;
+    size_t batch_max = 1;
+
+    if (fh->client.features & FOILS_HID_FEATURE_BATCH)
+        batch_max = RUDP_HID_BATCH_MAX_SIZE / 4;
+
+    while (budget && text->head < text->tail) {
+        const struct foils_hid_text_report *r = text->queue + text->head;
+        size_t max = text->tail - text->head, n;
+
+        if (max > budget)
+            max = budget;
+        if (max > batch_max)
+            max = batch_max;
+
+        for (n = 1; n < max; ++n)
+            if (r[n].device_index != r->device_index
+                || r[n].report_id != r->report_id)
+                break;
+
+        text_run_send(fh, r, n);
+        text->head += n;
+        budget -= n;
+    }
+
+    if (text->head == text->tail) {
+        text->head = text->tail = 0;
+        return;
+    }
+
+    ela_set_timeout(fh->el, text->timer, &text->pace_interval, ELA_EVENT_ONCE);
+    ela_add(fh->el, text->timer);
+    text->scheduled = 1;
+}
+
+static
+void text_timer_cb(
+    struct ela_event_source *source, int fd,
+    uint32_t mask, void *data)
+{
+    struct foils_hid *fh = data;
+
+    fh->text->scheduled = 0;
+    text_flush(fh);
+}
+
+/* Room for count more reports at queue tail */
+static
+struct foils_hid_text_report *text_reserve(
+    struct foils_hid_text *text, size_t count)
+{
+    struct foils_hid_text_report *queue;
+    size_t size;
+
+    if (text->head) {
+        memmove(text->queue, text->queue + text->head,
+                (text->tail - text->head) * sizeof(*text->queue));
+        text->tail -= text->head;
+        text->head = 0;
+    }
+
+    if (text->tail + count <= text->size)
+        return text->queue + text->tail;
+
+    size = text->size ? text->size : 256;
+    while (size < text->tail + count)
+        size *= 2;
+
+    queue = realloc(text->queue, size * sizeof(*queue));
+    if (queue == NULL)
+        return NULL;
+
+    text->queue = queue;
+    text->size = size;
+    return text->queue + text->tail;
+}
+
+/* Queues press and release of a character */
+static inline
+struct foils_hid_text_report *text_char_put(
+    struct foils_hid_text_report *r,
+    size_t device_index, uint8_t report_id,
+    uint32_t code)
+{
+    r[0].device_index = r[1].device_index = device_index;
+    r[0].report_id = r[1].report_id = report_id;
+    r[0].usage = code;
+    r[1].usage = 0;
+    return r + 2;
+}
+
+static
+void text_commit(struct foils_hid *fh, struct foils_hid_text_report *end)
+{
+    struct foils_hid_text *text = fh->text;
+
+    text->tail = end - text->queue;
+
+    /* First reports go right away, timer sends the rest */
+    if (!text->scheduled)
+        text_flush(fh);
+}
+
+/*
+  Token bucket, as a generic cell rate algorithm: tat is the
+  theoretical arrival time of the next report, a report conforms
+  when it is at most tolerance ahead of now.  A cost of 0 is
+  unlimited.  All times are in nanoseconds.
+ */
+struct foils_hid_bucket
+{
+    uint64_t cost;
+    uint64_t tolerance;
+    uint64_t tat;
+};
+
+struct foils_hid_pending
+{
+    uint8_t *data;
+    size_t size;
+    uint64_t timestamp;
+    int reliable;
+};
+
+/*
+  Rate limiting state of a device.  Queued is a bitmap of reports
+  with a pending payload.
+ */
+struct foils_hid_rate_device
+{
+    struct foils_hid_bucket bucket;
+    uint32_t queued[256/32];
+    size_t queued_count;
+    int blocked;
+    uint8_t policy[256];
+    struct foils_hid_pending *pending[256];
+};
+
+struct foils_hid_rate
+{
+    struct ela_event_source *timer;
+    int scheduled;
+    struct foils_hid_bucket connection;
+    struct foils_hid_rate_device **device;
+    size_t next;
+};
+
+static
+uint64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static
+void bucket_set(struct foils_hid_bucket *b,
+                unsigned int rate, unsigned int burst)
+{
+    b->cost = rate ? 1000000000 / rate : 0;
+    b->tolerance = (burst ? burst - 1 : 0) * b->cost;
+    b->tat = 0;
+}
+
+/* Time until a report conforms, 0 if it does */
+static inline
+uint64_t bucket_delay(const struct foils_hid_bucket *b, uint64_t now)
+{
+    if (b->tat <= now + b->tolerance)
+        return 0;
+    return b->tat - now - b->tolerance;
+}
+
+static inline
+void bucket_take(struct foils_hid_bucket *b, uint64_t now)
+{
+    if (b->cost)
+        b->tat = (b->tat > now ? b->tat : now) + b->cost;
+}
+
+static
+struct foils_hid_rate_device *rate_device_get(
+    struct foils_hid *fh, size_t device_index)
+{
+    struct foils_hid_rate *rate = fh->rate;
+
+    if (rate->device[device_index] == NULL)
+        rate->device[device_index] = calloc(1, sizeof(*rate->device[0]));
+
+    return rate->device[device_index];
+}
+
+static
+void rate_device_clear(struct foils_hid *fh, size_t device_index)
+{
+    struct foils_hid_rate_device *d = fh->rate->device[device_index];
+
+    if (d == NULL)
+        return;
+
+    memset(d->queued, 0, sizeof(d->queued));
+    d->queued_count = 0;
+
+    if (!d->blocked)
+        return;
+
+    d->blocked = 0;
+    if (fh->handler->flow)
+        fh->handler->flow(fh, device_index, 0);
+}
+
+static
+void rate_schedule(struct foils_hid *fh)
+{
+    struct foils_hid_rate *rate = fh->rate;
+    uint64_t now = now_ns(), delay = UINT64_MAX, d_delay;
+    struct timeval tv;
+    size_t i;
+
+    if (rate->scheduled)
+        ela_remove(fh->el, rate->timer);
+    rate->scheduled = 0;
+
+    for (i = 0; i < fh->descriptor_count; ++i) {
+        struct foils_hid_rate_device *d = rate->device[i];
+
+        if (d == NULL || (!d->queued_count && !d->blocked))
+            continue;
+
+        d_delay = bucket_delay(&d->bucket, now);
+        if (d_delay < delay)
+            delay = d_delay;
+    }
+
+    if (delay == UINT64_MAX)
+        return;
+
+    d_delay = bucket_delay(&rate->connection, now);
+    if (d_delay > delay)
+        delay = d_delay;
+
+    /* Rounded up, the timer must not fire early */
+    delay = (delay + 999) / 1000;
+    tv.tv_sec = delay / 1000000;
+    tv.tv_usec = delay % 1000000;
+
+    ela_set_timeout(fh->el, rate->timer, &tv, ELA_EVENT_ONCE);
+    ela_add(fh->el, rate->timer);
+    rate->scheduled = 1;
+}
+
+/* Sends one pending report of the device, lowest report id first */
+static
+void rate_device_pop(struct foils_hid *fh, size_t device_index)
+{
+    struct foils_hid_rate_device *d = fh->rate->device[device_index];
+    struct foils_hid_pending *p;
+    size_t i;
+    uint8_t report_id;
+
+    for (i = 0; !d->queued[i]; ++i)
+        ;
+
+    report_id = i * 32 + __builtin_ctz(d->queued[i]);
+    d->queued[i] &= d->queued[i] - 1;
+    d->queued_count--;
+
+    p = d->pending[report_id];
+    if (fh->state == FOILS_HID_CONNECTED
+        && is_grabbed(fh->ga + device_index, report_id))
+        input_report_emit(fh, device_index, report_id,
+                          p->reliable, p->timestamp, p->data, p->size);
+}
+
+/*
+  Sends pending reports as budgets allow, one per device in turn, so
+  that no device starves others.
+ */
+static
+void rate_flush(struct foils_hid *fh)
+{
+    struct foils_hid_rate *rate = fh->rate;
+    uint64_t now = now_ns();
+    size_t n, i;
+    int progress = 1;
+
+    while (progress) {
+        progress = 0;
+
+        for (n = 0; n < fh->descriptor_count; ++n) {
+            struct foils_hid_rate_device *d;
+
+            i = (rate->next + n) % fh->descriptor_count;
+            d = rate->device[i];
+
+            if (d == NULL || bucket_delay(&d->bucket, now))
+                continue;
+
+            if (d->queued_count) {
+                if (bucket_delay(&rate->connection, now))
+                    goto done;
+
+                bucket_take(&rate->connection, now);
+                bucket_take(&d->bucket, now);
+                rate_device_pop(fh, i);
+                progress = 1;
+            } else if (d->blocked) {
+                d->blocked = 0;
+                if (fh->handler->flow)
+                    fh->handler->flow(fh, i, 0);
+            }
+        }
+    }
+
+done:
+    if (fh->descriptor_count)
+        rate->next = (rate->next + 1) % fh->descriptor_count;
+    rate_schedule(fh);
+}
+
+static
+void rate_timer_cb(
+    struct ela_event_source *source, int fd,
+    uint32_t mask, void *data)
+{
+    struct foils_hid *fh = data;
+
+    fh->rate->scheduled = 0;
+    rate_flush(fh);
+}
+
+/* Keeps a report over budget, as policy of its class says */
+static
+void rate_defer(
+    struct foils_hid *fh,
+    size_t device_index, uint8_t report_id,
+    int reliable, uint64_t timestamp,
+    const void *data, size_t datalen)
+{
+    struct foils_hid_rate_device *d = rate_device_get(fh, device_index);
+    struct foils_hid_pending *p;
+    uint8_t *buffer;
+    int queued;
+
+    if (d == NULL) {
+        fh->stats.input_dropped++;
+        return;
+    }
+
+    if (d->policy[report_id] == FOILS_HID_RATE_BLOCK) {
+        fh->stats.input_dropped++;
+        if (!d->blocked) {
+            d->blocked = 1;
+            if (fh->handler->flow)
+                fh->handler->flow(fh, device_index, 1);
+        }
+        rate_schedule(fh);
+        return;
+    }
+
+    p = d->pending[report_id];
+    if (p == NULL) {
+        p = calloc(1, sizeof(*p));
+        if (p == NULL) {
+            fh->stats.input_dropped++;
+            return;
+        }
+        d->pending[report_id] = p;
+    }
+
+    queued = (d->queued[report_id / 32] >> (report_id % 32)) & 1;
+
+    if (queued && d->policy[report_id] == FOILS_HID_RATE_MERGE
+        && p->size == datalen && fh->handler->merge
+        && !fh->handler->merge(fh, device_index, report_id,
+                               p->data, data, datalen)) {
+        fh->stats.input_merged++;
+        p->reliable |= reliable;
+        p->timestamp = timestamp;
+        return;
+    }
+
+    if (p->size != datalen) {
+        buffer = realloc(p->data, datalen);
+        if (buffer == NULL && datalen) {
+            fh->stats.input_dropped++;
+            return;
+        }
+        p->data = buffer;
+    }
+
+    /* Newest one replaces it, and must get through if either had to */
+    if (queued) {
+        fh->stats.input_dropped++;
+        p->reliable |= reliable;
+    } else {
+        fh->stats.input_deferred++;
+        p->reliable = reliable;
+        d->queued[report_id / 32] |= 1u << (report_id % 32);
+        d->queued_count++;
+    }
+
+    memcpy(p->data, data, datalen);
+    p->size = datalen;
+    p->timestamp = timestamp;
+
+    if (!queued)
+        rate_schedule(fh);
+}
+
+/* Tells whether a report may go now, and takes its budget */
+static inline
+int rate_admit(
+    struct foils_hid *fh,
+    size_t device_index, uint8_t report_id,
+    int reliable, uint64_t timestamp,
+    const void *data, size_t datalen)
+{
+    struct foils_hid_rate *rate = fh->rate;
+    struct foils_hid_rate_device *d = rate->device[device_index];
+    uint64_t now;
+
+    if (!rate->connection.cost && (d == NULL || !d->bucket.cost))
+        return 1;
+
+    now = now_ns();
+
+    /* Pending reports of the device go first */
+    if ((d == NULL || (!d->queued_count && !bucket_delay(&d->bucket, now)))
+        && !bucket_delay(&rate->connection, now)) {
+        bucket_take(&rate->connection, now);
+        if (d)
+            bucket_take(&d->bucket, now);
+        return 1;
+    }
+
+    rate_defer(fh, device_index, report_id, reliable, timestamp,
+               data, datalen);
+    return 0;
+}
+
+static
+void rate_device_free(struct foils_hid *fh, size_t device_index)
+{
+    struct foils_hid_rate_device *d = fh->rate->device[device_index];
+    size_t i;
+
+    if (d == NULL)
+        return;
+
+    for (i = 0; i < 256; ++i) {
+        if (d->pending[i] == NULL)
+            continue;
+        free(d->pending[i]->data);
+        free(d->pending[i]);
+    }
+    free(d);
+    fh->rate->device[device_index] = NULL;
+}
+
+static
+void rate_free(struct foils_hid *fh)
+{
+    struct foils_hid_rate *rate = fh->rate;
+    size_t i;
+
+    if (rate->scheduled)
+        ela_remove(fh->el, rate->timer);
+    ela_source_free(fh->el, rate->timer);
+
+    for (i = 0; i < fh->descriptor_count; ++i)
+        rate_device_free(fh, i);
+    free(rate->device);
+    free(rate);
+}
+
+/* Decodes one UTF-8 sequence, returns its length */
+static
+size_t utf8_decode(const uint8_t *s, size_t len, uint32_t *code)
+{
+    uint32_t c = s[0], min;
+    size_t n, i;
+
+    if (c < 0x80) {
+        *code = c;
+        return 1;
+    } else if (c >= 0xc2 && c < 0xe0) {
+        n = 2;
+        c &= 0x1f;
+        min = 0x80;
+    } else if (c >= 0xe0 && c < 0xf0) {
+        n = 3;
+        c &= 0x0f;
+        min = 0x800;
+    } else if (c >= 0xf0 && c < 0xf5) {
+        n = 4;
+        c &= 0x07;
+        min = 0x10000;
+    } else {
+        goto invalid;
+    }
+
+    if (n > len)
+        goto invalid;
+
+    for (i = 1; i < n; ++i) {
+        if ((s[i] & 0xc0) != 0x80)
+            goto invalid;
+        c = (c << 6) | (s[i] & 0x3f);
+    }
+
+    if (c < min || c > 0x10ffff || (c >= 0xd800 && c < 0xe000))
+        goto invalid;
+
+    *code = c;
+    return n;
+
+invalid:
+    *code = 0xfffd;
+    return 1;
+}
+
+
+
+/*
+  Grows all per-device arrays to count slots, new slots are free.
+  Arrays already grown stay so on failure, which is harmless.
+ */
+static
+int device_table_grow(struct foils_hid *fh, size_t count)
+{
+    size_t old = fh->descriptor_count;
+    void *p;
+
+#define GROW(array)                                                 \
+    p = realloc(array, count * sizeof(*array));                     \
+    if (p == NULL)                                                  \
+        return ENOMEM;                                              \
+    array = p;                                                      \
+    memset(array + old, 0, (count - old) * sizeof(*array));
+
+    GROW(fh->descriptor);
+    GROW(fh->enable);
+    GROW(fh->ga);
+    GROW(fh->cache);
+    GROW(fh->rate->device);
+    GROW(fh->shared);
+    GROW(fh->held);
+    GROW(fh->held_token);
+#undef GROW
+
+    fh->descriptor_count = count;
+    return 0;
+}
+
+static
+void device_table_free(struct foils_hid *fh)
 {
-    ga->grab[report_id/8] |= 1 << (report_id % 8);
+    free(fh->descriptor);
+    free(fh->enable);
+    free(fh->ga);
+    free(fh->cache);
+    free(fh->rate->device);
+    free(fh->shared);
+    free(fh->held);
+    free(fh->held_token);
 }
 
+/* Drops the shared announce packet of a device, if any */
 static
-void release(struct foils_grab_accountant *ga, uint8_t report_id)
+void device_shared_put(struct foils_hid *fh, size_t index)
 {
-    ga->grab[report_id/8] &= ~(1 << (report_id % 8));
+    if (fh->shared[index] == NULL)
+        return;
+
+    foils_hid_desc_put(fh->desc_store, fh->shared[index]);
+    fh->shared[index] = NULL;
 }
 
+static
+void device_announce(struct foils_hid *fh, size_t index)
+{
+    void *packet;
+    size_t size;
+
+    /* Built once and kept, or built on each send as a fallback */
+    if (fh->desc_store && fh->shared[index] == NULL)
+        foils_hid_desc_get(fh->desc_store, fh->descriptor[index],
+                           &fh->shared[index]);
 
+    if (fh->shared[index] == NULL) {
+        rudp_hid_device_new(&fh->client, fh->descriptor[index], index);
+        return;
+    }
+
+    packet = foils_hid_desc_packet(fh->shared[index], &size);
+    rudp_hid_device_new_send(&fh->client, packet, size, index);
+}
 
 int foils_hid_init(
     struct foils_hid *fh,
@@ -57,21 +1058,36 @@ int foils_hid_init(
     const struct foils_hid_device_descriptor *descriptor,
     size_t descriptor_count)
 {
+    size_t i;
+
     memset(fh, 0, sizeof(*fh));
 
-    if (descriptor_count > 32)
-        return EINVAL;
+    rudp_error_t err = ENOMEM;
 
-    fh->ga = malloc(sizeof(*fh->ga) * descriptor_count);
-    if (fh->ga == NULL)
+    fh->text = calloc(1, sizeof(*fh->text));
+    if (fh->text == NULL)
         return ENOMEM;
 
-    memset(fh->ga, 0, sizeof(*fh->ga) * descriptor_count);
+    if (ela_source_alloc(el, text_timer_cb, fh, &fh->text->timer))
+        goto text_free;
+
+    fh->rate = calloc(1, sizeof(*fh->rate));
+    if (fh->rate == NULL)
+        goto timer_free;
 
-    rudp_error_t err = rudp_init(&fh->rudp, el,
-                                 RUDP_HANDLER_DEFAULT);
+    if (ela_source_alloc(el, rate_timer_cb, fh, &fh->rate->timer))
+        goto rate_free;
+
+    if (descriptor_count && device_table_grow(fh, descriptor_count))
+        goto table_free;
+
+    for (i = 0; i < descriptor_count; ++i)
+        fh->descriptor[i] = &descriptor[i];
+
+    err = rudp_init(&fh->rudp, el,
+                    RUDP_HANDLER_DEFAULT);
     if ( err )
-        goto out;
+        goto table_free;
 
     err = rudp_hid_client_init(&fh->client, &fh->rudp, &client_handler);
     if ( err )
@@ -79,48 +1095,85 @@ int foils_hid_init(
 
     fh->handler = handler;
     fh->el = el;
-    fh->enable = 0;
     fh->state = FOILS_HID_IDLE;
-    fh->descriptor = descriptor;
-    fh->descriptor_count = descriptor_count;
+
+    foils_hid_text_pace_set(fh, FOILS_HID_TEXT_PACE_REPORTS,
+                            FOILS_HID_TEXT_PACE_INTERVAL);
 
     return 0;
 deinit:
     rudp_deinit(&fh->rudp);
-out:
-    free(fh->ga);
+table_free:
+    device_table_free(fh);
+    ela_source_free(el, fh->rate->timer);
+rate_free:
+    free(fh->rate);
+timer_free:
+    ela_source_free(el, fh->text->timer);
+text_free:
+    free(fh->text);
     return err;
 }
 
 void foils_hid_deinit(struct foils_hid *fh)
 {
+    size_t i;
+
     if (fh->state != FOILS_HID_IDLE)
         rudp_hid_client_close(&fh->client);
 
+    for (i = 0; i < fh->descriptor_count; ++i)
+        cache_free(fh->cache[i]);
+    free(fh->cache);
+
+    text_clear(fh);
+    ela_source_free(fh->el, fh->text->timer);
+    free(fh->text->queue);
+    free(fh->text);
+
+    rate_free(fh);
+
+    for (i = 0; i < fh->descriptor_count; ++i)
+        device_shared_put(fh, i);
+    free(fh->shared);
+
     rudp_hid_client_deinit(&fh->client);
     rudp_deinit(&fh->rudp);
+    free(fh->held);
+    free(fh->held_token);
     free(fh->ga);
+    free(fh->enable);
+    free(fh->descriptor);
 }
 
 void foils_hid_device_enable(struct foils_hid *fh, size_t index)
 {
-    if (fh->enable & (1<<index))
+    if (index >= fh->descriptor_count || fh->descriptor[index] == NULL)
+        return;
+
+    if (fh->enable[index])
         return;
 
-    fh->enable |= 1<<index;
+    fh->enable[index] = 1;
 
     if (!(fh->state == FOILS_HID_CONNECTED))
         return;
 
-    rudp_hid_device_new(&fh->client, &fh->descriptor[index], index);
+    device_announce(fh, index);
 }
 
 void foils_hid_device_disable(struct foils_hid *fh, size_t index)
 {
-    if (!(fh->enable & (1<<index)))
+    if (index >= fh->descriptor_count || !fh->enable[index])
         return;
 
-    fh->enable &= ~(1<<index);
+    fh->enable[index] = 0;
+
+    /* Index may be reused for another device */
+    grab_reset(fh->ga + index);
+    cache_reset(fh->cache[index]);
+    cache_latest_forget(fh->cache[index]);
+    rate_device_clear(fh, index);
 
     if (!(fh->state == FOILS_HID_CONNECTED))
         return;
@@ -128,6 +1181,283 @@ void foils_hid_device_disable(struct foils_hid *fh, size_t index)
     rudp_hid_device_dropped(&fh->client, index);
 }
 
+int foils_hid_device_add(
+    struct foils_hid *fh,
+    const struct foils_hid_device_descriptor *descriptor,
+    size_t *index)
+{
+    size_t i;
+    int err;
+
+    /* Lowest free slot first, ids stay small */
+    for (i = 0; i < fh->descriptor_count; ++i)
+        if (fh->descriptor[i] == NULL && !fh->held[i])
+            break;
+
+    if (i == fh->descriptor_count) {
+        err = device_table_grow(fh, i + 1);
+        if (err)
+            return err;
+    }
+
+    fh->descriptor[i] = descriptor;
+    *index = i;
+
+    foils_hid_device_enable(fh, i);
+    return 0;
+}
+
+int foils_hid_device_remove(struct foils_hid *fh, size_t index)
+{
+    int dropped;
+
+    if (index >= fh->descriptor_count || fh->descriptor[index] == NULL)
+        return ENOENT;
+
+    /* Drop is only sent for an enabled device, when connected */
+    dropped = fh->enable[index] && fh->state == FOILS_HID_CONNECTED;
+    foils_hid_device_disable(fh, index);
+
+    /* Next device in this slot starts afresh */
+    text_device_drop(fh, index);
+    cache_free(fh->cache[index]);
+    fh->cache[index] = NULL;
+    rate_device_free(fh, index);
+    rate_schedule(fh);
+    device_shared_put(fh, index);
+    fh->descriptor[index] = NULL;
+
+    /* Requests for the removed device may still be on their way */
+    if (dropped && !foils_hid_ack_request(fh, &fh->held_token[index]))
+        fh->held[index] = 1;
+
+    return 0;
+}
+
+void foils_hid_desc_store_use(
+    struct foils_hid *fh,
+    struct foils_hid_desc_store *store)
+{
+    size_t i;
+
+    for (i = 0; i < fh->descriptor_count; ++i)
+        device_shared_put(fh, i);
+
+    fh->desc_store = store;
+}
+
+int foils_hid_send_pace_set(
+    struct foils_hid *fh,
+    size_t budget, unsigned int interval,
+    unsigned int hold, unsigned int starve)
+{
+    int err;
+
+    err = rudp_hid_client_scheduler_enable(&fh->client, fh->el);
+    if (err)
+        return err;
+
+    return rudp_hid_client_scheduler_pace_set(&fh->client, budget, interval,
+                                              hold, starve);
+}
+
+void foils_hid_send_pace_clear(struct foils_hid *fh)
+{
+    rudp_hid_client_scheduler_disable(&fh->client);
+}
+
+int foils_hid_delta_enable(struct foils_hid *fh, size_t device_index)
+{
+    return cache_mode_enable(fh, device_index, CACHE_DELTA);
+}
+
+void foils_hid_delta_disable(struct foils_hid *fh, size_t device_index)
+{
+    cache_mode_disable(fh, device_index, CACHE_DELTA);
+}
+
+int foils_hid_dedup_enable(struct foils_hid *fh, size_t device_index)
+{
+    return cache_mode_enable(fh, device_index, CACHE_DEDUP);
+}
+
+void foils_hid_dedup_disable(struct foils_hid *fh, size_t device_index)
+{
+    cache_mode_disable(fh, device_index, CACHE_DEDUP);
+}
+
+int foils_hid_resync_enable(struct foils_hid *fh, size_t device_index)
+{
+    return cache_mode_enable(fh, device_index, CACHE_RESYNC);
+}
+
+void foils_hid_resync_disable(struct foils_hid *fh, size_t device_index)
+{
+    cache_mode_disable(fh, device_index, CACHE_RESYNC);
+}
+
+int foils_hid_rate_limit_set(
+    struct foils_hid *fh, size_t device_index,
+    unsigned int rate, unsigned int burst)
+{
+    struct foils_hid_rate_device *d;
+
+    if (rate > 1000000000 || !device_valid(fh, device_index))
+        return EINVAL;
+
+    d = rate_device_get(fh, device_index);
+    if (d == NULL)
+        return ENOMEM;
+
+    bucket_set(&d->bucket, rate, burst);
+    rate_schedule(fh);
+    return 0;
+}
+
+int foils_hid_connection_rate_limit_set(
+    struct foils_hid *fh,
+    unsigned int rate, unsigned int burst)
+{
+    if (rate > 1000000000)
+        return EINVAL;
+
+    bucket_set(&fh->rate->connection, rate, burst);
+    rate_schedule(fh);
+    return 0;
+}
+
+int foils_hid_rate_policy_set(
+    struct foils_hid *fh, size_t device_index, uint8_t report_id,
+    enum foils_hid_rate_policy policy)
+{
+    struct foils_hid_rate_device *d;
+
+    if (!device_valid(fh, device_index))
+        return EINVAL;
+
+    d = rate_device_get(fh, device_index);
+    if (d == NULL)
+        return ENOMEM;
+
+    d->policy[report_id] = policy;
+    return 0;
+}
+
+int foils_hid_redundancy_set(
+    struct foils_hid *fh, size_t device_index,
+    unsigned int count)
+{
+    int err;
+
+    if (count > FOILS_HID_REDUNDANCY_MAX || !device_valid(fh, device_index))
+        return EINVAL;
+
+    if (!count) {
+        cache_mode_disable(fh, device_index, CACHE_REDUNDANT);
+        return 0;
+    }
+
+    err = cache_mode_enable(fh, device_index, CACHE_REDUNDANT);
+    if (err)
+        return err;
+
+    fh->cache[device_index]->redundancy = count;
+    return 0;
+}
+
+unsigned int foils_hid_redundancy_for_loss(double loss, double target)
+{
+    double lost = loss;
+    unsigned int count;
+
+    /* A report is lost with its packet and the count next ones */
+    for (count = 0; count < FOILS_HID_REDUNDANCY_MAX; ++count) {
+        if (lost <= target)
+            break;
+        lost *= loss;
+    }
+
+    return count;
+}
+
+int foils_hid_ack_request(struct foils_hid *fh, uint32_t *token)
+{
+    if (fh->state != FOILS_HID_CONNECTED)
+        return ENOTCONN;
+
+    return rudp_hid_ack_request(&fh->client, token);
+}
+
+/* Timestamp is 0 when not to be sent */
+static
+void input_report_emit(
+    struct foils_hid *fh,
+    size_t device_index, uint8_t report_id,
+    int reliable, uint64_t timestamp,
+    const void *data, size_t datalen)
+{
+    struct foils_hid_report_cache *cache = fh->cache[device_index];
+    struct foils_hid_report_state *r = NULL;
+
+    if (cache)
+        r = report_state_get(cache, report_id);
+
+    if (r && (cache->modes & CACHE_DEDUP)
+        && report_duplicate(r, reliable, data, datalen)) {
+        fh->stats.input_duplicates++;
+        return;
+    }
+
+    if (r && (cache->modes & CACHE_REDUNDANT) && !reliable
+        && (fh->client.features & FOILS_HID_FEATURE_REDUNDANT)
+        && !redundant_send(fh, r, cache->redundancy, device_index,
+                           report_id, timestamp, data, datalen))
+        return;
+
+    /* Server may not get history and other reports in order */
+    if (r)
+        r->history_count = 0;
+
+    /* Failed sends are lost, as plain ones below */
+    if (r && (cache->modes & CACHE_DELTA)
+        && (fh->client.features & FOILS_HID_FEATURE_DELTA)
+        && datalen >= FOILS_HID_DELTA_MIN_SIZE) {
+        delta_send(fh, r, device_index, report_id,
+                   reliable, timestamp, data, datalen);
+        return;
+    }
+
+    if (timestamp)
+        rudp_hid_input_report_timed_send(
+            &fh->client, device_index, report_id,
+            reliable, timestamp, data, datalen);
+    else
+        rudp_hid_input_report_send(
+            &fh->client, device_index, report_id,
+            reliable, data, datalen);
+}
+
+static
+void input_report_send(
+    struct foils_hid *fh,
+    size_t device_index, uint8_t report_id,
+    int reliable, uint64_t timestamp,
+    const void *data, size_t datalen)
+{
+    fh->stats.input_reports++;
+    if (reliable)
+        fh->stats.input_reliable++;
+
+    if (!(fh->client.features & FOILS_HID_FEATURE_TIMESTAMP))
+        timestamp = 0;
+
+    if (!rate_admit(fh, device_index, report_id, reliable, timestamp,
+                    data, datalen))
+        return;
+
+    input_report_emit(fh, device_index, report_id, reliable, timestamp,
+                      data, datalen);
+}
 
 void foils_hid_input_report_send(
     struct foils_hid *fh,
@@ -135,14 +1465,41 @@ void foils_hid_input_report_send(
     int reliable,
     const void *data, size_t datalen)
 {
+    uint64_t timestamp = 0;
+
+    report_latest_keep(fh, device_index, report_id, data, datalen);
+
     if (!(fh->state == FOILS_HID_CONNECTED))
         return;
     if (!is_grabbed(fh->ga + device_index, report_id))
         return;
 
-    rudp_hid_input_report_send(
-        &fh->client, device_index, report_id,
-        reliable, data, datalen);
+    /* Clock is only read when the server takes timestamps */
+    if (fh->client.features & FOILS_HID_FEATURE_TIMESTAMP)
+        timestamp = now_ns();
+
+    input_report_send(
+        fh, device_index, report_id, reliable, timestamp,
+        data, datalen);
+}
+
+void foils_hid_input_report_timed_send(
+    struct foils_hid *fh,
+    size_t device_index, uint8_t report_id,
+    int reliable,
+    uint64_t timestamp,
+    const void *data, size_t datalen)
+{
+    report_latest_keep(fh, device_index, report_id, data, datalen);
+
+    if (!(fh->state == FOILS_HID_CONNECTED))
+        return;
+    if (!is_grabbed(fh->ga + device_index, report_id))
+        return;
+
+    input_report_send(
+        fh, device_index, report_id, reliable,
+        timestamp, data, datalen);
 }
 
 void foils_hid_feature_report_send(
@@ -161,6 +1518,84 @@ void foils_hid_feature_report_send(
         reliable, data, datalen);
 }
 
+void foils_hid_features_set(struct foils_hid *fh, uint32_t features)
+{
+    rudp_hid_client_features_offer(&fh->client, features);
+}
+
+void foils_hid_text_pace_set(
+    struct foils_hid *fh,
+    size_t reports, unsigned int interval)
+{
+    fh->text->pace_reports = reports ? reports : 1;
+    fh->text->pace_interval.tv_sec = interval / 1000000;
+    fh->text->pace_interval.tv_usec = interval % 1000000;
+}
+
+int foils_hid_unicode_send(
+    struct foils_hid *fh,
+    size_t device_index, uint8_t report_id,
+    const uint32_t *codes, size_t count)
+{
+    struct foils_hid_text_report *r;
+    size_t i;
+
+    if (!(fh->state == FOILS_HID_CONNECTED))
+        return ENOTCONN;
+    if (!is_grabbed(fh->ga + device_index, report_id))
+        return ENOTCONN;
+
+    r = text_reserve(fh->text, count * 2);
+    if (r == NULL)
+        return ENOMEM;
+
+    for (i = 0; i < count; ++i)
+        r = text_char_put(r, device_index, report_id, codes[i]);
+
+    text_commit(fh, r);
+    return 0;
+}
+
+int foils_hid_unicode_text_send(
+    struct foils_hid *fh,
+    size_t device_index, uint8_t report_id,
+    const char *text, size_t len)
+{
+    const uint8_t *s = (const uint8_t *)text;
+    struct foils_hid_text_report *r;
+    uint32_t code;
+    size_t i = 0;
+
+    if (!(fh->state == FOILS_HID_CONNECTED))
+        return ENOTCONN;
+    if (!is_grabbed(fh->ga + device_index, report_id))
+        return ENOTCONN;
+
+    /* At most one character per byte */
+    r = text_reserve(fh->text, len * 2);
+    if (r == NULL)
+        return ENOMEM;
+
+    while (i < len) {
+        if (s[i] < 0x80)
+            code = s[i++];
+        else
+            i += utf8_decode(s + i, len - i, &code);
+
+        r = text_char_put(r, device_index, report_id, code);
+    }
+
+    text_commit(fh, r);
+    return 0;
+}
+
+void foils_hid_capture_set(
+    struct foils_hid *fh,
+    struct foils_hid_capture *capture)
+{
+    rudp_hid_client_capture_set(&fh->client, capture);
+}
+
 int foils_hid_client_connect_hostname(
     struct foils_hid *fh,
     const char *hostname,
@@ -244,10 +1679,10 @@ void connected(
 
     size_t i;
     for (i=0; i<fh->descriptor_count; ++i) {
-        if (!(fh->enable & (1<<i)))
+        if (!fh->enable[i])
             continue;
 
-        rudp_hid_device_new(&fh->client, &fh->descriptor[i], i);
+        device_announce(fh, i);
     }
 }
 
@@ -261,20 +1696,53 @@ void server_lost(
     fh->handler->status(fh, FOILS_HID_CONNECTING);
     fh->state = FOILS_HID_CONNECTING;
 
-    for (i=0; i<fh->descriptor_count; ++i)
+    for (i=0; i<fh->descriptor_count; ++i) {
         grab_reset(fh->ga + i);
+        cache_reset(fh->cache[i]);
+        rate_device_clear(fh, i);
+    }
+
+    text_clear(fh);
+    rate_schedule(fh);
 
     rudp_hid_client_connect(&fh->client);
 }
 
+/* Server may still talk about a device just removed */
+static
+int device_known(const struct foils_hid *fh, uint32_t device_id)
+{
+    return device_id < fh->descriptor_count && fh->enable[device_id];
+}
+
 static
 void device_grab(
         struct rudp_hid_client *_client,
         uint32_t device_id, uint8_t report_id)
 {
     struct foils_hid *fh = (struct foils_hid *)_client;
+    struct foils_hid_report_cache *cache;
+    struct foils_hid_report_state *r;
+
+    if (!device_known(fh, device_id))
+        return;
 
+    cache = fh->cache[device_id];
     grab(fh->ga + device_id, report_id);
+
+    if (cache == NULL || cache->report[report_id] == NULL)
+        return;
+
+    /* Server may have lost the keyframe and the last state */
+    r = cache->report[report_id];
+    report_state_reset(r);
+
+    /* Capture time is long gone, state is current anyway */
+    if ((cache->modes & CACHE_RESYNC) && r->latest_size) {
+        fh->stats.input_resynced++;
+        input_report_send(fh, device_id, report_id, 1, 0,
+                          r->latest, r->latest_size);
+    }
 }
 
 static
@@ -284,6 +1752,9 @@ void device_release(
 {
     struct foils_hid *fh = (struct foils_hid *)_client;
 
+    if (!device_known(fh, device_id))
+        return;
+
     release(fh->ga + device_id, report_id);
 }
 
@@ -303,7 +1774,11 @@ void device_close(
 {
     struct foils_hid *fh = (struct foils_hid *)_client;
 
+    if (!device_known(fh, device_id))
+        return;
+
     grab_reset(fh->ga + device_id);
+    cache_reset(fh->cache[device_id]);
 }
 
 static
@@ -314,6 +1789,9 @@ void feature_report(
 {
     struct foils_hid *fh = (struct foils_hid *)_client;
 
+    if (!device_known(fh, device_id))
+        return;
+
     fh->handler->feature_report(fh, device_id, report_id,
                                 data, datalen);
 }
@@ -326,6 +1804,9 @@ void output_report(
 {
     struct foils_hid *fh = (struct foils_hid *)_client;
 
+    if (!device_known(fh, device_id))
+        return;
+
     fh->handler->output_report(fh, device_id, report_id,
                                data, datalen);
 }
@@ -337,9 +1818,43 @@ void feature_report_sollicit(
 {
     struct foils_hid *fh = (struct foils_hid *)_client;
 
+    if (!device_known(fh, device_id))
+        return;
+
     fh->handler->feature_report_sollicit(fh, device_id, report_id);
 }
 
+static
+void features_acked(
+        struct rudp_hid_client *_client,
+        uint32_t features)
+{
+    struct foils_hid *fh = (struct foils_hid *)_client;
+
+    if (fh->handler->features)
+        fh->handler->features(fh, features);
+}
+
+static
+void ack_done(
+        struct rudp_hid_client *_client,
+        uint32_t token, int status, uint64_t rtt)
+{
+    struct foils_hid *fh = (struct foils_hid *)_client;
+    size_t i;
+
+    /* Server handled the drop, or connection is gone: slot is free */
+    for (i = 0; i < fh->descriptor_count; ++i) {
+        if (fh->held[i] && fh->held_token[i] == token) {
+            fh->held[i] = 0;
+            return;
+        }
+    }
+
+    if (fh->handler->ack)
+        fh->handler->ack(fh, token, status, rtt);
+}
+
 static const
 struct rudp_hid_client_handler client_handler =
 {
@@ -352,4 +1867,6 @@ struct rudp_hid_client_handler client_handler =
     .feature_report = feature_report,
     .output_report = output_report,
     .feature_report_sollicit = feature_report_sollicit,
+    .features = features_acked,
+    .ack = ack_done,
 };
@@ -10,8 +10,14 @@
  */
 
 #include <string.h>
+#include <errno.h>
 #include <alloca.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ela/ela.h>
 #include <foils/rudp_hid_client.h>
+#include <foils/compact_header.h>
+#include <foils/delta.h>
 
 enum foils_hid_command
 {
@@ -27,6 +33,19 @@ enum foils_hid_command
     FOILS_HID_RELEASE = 7, // server to client
 
     FOILS_HID_FEATURE_SOLLICIT = 8, // server to client
+
+    FOILS_HID_DATA_BATCH = 9, // client to server
+    FOILS_HID_DATA_COMPACT = 10, // client to server
+
+    FOILS_HID_HELLO = 11, // client to server
+    FOILS_HID_HELLO_ACK = 12, // server to client
+
+    FOILS_HID_DATA_KEYFRAME = 13, // client to server
+    FOILS_HID_DATA_DELTA = 14, // client to server
+    FOILS_HID_DATA_REDUNDANT = 15, // client to server
+
+    FOILS_HID_ACK_REQUEST = 16, // client to server
+    FOILS_HID_ACK = 17, // server to client
 };
 
 /**
@@ -40,6 +59,66 @@ struct foils_hid_header
     uint32_t report_id;
 };
 
+/**
+   Set in report_id of an input report when a 32-bit capture
+   timestamp follows the header.  It is the client's CLOCK_MONOTONIC
+   in microseconds, modulo 2^32.  Only differences between timestamps
+   are meaningful.
+ */
+#define FOILS_HID_REPORT_TIMESTAMP 0x80000000
+
+/**
+   Follows the header of a batch, then report_count reports of
+   report_size bytes each.
+
+   All fields are big-endian on the wire.
+ */
+struct foils_hid_batch
+{
+    uint16_t report_size;
+    uint16_t report_count;
+};
+
+/**
+   Follows the header and timestamp of DATA_REDUNDANT packets.  Then
+   come report_count reports of the same size, oldest first.  Newest
+   one has sequence number seq, the ones before it have the previous
+   numbers.
+
+   All fields are big-endian on the wire.
+ */
+struct foils_hid_redundant
+{
+    uint16_t seq;
+    uint16_t report_count;
+};
+
+/**
+   Follows the header of capability negotiation packets.  Client
+   sends its version and offered features on connection, server
+   answers with its own version and the subset it supports.  Legacy
+   servers ignore the offer.
+
+   All fields are big-endian on the wire.
+ */
+struct foils_hid_hello
+{
+    uint32_t version;
+    uint32_t features;
+};
+
+/**
+   Follows the header of delivery acknowledgement packets.  Server
+   echoes the token of each request once all reliable packets sent
+   before it were handled.
+
+   All fields are big-endian on the wire.
+ */
+struct foils_hid_ack
+{
+    uint32_t token;
+};
+
 #define DEVICE_NAME_LEN 64
 #define DEVICE_SERIAL_LEN 32
 
@@ -60,21 +139,207 @@ struct foils_hid_device_new
     uint16_t strings_size; // bytes
 };
 
+struct rudp_hid_scheduler
+{
+    struct foils_hid_sched sched;
+    struct ela_el *el;
+    struct ela_event_source *timer;
+    int scheduled;
+};
 
 static const struct rudp_client_handler _handler;
 
+static
+uint64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static
+void scheduler_packet_out(
+    void *opaque, int reliable, int command,
+    const void *data, size_t size)
+{
+    struct rudp_hid_client *client = opaque;
+
+    rudp_client_send(&client->base, reliable, command, data, size);
+}
+
+static
+void scheduler_run(struct rudp_hid_client *client)
+{
+    struct rudp_hid_scheduler *s = client->scheduler;
+    uint64_t now = now_ns();
+    uint64_t next = foils_hid_sched_run(&s->sched, now);
+    uint64_t delay;
+    struct timeval tv;
+
+    if (s->scheduled)
+        ela_remove(s->el, s->timer);
+    s->scheduled = 0;
+
+    if (!next)
+        return;
+
+    /* Rounded up, the timer must not fire early */
+    delay = (next - now + 999) / 1000;
+    tv.tv_sec = delay / 1000000;
+    tv.tv_usec = delay % 1000000;
+
+    ela_set_timeout(s->el, s->timer, &tv, ELA_EVENT_ONCE);
+    ela_add(s->el, s->timer);
+    s->scheduled = 1;
+}
+
+static
+void scheduler_timer_cb(
+    struct ela_event_source *source, int fd,
+    uint32_t mask, void *data)
+{
+    struct rudp_hid_client *client = data;
+
+    client->scheduler->scheduled = 0;
+    scheduler_run(client);
+}
+
+/* Drops queued packets */
+static
+void scheduler_free(struct rudp_hid_client *client)
+{
+    struct rudp_hid_scheduler *s = client->scheduler;
+
+    if (s == NULL)
+        return;
+
+    if (s->scheduled)
+        ela_remove(s->el, s->timer);
+    ela_source_free(s->el, s->timer);
+    foils_hid_sched_clear(&s->sched);
+    free(s);
+    client->scheduler = NULL;
+}
+
+/* Scheduler flow of a report, feature and input ones apart */
+static inline
+uint64_t report_flow(uint32_t device_id, uint8_t report_id, int feature)
+{
+    return (uint64_t)device_id << 9 | feature << 8 | report_id;
+}
+
+/*
+  All report traffic goes through here.  Without a scheduler,
+  packets go to librudp right away.
+ */
+static
+int packet_send(
+    struct rudp_hid_client *client, enum foils_hid_priority priority,
+    uint64_t flow,
+    int reliable, int command, const void *data, size_t size)
+{
+    struct rudp_hid_scheduler *s = client->scheduler;
+    int err;
+
+    if (s == NULL)
+        return rudp_client_send(&client->base, reliable, command,
+                                data, size);
+
+    err = foils_hid_sched_send(&s->sched, now_ns(), priority, flow,
+                               reliable, command, data, size);
+    if (err)
+        return err;
+
+    /*
+      A queued packet needs the timer.  Interactive ones are only
+      queued behind others, the timer already runs for them.
+     */
+    if (priority != FOILS_HID_PRIORITY_INTERACTIVE && !s->scheduled)
+        scheduler_run(client);
+
+    return 0;
+}
+
+int rudp_hid_client_scheduler_enable(
+    struct rudp_hid_client *client,
+    struct ela_el *el)
+{
+    struct rudp_hid_scheduler *s;
+
+    if (client->scheduler)
+        return 0;
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL)
+        return ENOMEM;
+
+    if (ela_source_alloc(el, scheduler_timer_cb, client, &s->timer)) {
+        free(s);
+        return ENOMEM;
+    }
+
+    s->el = el;
+    foils_hid_sched_init(&s->sched, scheduler_packet_out, client);
+    client->scheduler = s;
+
+    return 0;
+}
+
+void rudp_hid_client_scheduler_disable(
+    struct rudp_hid_client *client)
+{
+    struct rudp_hid_scheduler *s = client->scheduler;
+
+    if (s == NULL)
+        return;
+
+    /* Everything is starving with no budget limit */
+    foils_hid_sched_pace_set(&s->sched, 0, 0, 0, 0);
+    foils_hid_sched_run(&s->sched, now_ns());
+    scheduler_free(client);
+}
+
+int rudp_hid_client_scheduler_pace_set(
+    struct rudp_hid_client *client,
+    size_t budget, unsigned int interval,
+    unsigned int hold, unsigned int starve)
+{
+    struct rudp_hid_scheduler *s = client->scheduler;
+
+    if (s == NULL)
+        return EINVAL;
+
+    foils_hid_sched_pace_set(&s->sched, budget, interval * 1000ULL,
+                             hold * 1000ULL, starve * 1000ULL);
+    if (s->scheduled)
+        scheduler_run(client);
+
+    return 0;
+}
+
 int rudp_hid_client_init(
     struct rudp_hid_client *client,
     struct rudp *rudp,
     const struct rudp_hid_client_handler *handler)
 {
     client->handler = handler;
+    client->capture = NULL;
+    client->offered = FOILS_HID_FEATURES_ALL;
+    client->features = 0;
+    client->scheduler = NULL;
+    client->ack = NULL;
+    client->ack_first = 0;
+    client->ack_count = 0;
+    client->ack_token = 0;
     return rudp_client_init(&client->base, rudp, &_handler);
 }
 
 void rudp_hid_client_deinit(
     struct rudp_hid_client *client)
 {
+    scheduler_free(client);
+    free(client->ack);
     rudp_client_deinit(&client->base);
 }
 
@@ -83,25 +348,59 @@ static inline size_t round_up(size_t x)
     return (x + 3) & ~3;
 }
 
-int rudp_hid_device_new(
+struct device_new_packet {
+    struct foils_hid_header header[1];
+    struct foils_hid_device_new dev[1];
+    uint8_t data[];
+};
+
+static
+void device_capture(
     struct rudp_hid_client *client,
-    const struct foils_hid_device_descriptor *desc,
-    uint32_t device_id)
+    uint32_t device_id,
+    const struct device_new_packet *packet)
+{
+    const struct foils_hid_device_new *dev = packet->dev;
+    size_t name_len = strnlen(dev->name, DEVICE_NAME_LEN);
+    size_t descriptor_size = ntohs(dev->descriptor_size);
+    uint8_t payload[2 + DEVICE_NAME_LEN + 1 + descriptor_size];
+    uint16_t version = ntohs(dev->version);
+    uint8_t *p = payload;
+
+    memcpy(p, &version, 2);
+    p += 2;
+    memcpy(p, dev->name, name_len);
+    p += name_len;
+    *p++ = 0;
+    memcpy(p, (const uint8_t *)dev + ntohs(dev->descriptor_offset),
+           descriptor_size);
+    p += descriptor_size;
+
+    foils_hid_capture_record(
+        client->capture, FOILS_HID_CAPTURE_DEVICE,
+        device_id, 0, payload, p - payload);
+}
+
+size_t rudp_hid_device_new_size(
+    const struct foils_hid_device_descriptor *desc)
 {
     size_t blob_size = desc->descriptor_size
         + desc->physical_size
         + desc->strings_size + 8;
 
-    struct packet {
-        struct foils_hid_header header[1];
-        struct foils_hid_device_new dev[1];
-        uint8_t data[];
-    } *packet;
+    return sizeof(struct foils_hid_header)
+        + sizeof(struct foils_hid_device_new)
+        + blob_size;
+}
 
-    packet = alloca (sizeof (*packet) + blob_size);
-    memset(packet, 0, sizeof(*packet));
+void rudp_hid_device_new_build(
+    const struct foils_hid_device_descriptor *desc,
+    void *buffer)
+{
+    struct device_new_packet *packet = buffer;
 
-    packet->header->device_id = htonl(device_id);
+    /* Whole packet is cleared, equal descriptors build equal packets */
+    memset(packet, 0, rudp_hid_device_new_size(desc));
 
     strncpy(packet->dev->name, desc->name, DEVICE_NAME_LEN);
 //    strncpy(packet->dev->serial, desc->serial, DEVICE_SERIAL_LEN);
@@ -129,12 +428,39 @@ int rudp_hid_device_new(
            desc->physical, desc->physical_size);
     memcpy(packet->data + descriptor_size + physical_size,
            desc->strings, desc->strings_size);
+}
+
+int rudp_hid_device_new_send(
+    struct rudp_hid_client *client,
+    void *packet, size_t size,
+    uint32_t device_id)
+{
+    struct device_new_packet *p = packet;
+
+    if (size < sizeof(struct foils_hid_header))
+        return EINVAL;
+
+    /* Transport copies it on send, shared packets may be patched */
+    p->header->device_id = htonl(device_id);
+
+    if (client->capture)
+        device_capture(client, device_id, p);
 
     return rudp_client_send(
-        &client->base, 1, FOILS_HID_DEVICE_NEW,
-        packet, sizeof(struct foils_hid_header)
-        + sizeof(struct foils_hid_device_new)
-        + blob_size);
+        &client->base, 1, FOILS_HID_DEVICE_NEW, p, size);
+}
+
+int rudp_hid_device_new(
+    struct rudp_hid_client *client,
+    const struct foils_hid_device_descriptor *desc,
+    uint32_t device_id)
+{
+    size_t size = rudp_hid_device_new_size(desc);
+    struct device_new_packet *packet = alloca(size);
+
+    rudp_hid_device_new_build(desc, packet);
+
+    return rudp_hid_device_new_send(client, packet, size, device_id);
 }
 
 
@@ -144,6 +470,15 @@ int rudp_hid_device_dropped(
 {
     struct foils_hid_header packet[1];
 
+    /*
+      Queued reports of the device would reach the server after the
+      drop, or go to the next device announced with this id.
+     */
+    if (client->scheduler)
+        foils_hid_sched_discard(&client->scheduler->sched,
+                                report_flow(device_id, 0, 0),
+                                ~(uint64_t)0x1ff);
+
     memset(packet, 0, sizeof(packet));
 
     packet->device_id = htonl(device_id);
@@ -154,6 +489,133 @@ int rudp_hid_device_dropped(
 }
 
 
+static
+void capture_packet(
+    struct rudp_hid_client *client,
+    int command, const struct foils_hid_header *header, size_t len)
+{
+    uint8_t type;
+
+    switch (command) {
+    case FOILS_HID_FEATURE:
+        type = FOILS_HID_CAPTURE_FEATURE_RECEIVED;
+        break;
+    case FOILS_HID_DATA:
+        type = FOILS_HID_CAPTURE_OUTPUT;
+        break;
+    case FOILS_HID_GRAB:
+        type = FOILS_HID_CAPTURE_GRAB;
+        break;
+    case FOILS_HID_RELEASE:
+        type = FOILS_HID_CAPTURE_RELEASE;
+        break;
+    case FOILS_HID_FEATURE_SOLLICIT:
+        type = FOILS_HID_CAPTURE_SOLLICIT;
+        break;
+    default:
+        return;
+    }
+
+    foils_hid_capture_record(
+        client->capture, type,
+        ntohl(header->device_id), ntohl(header->report_id),
+        header + 1, len - sizeof(*header));
+}
+
+static
+void ack_pop(struct rudp_hid_client *client, int status, uint64_t now)
+{
+    const struct rudp_hid_ack_pending *p = &client->ack[client->ack_first];
+    uint32_t token = p->token;
+    uint64_t rtt = status ? 0 : now - p->sent;
+
+    client->ack_first = (client->ack_first + 1) % RUDP_HID_ACK_MAX;
+    client->ack_count--;
+
+    if (client->handler->ack)
+        client->handler->ack(client, token, status, rtt);
+}
+
+/*
+  Server handles reliable packets in order, an acknowledgement also
+  stands for the requests before it.
+ */
+static
+void ack_complete(struct rudp_hid_client *client, uint32_t token)
+{
+    uint64_t now = now_ns();
+    size_t i;
+
+    for (i = 0; i < client->ack_count; ++i)
+        if (client->ack[(client->ack_first + i) % RUDP_HID_ACK_MAX].token
+            == token)
+            break;
+
+    if (i == client->ack_count)
+        return;
+
+    while (i-- > 0)
+        ack_pop(client, 0, now);
+    ack_pop(client, 0, now);
+}
+
+static
+void ack_fail_all(struct rudp_hid_client *client)
+{
+    while (client->ack_count)
+        ack_pop(client, ECONNRESET, 0);
+}
+
+int rudp_hid_ack_request(
+    struct rudp_hid_client *client,
+    uint32_t *token)
+{
+    struct packet {
+        struct foils_hid_header header[1];
+        struct foils_hid_ack ack[1];
+    } packet;
+    struct rudp_hid_ack_pending *p;
+    int err;
+
+    if (!(client->features & FOILS_HID_FEATURE_ACK))
+        return EOPNOTSUPP;
+
+    if (client->ack_count == RUDP_HID_ACK_MAX)
+        return EAGAIN;
+
+    /* Most clients never ask, window is only paid for when used */
+    if (client->ack == NULL) {
+        client->ack = malloc(RUDP_HID_ACK_MAX * sizeof(*client->ack));
+        if (client->ack == NULL)
+            return ENOMEM;
+    }
+
+    memset(&packet, 0, sizeof(packet));
+    packet.ack->token = htonl(client->ack_token + 1);
+
+    /* Behind all queued packets, of any class and flow */
+    if (client->scheduler)
+        err = foils_hid_sched_barrier_send(
+            &client->scheduler->sched, now_ns(), 1, FOILS_HID_ACK_REQUEST,
+            &packet, sizeof(packet));
+    else
+        err = rudp_client_send(&client->base, 1, FOILS_HID_ACK_REQUEST,
+                               &packet, sizeof(packet));
+    if (err)
+        return err;
+
+    client->ack_token++;
+
+    p = &client->ack[(client->ack_first + client->ack_count)
+                     % RUDP_HID_ACK_MAX];
+    p->token = client->ack_token;
+    p->sent = now_ns();
+    client->ack_count++;
+
+    *token = p->token;
+    return 0;
+}
+
 static
 void do_handle_packet(
     struct rudp_client *_client,
@@ -165,6 +627,9 @@ void do_handle_packet(
     if (len < sizeof(*header))
         return;
 
+    if (client->capture)
+        capture_packet(client, command, header, len);
+
     switch (command) {
     case FOILS_HID_DEVICE_NEW:
     case FOILS_HID_DEVICE_DROPPED:
@@ -212,6 +677,29 @@ void do_handle_packet(
             client, ntohl(header->device_id),
             ntohl(header->report_id));
         break;
+
+    case FOILS_HID_HELLO_ACK: {
+        const struct foils_hid_hello *hello = (const void *)(header + 1);
+
+        if (len < sizeof(*header) + sizeof(*hello))
+            return;
+
+        /* Server may not grant more than offered */
+        client->features = ntohl(hello->features) & client->offered;
+        if (client->handler->features)
+            client->handler->features(client, client->features);
+        break;
+    }
+
+    case FOILS_HID_ACK: {
+        const struct foils_hid_ack *ack = (const void *)(header + 1);
+
+        if (len < sizeof(*header) + sizeof(*ack))
+            return;
+
+        ack_complete(client, ntohl(ack->token));
+        break;
+    }
     }
 }
 
@@ -222,11 +710,35 @@ void do_link_info(struct rudp_client *_client, struct rudp_link_info *info)
     (void)client;
 }
 
+static
+void hello_send(struct rudp_hid_client *client)
+{
+    struct packet {
+        struct foils_hid_header header[1];
+        struct foils_hid_hello hello[1];
+    } packet;
+
+    memset(&packet, 0, sizeof(packet));
+    packet.hello->version = htonl(FOILS_HID_PROTOCOL_VERSION);
+    packet.hello->features = htonl(client->offered);
+
+    rudp_client_send(&client->base, 1, FOILS_HID_HELLO,
+                     &packet, sizeof(packet));
+}
+
 static
 void do_connected(struct rudp_client *_client)
 {
     struct rudp_hid_client *client = (struct rudp_hid_client *)_client;
 
+    /*
+      Do not wait for the answer, legacy servers never send one.
+      Until then, packets use the base protocol.
+     */
+    client->features = 0;
+    ack_fail_all(client);
+    hello_send(client);
+
     client->handler->connected(client);
 }
 
@@ -235,6 +747,15 @@ void do_server_lost(struct rudp_client *_client)
 {
     struct rudp_hid_client *client = (struct rudp_hid_client *)_client;
 
+    client->features = 0;
+
+    /* Nothing queued for the lost connection is worth sending */
+    if (client->scheduler) {
+        foils_hid_sched_clear(&client->scheduler->sched);
+        scheduler_run(client);
+    }
+
+    ack_fail_all(client);
     client->handler->server_lost(client);
 }
 
@@ -249,12 +770,80 @@ int rudp_hid_feature_report_send(
     uint8_t blob[datalen + 8];
     struct foils_hid_header *header = (struct foils_hid_header *)blob;
 
+    if (client->capture)
+        foils_hid_capture_record(
+            client->capture,
+            FOILS_HID_CAPTURE_FEATURE_SENT
+            | (reliable ? FOILS_HID_CAPTURE_RELIABLE : 0),
+            device_id, report_id, data, datalen);
+
     header->device_id = htonl(device_id);
     header->report_id = htonl(report_id);
     memcpy(header+1, data, datalen);
-    return rudp_client_send(&client->base, reliable,
-                            FOILS_HID_FEATURE, header,
-                            datalen + 8);
+    return packet_send(client, FOILS_HID_PRIORITY_BACKGROUND,
+                       report_flow(device_id, report_id, 1), reliable,
+                       FOILS_HID_FEATURE, header, datalen + 8);
+}
+
+
+static
+void input_capture(
+    struct rudp_hid_client *client,
+    uint32_t device_id, uint8_t report_id, int reliable,
+    const void *data, size_t datalen)
+{
+    if (client->capture)
+        foils_hid_capture_record(
+            client->capture,
+            FOILS_HID_CAPTURE_INPUT
+            | (reliable ? FOILS_HID_CAPTURE_RELIABLE : 0),
+            device_id, report_id, data, datalen);
+}
+
+/*
+  Builds an input report packet: header, optional timestamp, then
+  prefix and data.  Plain reports get a compact header when in use.
+ */
+static
+int input_packet_send(
+    struct rudp_hid_client *client, int command,
+    uint32_t device_id, uint8_t report_id, int reliable,
+    int stamped, uint64_t timestamp,
+    const void *prefix, size_t prefix_len,
+    const void *data, size_t datalen)
+{
+    uint8_t blob[12 + prefix_len + datalen];
+    struct foils_hid_header *header = (struct foils_hid_header *)blob;
+    uint32_t stamp = timestamp / 1000;
+    size_t size;
+
+    if (command == FOILS_HID_DATA
+        && (client->features & FOILS_HID_FEATURE_COMPACT)) {
+        size = foils_hid_compact_header_encode(
+            blob, device_id, report_id,
+            stamped ? FOILS_HID_COMPACT_TIMESTAMP : 0);
+        command = FOILS_HID_DATA_COMPACT;
+    } else {
+        header->device_id = htonl(device_id);
+        header->report_id = htonl(report_id
+                                  | (stamped ? FOILS_HID_REPORT_TIMESTAMP : 0));
+        size = sizeof(*header);
+    }
+
+    if (stamped) {
+        blob[size++] = stamp >> 24;
+        blob[size++] = stamp >> 16;
+        blob[size++] = stamp >> 8;
+        blob[size++] = stamp;
+    }
+
+    if (prefix_len)
+        memcpy(blob + size, prefix, prefix_len);
+    size += prefix_len;
+    memcpy(blob + size, data, datalen);
+    return packet_send(client, FOILS_HID_PRIORITY_INTERACTIVE,
+                       report_flow(device_id, report_id, 0), reliable,
+                       command, blob, size + datalen);
 }
 
 
@@ -265,15 +854,132 @@ int rudp_hid_input_report_send(
     int reliable,
     const void *data, size_t datalen)
 {
-    uint8_t blob[datalen + 8];
+    input_capture(client, device_id, report_id, reliable, data, datalen);
+    return input_packet_send(client, FOILS_HID_DATA,
+                             device_id, report_id, reliable,
+                             0, 0, NULL, 0, data, datalen);
+}
+
+
+int rudp_hid_input_report_timed_send(
+    struct rudp_hid_client *client,
+    uint32_t device_id,
+    uint8_t report_id,
+    int reliable,
+    uint64_t timestamp,
+    const void *data, size_t datalen)
+{
+    input_capture(client, device_id, report_id, reliable, data, datalen);
+    return input_packet_send(client, FOILS_HID_DATA,
+                             device_id, report_id, reliable,
+                             1, timestamp, NULL, 0, data, datalen);
+}
+
+
+int rudp_hid_input_report_keyframe_send(
+    struct rudp_hid_client *client,
+    uint32_t device_id,
+    uint8_t report_id,
+    uint8_t seq,
+    uint64_t timestamp,
+    const void *data, size_t datalen)
+{
+    input_capture(client, device_id, report_id, 1, data, datalen);
+    return input_packet_send(client, FOILS_HID_DATA_KEYFRAME,
+                             device_id, report_id, 1,
+                             timestamp != 0, timestamp,
+                             &seq, 1, data, datalen);
+}
+
+
+int rudp_hid_input_report_delta_send(
+    struct rudp_hid_client *client,
+    uint32_t device_id,
+    uint8_t report_id,
+    int reliable,
+    uint8_t seq,
+    uint64_t timestamp,
+    const void *keyframe,
+    const void *data, size_t datalen)
+{
+    uint8_t delta[datalen / 2 + 1];
+    size_t delta_len;
+
+    /* Not worth it past half the report */
+    if (foils_hid_delta_encode(keyframe, data, datalen,
+                               delta, datalen / 2, &delta_len))
+        return EMSGSIZE;
+
+    input_capture(client, device_id, report_id, reliable, data, datalen);
+    return input_packet_send(client, FOILS_HID_DATA_DELTA,
+                             device_id, report_id, reliable,
+                             timestamp != 0, timestamp,
+                             &seq, 1, delta, delta_len);
+}
+
+
+int rudp_hid_input_report_batch_send(
+    struct rudp_hid_client *client,
+    uint32_t device_id,
+    uint8_t report_id,
+    int reliable,
+    const void *data, size_t report_size, size_t report_count)
+{
+    size_t datalen = report_size * report_count;
+    uint8_t blob[datalen + 12];
     struct foils_hid_header *header = (struct foils_hid_header *)blob;
+    struct foils_hid_batch *batch = (struct foils_hid_batch *)(header + 1);
+    size_t i;
+
+    if (!report_size || datalen > RUDP_HID_BATCH_MAX_SIZE)
+        return EINVAL;
+
+    if (client->capture)
+        for (i = 0; i < report_count; ++i)
+            foils_hid_capture_record(
+                client->capture,
+                FOILS_HID_CAPTURE_INPUT
+                | (reliable ? FOILS_HID_CAPTURE_RELIABLE : 0),
+                device_id, report_id,
+                (const uint8_t *)data + i * report_size, report_size);
 
     header->device_id = htonl(device_id);
     header->report_id = htonl(report_id);
-    memcpy(header+1, data, datalen);
-    return rudp_client_send(&client->base, reliable,
-                            FOILS_HID_DATA, header,
-                            datalen + 8);
+    batch->report_size = htons(report_size);
+    batch->report_count = htons(report_count);
+    memcpy(batch + 1, data, datalen);
+    return packet_send(client, FOILS_HID_PRIORITY_BULK,
+                       report_flow(device_id, report_id, 0), reliable,
+                       FOILS_HID_DATA_BATCH, header, datalen + 12);
+}
+
+
+int rudp_hid_input_report_redundant_send(
+    struct rudp_hid_client *client,
+    uint32_t device_id,
+    uint8_t report_id,
+    uint16_t seq,
+    uint64_t timestamp,
+    const void *data, size_t report_size, size_t report_count)
+{
+    struct foils_hid_redundant redundant;
+    size_t datalen = report_size * report_count;
+
+    if (!report_size || !report_count || datalen > RUDP_HID_BATCH_MAX_SIZE)
+        return EINVAL;
+
+    /* Older reports were recorded when first sent */
+    input_capture(client, device_id, report_id, 0,
+                  (const uint8_t *)data + datalen - report_size,
+                  report_size);
+
+    redundant.seq = htons(seq);
+    redundant.report_count = htons(report_count);
+    return input_packet_send(client, FOILS_HID_DATA_REDUNDANT,
+                             device_id, report_id, 0,
+                             timestamp != 0, timestamp,
+                             &redundant, sizeof(redundant),
+                             data, datalen);
 }
 
 
@@ -0,0 +1,372 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <foils/send_sched.h>
+
+struct foils_hid_sched_packet
+{
+    struct foils_hid_sched_packet *next;
+    uint64_t queued;
+    uint64_t seq;
+    uint64_t flow;
+    int reliable;
+    int command;
+    size_t size;
+    uint8_t data[];
+};
+
+/*
+  Credit is kept in bytes times interval, so that refilling in small
+  steps loses nothing to rounding.
+ */
+static
+void credit_refill(struct foils_hid_sched *sched, uint64_t now)
+{
+    int64_t full = sched->budget * sched->interval;
+    uint64_t elapsed = now - sched->refill;
+
+    if (!sched->budget || now <= sched->refill)
+        return;
+
+    /* Debt of large packets is paid back before credit is full */
+    if (elapsed >= (uint64_t)(full - sched->credit) / sched->budget)
+        sched->credit = full;
+    else
+        sched->credit += elapsed * sched->budget;
+
+    sched->refill = now;
+}
+
+static
+int credit_left(const struct foils_hid_sched *sched)
+{
+    return !sched->budget || sched->credit > 0;
+}
+
+static
+void packet_out(struct foils_hid_sched *sched,
+                int reliable, int command, const void *data, size_t size)
+{
+    if (sched->budget)
+        sched->credit -= (int64_t)size * sched->interval;
+
+    sched->send(sched->opaque, reliable, command, data, size);
+}
+
+static
+int starving(const struct foils_hid_sched *sched,
+             const struct foils_hid_sched_packet *packet, uint64_t now)
+{
+    return packet && packet->queued + sched->starve <= now;
+}
+
+/* Next queue to serve, or NULL if none may go now */
+static
+struct foils_hid_sched_queue *queue_pick(
+    struct foils_hid_sched *sched, uint64_t now)
+{
+    struct foils_hid_sched_queue *bulk
+        = &sched->queue[FOILS_HID_PRIORITY_BULK];
+    struct foils_hid_sched_queue *background
+        = &sched->queue[FOILS_HID_PRIORITY_BACKGROUND];
+    int held = now < sched->held_until;
+
+    /* Aged background packets go first, as if they were bulk */
+    if (starving(sched, background->head, now))
+        return background;
+
+    if (bulk->head)
+        return !held || starving(sched, bulk->head, now) ? bulk : NULL;
+
+    if (background->head && !held)
+        return background;
+
+    return NULL;
+}
+
+static
+int queue_holds_flow(const struct foils_hid_sched_queue *queue, uint64_t flow)
+{
+    const struct foils_hid_sched_packet *packet;
+
+    for (packet = queue->head; packet; packet = packet->next)
+        if (packet->flow == flow)
+            return 1;
+
+    return 0;
+}
+
+static
+void queue_push(struct foils_hid_sched_queue *queue,
+                struct foils_hid_sched_packet *packet)
+{
+    packet->next = NULL;
+    *queue->tail = packet;
+    queue->tail = &packet->next;
+}
+
+static
+struct foils_hid_sched_packet *packet_alloc(
+    uint64_t now, uint64_t seq, uint64_t flow,
+    int reliable, int command, const void *data, size_t size)
+{
+    struct foils_hid_sched_packet *packet;
+
+    packet = malloc(sizeof(*packet) + size);
+    if (packet == NULL)
+        return NULL;
+
+    packet->queued = now;
+    packet->seq = seq;
+    packet->flow = flow;
+    packet->reliable = reliable;
+    packet->command = command;
+    packet->size = size;
+    memcpy(packet->data, data, size);
+
+    return packet;
+}
+
+/* Whether a packet queued up to seq still waits in a class */
+static
+int queued_before(const struct foils_hid_sched *sched, uint64_t seq)
+{
+    size_t i;
+
+    for (i = 0; i < FOILS_HID_PRIORITY_COUNT; ++i)
+        if (sched->queue[i].head && sched->queue[i].head->seq <= seq)
+            return 1;
+
+    return 0;
+}
+
+/* Sends barrier packets nothing is queued ahead of anymore */
+static
+void barrier_release(struct foils_hid_sched *sched)
+{
+    struct foils_hid_sched_queue *barrier = &sched->barrier;
+    struct foils_hid_sched_packet *packet;
+
+    while ((packet = barrier->head) && !queued_before(sched, packet->seq)) {
+        barrier->head = packet->next;
+        if (!barrier->head)
+            barrier->tail = &barrier->head;
+
+        sched->send(sched->opaque, packet->reliable, packet->command,
+                    packet->data, packet->size);
+        free(packet);
+    }
+}
+
+void foils_hid_sched_init(
+    struct foils_hid_sched *sched,
+    foils_hid_sched_send_func_t *send, void *opaque)
+{
+    size_t i;
+
+    memset(sched, 0, sizeof(*sched));
+    sched->send = send;
+    sched->opaque = opaque;
+
+    for (i = 0; i < FOILS_HID_PRIORITY_COUNT; ++i)
+        sched->queue[i].tail = &sched->queue[i].head;
+    sched->barrier.tail = &sched->barrier.head;
+
+    foils_hid_sched_pace_set(
+        sched, FOILS_HID_SCHED_BUDGET, FOILS_HID_SCHED_INTERVAL,
+        FOILS_HID_SCHED_HOLD, FOILS_HID_SCHED_STARVE);
+}
+
+static
+void queue_clear(struct foils_hid_sched_queue *queue)
+{
+    struct foils_hid_sched_packet *packet, *next;
+
+    for (packet = queue->head; packet; packet = next) {
+        next = packet->next;
+        free(packet);
+    }
+
+    queue->head = NULL;
+    queue->tail = &queue->head;
+}
+
+void foils_hid_sched_clear(struct foils_hid_sched *sched)
+{
+    size_t i;
+
+    for (i = 0; i < FOILS_HID_PRIORITY_COUNT; ++i)
+        queue_clear(&sched->queue[i]);
+    queue_clear(&sched->barrier);
+
+    sched->held_until = 0;
+}
+
+void foils_hid_sched_pace_set(
+    struct foils_hid_sched *sched,
+    size_t budget, uint64_t interval,
+    uint64_t hold, uint64_t starve)
+{
+    sched->budget = interval ? budget : 0;
+    sched->interval = interval;
+    sched->hold = hold;
+    sched->starve = starve;
+    sched->credit = sched->budget * sched->interval;
+}
+
+int foils_hid_sched_send(
+    struct foils_hid_sched *sched, uint64_t now,
+    enum foils_hid_priority priority, uint64_t flow,
+    int reliable, int command,
+    const void *data, size_t size)
+{
+    struct foils_hid_sched_queue *queue;
+    struct foils_hid_sched_packet *packet;
+    int may_go, i;
+
+    /* Packets of a flow stay in order, behind the lowest queued one */
+    for (i = FOILS_HID_PRIORITY_COUNT - 1; i > (int)priority; --i) {
+        if (queue_holds_flow(&sched->queue[i], flow)) {
+            priority = i;
+            break;
+        }
+    }
+
+    queue = &sched->queue[priority];
+
+    if (priority == FOILS_HID_PRIORITY_INTERACTIVE) {
+        sched->send(sched->opaque, reliable, command, data, size);
+
+        /*
+          Unreliable streams like pointer motion are sent too often to
+          hold anything back after them.
+         */
+        if (reliable)
+            sched->held_until = now + sched->hold;
+
+        return 0;
+    }
+
+    credit_refill(sched, now);
+
+    /* Only overtake nothing: same and higher queues must be empty */
+    may_go = !sched->queue[FOILS_HID_PRIORITY_BULK].head
+        && !queue->head
+        && now >= sched->held_until
+        && credit_left(sched);
+
+    if (may_go) {
+        packet_out(sched, reliable, command, data, size);
+        return 0;
+    }
+
+    packet = packet_alloc(now, ++sched->seq, flow,
+                          reliable, command, data, size);
+    if (packet == NULL)
+        return ENOMEM;
+
+    queue_push(queue, packet);
+
+    return 0;
+}
+
+int foils_hid_sched_barrier_send(
+    struct foils_hid_sched *sched, uint64_t now,
+    int reliable, int command,
+    const void *data, size_t size)
+{
+    struct foils_hid_sched_packet *packet;
+
+    if (!sched->barrier.head && !queued_before(sched, sched->seq)) {
+        sched->send(sched->opaque, reliable, command, data, size);
+        return 0;
+    }
+
+    /* Goes once every packet queued so far is out */
+    packet = packet_alloc(now, sched->seq, 0,
+                          reliable, command, data, size);
+    if (packet == NULL)
+        return ENOMEM;
+
+    queue_push(&sched->barrier, packet);
+
+    return 0;
+}
+
+void foils_hid_sched_discard(
+    struct foils_hid_sched *sched, uint64_t flow, uint64_t mask)
+{
+    struct foils_hid_sched_packet **link, *packet;
+    size_t i;
+
+    for (i = 0; i < FOILS_HID_PRIORITY_COUNT; ++i) {
+        struct foils_hid_sched_queue *queue = &sched->queue[i];
+
+        for (link = &queue->head; (packet = *link); ) {
+            if ((packet->flow & mask) != flow) {
+                link = &packet->next;
+                continue;
+            }
+
+            *link = packet->next;
+            free(packet);
+        }
+
+        queue->tail = link;
+    }
+
+    barrier_release(sched);
+}
+
+uint64_t foils_hid_sched_run(struct foils_hid_sched *sched, uint64_t now)
+{
+    struct foils_hid_sched_queue *queue;
+    struct foils_hid_sched_packet *packet;
+    uint64_t next, starve = UINT64_MAX;
+    size_t i;
+
+    credit_refill(sched, now);
+
+    while (credit_left(sched) && (queue = queue_pick(sched, now))) {
+        packet = queue->head;
+        queue->head = packet->next;
+        if (!queue->head)
+            queue->tail = &queue->head;
+
+        packet_out(sched, packet->reliable, packet->command,
+                   packet->data, packet->size);
+        free(packet);
+    }
+
+    barrier_release(sched);
+
+    for (i = FOILS_HID_PRIORITY_BULK; i < FOILS_HID_PRIORITY_COUNT; ++i)
+        if (sched->queue[i].head
+            && sched->queue[i].head->queued + sched->starve < starve)
+            starve = sched->queue[i].head->queued + sched->starve;
+
+    if (starve == UINT64_MAX)
+        return 0;
+
+    /* Whatever comes first of hold end and starvation, given credit */
+    next = now < sched->held_until ? sched->held_until : now;
+    if (starve < next)
+        next = starve;
+
+    if (!credit_left(sched)
+        && next < now + (-sched->credit) / sched->budget + 1)
+        next = now + (-sched->credit) / sched->budget + 1;
+
+    return next > now ? next : now + 1;
+}
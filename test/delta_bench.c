@@ -0,0 +1,439 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Report delta benchmark.
+
+  Replays input reports of a capture file, or of a synthetic gamepad
+  trace, through the keyframe and delta policy of foils_hid.  Checks
+  every delta decodes back to its report, then compares bytes on the
+  wire and times encoding and decoding.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <foils/capture.h>
+#include <foils/delta.h>
+#include <foils/hid.h>
+
+/* Fixed header plus keyframe sequence number */
+#define HEADER_SIZE 8
+#define DELTA_HEADER_SIZE 9
+
+#define GAMEPAD_REPORT_SIZE 64
+#define STREAM_MAX 64
+
+struct report
+{
+    uint32_t device_id;
+    uint8_t report_id;
+    size_t size;
+    const uint8_t *data;
+};
+
+struct trace
+{
+    struct report *report;
+    size_t count;
+    void *map;
+    size_t map_size;
+    uint8_t *synthetic;
+};
+
+struct stream
+{
+    uint32_t device_id;
+    uint8_t report_id;
+    uint8_t keyframe[UINT16_MAX];
+    size_t size;
+    uint32_t deltas;
+};
+
+struct stats
+{
+    unsigned long reports;
+    unsigned long keyframes;
+    unsigned long deltas;
+    unsigned long plain;
+    unsigned long long raw_bytes;
+    unsigned long long wire_bytes;
+};
+
+static struct stream streams[STREAM_MAX];
+static size_t stream_count;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int trace_push(struct trace *t, size_t *size, const struct report *r)
+{
+    struct report *report;
+
+    if (t->count == *size) {
+        *size = *size ? *size * 2 : 1024;
+        report = realloc(t->report, *size * sizeof(*report));
+        if (report == NULL)
+            return ENOMEM;
+        t->report = report;
+    }
+
+    t->report[t->count++] = *r;
+    return 0;
+}
+
+static int trace_load(struct trace *t, const char *path)
+{
+    const struct foils_hid_capture_header *header;
+    const uint8_t *cursor, *end;
+    struct stat st;
+    size_t size = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        perror(path);
+        return 1;
+    }
+
+    t->map_size = st.st_size;
+    t->map = mmap(NULL, t->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (t->map == MAP_FAILED) {
+        perror(path);
+        return 1;
+    }
+
+    header = t->map;
+    if (t->map_size < sizeof(*header)
+        || memcmp(header->magic, FOILS_HID_CAPTURE_MAGIC,
+                  sizeof(FOILS_HID_CAPTURE_MAGIC))
+        || header->version != FOILS_HID_CAPTURE_VERSION) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        return 1;
+    }
+
+    cursor = (const uint8_t *)t->map + header->header_size;
+    end = cursor + header->used;
+    if (end > (const uint8_t *)t->map + t->map_size)
+        end = (const uint8_t *)t->map + t->map_size;
+
+    while (cursor + sizeof(struct foils_hid_capture_record) <= end) {
+        const struct foils_hid_capture_record *r = (const void *)cursor;
+        struct report report;
+
+        if (r->type == FOILS_HID_CAPTURE_NONE
+            || cursor + foils_hid_capture_record_size(r->size) > end)
+            break;
+
+        cursor += foils_hid_capture_record_size(r->size);
+
+        if ((r->type & FOILS_HID_CAPTURE_TYPE_MASK)
+            != FOILS_HID_CAPTURE_INPUT)
+            continue;
+
+        report.device_id = r->device_id;
+        report.report_id = r->report_id;
+        report.size = r->size;
+        report.data = (const uint8_t *)(r + 1);
+        if (trace_push(t, &size, &report))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int walk(unsigned int *seed, int v, int step, int min, int max)
+{
+    v += (int)(rand_r(seed) % (2 * step + 1)) - step;
+    return v < min ? min : v > max ? max : v;
+}
+
+/*
+  A 64-byte gamepad input report, as sent at 250Hz by common USB
+  controllers: sticks, hat and buttons, triggers, a frame counter,
+  noisy motion sensors, battery, and constant padding.
+ */
+static int trace_gamepad(struct trace *t, size_t count)
+{
+    unsigned int seed = 1;
+    int sticks[4] = { 128, 128, 128, 128 }, triggers[2] = { 0, 0 };
+    int motion[6] = { 0, 0, 0, 0, 8192, 0 };
+    uint16_t frame = 0;
+    uint8_t buttons[3] = { 0x08, 0, 0 };
+    size_t size = 0, i, j;
+
+    t->synthetic = calloc(count, GAMEPAD_REPORT_SIZE);
+    if (t->synthetic == NULL)
+        return 1;
+
+    for (i = 0; i < count; ++i) {
+        uint8_t *d = t->synthetic + i * GAMEPAD_REPORT_SIZE;
+        struct report report = {
+            .device_id = 0,
+            .report_id = 1,
+            .size = GAMEPAD_REPORT_SIZE,
+            .data = d,
+        };
+
+        /* Sticks move in bursts */
+        if (rand_r(&seed) % 4 == 0)
+            for (j = 0; j < 4; ++j)
+                sticks[j] = walk(&seed, sticks[j], 6, 0, 255);
+        if (rand_r(&seed) % 50 == 0)
+            buttons[rand_r(&seed) % 3] ^= 1 << (rand_r(&seed) % 8);
+        if (rand_r(&seed) % 8 == 0)
+            for (j = 0; j < 2; ++j)
+                triggers[j] = walk(&seed, triggers[j], 20, 0, 255);
+        for (j = 0; j < 6; ++j)
+            motion[j] = walk(&seed, motion[j], 3, -32768, 32767);
+        frame += 188;
+
+        d[0] = report.report_id;
+        for (j = 0; j < 4; ++j)
+            d[1 + j] = sticks[j];
+        memcpy(d + 5, buttons, 3);
+        d[8] = triggers[0];
+        d[9] = triggers[1];
+        d[10] = frame;
+        d[11] = frame >> 8;
+        d[12] = 0xa0;
+        for (j = 0; j < 6; ++j) {
+            d[13 + j * 2] = motion[j];
+            d[14 + j * 2] = motion[j] >> 8;
+        }
+        d[30] = 0x1b;
+        d[33] = 0x80;
+        d[35] = 0x80;
+
+        if (trace_push(t, &size, &report))
+            return 1;
+    }
+
+    return 0;
+}
+
+static struct stream *stream_get(const struct report *r)
+{
+    size_t i;
+
+    for (i = 0; i < stream_count; ++i)
+        if (streams[i].device_id == r->device_id
+            && streams[i].report_id == r->report_id)
+            return streams + i;
+
+    if (stream_count == STREAM_MAX)
+        return NULL;
+
+    streams[stream_count].device_id = r->device_id;
+    streams[stream_count].report_id = r->report_id;
+    streams[stream_count].size = 0;
+    return streams + stream_count++;
+}
+
+/*
+  Same choices as foils_hid: small reports go plain, deltas are
+  bounded to half a report, keyframes come periodically.  Checks the
+  delta decodes back when verify is set.
+ */
+static int trace_run(const struct trace *t, struct stats *st, int verify)
+{
+    uint8_t delta[UINT16_MAX / 2 + 1], decoded[UINT16_MAX];
+    size_t i, len;
+
+    stream_count = 0;
+    memset(st, 0, sizeof(*st));
+
+    for (i = 0; i < t->count; ++i) {
+        const struct report *r = t->report + i;
+        struct stream *s = stream_get(r);
+
+        st->reports++;
+        st->raw_bytes += HEADER_SIZE + r->size;
+
+        if (s == NULL || r->size < FOILS_HID_DELTA_MIN_SIZE) {
+            st->plain++;
+            st->wire_bytes += HEADER_SIZE + r->size;
+            continue;
+        }
+
+        if (s->size == r->size
+            && s->deltas < FOILS_HID_DELTA_KEYFRAME_INTERVAL
+            && !foils_hid_delta_encode(s->keyframe, r->data, r->size,
+                                       delta, r->size / 2, &len)) {
+            if (verify
+                && (foils_hid_delta_decode(s->keyframe, s->size,
+                                           delta, len, decoded)
+                    || memcmp(decoded, r->data, r->size))) {
+                fprintf(stderr, "delta of report %zu does not decode\n", i);
+                return 1;
+            }
+
+            s->deltas++;
+            st->deltas++;
+            st->wire_bytes += DELTA_HEADER_SIZE + len;
+            continue;
+        }
+
+        memcpy(s->keyframe, r->data, r->size);
+        s->size = r->size;
+        s->deltas = 0;
+        st->keyframes++;
+        st->wire_bytes += DELTA_HEADER_SIZE + r->size;
+    }
+
+    return 0;
+}
+
+/* Decodes deltas of all reports to their previous one */
+static double decode_time(const struct trace *t, unsigned int passes)
+{
+    uint8_t decoded[UINT16_MAX], *blob, *p;
+    size_t *index, *len, n = 0, i, size = 0;
+    unsigned int pass;
+    uint32_t sum = 0;
+    double start, elapsed;
+
+    for (i = 0; i < t->count; ++i)
+        size += t->report[i].size / 2;
+
+    blob = malloc(size + 1);
+    index = malloc(t->count * sizeof(*index));
+    len = malloc(t->count * sizeof(*len));
+    if (blob == NULL || index == NULL || len == NULL) {
+        elapsed = 0;
+        goto out;
+    }
+
+    /* Encoded beforehand, only decoding is timed */
+    for (p = blob, i = 1; i < t->count; ++i) {
+        const struct report *prev = t->report + i - 1;
+        const struct report *r = t->report + i;
+
+        if (prev->size != r->size
+            || r->size < FOILS_HID_DELTA_MIN_SIZE
+            || foils_hid_delta_encode(prev->data, r->data, r->size,
+                                      p, r->size / 2, len + n))
+            continue;
+
+        index[n++] = i;
+        p += len[n - 1];
+    }
+
+    start = now();
+    for (pass = 0; pass < passes; ++pass) {
+        for (p = blob, i = 0; i < n; ++i) {
+            const struct report *r = t->report + index[i];
+
+            foils_hid_delta_decode(r[-1].data, r->size, p, len[i], decoded);
+            sum += decoded[0];
+            p += len[i];
+        }
+    }
+    elapsed = n ? (now() - start) * 1e9 / ((double)passes * n) : 0;
+
+    /* Keeps loops from being optimized out */
+    if (sum == 42)
+        printf("\n");
+
+out:
+    free(blob);
+    free(index);
+    free(len);
+    return elapsed;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n passes] [-c count] [capture]\n"
+            "  -n  timed passes over the trace (default 100)\n"
+            "  -c  synthetic gamepad reports when no capture is given"
+            " (default 10000)\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    struct trace t = { 0 };
+    unsigned int passes = 100, pass;
+    size_t count = 10000;
+    struct stats st;
+    double start, encode;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            passes = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!passes || optind + 1 < argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (optind < argc ? trace_load(&t, argv[optind])
+        : trace_gamepad(&t, count))
+        return 1;
+
+    if (!t.count) {
+        fprintf(stderr, "no input report in trace\n");
+        return 1;
+    }
+
+    if (trace_run(&t, &st, 1))
+        return 1;
+
+    start = now();
+    for (pass = 0; pass < passes; ++pass)
+        trace_run(&t, &st, 0);
+    encode = (now() - start) * 1e9 / ((double)passes * st.reports);
+
+    printf("%lu reports: %lu keyframes, %lu deltas, %lu sent whole\n",
+           st.reports, st.keyframes, st.deltas, st.plain);
+    printf("bytes on the wire: %llu raw, %llu delta, %.1f%% saved\n",
+           st.raw_bytes, st.wire_bytes,
+           100. * ((double)st.raw_bytes - st.wire_bytes) / st.raw_bytes);
+    printf("bytes per report:  %.2f raw, %.2f delta\n",
+           (double)st.raw_bytes / st.reports,
+           (double)st.wire_bytes / st.reports);
+    printf("encode %.1f ns/report, decode %.1f ns/delta\n",
+           encode, decode_time(&t, passes));
+
+    free(t.report);
+    free(t.synthetic);
+    if (t.map)
+        munmap(t.map, t.map_size);
+
+    return 0;
+}
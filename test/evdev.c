@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/input.h>
+
+#include <ela/ela.h>
+#include <foils/hid.h>
+#include <foils/hid_device.h>
+
+#include "evdev_translate.h"
+
+/* Events fetched per read() */
+#define EVDEV_READ_COUNT 64
+
+struct evdev_bridge {
+	/* Must stay first, callbacks cast the client back */
+	struct foils_hid client;
+	struct ela_el *el;
+	struct foils_hid_device_descriptor descriptor;
+	struct evdev_translate translate;
+	int fd;
+	struct ela_event_source *source;
+};
+
+static void
+status(struct foils_hid *client, enum foils_hid_state state)
+{
+	const char *st = NULL;
+
+	switch (state) {
+	case FOILS_HID_IDLE:
+		st = "idle";
+		break;
+	case FOILS_HID_CONNECTING:
+		st = "connecting";
+		break;
+	case FOILS_HID_CONNECTED:
+		st = "connected";
+		break;
+	case FOILS_HID_RESOLVE_FAILED:
+		st = "resolve failed";
+		break;
+	case FOILS_HID_DROPPED:
+		st = "dropped";
+		break;
+	}
+
+	printf("Status: %s\n", st);
+}
+
+static void
+feature_report(struct foils_hid *client,
+	       uint32_t device_id, uint8_t report_id,
+	       const void *data, size_t datalen)
+{
+}
+
+static void
+output_report(struct foils_hid *client,
+	      uint32_t device_id, uint8_t report_id,
+	      const void *data, size_t datalen)
+{
+}
+
+static void
+feature_report_sollicit(struct foils_hid *client,
+			uint32_t device_id, uint8_t report_id)
+{
+}
+
+static const struct foils_hid_handler handler =
+{
+	.status = status,
+	.feature_report = feature_report,
+	.output_report = output_report,
+	.feature_report_sollicit = feature_report_sollicit,
+};
+
+/* Event times are CLOCK_MONOTONIC, see EVIOCSCLOCKID below */
+static void
+evdev_report_send(struct evdev_bridge *bridge, const struct input_event *ev)
+{
+	uint64_t timestamp = (uint64_t)ev->input_event_sec * 1000000000
+		+ ev->input_event_usec * 1000;
+
+	foils_hid_input_report_timed_send(&bridge->client, 0, 0, 1, timestamp,
+					  bridge->translate.report,
+					  bridge->translate.report_size);
+}
+
+static void
+evdev_cb(struct ela_event_source *source, int fd,
+	 uint32_t mask, void *data)
+{
+	struct evdev_bridge *bridge = data;
+	struct input_event events[EVDEV_READ_COUNT];
+	ssize_t len;
+	size_t i;
+	int err;
+
+	while ((len = read(fd, events, sizeof (events))) > 0) {
+		for (i = 0; i < len / sizeof (events[0]); i++) {
+			switch (evdev_translate_event(&bridge->translate,
+						      &events[i])) {
+			case EVDEV_TRANSLATE_NONE:
+				break;
+
+			case EVDEV_TRANSLATE_REPORT:
+				evdev_report_send(bridge, &events[i]);
+				break;
+
+			case EVDEV_TRANSLATE_RESYNC:
+				err = evdev_translate_resync(&bridge->translate,
+							     fd);
+				if (err) {
+					fprintf(stderr, "error: resync failed: %s\n",
+						strerror(err));
+					break;
+				}
+				evdev_report_send(bridge, &events[i]);
+				break;
+			}
+		}
+	}
+
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	fprintf(stderr, "error: device read failed: %s\n",
+		len ? strerror(errno) : "end of file");
+	ela_exit(bridge->el);
+}
+
+static void
+hex_dump(const char *prefix, const uint8_t *data, size_t size)
+{
+	size_t i;
+
+	printf("%s", prefix);
+	for (i = 0; i < size; i++)
+		printf("%02x", data[i]);
+	printf("\n");
+}
+
+/*
+ * Translates a recorded event stream, as read from an evdev node, and
+ * prints the generated descriptor and reports.  Capabilities are
+ * inferred from the recorded events.  evdev_check compares this
+ * output for the dumps under evdev_dumps/.
+ */
+static int
+evdev_replay(const char *path)
+{
+	static struct evdev_translate translate;
+	struct evdev_caps caps;
+	const struct input_event *events;
+	size_t count, i;
+	size_t frames = 0, reports = 0;
+	struct stat st;
+	void *map;
+	int fd, err;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+
+	count = st.st_size / sizeof (*events);
+	if (!count) {
+		fprintf(stderr, "%s: no event recorded\n", path);
+		close(fd);
+		return 1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	events = map;
+
+	memset(&caps, 0, sizeof (caps));
+	for (i = 0; i < count; i++)
+		evdev_caps_learn(&caps, &events[i]);
+
+	err = evdev_translate_init(&translate, &caps);
+	if (err) {
+		fprintf(stderr, "%s: cannot translate events: %s\n",
+			path, strerror(err));
+		munmap(map, st.st_size);
+		return 1;
+	}
+
+	hex_dump("descriptor: ", translate.descriptor,
+		 translate.descriptor_size);
+
+	for (i = 0; i < count; i++) {
+		char prefix[32];
+
+		if (events[i].type == EV_SYN && events[i].code == SYN_REPORT)
+			frames++;
+
+		/* No device to read state back from, keep going */
+		if (evdev_translate_event(&translate, &events[i])
+		    == EVDEV_TRANSLATE_NONE)
+			continue;
+
+		snprintf(prefix, sizeof (prefix), "%ld.%06ld: ",
+			 (long)events[i].input_event_sec,
+			 (long)events[i].input_event_usec);
+		hex_dump(prefix, translate.report, translate.report_size);
+		reports++;
+	}
+
+	printf("%zu events, %zu frames, %zu reports of %zu bytes\n",
+	       count, frames, reports, translate.report_size);
+
+	munmap(map, st.st_size);
+	return 0;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-g] /dev/input/eventX IP [PORT]\n"
+		"       %s -r DUMP\n"
+		"  -g  grab device, its events are not seen locally anymore\n"
+		"  -r  print reports translated from a recorded event dump,\n"
+		"      as taken with `cat /dev/input/eventX > DUMP'\n",
+		name, name);
+}
+
+int main(int argc, char **argv)
+{
+	static struct evdev_bridge bridge;
+	struct evdev_caps caps;
+	char *devpath;
+	char *host;
+	int grab = 0;
+	int port;
+	int ret = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "gr:h")) != -1) {
+		switch (opt) {
+		case 'g':
+			grab = 1;
+			break;
+		case 'r':
+			return evdev_replay(optarg);
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	devpath = argv[optind];
+	host = argv[optind + 1];
+	port = argc > optind + 2 ? atoi(argv[optind + 2]) : 24322;
+
+	bridge.fd = open(devpath, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (bridge.fd < 0) {
+		perror(devpath);
+		return 1;
+	}
+
+	ret = evdev_caps_query(&caps, bridge.fd);
+	if (!ret)
+		ret = evdev_translate_init(&bridge.translate, &caps);
+	if (ret) {
+		fprintf(stderr, "failed to translate %s: %s,"
+			" is it an evdev device ?\n",
+			devpath, strerror(ret));
+		goto close_fd;
+	}
+
+	/* Report timestamps are taken from events */
+	if (ioctl(bridge.fd, EVIOCSCLOCKID, &(int){ CLOCK_MONOTONIC })) {
+		ret = errno;
+		perror("ioctl/EVIOCSCLOCKID");
+		goto close_fd;
+	}
+
+	if (grab && ioctl(bridge.fd, EVIOCGRAB, 1)) {
+		ret = errno;
+		perror("ioctl/EVIOCGRAB");
+		goto close_fd;
+	}
+
+	bridge.descriptor.version = 0x0100;
+	bridge.descriptor.descriptor = bridge.translate.descriptor;
+	bridge.descriptor.descriptor_size = bridge.translate.descriptor_size;
+	ioctl(bridge.fd, EVIOCGNAME(DEVICE_NAME_LEN), bridge.descriptor.name);
+
+	printf("Forwarding device `%s', %zu byte reports\n",
+	       bridge.descriptor.name, bridge.translate.report_size);
+
+	bridge.el = ela_create(NULL);
+
+	ret = foils_hid_init(&bridge.client, bridge.el, &handler,
+			     &bridge.descriptor, 1);
+	if (ret) {
+		fprintf(stderr, "Error creating client: %s\n", strerror(ret));
+		goto ela_deinit;
+	}
+
+	ela_source_alloc(bridge.el, evdev_cb, &bridge, &bridge.source);
+	ela_set_fd(bridge.el, bridge.source, bridge.fd, ELA_EVENT_READABLE);
+	ela_add(bridge.el, bridge.source);
+
+	foils_hid_device_enable(&bridge.client, 0);
+
+	printf("Forwarding to %s:%d\n", host, port);
+
+	ret = foils_hid_client_connect_hostname(&bridge.client, host, port, 0);
+	if (ret) {
+		fprintf(stderr, "Error starting connection: %s\n", strerror(ret));
+		goto source_deinit;
+	}
+
+	ela_run(bridge.el);
+
+	ret = 0;
+
+source_deinit:
+	ela_remove(bridge.el, bridge.source);
+	ela_source_free(bridge.el, bridge.source);
+	foils_hid_deinit(&bridge.client);
+ela_deinit:
+	ela_close(bridge.el);
+close_fd:
+	close(bridge.fd);
+	return !!ret;
+}
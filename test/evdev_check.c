@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/input.h>
+
+#include "evdev_translate.h"
+
+/*
+ * Checks evdev translation against recorded dumps.
+ *
+ * A dump is a ".events" text file of events, one per line, as
+ * "SEC.USEC TYPE CODE VALUE" in decimal; '#' starts a comment.  Text
+ * keeps dumps independent of struct input_event layout.  Next to it,
+ * the ".expected" file holds the output of foils_evdev -r for the same
+ * events: descriptor, reports and summary.  Any difference is an
+ * error.
+ */
+
+#define DUMP_EVENTS_MAX 4096
+#define LINE_MAX_SIZE 4096
+
+static struct input_event events[DUMP_EVENTS_MAX];
+static struct evdev_translate translate;
+
+static size_t
+dump_load(const char *path)
+{
+	char line[LINE_MAX_SIZE];
+	size_t count = 0;
+	unsigned int lineno = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return 0;
+	}
+
+	while (fgets(line, sizeof (line), f)) {
+		struct input_event *ev = &events[count];
+		long sec, usec;
+		unsigned int type, code;
+		int value;
+		char *p;
+
+		lineno++;
+		p = strchr(line, '#');
+		if (p)
+			*p = 0;
+		p = line + strspn(line, " \t\n");
+		if (!*p)
+			continue;
+
+		if (count == DUMP_EVENTS_MAX
+		    || sscanf(p, "%ld.%ld %u %u %d",
+			      &sec, &usec, &type, &code, &value) != 5) {
+			fprintf(stderr, "%s:%u: bad event\n", path, lineno);
+			count = 0;
+			break;
+		}
+
+		memset(ev, 0, sizeof (*ev));
+		ev->input_event_sec = sec;
+		ev->input_event_usec = usec;
+		ev->type = type;
+		ev->code = code;
+		ev->value = value;
+		count++;
+	}
+
+	fclose(f);
+	return count;
+}
+
+static void
+hex_dump(FILE *out, const char *prefix, const uint8_t *data, size_t size)
+{
+	size_t i;
+
+	fprintf(out, "%s", prefix);
+	for (i = 0; i < size; i++)
+		fprintf(out, "%02x", data[i]);
+	fprintf(out, "\n");
+}
+
+/* Same output as foils_evdev -r */
+static int
+dump_translate(FILE *out, size_t count)
+{
+	struct evdev_caps caps;
+	size_t frames = 0, reports = 0;
+	size_t i;
+	int err;
+
+	memset(&caps, 0, sizeof (caps));
+	for (i = 0; i < count; i++)
+		evdev_caps_learn(&caps, &events[i]);
+
+	err = evdev_translate_init(&translate, &caps);
+	if (err)
+		return err;
+
+	hex_dump(out, "descriptor: ", translate.descriptor,
+		 translate.descriptor_size);
+
+	for (i = 0; i < count; i++) {
+		char prefix[32];
+
+		if (events[i].type == EV_SYN && events[i].code == SYN_REPORT)
+			frames++;
+
+		if (evdev_translate_event(&translate, &events[i])
+		    == EVDEV_TRANSLATE_NONE)
+			continue;
+
+		snprintf(prefix, sizeof (prefix), "%ld.%06ld: ",
+			 (long)events[i].input_event_sec,
+			 (long)events[i].input_event_usec);
+		hex_dump(out, prefix, translate.report, translate.report_size);
+		reports++;
+	}
+
+	fprintf(out, "%zu events, %zu frames, %zu reports of %zu bytes\n",
+		count, frames, reports, translate.report_size);
+
+	return 0;
+}
+
+static int
+dump_check(const char *path)
+{
+	char expected_path[LINE_MAX_SIZE];
+	char got[LINE_MAX_SIZE], want[LINE_MAX_SIZE];
+	unsigned int lineno = 0;
+	FILE *expected, *out;
+	size_t count;
+	int err, ret = 1;
+	const char *suffix;
+	char *g, *w;
+
+	suffix = strrchr(path, '.');
+	if (suffix == NULL || strcmp(suffix, ".events")) {
+		fprintf(stderr, "%s: dump name must end in .events\n", path);
+		return 1;
+	}
+	snprintf(expected_path, sizeof (expected_path), "%.*s.expected",
+		 (int)(suffix - path), path);
+
+	count = dump_load(path);
+	if (!count)
+		return 1;
+
+	expected = fopen(expected_path, "r");
+	if (expected == NULL) {
+		perror(expected_path);
+		return 1;
+	}
+
+	out = tmpfile();
+	if (out == NULL) {
+		perror("tmpfile");
+		goto close_expected;
+	}
+
+	err = dump_translate(out, count);
+	if (err) {
+		fprintf(stderr, "%s: cannot translate events: %s\n",
+			path, strerror(err));
+		goto close_out;
+	}
+	rewind(out);
+
+	for (;;) {
+		lineno++;
+		g = fgets(got, sizeof (got), out);
+		w = fgets(want, sizeof (want), expected);
+
+		if (!g && !w)
+			break;
+
+		if (!g || !w || strcmp(got, want)) {
+			fprintf(stderr, "%s:%u: expected %s", expected_path,
+				lineno, w ? want : "end of output\n");
+			fprintf(stderr, "%s:%u: got      %s", path,
+				lineno, g ? got : "end of output\n");
+			goto close_out;
+		}
+	}
+
+	printf("OK: %s, %zu events\n", path, count);
+	ret = 0;
+
+close_out:
+	fclose(out);
+close_expected:
+	fclose(expected);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	int i;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s DUMP...\n", argv[0]);
+		return 1;
+	}
+
+	for (i = 1; i < argc; i++)
+		ret |= dump_check(argv[i]);
+
+	return ret;
+}
@@ -0,0 +1,522 @@
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+#include "evdev_translate.h"
+
+#define LONG_BITS (8 * sizeof (unsigned long))
+
+/* Keyboard page usages 0x00-0xe7 to key codes, from kernel hid-input */
+static const uint8_t hid_keyboard[0xe8] = {
+	  0,  0,  0,  0, 30, 48, 46, 32, 18, 33, 34, 35, 23, 36, 37, 38,
+	 50, 49, 24, 25, 16, 19, 31, 20, 22, 47, 17, 45, 21, 44,  2,  3,
+	  4,  5,  6,  7,  8,  9, 10, 11, 28,  1, 14, 15, 57, 12, 13, 26,
+	 27, 43, 43, 39, 40, 41, 51, 52, 53, 58, 59, 60, 61, 62, 63, 64,
+	 65, 66, 67, 68, 87, 88, 99, 70,119,110,102,104,111,107,109,106,
+	105,108,103, 69, 98, 55, 74, 78, 96, 79, 80, 81, 75, 76, 77, 71,
+	 72, 73, 82, 83, 86,127,116,117,183,184,185,186,187,188,189,190,
+	191,192,193,194,134,138,130,132,128,129,131,137,133,135,136,113,
+	115,114,  0,  0,  0,121,  0, 89, 93,124, 92, 94, 95,  0,  0,  0,
+	122,123, 90, 91, 85,  0,  0,  0,  0,  0,  0,  0,111,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,179,180,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,111,  0,  0,  0,  0,  0,  0,  0,
+	 29, 42, 56,125, 97, 54,100,126,
+};
+
+struct usage_map {
+	uint16_t code;
+	uint16_t page;
+	uint16_t usage;
+};
+
+static const struct usage_map consumer_map[] = {
+	{ KEY_PLAY, 0x0c, 0xb0 },
+	{ KEY_PAUSECD, 0x0c, 0xb1 },
+	{ KEY_RECORD, 0x0c, 0xb2 },
+	{ KEY_FASTFORWARD, 0x0c, 0xb3 },
+	{ KEY_REWIND, 0x0c, 0xb4 },
+	{ KEY_NEXTSONG, 0x0c, 0xb5 },
+	{ KEY_PREVIOUSSONG, 0x0c, 0xb6 },
+	{ KEY_STOPCD, 0x0c, 0xb7 },
+	{ KEY_EJECTCD, 0x0c, 0xb8 },
+	{ KEY_PLAYPAUSE, 0x0c, 0xcd },
+	{ KEY_CHANNELUP, 0x0c, 0x9c },
+	{ KEY_CHANNELDOWN, 0x0c, 0x9d },
+	{ KEY_MENU, 0x0c, 0x40 },
+	{ KEY_SEARCH, 0x0c, 0x221 },
+	{ KEY_HOMEPAGE, 0x0c, 0x223 },
+	{ KEY_BACK, 0x0c, 0x224 },
+	{ KEY_FORWARD, 0x0c, 0x225 },
+};
+
+/* High resolution wheel codes are left out, they duplicate wheels */
+static const struct usage_map rel_map[] = {
+	{ REL_X, 0x01, 0x30 },
+	{ REL_Y, 0x01, 0x31 },
+	{ REL_Z, 0x01, 0x32 },
+	{ REL_RX, 0x01, 0x33 },
+	{ REL_RY, 0x01, 0x34 },
+	{ REL_RZ, 0x01, 0x35 },
+	{ REL_DIAL, 0x01, 0x37 },
+	{ REL_WHEEL, 0x01, 0x38 },
+	{ REL_HWHEEL, 0x0c, 0x238 },
+};
+
+static const struct usage_map abs_map[] = {
+	{ ABS_X, 0x01, 0x30 },
+	{ ABS_Y, 0x01, 0x31 },
+	{ ABS_Z, 0x01, 0x32 },
+	{ ABS_RX, 0x01, 0x33 },
+	{ ABS_RY, 0x01, 0x34 },
+	{ ABS_RZ, 0x01, 0x35 },
+	{ ABS_WHEEL, 0x01, 0x38 },
+	{ ABS_RUDDER, 0x02, 0xba },
+	{ ABS_THROTTLE, 0x02, 0xbb },
+	{ ABS_GAS, 0x02, 0xc4 },
+	{ ABS_BRAKE, 0x02, 0xc5 },
+	{ ABS_PRESSURE, 0x0d, 0x30 },
+};
+
+#define ARRAY_SIZE(a) (sizeof (a) / sizeof ((a)[0]))
+
+/* Short item prefixes, without size bits */
+#define ITEM_INPUT          0x80
+#define ITEM_COLLECTION     0xa0
+#define ITEM_END_COLLECTION 0xc0
+#define ITEM_USAGE_PAGE     0x04
+#define ITEM_LOGICAL_MIN    0x14
+#define ITEM_LOGICAL_MAX    0x24
+#define ITEM_REPORT_SIZE    0x74
+#define ITEM_REPORT_COUNT   0x94
+#define ITEM_USAGE          0x08
+#define ITEM_USAGE_MIN      0x18
+#define ITEM_USAGE_MAX      0x28
+
+#define INPUT_CONSTANT      0x01
+#define INPUT_VARIABLE      0x02
+#define INPUT_RELATIVE      0x04
+
+struct desc {
+	struct evdev_translate *t;
+	size_t bits;
+	int page;
+	int overflow;
+};
+
+static int
+test_bit(const unsigned long *bits, unsigned int bit)
+{
+	return !!(bits[bit / LONG_BITS] & (1ul << (bit % LONG_BITS)));
+}
+
+static void
+set_bit(unsigned long *bits, unsigned int bit)
+{
+	bits[bit / LONG_BITS] |= 1ul << (bit % LONG_BITS);
+}
+
+static void
+desc_item(struct desc *d, uint8_t prefix, int32_t value)
+{
+	struct evdev_translate *t = d->t;
+	size_t len, i;
+
+	if (prefix == ITEM_END_COLLECTION)
+		len = 0;
+	else if (value >= -128 && value <= 127)
+		len = 1;
+	else if (value >= -32768 && value <= 32767)
+		len = 2;
+	else
+		len = 4;
+
+	if (t->descriptor_size + 1 + len > sizeof (t->descriptor)) {
+		d->overflow = 1;
+		return;
+	}
+
+	t->descriptor[t->descriptor_size++] = prefix | (len == 4 ? 3 : len);
+	for (i = 0; i < len; i++)
+		t->descriptor[t->descriptor_size++] = (uint32_t)value >> (8 * i);
+}
+
+static void
+desc_page(struct desc *d, int page)
+{
+	if (d->page == page)
+		return;
+
+	desc_item(d, ITEM_USAGE_PAGE, page);
+	d->page = page;
+}
+
+static void
+desc_field(struct desc *d, int32_t min, int32_t max,
+	   unsigned int size, unsigned int count, uint8_t flags)
+{
+	desc_item(d, ITEM_LOGICAL_MIN, min);
+	desc_item(d, ITEM_LOGICAL_MAX, max);
+	desc_item(d, ITEM_REPORT_SIZE, size);
+	desc_item(d, ITEM_REPORT_COUNT, count);
+	desc_item(d, ITEM_INPUT, flags);
+	d->bits += size * count;
+}
+
+static void
+desc_pad(struct desc *d)
+{
+	if (!(d->bits % 8))
+		return;
+
+	desc_item(d, ITEM_REPORT_SIZE, 1);
+	desc_item(d, ITEM_REPORT_COUNT, 8 - d->bits % 8);
+	desc_item(d, ITEM_INPUT, INPUT_CONSTANT);
+	d->bits += 8 - d->bits % 8;
+}
+
+static int
+keyboard_usage(unsigned int code)
+{
+	int usage;
+
+	for (usage = 4; usage < (int)ARRAY_SIZE(hid_keyboard); usage++)
+		if (hid_keyboard[usage] == code)
+			return usage;
+
+	return 0;
+}
+
+static void
+put_le(uint8_t *dst, uint32_t value, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		dst[i] = value >> (8 * i);
+}
+
+static void
+key_set(struct evdev_translate *t, unsigned int code, int pressed)
+{
+	uint16_t bit = t->key_bit[code];
+	uint8_t *byte = &t->report[bit / 8];
+	uint8_t mask = 1 << (bit % 8);
+	uint8_t old = *byte;
+
+	if (pressed)
+		*byte |= mask;
+	else
+		*byte &= ~mask;
+
+	if (*byte != old)
+		t->changed = 1;
+}
+
+static void
+abs_set(struct evdev_translate *t, unsigned int code, int32_t value)
+{
+	uint8_t le[4];
+
+	put_le(le, value, 4);
+	if (!memcmp(t->report + t->abs_offset[code], le, 4))
+		return;
+
+	memcpy(t->report + t->abs_offset[code], le, 4);
+	t->changed = 1;
+}
+
+int
+evdev_caps_query(struct evdev_caps *caps, int fd)
+{
+	const struct usage_map *m;
+
+	memset(caps, 0, sizeof (*caps));
+
+	if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof (caps->key)), caps->key) < 0
+	    || ioctl(fd, EVIOCGBIT(EV_REL, sizeof (caps->rel)), caps->rel) < 0
+	    || ioctl(fd, EVIOCGBIT(EV_ABS, sizeof (caps->abs)), caps->abs) < 0)
+		return errno;
+
+	for (m = abs_map; m < abs_map + ARRAY_SIZE(abs_map); m++) {
+		if (!test_bit(caps->abs, m->code))
+			continue;
+		if (ioctl(fd, EVIOCGABS(m->code), &caps->absinfo[m->code]) < 0)
+			return errno;
+	}
+
+	return 0;
+}
+
+void
+evdev_caps_learn(struct evdev_caps *caps, const struct input_event *ev)
+{
+	struct input_absinfo *info;
+
+	switch (ev->type) {
+	case EV_KEY:
+		if (ev->code < KEY_CNT)
+			set_bit(caps->key, ev->code);
+		break;
+	case EV_REL:
+		if (ev->code < REL_CNT)
+			set_bit(caps->rel, ev->code);
+		break;
+	case EV_ABS:
+		if (ev->code >= ABS_CNT)
+			break;
+		info = &caps->absinfo[ev->code];
+		if (!test_bit(caps->abs, ev->code)) {
+			set_bit(caps->abs, ev->code);
+			info->minimum = info->maximum = ev->value;
+		}
+		if (ev->value < info->minimum)
+			info->minimum = ev->value;
+		if (ev->value > info->maximum)
+			info->maximum = ev->value;
+		break;
+	}
+}
+
+int
+evdev_translate_init(struct evdev_translate *t,
+		     const struct evdev_caps *caps)
+{
+	struct desc d = { .t = t, .page = -1 };
+	const struct usage_map *m;
+	int keyboard = 0, consumer = 0, buttons = 0, axes = 0;
+	int application;
+	unsigned int code;
+	int32_t min, max;
+	size_t bit;
+
+	memset(t, 0, sizeof (*t));
+	memset(t->key_bit, 0xff, sizeof (t->key_bit));
+	memset(t->rel_offset, 0xff, sizeof (t->rel_offset));
+	memset(t->abs_offset, 0xff, sizeof (t->abs_offset));
+
+	for (code = 0; code < KEY_CNT; code++) {
+		if (!test_bit(caps->key, code))
+			continue;
+		if (keyboard_usage(code))
+			keyboard = 1;
+		else
+			buttons++;
+	}
+
+	for (m = consumer_map; m < consumer_map + ARRAY_SIZE(consumer_map); m++) {
+		if (!test_bit(caps->key, m->code) || keyboard_usage(m->code))
+			continue;
+		consumer++;
+		buttons--;
+	}
+
+	for (m = rel_map; m < rel_map + ARRAY_SIZE(rel_map); m++)
+		axes += test_bit(caps->rel, m->code);
+	for (m = abs_map; m < abs_map + ARRAY_SIZE(abs_map); m++)
+		axes += test_bit(caps->abs, m->code);
+
+	if (!keyboard && !consumer && !buttons && !axes)
+		return ENODEV;
+
+	if (keyboard)
+		application = 0x06;
+	else if (test_bit(caps->rel, REL_X))
+		application = 0x02;
+	else if (test_bit(caps->abs, ABS_X))
+		application = 0x04;
+	else
+		application = 0x05;
+
+	desc_page(&d, 0x01);
+	desc_item(&d, ITEM_USAGE, application);
+	desc_item(&d, ITEM_COLLECTION, 0x01);
+
+	if (keyboard) {
+		desc_page(&d, 0x07);
+		desc_item(&d, ITEM_USAGE_MIN, 0);
+		desc_item(&d, ITEM_USAGE_MAX, ARRAY_SIZE(hid_keyboard) - 1);
+		for (code = 0; code < KEY_CNT; code++) {
+			int usage;
+
+			if (!test_bit(caps->key, code))
+				continue;
+			usage = keyboard_usage(code);
+			if (usage)
+				t->key_bit[code] = d.bits + usage;
+		}
+		desc_field(&d, 0, 1, 1, ARRAY_SIZE(hid_keyboard),
+			   INPUT_VARIABLE);
+	}
+
+	if (consumer) {
+		bit = d.bits;
+		desc_page(&d, 0x0c);
+		for (m = consumer_map;
+		     m < consumer_map + ARRAY_SIZE(consumer_map); m++) {
+			if (!test_bit(caps->key, m->code)
+			    || t->key_bit[m->code] != EVDEV_UNMAPPED)
+				continue;
+			desc_item(&d, ITEM_USAGE, m->usage);
+			t->key_bit[m->code] = bit++;
+		}
+		desc_field(&d, 0, 1, 1, consumer, INPUT_VARIABLE);
+		desc_pad(&d);
+	}
+
+	if (buttons) {
+		bit = d.bits;
+		desc_page(&d, 0x09);
+		desc_item(&d, ITEM_USAGE_MIN, 1);
+		desc_item(&d, ITEM_USAGE_MAX, buttons);
+		/* Remaining keys, in code order */
+		for (code = 0; code < KEY_CNT; code++)
+			if (test_bit(caps->key, code)
+			    && t->key_bit[code] == EVDEV_UNMAPPED)
+				t->key_bit[code] = bit++;
+		desc_field(&d, 0, 1, 1, buttons, INPUT_VARIABLE);
+		desc_pad(&d);
+	}
+
+	for (m = rel_map; m < rel_map + ARRAY_SIZE(rel_map); m++) {
+		if (!test_bit(caps->rel, m->code))
+			continue;
+		desc_page(&d, m->page);
+		desc_item(&d, ITEM_USAGE, m->usage);
+		t->rel_offset[m->code] = d.bits / 8;
+		desc_field(&d, -32767, 32767, 16, 1,
+			   INPUT_VARIABLE | INPUT_RELATIVE);
+	}
+
+	for (m = abs_map; m < abs_map + ARRAY_SIZE(abs_map); m++) {
+		if (!test_bit(caps->abs, m->code))
+			continue;
+		min = caps->absinfo[m->code].minimum;
+		max = caps->absinfo[m->code].maximum;
+		if (max <= min)
+			max = min + 1;
+		desc_page(&d, m->page);
+		desc_item(&d, ITEM_USAGE, m->usage);
+		t->abs_offset[m->code] = d.bits / 8;
+		desc_field(&d, min, max, 32, 1, INPUT_VARIABLE);
+	}
+
+	desc_item(&d, ITEM_END_COLLECTION, 0);
+
+	t->report_size = d.bits / 8;
+	if (d.overflow || t->report_size > sizeof (t->report))
+		return E2BIG;
+
+	for (m = abs_map; m < abs_map + ARRAY_SIZE(abs_map); m++)
+		if (t->abs_offset[m->code] != EVDEV_UNMAPPED)
+			put_le(t->report + t->abs_offset[m->code],
+			       caps->absinfo[m->code].value, 4);
+
+	return 0;
+}
+
+static void
+rel_flush(struct evdev_translate *t)
+{
+	unsigned int code;
+	int32_t value;
+
+	for (code = 0; code < REL_CNT; code++) {
+		if (t->rel_offset[code] == EVDEV_UNMAPPED)
+			continue;
+
+		value = t->rel[code];
+		if (value > 32767)
+			value = 32767;
+		if (value < -32767)
+			value = -32767;
+		if (value)
+			t->changed = 1;
+
+		put_le(t->report + t->rel_offset[code], value, 2);
+		t->rel[code] = 0;
+	}
+}
+
+enum evdev_translate_result
+evdev_translate_event(struct evdev_translate *t,
+		      const struct input_event *ev)
+{
+	if (t->dropping) {
+		if (ev->type != EV_SYN || ev->code != SYN_REPORT)
+			return EVDEV_TRANSLATE_NONE;
+
+		/* Deltas of the last frame sent must not be sent again */
+		t->dropping = 0;
+		rel_flush(t);
+		t->changed = 0;
+		return EVDEV_TRANSLATE_RESYNC;
+	}
+
+	switch (ev->type) {
+	case EV_KEY:
+		/* Autorepeat (value 2) leaves the key down */
+		if (ev->code < KEY_CNT && t->key_bit[ev->code] != EVDEV_UNMAPPED)
+			key_set(t, ev->code, ev->value != 0);
+		break;
+
+	case EV_REL:
+		if (ev->code < REL_CNT && t->rel_offset[ev->code] != EVDEV_UNMAPPED)
+			t->rel[ev->code] += ev->value;
+		break;
+
+	case EV_ABS:
+		if (ev->code < ABS_CNT && t->abs_offset[ev->code] != EVDEV_UNMAPPED)
+			abs_set(t, ev->code, ev->value);
+		break;
+
+	case EV_SYN:
+		switch (ev->code) {
+		case SYN_REPORT:
+			/* Relative fields are rewritten on every frame */
+			rel_flush(t);
+			if (!t->changed)
+				break;
+			t->changed = 0;
+			return EVDEV_TRANSLATE_REPORT;
+
+		case SYN_DROPPED:
+			memset(t->rel, 0, sizeof (t->rel));
+			t->dropping = 1;
+			break;
+		}
+		break;
+	}
+
+	return EVDEV_TRANSLATE_NONE;
+}
+
+int
+evdev_translate_resync(struct evdev_translate *t, int fd)
+{
+	unsigned long keys[EVDEV_LONGS(KEY_CNT)];
+	struct input_absinfo info;
+	unsigned int code;
+
+	if (ioctl(fd, EVIOCGKEY(sizeof (keys)), keys) < 0)
+		return errno;
+
+	for (code = 0; code < KEY_CNT; code++)
+		if (t->key_bit[code] != EVDEV_UNMAPPED)
+			key_set(t, code, test_bit(keys, code));
+
+	for (code = 0; code < ABS_CNT; code++) {
+		if (t->abs_offset[code] == EVDEV_UNMAPPED)
+			continue;
+		if (ioctl(fd, EVIOCGABS(code), &info) < 0)
+			return errno;
+		abs_set(t, code, info.value);
+	}
+
+	/* Caller sends the report anyway, to confirm state to the server */
+	rel_flush(t);
+	t->changed = 0;
+
+	return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef EVDEV_TRANSLATE_H_
+#define EVDEV_TRANSLATE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/input.h>
+
+/*
+ * Translation of evdev events to HID reports.
+ *
+ * A report descriptor is generated from the device capabilities:
+ * keyboard keys as a usage bitmap, media keys as consumer bits, other
+ * buttons on the button page, relative axes as 16-bit fields and
+ * absolute axes as 32-bit fields.  Events update the report, which is
+ * complete once per SYN_REPORT frame.  Relative deltas are summed
+ * over the frame.
+ */
+
+#define EVDEV_DESCRIPTOR_MAX 1024
+#define EVDEV_REPORT_MAX 256
+
+#define EVDEV_LONGS(bits) \
+	(((bits) + 8 * sizeof (unsigned long) - 1) / (8 * sizeof (unsigned long)))
+
+struct evdev_caps {
+	unsigned long key[EVDEV_LONGS(KEY_CNT)];
+	unsigned long rel[EVDEV_LONGS(REL_CNT)];
+	unsigned long abs[EVDEV_LONGS(ABS_CNT)];
+	struct input_absinfo absinfo[ABS_CNT];
+};
+
+enum evdev_translate_result {
+	/* Nothing to send yet */
+	EVDEV_TRANSLATE_NONE,
+	/* Frame complete, report changed */
+	EVDEV_TRANSLATE_REPORT,
+	/* Events were dropped, state must be read back from device */
+	EVDEV_TRANSLATE_RESYNC,
+};
+
+#define EVDEV_UNMAPPED 0xffff
+
+struct evdev_translate {
+	/* Bit offset of each key in report */
+	uint16_t key_bit[KEY_CNT];
+	/* Byte offset of each axis in report */
+	uint16_t rel_offset[REL_CNT];
+	uint16_t abs_offset[ABS_CNT];
+	/* Deltas summed over current frame */
+	int32_t rel[REL_CNT];
+	int changed;
+	int dropping;
+
+	uint8_t descriptor[EVDEV_DESCRIPTOR_MAX];
+	size_t descriptor_size;
+	uint8_t report[EVDEV_REPORT_MAX];
+	size_t report_size;
+};
+
+/* Reads capabilities and axis ranges from an evdev fd */
+int evdev_caps_query(struct evdev_caps *caps, int fd);
+
+/* Widens capabilities to cover a recorded event */
+void evdev_caps_learn(struct evdev_caps *caps, const struct input_event *ev);
+
+/* Returns ENODEV if no capability can be expressed in HID */
+int evdev_translate_init(struct evdev_translate *t,
+			 const struct evdev_caps *caps);
+
+enum evdev_translate_result
+evdev_translate_event(struct evdev_translate *t,
+		      const struct input_event *ev);
+
+/*
+ * Reloads key and absolute axis state from device after
+ * EVDEV_TRANSLATE_RESYNC.  Returns 0 when done, or an error taken
+ * from errno(7).
+ */
+int evdev_translate_resync(struct evdev_translate *t, int fd);
+
+#endif
@@ -0,0 +1,245 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Report header benchmark.
+
+  Checks compact header round trips, times encoding and decoding of
+  fixed and compact headers, and compares bytes on the wire for the
+  report mix of test/remote.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include <foils/compact_header.h>
+
+/* Reports of test/remote.c, weighted for a typical session */
+static const struct {
+    const char *name;
+    uint8_t report_id;
+    size_t size;
+    unsigned int weight;
+} remote_mix[] = {
+    { "unicode", 1, 4, 40 },
+    { "keyboard", 2, 1, 35 },
+    { "consumer", 3, 2, 20 },
+    { "system", 4, 1, 5 },
+};
+
+#define REMOTE_MIX_COUNT (sizeof(remote_mix) / sizeof(remote_mix[0]))
+
+/* Headers encoded per timed pass, cycling over random ids */
+#define ID_COUNT 4096
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t fixed_encode(uint8_t *buf, uint32_t device_id, uint8_t report_id)
+{
+    uint32_t v[2] = { htonl(device_id), htonl(report_id) };
+
+    memcpy(buf, v, sizeof(v));
+    return sizeof(v);
+}
+
+static size_t fixed_decode(
+    const uint8_t *buf, size_t size,
+    uint32_t *device_id, uint8_t *report_id)
+{
+    uint32_t v[2];
+
+    if (size < sizeof(v))
+        return 0;
+
+    memcpy(v, buf, sizeof(v));
+    *device_id = ntohl(v[0]);
+    *report_id = ntohl(v[1]);
+    return sizeof(v);
+}
+
+static int roundtrip_check(void)
+{
+    static const uint32_t edges[] = {
+        0, 1, 63, 64, 127, 128, 8191, 8192,
+        0xfffff, 0x100000, 0x7fffffff, 0x80000000, 0xffffffff,
+    };
+    uint8_t buf[FOILS_HID_COMPACT_HEADER_MAX + 1];
+    uint32_t device_id = 0;
+    uint8_t report_id = 0;
+    unsigned int flags = 0, i, f;
+    size_t len;
+
+    for (i = 0; i < sizeof(edges) / sizeof(edges[0]); ++i) {
+        for (f = 0; f < 2; ++f) {
+            len = foils_hid_compact_header_encode(buf, edges[i], 0xa5, f);
+            if (len > FOILS_HID_COMPACT_HEADER_MAX
+                || foils_hid_compact_header_decode(buf, len + 1, &device_id,
+                                                   &report_id, &flags) != len
+                || device_id != edges[i] || report_id != 0xa5 || flags != f) {
+                fprintf(stderr, "round trip failed for device %u\n", edges[i]);
+                return 1;
+            }
+
+            /* Truncated headers must be rejected */
+            if (foils_hid_compact_header_decode(buf, len - 1, &device_id,
+                                                &report_id, &flags)) {
+                fprintf(stderr, "truncated header accepted for device %u\n",
+                        edges[i]);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void time_codecs(unsigned long iterations, uint32_t max_device)
+{
+    static uint32_t devices[ID_COUNT];
+    static uint8_t reports[ID_COUNT];
+    static uint8_t fixed[ID_COUNT][8];
+    static uint8_t compact[ID_COUNT][FOILS_HID_COMPACT_HEADER_MAX];
+    static size_t compact_len[ID_COUNT];
+    unsigned int seed = 1, flags;
+    uint32_t device_id = 0, sum = 0;
+    uint8_t report_id = 0;
+    unsigned long i;
+    double t;
+
+    for (i = 0; i < ID_COUNT; ++i) {
+        devices[i] = rand_r(&seed) % (max_device + 1);
+        reports[i] = remote_mix[rand_r(&seed) % REMOTE_MIX_COUNT].report_id;
+    }
+
+    t = now();
+    for (i = 0; i < iterations; ++i)
+        sum += fixed_encode(fixed[i % ID_COUNT],
+                            devices[i % ID_COUNT], reports[i % ID_COUNT]);
+    printf("fixed encode     %6.2f ns\n", (now() - t) * 1e9 / iterations);
+
+    t = now();
+    for (i = 0; i < iterations; ++i)
+        sum += compact_len[i % ID_COUNT] = foils_hid_compact_header_encode(
+            compact[i % ID_COUNT],
+            devices[i % ID_COUNT], reports[i % ID_COUNT], 0);
+    printf("compact encode   %6.2f ns\n", (now() - t) * 1e9 / iterations);
+
+    t = now();
+    for (i = 0; i < iterations; ++i) {
+        sum += fixed_decode(fixed[i % ID_COUNT], 8, &device_id, &report_id);
+        sum += device_id + report_id;
+    }
+    printf("fixed decode     %6.2f ns\n", (now() - t) * 1e9 / iterations);
+
+    t = now();
+    for (i = 0; i < iterations; ++i) {
+        sum += foils_hid_compact_header_decode(
+            compact[i % ID_COUNT], compact_len[i % ID_COUNT],
+            &device_id, &report_id, &flags);
+        sum += device_id + report_id;
+    }
+    printf("compact decode   %6.2f ns\n", (now() - t) * 1e9 / iterations);
+
+    /* Keeps loops from being optimized out */
+    if (sum == 42)
+        printf("\n");
+}
+
+static void wire_compare(uint32_t device_id)
+{
+    uint8_t buf[FOILS_HID_COMPACT_HEADER_MAX];
+    double fixed = 0, compact = 0, payload = 0, weights = 0;
+    size_t i;
+
+    printf("\nbytes per report for remote mix, device %u:\n", device_id);
+    printf("%-10s %6s %7s %7s %9s %9s\n",
+           "report", "weight", "fixed", "compact", "fixed+ts", "compact+ts");
+
+    for (i = 0; i < REMOTE_MIX_COUNT; ++i) {
+        size_t size = remote_mix[i].size;
+        size_t c = foils_hid_compact_header_encode(
+            buf, device_id, remote_mix[i].report_id, 0);
+
+        printf("%-10s %5u%% %7zu %7zu %9zu %9zu\n",
+               remote_mix[i].name, remote_mix[i].weight,
+               8 + size, c + size, 12 + size, c + 4 + size);
+
+        weights += remote_mix[i].weight;
+        payload += remote_mix[i].weight * size;
+        fixed += remote_mix[i].weight * (8 + size);
+        compact += remote_mix[i].weight * (c + size);
+    }
+
+    payload /= weights;
+    fixed /= weights;
+    compact /= weights;
+
+    printf("%-10s %6s %7.2f %7.2f %9.2f %9.2f\n",
+           "mean", "", fixed, compact, fixed + 4, compact + 4);
+    printf("header share of bytes: fixed %.0f%%, compact %.0f%%,"
+           " %.0f%% fewer bytes\n",
+           100 * (fixed - payload) / fixed,
+           100 * (compact - payload) / compact,
+           100 * (fixed - compact) / fixed);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n iterations] [-d max_device]\n"
+            "  -n  headers per timed pass (default 100000000)\n"
+            "  -d  highest device id used (default 31)\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long iterations = 100000000;
+    uint32_t max_device = 31;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            max_device = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!iterations) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (roundtrip_check())
+        return 1;
+
+    time_codecs(iterations, max_device);
+    wire_compare(0);
+
+    return 0;
+}
@@ -5,13 +5,52 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
 #include <sys/ioctl.h>
+#include <sys/inotify.h>
 #include <linux/hidraw.h>
 
 #include <ela/ela.h>
 #include <foils/hid.h>
 #include <foils/hid_device.h>
 
+#include "hidraw_ingest.h"
+#include "hidraw_worker.h"
+
+/* Devices forwarded at once */
+#define HIDRAW_SLOT_COUNT 32
+#define HIDRAW_NODE_LEN 32
+
+struct hidraw_bridge;
+
+struct hidraw_slot {
+	struct hidraw_bridge *bridge;
+	int fd;
+	/* hidrawN, empty when slot is free */
+	char node[HIDRAW_NODE_LEN];
+	/* Reports are prefixed with their ID byte */
+	int numbered;
+	/* Bumped on open, stale worker replies are dropped */
+	unsigned int generation;
+	struct hidraw_report_descriptor rdesc;
+};
+
+struct hidraw_bridge {
+	/* Must stay first, callbacks cast the client back */
+	struct foils_hid client;
+	struct ela_el *el;
+	struct foils_hid_device_descriptor descriptors[HIDRAW_SLOT_COUNT];
+	struct hidraw_slot slots[HIDRAW_SLOT_COUNT];
+	struct hidraw_ingest ingest;
+	struct hidraw_worker worker;
+	int inotify_fd;
+	struct ela_event_source *inotify_source;
+	/* Requested for devices with absolute inputs only */
+	int dedup;
+	int resync;
+};
+
 static void
 status(struct foils_hid *client, enum foils_hid_state state)
 {
@@ -38,11 +77,44 @@ status(struct foils_hid *client, enum foils_hid_state state)
 	printf("Status: %s\n", st);
 }
 
+/*
+ * Report ID byte is always prepended on the hidraw side: it is zero
+ * for devices without numbered reports, and the kernel strips it.
+ */
+static void
+hidraw_submit(struct foils_hid *client, enum hidraw_request_type type,
+	      uint32_t device_id, uint8_t report_id,
+	      const void *data, size_t datalen)
+{
+	struct hidraw_bridge *bridge = (struct hidraw_bridge *)client;
+	struct hidraw_slot *slot;
+	int err;
+
+	if (device_id >= HIDRAW_SLOT_COUNT)
+		return;
+
+	slot = &bridge->slots[device_id];
+	if (!slot->node[0])
+		return;
+
+	if (!slot->numbered)
+		report_id = 0;
+
+	err = hidraw_worker_submit(&bridge->worker, type, device_id,
+				   slot->generation, slot->fd,
+				   report_id, data, datalen);
+	if (err)
+		fprintf(stderr, "error: cannot queue request to %s: %s\n",
+			slot->node, strerror(err));
+}
+
 static void
 feature_report(struct foils_hid *client,
 	       uint32_t device_id, uint8_t report_id,
 	       const void *data, size_t datalen)
 {
+	hidraw_submit(client, HIDRAW_REQUEST_SET_FEATURE,
+		      device_id, report_id, data, datalen);
 }
 
 static void
@@ -50,12 +122,49 @@ output_report(struct foils_hid *client,
 	      uint32_t device_id, uint8_t report_id,
 	      const void *data, size_t datalen)
 {
+	hidraw_submit(client, HIDRAW_REQUEST_OUTPUT,
+		      device_id, report_id, data, datalen);
 }
 
 static void
 feature_report_sollicit(struct foils_hid *client,
 			uint32_t device_id, uint8_t report_id)
 {
+	/* Report size is unknown, let the device fill what it has */
+	hidraw_submit(client, HIDRAW_REQUEST_GET_FEATURE,
+		      device_id, report_id, NULL, HIDRAW_REQUEST_SIZE - 1);
+}
+
+static void
+hidraw_request_done(void *opaque, const struct hidraw_request *request)
+{
+	struct hidraw_bridge *bridge = opaque;
+	struct hidraw_slot *slot = &bridge->slots[request->slot];
+	uint8_t report_id = request->data[0];
+
+	/* Device went away or slot was reused meanwhile */
+	if (!slot->node[0] || slot->generation != request->generation)
+		return;
+
+	if (request->result < 0) {
+		fprintf(stderr, "error: %s on %s, report %d: %s\n",
+			request->type == HIDRAW_REQUEST_OUTPUT ? "write"
+			: request->type == HIDRAW_REQUEST_SET_FEATURE
+			? "feature set" : "feature get",
+			slot->node, report_id, strerror(-request->result));
+		return;
+	}
+
+	if (request->type != HIDRAW_REQUEST_GET_FEATURE)
+		return;
+
+	/* Returned buffer starts with the report ID byte */
+	if (request->result < 1)
+		return;
+
+	foils_hid_feature_report_send(&bridge->client, request->slot,
+				      report_id, 1, request->data + 1,
+				      request->result - 1);
 }
 
 static const struct foils_hid_handler handler =
@@ -66,29 +175,158 @@ static const struct foils_hid_handler handler =
 	.feature_report_sollicit = feature_report_sollicit,
 };
 
+static size_t
+slot_index(const struct hidraw_slot *slot)
+{
+	return slot - slot->bridge->slots;
+}
+
 static void
-hidraw_cb(struct ela_event_source *source, int fd,
-	  uint32_t mask, void *data)
-{
-	struct foils_hid *client = data;
-	uint8_t report[512];
-	ssize_t ret;
-
-	while (1) {
-		ret = read(fd, report, sizeof (report));
-		if (ret <= 0) {
-			if (errno != EAGAIN)
-				fprintf(stderr, "error: failed reading from device\n");
-			break;
+hidraw_slot_close(struct hidraw_slot *slot)
+{
+	struct hidraw_bridge *bridge = slot->bridge;
+
+	if (!slot->node[0])
+		return;
+
+	printf("Removing device `%s' (%s) from slot %zu\n",
+	       bridge->descriptors[slot_index(slot)].name,
+	       slot->node, slot_index(slot));
+
+	foils_hid_device_disable(&bridge->client, slot_index(slot));
+
+	hidraw_ingest_remove(&bridge->ingest, slot_index(slot));
+	close(slot->fd);
+
+	slot->fd = -1;
+	slot->node[0] = 0;
+}
+
+static void
+hidraw_report(void *opaque, size_t index, const uint8_t *report, size_t size,
+	      uint64_t timestamp)
+{
+	struct hidraw_bridge *bridge = opaque;
+	struct hidraw_slot *slot = &bridge->slots[index];
+	uint8_t report_id = 0;
+
+	if (slot->numbered) {
+		if (!size)
+			return;
+		report_id = *report++;
+		size--;
+	}
+
+	/* Reports not grabbed by the server are dropped there */
+	foils_hid_input_report_timed_send(&bridge->client, index,
+					  report_id, 1, timestamp,
+					  report, size);
+}
+
+static void
+hidraw_error(void *opaque, size_t index, int err)
+{
+	struct hidraw_bridge *bridge = opaque;
+	struct hidraw_slot *slot = &bridge->slots[index];
+
+	/* Device is gone, inotify may lag behind */
+	fprintf(stderr, "error: failed reading from %s: %s\n",
+		slot->node, strerror(err));
+	hidraw_slot_close(slot);
+}
+
+static const struct hidraw_ingest_handler ingest_handler = {
+	.report = hidraw_report,
+	.error = hidraw_error,
+};
+
+/*
+ * Walks report descriptor items looking for a Report ID global item.
+ * If there is any, every report on the device is numbered.
+ */
+static int
+hidraw_uses_report_ids(const uint8_t *desc, size_t size)
+{
+	static const uint8_t item_size[4] = { 0, 1, 2, 4 };
+	size_t i = 0;
+
+	while (i < size) {
+		uint8_t prefix = desc[i];
+
+		if (prefix == 0xfe) {
+			/* Long item: bDataSize, bLongItemTag, data */
+			if (i + 1 >= size)
+				break;
+			i += 3 + desc[i + 1];
+			continue;
+		}
+
+		/* Report ID, global item tag 8 */
+		if ((prefix & 0xfc) == 0x84)
+			return 1;
+
+		i += 1 + item_size[prefix & 3];
+	}
+
+	return 0;
+}
+
+/*
+ * Looks for an Input main item with the Relative flag.  Identical
+ * consecutive relative reports, like constant mouse motion, are
+ * real input: they must not be suppressed nor replayed.
+ */
+static int
+hidraw_has_relative_input(const uint8_t *desc, size_t size)
+{
+	static const uint8_t item_size[4] = { 0, 1, 2, 4 };
+	size_t i = 0;
+
+	while (i < size) {
+		uint8_t prefix = desc[i];
+
+		if (prefix == 0xfe) {
+			if (i + 1 >= size)
+				break;
+			i += 3 + desc[i + 1];
+			continue;
 		}
-		foils_hid_input_report_send(client, 0, 0, 1, report, ret);
+
+		/* Input, main item tag 8, Relative is data bit 2 */
+		if ((prefix & 0xfc) == 0x80 && (prefix & 3)
+		    && i + 1 < size && (desc[i + 1] & 0x04))
+			return 1;
+
+		i += 1 + item_size[prefix & 3];
 	}
+
+	return 0;
+}
+
+/* Slots keep their modes across devices, set them for each one */
+static int
+hidraw_slot_modes_set(struct hidraw_bridge *bridge, size_t index,
+		      int relative)
+{
+	int ret = 0;
+
+	if (bridge->dedup && !relative)
+		ret = foils_hid_dedup_enable(&bridge->client, index);
+	else
+		foils_hid_dedup_disable(&bridge->client, index);
+
+	if (!ret && bridge->resync && !relative)
+		ret = foils_hid_resync_enable(&bridge->client, index);
+	else
+		foils_hid_resync_disable(&bridge->client, index);
+
+	return ret;
 }
 
 static int
-hidraw_get_descriptor(int fd, struct foils_hid_device_descriptor *descriptor)
+hidraw_get_descriptor(int fd, struct hidraw_report_descriptor *hidraw_desc,
+		      struct foils_hid_device_descriptor *descriptor)
 {
-	static struct hidraw_report_descriptor hidraw_desc;
 	int size;
 
 	if (ioctl(fd, HIDIOCGRDESCSIZE, &size)) {
@@ -96,84 +334,342 @@ hidraw_get_descriptor(int fd, struct foils_hid_device_descriptor *descriptor)
 		return 1;
 	}
 
-	hidraw_desc.size = size;
-	if (ioctl(fd, HIDIOCGRDESC, &hidraw_desc)) {
+	hidraw_desc->size = size;
+	if (ioctl(fd, HIDIOCGRDESC, hidraw_desc)) {
 		perror("ioctl/HIDIOCGRDESC");
 		return 1;
 	}
 
 	memset(descriptor, 0, sizeof (*descriptor));
-	descriptor->descriptor = hidraw_desc.value;
-	descriptor->descriptor_size = hidraw_desc.size;
+	descriptor->descriptor = hidraw_desc->value;
+	descriptor->descriptor_size = hidraw_desc->size;
 	descriptor->version = 0x0100;
 	ioctl(fd, HIDIOCGRAWNAME(DEVICE_NAME_LEN), descriptor->name);
 
 	return 0;
 }
 
+static struct hidraw_slot *
+hidraw_slot_find(struct hidraw_bridge *bridge, const char *node)
+{
+	size_t i;
+
+	for (i = 0; i < HIDRAW_SLOT_COUNT; i++)
+		if (!strcmp(bridge->slots[i].node, node))
+			return &bridge->slots[i];
+
+	return NULL;
+}
+
+/* node is either a /dev path, or a bare hidrawN name */
+static int
+hidraw_slot_open(struct hidraw_bridge *bridge, const char *node)
+{
+	struct hidraw_slot *slot;
+	char buf[HIDRAW_NODE_LEN + 8];
+	const char *path = node;
+	const char *name;
+	size_t index;
+	int relative;
+	int fd;
+
+	name = strrchr(node, '/');
+	name = name ? name + 1 : node;
+	if (strlen(name) >= HIDRAW_NODE_LEN)
+		return EINVAL;
+
+	if (hidraw_slot_find(bridge, name))
+		return EEXIST;
+
+	slot = hidraw_slot_find(bridge, "");
+	if (!slot) {
+		fprintf(stderr, "No free slot for %s\n", name);
+		return ENOSPC;
+	}
+	index = slot_index(slot);
+
+	if (name == node) {
+		snprintf(buf, sizeof (buf), "/dev/%s", name);
+		path = buf;
+	}
+
+	fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return errno;
+
+	if (hidraw_get_descriptor(fd, &slot->rdesc,
+				  &bridge->descriptors[index])) {
+		close(fd);
+		return ENODEV;
+	}
+
+	if (hidraw_ingest_add(&bridge->ingest, index, fd)) {
+		close(fd);
+		return ENOMEM;
+	}
+
+	slot->fd = fd;
+	slot->generation++;
+	slot->numbered = hidraw_uses_report_ids(slot->rdesc.value,
+						slot->rdesc.size);
+	strcpy(slot->node, name);
+
+	relative = hidraw_has_relative_input(slot->rdesc.value,
+					     slot->rdesc.size);
+	if (hidraw_slot_modes_set(bridge, index, relative))
+		fprintf(stderr, "Error enabling report modes of %s\n", name);
+
+	printf("Forwarding device `%s' (%s) as slot %zu%s%s\n",
+	       bridge->descriptors[index].name, name, index,
+	       slot->numbered ? ", numbered reports" : "",
+	       relative && (bridge->dedup || bridge->resync)
+	       ? ", relative, no dedup nor resync" : "");
+
+	foils_hid_device_enable(&bridge->client, index);
+
+	return 0;
+}
+
+static void
+hidraw_enumerate(struct hidraw_bridge *bridge)
+{
+	struct dirent *entry;
+	DIR *dir;
+	int err;
+
+	dir = opendir("/sys/class/hidraw");
+	if (!dir) {
+		perror("opendir /sys/class/hidraw");
+		return;
+	}
+
+	while ((entry = readdir(dir))) {
+		if (strncmp(entry->d_name, "hidraw", 6))
+			continue;
+
+		err = hidraw_slot_open(bridge, entry->d_name);
+		if (err && err != EEXIST)
+			fprintf(stderr, "Cannot forward %s: %s\n",
+				entry->d_name, strerror(err));
+	}
+
+	closedir(dir);
+}
+
+static void
+inotify_cb(struct ela_event_source *source, int fd,
+	   uint32_t mask, void *data)
+{
+	struct hidraw_bridge *bridge = data;
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	struct hidraw_slot *slot;
+	ssize_t len;
+	char *ptr;
+
+	while ((len = read(fd, buf, sizeof (buf))) > 0) {
+		for (ptr = buf; ptr < buf + len;
+		     ptr += sizeof (*event) + event->len) {
+			event = (const struct inotify_event *)ptr;
+
+			if (!event->len || strncmp(event->name, "hidraw", 6))
+				continue;
+
+			if (event->mask & IN_DELETE) {
+				slot = hidraw_slot_find(bridge, event->name);
+				if (slot)
+					hidraw_slot_close(slot);
+				continue;
+			}
+
+			/*
+			 * Node may not be accessible yet on IN_CREATE, udev
+			 * fixes permissions afterwards and we get IN_ATTRIB.
+			 */
+			hidraw_slot_open(bridge, event->name);
+		}
+	}
+}
+
+static int
+hidraw_hotplug_init(struct hidraw_bridge *bridge)
+{
+	int err;
+
+	bridge->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (bridge->inotify_fd < 0)
+		return errno;
+
+	if (inotify_add_watch(bridge->inotify_fd, "/dev",
+			      IN_CREATE | IN_ATTRIB | IN_DELETE) < 0) {
+		err = errno;
+		close(bridge->inotify_fd);
+		bridge->inotify_fd = -1;
+		return err;
+	}
+
+	ela_source_alloc(bridge->el, inotify_cb, bridge,
+			 &bridge->inotify_source);
+	ela_set_fd(bridge->el, bridge->inotify_source, bridge->inotify_fd,
+		   ELA_EVENT_READABLE);
+	ela_add(bridge->el, bridge->inotify_source);
+
+	return 0;
+}
+
+static void
+hidraw_hotplug_deinit(struct hidraw_bridge *bridge)
+{
+	if (bridge->inotify_fd < 0)
+		return;
+
+	ela_remove(bridge->el, bridge->inotify_source);
+	ela_source_free(bridge->el, bridge->inotify_source);
+	close(bridge->inotify_fd);
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-udsr] /dev/hidrawX IP [PORT]\n"
+		"       %s [-udsr] -a IP [PORT]\n"
+		"  -a  forward all hidraw devices, following hotplug\n"
+		"  -u  read devices through io_uring\n"
+		"  -d  send large reports as deltas, if server supports it\n"
+		"  -s  suppress reports identical to the previous one\n"
+		"  -r  send latest reports again on reconnection\n"
+		"  -s and -r only apply to devices without relative inputs\n",
+		name, name);
+}
+
 int main(int argc, char **argv)
 {
-	struct foils_hid client;
-	struct foils_hid_device_descriptor descriptor;
-	struct ela_el *el;
-	struct ela_event_source *ev;
-	char *devpath;
+	static struct hidraw_bridge bridge;
+	char *devpath = NULL;
 	char *host;
+	enum hidraw_ingest_backend backend = HIDRAW_INGEST_READ;
+	int all = 0;
+	int delta = 0;
 	int port;
-	int dev_fd;
 	int ret = 1;
+	int opt;
+	size_t i;
 
-	if (argc < 3) {
-		fprintf(stderr, "usage: %s /dev/hidrawX IP [PORT]\n", argv[0]);
-		return 1;
+	while ((opt = getopt(argc, argv, "aduhsr")) != -1) {
+		switch (opt) {
+		case 'a':
+			all = 1;
+			break;
+		case 'd':
+			delta = 1;
+			break;
+		case 's':
+			bridge.dedup = 1;
+			break;
+		case 'r':
+			bridge.resync = 1;
+			break;
+		case 'u':
+			backend = HIDRAW_INGEST_URING;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
 	}
 
-	devpath = argv[1];
-	host = argv[2];
-	port = argc > 3 ? atoi(argv[3]) : 24322;
-
-	dev_fd = open(devpath, O_RDWR | O_NONBLOCK);
-	if (dev_fd < 0) {
-		fprintf(stderr, "failed to open %s: %m\n", devpath);
+	if (argc - optind < (all ? 1 : 2)) {
+		usage(argv[0]);
 		return 1;
 	}
 
-	if (hidraw_get_descriptor(dev_fd, &descriptor)) {
-		fprintf(stderr, "failed to get hid descriptor, is %s an hidraw device ?\n",
-			devpath);
-		goto dev_deinit;
-	}
+	if (!all)
+		devpath = argv[optind++];
+	host = argv[optind];
+	port = argc > optind + 1 ? atoi(argv[optind + 1]) : 24322;
 
-	printf("Forwarding device `%s' to %s:%d\n",
-	       descriptor.name, host, port);
+	bridge.inotify_fd = -1;
+	for (i = 0; i < HIDRAW_SLOT_COUNT; i++) {
+		bridge.slots[i].bridge = &bridge;
+		bridge.slots[i].fd = -1;
+	}
 
-	el = ela_create(NULL);
+	bridge.el = ela_create(NULL);
 
-	ret = foils_hid_init(&client, el, &handler, &descriptor, 1);
+	ret = foils_hid_init(&bridge.client, bridge.el, &handler,
+			     bridge.descriptors, HIDRAW_SLOT_COUNT);
 	if (ret) {
 		fprintf(stderr, "Error creating client: %s\n", strerror(ret));
 		goto ela_deinit;
 	}
 
-	ret = foils_hid_client_connect_hostname(&client, host, port, 0);
+	/* Delta suits any device, other modes are set on open */
+	for (i = 0; i < HIDRAW_SLOT_COUNT; i++) {
+		ret = delta ? foils_hid_delta_enable(&bridge.client, i) : 0;
+		if (ret) {
+			fprintf(stderr, "Error enabling report modes: %s\n",
+				strerror(ret));
+			goto client_deinit;
+		}
+	}
+
+	ret = hidraw_ingest_init(&bridge.ingest, bridge.el, backend,
+				 &ingest_handler, &bridge, HIDRAW_SLOT_COUNT);
 	if (ret) {
-		fprintf(stderr, "Error starting connection: %s\n", strerror(ret));
-		goto ela_deinit;
+		fprintf(stderr, "Error creating reader: %s\n", strerror(ret));
+		goto client_deinit;
 	}
 
-	foils_hid_device_enable(&client, 0);
+	ret = hidraw_worker_init(&bridge.worker, bridge.el,
+				 hidraw_request_done, &bridge);
+	if (ret) {
+		fprintf(stderr, "Error creating worker: %s\n", strerror(ret));
+		goto ingest_deinit;
+	}
+
+	if (all) {
+		/* Watch first, so that no device slips in between */
+		ret = hidraw_hotplug_init(&bridge);
+		if (ret) {
+			fprintf(stderr, "Error watching /dev: %s\n",
+				strerror(ret));
+			goto worker_deinit;
+		}
+		hidraw_enumerate(&bridge);
+	} else {
+		ret = hidraw_slot_open(&bridge, devpath);
+		if (ret) {
+			fprintf(stderr, "failed to forward %s: %s,"
+				" is it an hidraw device ?\n",
+				devpath, strerror(ret));
+			goto worker_deinit;
+		}
+	}
+
+	printf("Forwarding to %s:%d\n", host, port);
+
+	ret = foils_hid_client_connect_hostname(&bridge.client, host, port, 0);
+	if (ret) {
+		fprintf(stderr, "Error starting connection: %s\n", strerror(ret));
+		goto slots_deinit;
+	}
 
-	ela_source_alloc(el, hidraw_cb, &client, &ev);
-	ela_set_fd(el, ev, dev_fd, ELA_EVENT_READABLE);
-	ela_add(el, ev);
-	ela_run(el);
+	ela_run(bridge.el);
 
 	ret = 0;
 
-	foils_hid_deinit(&client);
+slots_deinit:
+	for (i = 0; i < HIDRAW_SLOT_COUNT; i++)
+		hidraw_slot_close(&bridge.slots[i]);
+	hidraw_hotplug_deinit(&bridge);
+worker_deinit:
+	hidraw_worker_deinit(&bridge.worker);
+ingest_deinit:
+	hidraw_ingest_deinit(&bridge.ingest);
+client_deinit:
+	foils_hid_deinit(&bridge.client);
 ela_deinit:
-	ela_close(el);
-dev_deinit:
-	close(dev_fd);
+	ela_close(bridge.el);
 	return ret;
 }
@@ -0,0 +1,427 @@
+/*
+ * hidraw ingestion benchmark.
+ *
+ * Simulates a set of high-rate hidraw devices with SOCK_SEQPACKET
+ * socket pairs, which keep report boundaries like hidraw does, or
+ * with real hidraw nodes of uhid devices.  A producer thread writes
+ * reports to every device at a given rate and the event loop thread
+ * ingests them with the chosen backend.  Syscall count, wakeups and
+ * consumer CPU time are reported.
+ *
+ * Socket pairs support nowait reads, hidraw does not: io_uring runs
+ * hidraw reads on io-wq worker threads.  Consumer CPU time includes
+ * theirs, it is the process time less the producer's, and the peak
+ * count of workers is reported.  Only uhid runs tell how the io_uring
+ * backend fares on hidraw.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <linux/uhid.h>
+
+#include <ela/ela.h>
+
+#include "hidraw_ingest.h"
+
+struct bench {
+	struct ela_el *el;
+	struct hidraw_ingest ingest;
+	int (*pairs)[2];
+	size_t devices;
+	size_t reports;
+	size_t size;
+	unsigned int rate;
+	int uhid;
+	/* Written by producer, read once it is joined */
+	double producer_cpu;
+	unsigned int iowq_peak;
+	uint64_t received;
+	uint64_t expected;
+	uint64_t bytes;
+};
+
+static void
+bench_report(void *opaque, size_t slot, const uint8_t *data, size_t size,
+	     uint64_t timestamp)
+{
+	struct bench *b = opaque;
+
+	b->received++;
+	b->bytes += size;
+}
+
+static void
+bench_error(void *opaque, size_t slot, int err)
+{
+	struct bench *b = opaque;
+
+	fprintf(stderr, "device %zu failed: %s\n", slot, strerror(err));
+	hidraw_ingest_remove(&b->ingest, slot);
+}
+
+static void
+bench_flush(void *opaque)
+{
+	struct bench *b = opaque;
+
+	if (b->received >= b->expected)
+		ela_exit(b->el);
+}
+
+static const struct hidraw_ingest_handler bench_handler = {
+	.report = bench_report,
+	.error = bench_error,
+	.flush = bench_flush,
+};
+
+/* io_uring workers of the process, named iou-wrk-<tid> */
+static unsigned int
+iowq_threads(void)
+{
+	char path[300], comm[32];
+	struct dirent *ent;
+	unsigned int count = 0;
+	DIR *dir;
+	int fd;
+	ssize_t len;
+
+	dir = opendir("/proc/self/task");
+	if (!dir)
+		return 0;
+
+	while ((ent = readdir(dir))) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof (path), "/proc/self/task/%s/comm",
+			 ent->d_name);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			continue;
+		len = read(fd, comm, sizeof (comm) - 1);
+		close(fd);
+
+		if (len > 0 && !strncmp(comm, "iou-wrk", 7))
+			count++;
+	}
+
+	closedir(dir);
+	return count;
+}
+
+static double
+ts_diff(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+static void
+report_write(struct bench *b, size_t d, const uint8_t *report)
+{
+	struct uhid_event ev;
+
+	if (!b->uhid) {
+		if (write(b->pairs[d][1], report, b->size) < 0)
+			perror("write");
+		return;
+	}
+
+	memset(&ev, 0, sizeof (ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = b->size;
+	memcpy(ev.u.input2.data, report, b->size);
+	if (write(b->pairs[d][1], &ev, sizeof (ev)) < 0)
+		perror("write");
+}
+
+static void *
+producer(void *opaque)
+{
+	struct bench *b = opaque;
+	uint8_t report[HIDRAW_INGEST_REPORT_SIZE];
+	struct timespec next, sampled, now, cpu;
+	unsigned int threads;
+	size_t i, d;
+
+	memset(report, 0x5a, sizeof (report));
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	sampled = next;
+
+	for (i = 0; i < b->reports; i++) {
+		for (d = 0; d < b->devices; d++) {
+			report[0] = i;
+			report_write(b, d, report);
+		}
+
+		/* Workers come and go, look at them every 10ms */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (ts_diff(&now, &sampled) >= .01) {
+			threads = iowq_threads();
+			if (threads > b->iowq_peak)
+				b->iowq_peak = threads;
+			sampled = now;
+		}
+
+		if (!b->rate)
+			continue;
+
+		next.tv_nsec += 1000000000 / b->rate;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+	b->producer_cpu = cpu.tv_sec + cpu.tv_nsec / 1e9;
+
+	return NULL;
+}
+
+/* Vendor page input report of size bytes, no report id */
+static int
+uhid_open(struct bench *b, size_t d, int *hidraw_fd, int *uhid_fd)
+{
+	const uint8_t rd[] = {
+		0x06, 0x00, 0xff,	/* Usage Page (Vendor)		*/
+		0x09, 0x01,		/* Usage (01h)			*/
+		0xa1, 0x01,		/* Collection (Application)	*/
+		0x15, 0x00,		/*   Logical Minimum (0)	*/
+		0x26, 0xff, 0x00,	/*   Logical Maximum (255)	*/
+		0x75, 0x08,		/*   Report Size (8)		*/
+		0x95, b->size,		/*   Report Count (size)	*/
+		0x09, 0x01,		/*   Usage (01h)		*/
+		0x81, 0x02,		/*   Input (Variable)		*/
+		0xc0,			/* End Collection		*/
+	};
+	char uniq[64], path[320], line[128];
+	struct uhid_event ev;
+	struct dirent *ent;
+	int tries, found = 0;
+	DIR *dir;
+	FILE *f;
+
+	*uhid_fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (*uhid_fd < 0)
+		return errno;
+
+	snprintf(uniq, sizeof (uniq), "hidraw_bench-%d-%zu", getpid(), d);
+
+	memset(&ev, 0, sizeof (ev));
+	ev.type = UHID_CREATE2;
+	strcpy((char *)ev.u.create2.name, "hidraw_bench");
+	strcpy((char *)ev.u.create2.uniq, uniq);
+	ev.u.create2.rd_size = sizeof (rd);
+	ev.u.create2.bus = BUS_VIRTUAL;
+	memcpy(ev.u.create2.rd_data, rd, sizeof (rd));
+	if (write(*uhid_fd, &ev, sizeof (ev)) < 0)
+		goto fail;
+
+	/* hidraw node shows up asynchronously, found by uniq */
+	for (tries = 0; tries < 100 && !found; tries++) {
+		dir = opendir("/sys/class/hidraw");
+		while (dir && !found && (ent = readdir(dir))) {
+			if (strncmp(ent->d_name, "hidraw", 6))
+				continue;
+			snprintf(path, sizeof (path),
+				 "/sys/class/hidraw/%s/device/uevent",
+				 ent->d_name);
+			f = fopen(path, "r");
+			while (f && fgets(line, sizeof (line), f))
+				if (!strncmp(line, "HID_UNIQ=", 9)
+				    && !strncmp(line + 9, uniq, strlen(uniq))
+				    && line[9 + strlen(uniq)] == '\n')
+					found = 1;
+			if (f)
+				fclose(f);
+			if (found)
+				snprintf(path, sizeof (path), "/dev/%s",
+					 ent->d_name);
+		}
+		if (dir)
+			closedir(dir);
+		if (!found)
+			usleep(10000);
+	}
+
+	if (!found) {
+		errno = ENODEV;
+		goto fail;
+	}
+
+	*hidraw_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (*hidraw_fd < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	tries = errno;
+	close(*uhid_fd);
+	return tries;
+}
+
+static int
+bench_run(struct bench *b, enum hidraw_ingest_backend backend)
+{
+	struct timespec start, end, cpu_start, cpu_end;
+	struct timespec proc_start, proc_end;
+	pthread_t thread;
+	double elapsed, cpu, proc;
+	size_t d;
+	int err;
+
+	b->received = 0;
+	b->bytes = 0;
+	b->iowq_peak = 0;
+	b->expected = (uint64_t)b->devices * b->reports;
+
+	b->el = ela_create(NULL);
+	if (!b->el)
+		return ENOMEM;
+
+	err = hidraw_ingest_init(&b->ingest, b->el, backend, &bench_handler,
+				 b, b->devices);
+	if (err)
+		goto close_el;
+
+	for (d = 0; d < b->devices; d++) {
+		if (b->uhid)
+			err = uhid_open(b, d, &b->pairs[d][0], &b->pairs[d][1]);
+		else if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, b->pairs[d]))
+			err = errno;
+		if (err)
+			goto close_pairs;
+		hidraw_ingest_add(&b->ingest, d, b->pairs[d][0]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &proc_start);
+
+	pthread_create(&thread, NULL, producer, b);
+	ela_run(b->el);
+	pthread_join(thread, NULL);
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &proc_end);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = ts_diff(&end, &start);
+	cpu = ts_diff(&cpu_end, &cpu_start);
+	/* Event loop thread and io-wq workers */
+	proc = ts_diff(&proc_end, &proc_start) - b->producer_cpu;
+
+	printf("%-6s %3zu devices: %8llu reports in %7.3fs (%9.0f/s),"
+	       " %.3f syscalls/report, %.2f reports/wakeup,"
+	       " %.2f us cpu/report (%.2f in loop), %u io-wq threads peak\n",
+	       backend == HIDRAW_INGEST_URING ? "uring" : "read",
+	       b->devices, (unsigned long long)b->received, elapsed,
+	       b->received / elapsed,
+	       (double)b->ingest.stats.syscalls / b->received,
+	       (double)b->received / b->ingest.stats.wakeups,
+	       1e6 * proc / b->received, 1e6 * cpu / b->received,
+	       b->iowq_peak);
+
+	err = 0;
+
+close_pairs:
+	hidraw_ingest_deinit(&b->ingest);
+	while (d--) {
+		close(b->pairs[d][0]);
+		close(b->pairs[d][1]);
+	}
+close_el:
+	ela_close(b->el);
+	return err;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-d devices] [-n reports] [-r rate]"
+		" [-s size] [-b read|uring] [-u]\n"
+		"  -d  simulated device count (default 16)\n"
+		"  -n  reports per device (default 10000)\n"
+		"  -r  reports per second per device, 0 to flood"
+		" (default 1000)\n"
+		"  -s  report size (default 8)\n"
+		"  -b  only run given backend\n"
+		"  -u  use hidraw nodes of uhid devices, needs /dev/uhid"
+		" access\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b;
+	int run_read = 1, run_uring = 1;
+	int opt;
+	int err = 0;
+
+	memset(&b, 0, sizeof (b));
+	b.devices = 16;
+	b.reports = 10000;
+	b.rate = 1000;
+	b.size = 8;
+
+	while ((opt = getopt(argc, argv, "d:n:r:s:b:uh")) != -1) {
+		switch (opt) {
+		case 'd':
+			b.devices = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			b.reports = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			b.rate = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			b.size = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			b.uhid = 1;
+			break;
+		case 'b':
+			run_read = !strcmp(optarg, "read");
+			run_uring = !strcmp(optarg, "uring");
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!b.devices || !b.reports || !b.size
+	    || b.size > HIDRAW_INGEST_REPORT_SIZE
+	    || (b.uhid && b.size > 255)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	b.pairs = calloc(b.devices, sizeof (*b.pairs));
+	if (!b.pairs)
+		return 1;
+
+	if (run_read)
+		err = bench_run(&b, HIDRAW_INGEST_READ);
+	if (!err && run_uring)
+		err = bench_run(&b, HIDRAW_INGEST_URING);
+
+	if (err)
+		fprintf(stderr, "benchmark failed: %s\n", strerror(err));
+
+	free(b.pairs);
+	return !!err;
+}
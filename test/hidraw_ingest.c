@@ -0,0 +1,707 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+
+#include "hidraw_ingest.h"
+
+struct hidraw_ingest_read {
+	struct hidraw_ingest_device *device;
+	uint8_t buffer[HIDRAW_INGEST_REPORT_SIZE];
+};
+
+struct hidraw_ingest_device {
+	struct hidraw_ingest *ingest;
+	size_t slot;
+	int fd;
+	/* Removed, waiting for in-flight reads to complete */
+	int dead;
+	/* Ring was full, chain or cancel to be queued again */
+	int retry;
+	struct hidraw_ingest_device *next_dead;
+	/* Poll and reads of the chain not completed yet */
+	unsigned int inflight;
+	struct ela_event_source *source;
+	struct hidraw_ingest_read reads[HIDRAW_INGEST_DEPTH];
+};
+
+struct hidraw_ingest_ring {
+	int fd;
+	int event_fd;
+	struct ela_event_source *source;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	unsigned int sq_pending;
+	/* Devices with retry set */
+	unsigned int retries;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	size_t sqes_size;
+};
+
+/* Ring size, enough for 51 device chains without intermediate submission */
+#define HIDRAW_INGEST_RING_ENTRIES 256
+
+/*
+ * Read loop backend
+ */
+
+static uint64_t
+ingest_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+read_cb(struct ela_event_source *source, int fd,
+	uint32_t mask, void *data)
+{
+	struct hidraw_ingest_device *device = data;
+	struct hidraw_ingest *ingest = device->ingest;
+	uint8_t *report = device->reads[0].buffer;
+	ssize_t ret;
+
+	ingest->stats.wakeups++;
+
+	while (1) {
+		ret = read(fd, report, HIDRAW_INGEST_REPORT_SIZE);
+		ingest->stats.syscalls++;
+		if (ret <= 0) {
+			if (ret == 0 || errno != EAGAIN)
+				/* This may remove the device */
+				ingest->handler->error(ingest->opaque, device->slot,
+						       ret ? errno : ENODEV);
+			break;
+		}
+
+		ingest->stats.reports++;
+		ingest->handler->report(ingest->opaque, device->slot,
+					report, ret, ingest_now());
+	}
+
+	if (ingest->handler->flush)
+		ingest->handler->flush(ingest->opaque);
+}
+
+/*
+ * io_uring backend
+ */
+
+static int
+ring_setup(struct hidraw_ingest_ring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	int err;
+
+	memset(&p, 0, sizeof (p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return errno;
+
+	ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+	ring->cq_map_size = p.cq_off.cqes
+		+ p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_map_size > ring->sq_map_size)
+			ring->sq_map_size = ring->cq_map_size;
+		ring->cq_map_size = ring->sq_map_size;
+	}
+
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_SQ_RING);
+	if (ring->sq_map == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map = mmap(NULL, ring->cq_map_size,
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd,
+				    IORING_OFF_CQ_RING);
+		if (ring->cq_map == MAP_FAILED)
+			goto unmap_sq;
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto unmap_cq;
+
+	ring->sq_head = (void *)((char *)ring->sq_map + p.sq_off.head);
+	ring->sq_tail = (void *)((char *)ring->sq_map + p.sq_off.tail);
+	ring->sq_mask = (void *)((char *)ring->sq_map + p.sq_off.ring_mask);
+	ring->sq_array = (void *)((char *)ring->sq_map + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_pending = 0;
+
+	ring->cq_head = (void *)((char *)ring->cq_map + p.cq_off.head);
+	ring->cq_tail = (void *)((char *)ring->cq_map + p.cq_off.tail);
+	ring->cq_mask = (void *)((char *)ring->cq_map + p.cq_off.ring_mask);
+	ring->cqes = (void *)((char *)ring->cq_map + p.cq_off.cqes);
+
+	return 0;
+
+unmap_cq:
+	if (ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+unmap_sq:
+	munmap(ring->sq_map, ring->sq_map_size);
+fail:
+	err = errno;
+	close(ring->fd);
+	return err;
+}
+
+static void
+ring_teardown(struct hidraw_ingest_ring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+	munmap(ring->sq_map, ring->sq_map_size);
+	close(ring->fd);
+}
+
+static void
+ring_submit(struct hidraw_ingest *ingest)
+{
+	struct hidraw_ingest_ring *ring = ingest->ring;
+	int ret;
+
+	while (ring->sq_pending) {
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending,
+			      0, 0, NULL, 0);
+		ingest->stats.syscalls++;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Entries stay queued, retried on next submission */
+			break;
+		}
+		ring->sq_pending -= ret;
+	}
+}
+
+/* Free submission entries, submitting queued ones when short */
+static unsigned int
+ring_space(struct hidraw_ingest *ingest, unsigned int wanted)
+{
+	struct hidraw_ingest_ring *ring = ingest->ring;
+	unsigned int used;
+
+	used = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_entries - used < wanted) {
+		ring_submit(ingest);
+		used = *ring->sq_tail
+			- __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	}
+
+	return ring->sq_entries - used;
+}
+
+/* Caller checked ring_space() first */
+static struct io_uring_sqe *
+ring_get_sqe(struct hidraw_ingest_ring *ring)
+{
+	unsigned int tail = *ring->sq_tail;
+	struct io_uring_sqe *sqe;
+
+	sqe = &ring->sqes[tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof (*sqe));
+	ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+
+	return sqe;
+}
+
+static void
+ring_commit_sqe(struct hidraw_ingest_ring *ring)
+{
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+	ring->sq_pending++;
+}
+
+/* Poll completions are told apart from reads by the low bit */
+#define RING_POLL_TAG 1
+
+static void
+device_retry_set(struct hidraw_ingest *ingest,
+		 struct hidraw_ingest_device *device)
+{
+	if (device->retry)
+		return;
+
+	device->retry = 1;
+	ingest->ring->retries++;
+}
+
+/*
+ * hidraw has no nowait read, io_uring runs every read on an io-wq
+ * worker, blocking it until a report comes.  Reads are linked behind
+ * a poll instead, so that they are only issued once reports are
+ * there, and on a non-blocking file, so that the ones past the last
+ * report fail, cancelling the rest of the chain, instead of waiting.
+ * An idle device holds no worker.
+ */
+static void
+ring_queue_chain(struct hidraw_ingest *ingest,
+		 struct hidraw_ingest_device *device)
+{
+	struct hidraw_ingest_ring *ring = ingest->ring;
+	struct io_uring_sqe *sqe;
+	size_t i;
+
+	/* A chain is submitted whole, or its last link runs into others */
+	if (ring_space(ingest, HIDRAW_INGEST_DEPTH + 1)
+	    < HIDRAW_INGEST_DEPTH + 1) {
+		device_retry_set(ingest, device);
+		return;
+	}
+
+	sqe = ring_get_sqe(ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = device->fd;
+	sqe->poll32_events = POLLIN;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = (uintptr_t)device | RING_POLL_TAG;
+	ring_commit_sqe(ring);
+
+	for (i = 0; i < HIDRAW_INGEST_DEPTH; i++) {
+		struct hidraw_ingest_read *req = &device->reads[i];
+
+		sqe = ring_get_sqe(ring);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = device->fd;
+		sqe->addr = (uintptr_t)req->buffer;
+		sqe->len = HIDRAW_INGEST_REPORT_SIZE;
+		sqe->off = -1;
+		if (i + 1 < HIDRAW_INGEST_DEPTH)
+			sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = (uintptr_t)req;
+		ring_commit_sqe(ring);
+	}
+
+	device->inflight = HIDRAW_INGEST_DEPTH + 1;
+}
+
+/* Cancelling the poll cancels the reads linked to it */
+static void
+ring_queue_cancel(struct hidraw_ingest *ingest,
+		  struct hidraw_ingest_device *device)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!ring_space(ingest, 1)) {
+		device_retry_set(ingest, device);
+		return;
+	}
+
+	sqe = ring_get_sqe(ingest->ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)device | RING_POLL_TAG;
+	/* Cancel completions carry no read */
+	sqe->user_data = 0;
+	ring_commit_sqe(ingest->ring);
+}
+
+static void
+device_release(struct hidraw_ingest *ingest,
+	       struct hidraw_ingest_device *device)
+{
+	struct hidraw_ingest_device **link;
+
+	for (link = &ingest->dead; *link; link = &(*link)->next_dead) {
+		if (*link == device) {
+			*link = device->next_dead;
+			break;
+		}
+	}
+
+	if (device->retry)
+		ingest->ring->retries--;
+
+	free(device);
+}
+
+static void
+ring_retry(struct hidraw_ingest *ingest,
+	   struct hidraw_ingest_device *device)
+{
+	if (!device->retry)
+		return;
+
+	device->retry = 0;
+	ingest->ring->retries--;
+
+	if (device->dead)
+		ring_queue_cancel(ingest, device);
+	else
+		ring_queue_chain(ingest, device);
+}
+
+static void
+ring_retry_all(struct hidraw_ingest *ingest)
+{
+	struct hidraw_ingest_device *device;
+	size_t i;
+
+	for (i = 0; i < ingest->device_count && ingest->ring->retries; i++)
+		if (ingest->devices[i])
+			ring_retry(ingest, ingest->devices[i]);
+
+	for (device = ingest->dead; device && ingest->ring->retries;
+	     device = device->next_dead)
+		ring_retry(ingest, device);
+}
+
+static void
+ring_complete(struct hidraw_ingest *ingest, uint64_t user_data,
+	      int res, uint64_t timestamp)
+{
+	struct hidraw_ingest_device *device;
+	struct hidraw_ingest_read *req = NULL;
+
+	if (user_data & RING_POLL_TAG) {
+		device = (void *)(uintptr_t)(user_data & ~RING_POLL_TAG);
+	} else {
+		req = (void *)(uintptr_t)user_data;
+		device = req->device;
+	}
+
+	if (!device->dead && req) {
+		if (res > 0) {
+			ingest->stats.reports++;
+			ingest->handler->report(ingest->opaque, device->slot,
+						req->buffer, res, timestamp);
+		} else if (res != -EAGAIN && res != -EINTR
+			   && res != -ECANCELED) {
+			/* This removes the device */
+			ingest->handler->error(ingest->opaque, device->slot,
+					       res ? -res : ENODEV);
+		}
+	}
+
+	/* Chain stays accounted until here, so device cannot vanish */
+	device->inflight--;
+	if (device->inflight)
+		return;
+
+	if (device->dead)
+		device_release(ingest, device);
+	else
+		ring_queue_chain(ingest, device);
+}
+
+/* Handles all completions posted so far */
+static void
+ring_reap(struct hidraw_ingest *ingest)
+{
+	struct hidraw_ingest_ring *ring = ingest->ring;
+	unsigned int head, tail;
+	uint64_t now;
+
+	head = *ring->cq_head;
+	do {
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		/* Completions reaped together share a timestamp */
+		now = ingest_now();
+
+		for (; head != tail; head++) {
+			const struct io_uring_cqe *cqe =
+				&ring->cqes[head & *ring->cq_mask];
+			uint64_t user_data = cqe->user_data;
+			int res = cqe->res;
+
+			/* Free the entry before completion may queue reads */
+			__atomic_store_n(ring->cq_head, head + 1,
+					 __ATOMIC_RELEASE);
+
+			if (user_data)
+				ring_complete(ingest, user_data, res, now);
+		}
+	} while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE));
+}
+
+static void
+ring_cb(struct ela_event_source *source, int fd,
+	uint32_t mask, void *data)
+{
+	struct hidraw_ingest *ingest = data;
+	struct hidraw_ingest_ring *ring = ingest->ring;
+	uint64_t count;
+
+	ingest->stats.wakeups++;
+
+	if (read(ring->event_fd, &count, sizeof (count)) > 0)
+		ingest->stats.syscalls++;
+
+	ring_reap(ingest);
+
+	if (ingest->handler->flush)
+		ingest->handler->flush(ingest->opaque);
+
+	/* All chains requeued by this batch go in a single syscall */
+	ring_submit(ingest);
+
+	if (ring->retries) {
+		ring_retry_all(ingest);
+		ring_submit(ingest);
+	}
+}
+
+static int
+ring_init(struct hidraw_ingest *ingest)
+{
+	struct hidraw_ingest_ring *ring;
+	int err;
+
+	ring = calloc(1, sizeof (*ring));
+	if (!ring)
+		return ENOMEM;
+
+	err = ring_setup(ring, HIDRAW_INGEST_RING_ENTRIES);
+	if (err)
+		goto free;
+
+	ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->event_fd < 0) {
+		err = errno;
+		goto teardown;
+	}
+
+	if (syscall(__NR_io_uring_register, ring->fd,
+		    IORING_REGISTER_EVENTFD, &ring->event_fd, 1)) {
+		err = errno;
+		goto close_event;
+	}
+
+	if (ela_source_alloc(ingest->el, ring_cb, ingest, &ring->source)) {
+		err = ENOMEM;
+		goto close_event;
+	}
+
+	ela_set_fd(ingest->el, ring->source, ring->event_fd,
+		   ELA_EVENT_READABLE);
+	ela_add(ingest->el, ring->source);
+
+	ingest->ring = ring;
+	return 0;
+
+close_event:
+	close(ring->event_fd);
+teardown:
+	ring_teardown(ring);
+free:
+	free(ring);
+	return err;
+}
+
+/*
+ * Closing the ring would cancel pending requests, but reads running
+ * on io-wq may still complete into buffers after it returns.  All
+ * chains are cancelled and waited for instead.
+ */
+static void
+ring_drain(struct hidraw_ingest *ingest)
+{
+	struct hidraw_ingest_ring *ring = ingest->ring;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < ingest->device_count; i++)
+		hidraw_ingest_remove(ingest, i);
+
+	while (ingest->dead) {
+		ring_retry_all(ingest);
+
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending,
+			      1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR && errno != EBUSY)
+			break;
+		if (ret > 0)
+			ring->sq_pending -= ret;
+
+		ring_reap(ingest);
+	}
+}
+
+static void
+ring_deinit(struct hidraw_ingest *ingest)
+{
+	struct hidraw_ingest_ring *ring = ingest->ring;
+
+	ring_drain(ingest);
+
+	ela_remove(ingest->el, ring->source);
+	ela_source_free(ingest->el, ring->source);
+	close(ring->event_fd);
+	ring_teardown(ring);
+	free(ring);
+}
+
+/*
+ * Common
+ */
+
+int
+hidraw_ingest_init(struct hidraw_ingest *ingest, struct ela_el *el,
+		   enum hidraw_ingest_backend backend,
+		   const struct hidraw_ingest_handler *handler,
+		   void *opaque, size_t device_count)
+{
+	int err;
+
+	memset(ingest, 0, sizeof (*ingest));
+
+	ingest->el = el;
+	ingest->backend = backend;
+	ingest->handler = handler;
+	ingest->opaque = opaque;
+	ingest->device_count = device_count;
+
+	ingest->devices = calloc(device_count, sizeof (*ingest->devices));
+	if (!ingest->devices)
+		return ENOMEM;
+
+	if (backend == HIDRAW_INGEST_URING) {
+		err = ring_init(ingest);
+		if (err) {
+			free(ingest->devices);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+int
+hidraw_ingest_add(struct hidraw_ingest *ingest, size_t slot, int fd)
+{
+	struct hidraw_ingest_device *device;
+	int flags;
+	size_t i;
+
+	if (slot >= ingest->device_count || ingest->devices[slot])
+		return EINVAL;
+
+	device = calloc(1, sizeof (*device));
+	if (!device)
+		return ENOMEM;
+
+	device->ingest = ingest;
+	device->slot = slot;
+	device->fd = fd;
+
+	/* Both backends read until EAGAIN */
+	flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+	if (ingest->backend == HIDRAW_INGEST_READ) {
+		if (ela_source_alloc(ingest->el, read_cb, device,
+				     &device->source)) {
+			free(device);
+			return ENOMEM;
+		}
+		ela_set_fd(ingest->el, device->source, fd, ELA_EVENT_READABLE);
+		ela_add(ingest->el, device->source);
+	} else {
+		for (i = 0; i < HIDRAW_INGEST_DEPTH; i++)
+			device->reads[i].device = device;
+		ring_queue_chain(ingest, device);
+		ring_submit(ingest);
+	}
+
+	ingest->devices[slot] = device;
+
+	return 0;
+}
+
+void
+hidraw_ingest_remove(struct hidraw_ingest *ingest, size_t slot)
+{
+	struct hidraw_ingest_device *device;
+
+	if (slot >= ingest->device_count || !ingest->devices[slot])
+		return;
+
+	device = ingest->devices[slot];
+	ingest->devices[slot] = NULL;
+
+	if (ingest->backend == HIDRAW_INGEST_READ) {
+		ela_remove(ingest->el, device->source);
+		ela_source_free(ingest->el, device->source);
+		free(device);
+		return;
+	}
+
+	device->dead = 1;
+	if (!device->inflight) {
+		device_release(ingest, device);
+		return;
+	}
+
+	/* Buffers are released when the last read completes */
+	device->next_dead = ingest->dead;
+	ingest->dead = device;
+	if (device->retry) {
+		/* Nothing to cancel, waiting for a chain */
+		ingest->ring->retries--;
+		device->retry = 0;
+	}
+	ring_queue_cancel(ingest, device);
+	ring_submit(ingest);
+}
+
+void
+hidraw_ingest_deinit(struct hidraw_ingest *ingest)
+{
+	size_t i;
+
+	if (ingest->backend == HIDRAW_INGEST_URING)
+		ring_deinit(ingest);
+
+	while (ingest->dead) {
+		struct hidraw_ingest_device *device = ingest->dead;
+
+		ingest->dead = device->next_dead;
+		free(device);
+	}
+
+	for (i = 0; i < ingest->device_count; i++) {
+		if (!ingest->devices[i])
+			continue;
+		if (ingest->backend == HIDRAW_INGEST_READ) {
+			ela_remove(ingest->el, ingest->devices[i]->source);
+			ela_source_free(ingest->el, ingest->devices[i]->source);
+		}
+		free(ingest->devices[i]);
+	}
+
+	free(ingest->devices);
+}
@@ -0,0 +1,88 @@
+#ifndef HIDRAW_INGEST_H_
+#define HIDRAW_INGEST_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <ela/ela.h>
+
+/*
+ * Report ingestion from a set of hidraw file descriptors.
+ *
+ * The read loop backend issues one read() per report on each readable
+ * device.  The io_uring backend keeps a poll on every device, linked
+ * to HIDRAW_INGEST_DEPTH non-blocking reads, reaps completions in
+ * batches when the ring signals its eventfd, and resubmits all chains
+ * in one syscall.
+ *
+ * hidraw reads cannot be issued without blocking, io_uring runs them
+ * on its io-wq worker threads.  The poll keeps them from being issued
+ * before reports are there, but each read still costs a worker
+ * wakeup: syscall savings come with worker CPU time, see hidraw_bench
+ * -u for figures on real hidraw nodes.
+ */
+
+#define HIDRAW_INGEST_DEPTH 4
+#define HIDRAW_INGEST_REPORT_SIZE 512
+
+enum hidraw_ingest_backend {
+	HIDRAW_INGEST_READ,
+	HIDRAW_INGEST_URING,
+};
+
+/*
+ * Called for every report read.  timestamp is the read completion
+ * time, CLOCK_MONOTONIC in ns.
+ */
+typedef void hidraw_ingest_report_func_t(void *opaque, size_t slot,
+					 const uint8_t *data, size_t size,
+					 uint64_t timestamp);
+
+/* Called when a device fails, it should be removed */
+typedef void hidraw_ingest_error_func_t(void *opaque, size_t slot,
+					int err);
+
+/* Called once all reports of a batch are delivered */
+typedef void hidraw_ingest_flush_func_t(void *opaque);
+
+struct hidraw_ingest_handler {
+	hidraw_ingest_report_func_t *report;
+	hidraw_ingest_error_func_t *error;
+	hidraw_ingest_flush_func_t *flush;
+};
+
+struct hidraw_ingest_stats {
+	uint64_t reports;
+	uint64_t syscalls;
+	uint64_t wakeups;
+};
+
+struct hidraw_ingest_device;
+struct hidraw_ingest_ring;
+
+struct hidraw_ingest {
+	struct ela_el *el;
+	enum hidraw_ingest_backend backend;
+	const struct hidraw_ingest_handler *handler;
+	void *opaque;
+	struct hidraw_ingest_device **devices;
+	size_t device_count;
+	/* Removed devices with reads still in flight */
+	struct hidraw_ingest_device *dead;
+	struct hidraw_ingest_ring *ring;
+	struct hidraw_ingest_stats stats;
+};
+
+int hidraw_ingest_init(struct hidraw_ingest *ingest, struct ela_el *el,
+		       enum hidraw_ingest_backend backend,
+		       const struct hidraw_ingest_handler *handler,
+		       void *opaque, size_t device_count);
+
+/* Starts reading fd as device slot.  fd stays owned by caller. */
+int hidraw_ingest_add(struct hidraw_ingest *ingest, size_t slot, int fd);
+
+/* Stops reading device slot.  fd may be closed on return. */
+void hidraw_ingest_remove(struct hidraw_ingest *ingest, size_t slot);
+
+void hidraw_ingest_deinit(struct hidraw_ingest *ingest);
+
+#endif
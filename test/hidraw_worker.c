@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <linux/hidraw.h>
+
+#include "hidraw_worker.h"
+
+static void
+request_run(struct hidraw_request *request)
+{
+	int ret;
+
+	switch (request->type) {
+	case HIDRAW_REQUEST_OUTPUT:
+		ret = write(request->fd, request->data, request->size);
+		break;
+	case HIDRAW_REQUEST_SET_FEATURE:
+		ret = ioctl(request->fd, HIDIOCSFEATURE(request->size),
+			    request->data);
+		break;
+	case HIDRAW_REQUEST_GET_FEATURE:
+		ret = ioctl(request->fd, HIDIOCGFEATURE(request->size),
+			    request->data);
+		break;
+	default:
+		ret = -1;
+		errno = EINVAL;
+		break;
+	}
+
+	request->result = ret < 0 ? -errno : ret;
+
+	close(request->fd);
+	request->fd = -1;
+}
+
+static void *
+worker_thread(void *opaque)
+{
+	struct hidraw_worker *worker = opaque;
+	struct hidraw_request *request;
+	uint64_t one = 1;
+	ssize_t ret;
+
+	pthread_mutex_lock(&worker->lock);
+
+	while (1) {
+		while (!worker->pending && !worker->stop)
+			pthread_cond_wait(&worker->cond, &worker->lock);
+
+		if (!worker->pending)
+			break;
+
+		request = worker->pending;
+		worker->pending = request->next;
+		if (!worker->pending)
+			worker->pending_tail = &worker->pending;
+
+		pthread_mutex_unlock(&worker->lock);
+		request_run(request);
+		pthread_mutex_lock(&worker->lock);
+
+		request->next = NULL;
+		*worker->completed_tail = request;
+		worker->completed_tail = &request->next;
+
+		/* Only fails on counter overflow, loop is woken anyway */
+		ret = write(worker->event_fd, &one, sizeof (one));
+		(void)ret;
+	}
+
+	pthread_mutex_unlock(&worker->lock);
+
+	return NULL;
+}
+
+static void
+worker_cb(struct ela_event_source *source, int fd,
+	  uint32_t mask, void *data)
+{
+	struct hidraw_worker *worker = data;
+	struct hidraw_request *request, *next;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof (count)) < 0)
+		return;
+
+	pthread_mutex_lock(&worker->lock);
+	request = worker->completed;
+	worker->completed = NULL;
+	worker->completed_tail = &worker->completed;
+	pthread_mutex_unlock(&worker->lock);
+
+	for (; request; request = next) {
+		next = request->next;
+		worker->done(worker->opaque, request);
+		free(request);
+	}
+}
+
+int
+hidraw_worker_init(struct hidraw_worker *worker, struct ela_el *el,
+		   hidraw_worker_done_func_t *done, void *opaque)
+{
+	int err;
+
+	memset(worker, 0, sizeof (*worker));
+	worker->el = el;
+	worker->done = done;
+	worker->opaque = opaque;
+	worker->pending_tail = &worker->pending;
+	worker->completed_tail = &worker->completed;
+
+	worker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker->event_fd < 0)
+		return errno;
+
+	if (ela_source_alloc(el, worker_cb, worker, &worker->source)) {
+		err = ENOMEM;
+		goto close_event;
+	}
+
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->cond, NULL);
+
+	err = pthread_create(&worker->thread, NULL, worker_thread, worker);
+	if (err)
+		goto free_source;
+
+	ela_set_fd(el, worker->source, worker->event_fd, ELA_EVENT_READABLE);
+	ela_add(el, worker->source);
+
+	return 0;
+
+free_source:
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->lock);
+	ela_source_free(el, worker->source);
+close_event:
+	close(worker->event_fd);
+	return err;
+}
+
+int
+hidraw_worker_submit(struct hidraw_worker *worker,
+		     enum hidraw_request_type type,
+		     size_t slot, unsigned int generation, int fd,
+		     uint8_t report_id, const void *data, size_t size)
+{
+	struct hidraw_request *request;
+
+	/* Room for the report id prefix */
+	if (size + 1 > HIDRAW_REQUEST_SIZE)
+		return EMSGSIZE;
+
+	request = malloc(sizeof (*request));
+	if (!request)
+		return ENOMEM;
+
+	request->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (request->fd < 0) {
+		free(request);
+		return errno;
+	}
+
+	request->next = NULL;
+	request->type = type;
+	request->slot = slot;
+	request->generation = generation;
+	request->result = 0;
+	request->size = size + 1;
+	request->data[0] = report_id;
+	if (type == HIDRAW_REQUEST_GET_FEATURE)
+		memset(request->data + 1, 0, size);
+	else
+		memcpy(request->data + 1, data, size);
+
+	pthread_mutex_lock(&worker->lock);
+	*worker->pending_tail = request;
+	worker->pending_tail = &request->next;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+
+	return 0;
+}
+
+void
+hidraw_worker_deinit(struct hidraw_worker *worker)
+{
+	struct hidraw_request *request, *next;
+
+	pthread_mutex_lock(&worker->lock);
+	worker->stop = 1;
+	/* Do not wait for requests not started yet */
+	request = worker->pending;
+	worker->pending = NULL;
+	worker->pending_tail = &worker->pending;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+
+	pthread_join(worker->thread, NULL);
+
+	for (; request; request = next) {
+		next = request->next;
+		close(request->fd);
+		free(request);
+	}
+
+	for (request = worker->completed; request; request = next) {
+		next = request->next;
+		free(request);
+	}
+
+	ela_remove(worker->el, worker->source);
+	ela_source_free(worker->el, worker->source);
+	close(worker->event_fd);
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->lock);
+}
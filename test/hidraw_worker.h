@@ -0,0 +1,76 @@
+#ifndef HIDRAW_WORKER_H_
+#define HIDRAW_WORKER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <ela/ela.h>
+
+/*
+ * Blocking hidraw operations, run on a worker thread.
+ *
+ * hidraw write() and feature ioctls wait for the device to complete
+ * the transfer, whatever O_NONBLOCK says.  Requests are queued here,
+ * executed in order by a worker thread, and handed back to the event
+ * loop thread once done.
+ */
+
+#define HIDRAW_REQUEST_SIZE 512
+
+enum hidraw_request_type {
+	HIDRAW_REQUEST_OUTPUT,
+	HIDRAW_REQUEST_SET_FEATURE,
+	HIDRAW_REQUEST_GET_FEATURE,
+};
+
+struct hidraw_request {
+	struct hidraw_request *next;
+	enum hidraw_request_type type;
+	size_t slot;
+	unsigned int generation;
+	/* Private copy of device fd, closed once done */
+	int fd;
+	/* Transferred size, or negative errno */
+	int result;
+	/* data[0] is report id, 0 for unnumbered devices */
+	size_t size;
+	uint8_t data[HIDRAW_REQUEST_SIZE];
+};
+
+/* Called in event loop thread, request is freed on return */
+typedef void hidraw_worker_done_func_t(void *opaque,
+				       const struct hidraw_request *request);
+
+struct hidraw_worker {
+	struct ela_el *el;
+	hidraw_worker_done_func_t *done;
+	void *opaque;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+	struct hidraw_request *pending;
+	struct hidraw_request **pending_tail;
+	struct hidraw_request *completed;
+	struct hidraw_request **completed_tail;
+
+	int event_fd;
+	struct ela_event_source *source;
+};
+
+int hidraw_worker_init(struct hidraw_worker *worker, struct ela_el *el,
+		       hidraw_worker_done_func_t *done, void *opaque);
+
+/*
+ * Queues a request on device fd.  For feature get, data is ignored
+ * and size is the maximum report size expected.
+ */
+int hidraw_worker_submit(struct hidraw_worker *worker,
+			 enum hidraw_request_type type,
+			 size_t slot, unsigned int generation, int fd,
+			 uint8_t report_id, const void *data, size_t size);
+
+void hidraw_worker_deinit(struct hidraw_worker *worker);
+
+#endif
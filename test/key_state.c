@@ -0,0 +1,131 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#include <string.h>
+
+#include "key_state.h"
+
+/* Wheel resolution, well below the hold time */
+#define KEY_STATE_TICK 1000000
+
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - __builtin_offsetof(type, member)))
+
+static void report_release(struct key_state_report *r)
+{
+    timer_wheel_del(&r->release);
+    timer_wheel_del(&r->repeat);
+
+    if (!r->usage)
+        return;
+
+    r->owner->send(r->owner->opaque, r->report_id, 0);
+    r->usage = 0;
+}
+
+static void release_cb(struct timer_wheel_timer *timer, uint64_t now)
+{
+    report_release(container_of(timer, struct key_state_report, release));
+}
+
+static void repeat_cb(struct timer_wheel_timer *timer, uint64_t now)
+{
+    struct key_state_report *r = container_of(timer, struct key_state_report, repeat);
+    struct key_state *ks = r->owner;
+
+    /* Released in the same wakeup */
+    if (!r->usage)
+        return;
+
+    ks->send(ks->opaque, r->report_id, 0);
+    ks->send(ks->opaque, r->report_id, r->usage);
+
+    /* Keep period regardless of wakeup lateness */
+    timer_wheel_add(&ks->wheel, &r->repeat, timer->deadline + ks->repeat);
+}
+
+int key_state_init(
+    struct key_state *ks,
+    struct ela_el *el,
+    uint64_t hold, uint64_t repeat,
+    key_state_send_func_t *send, void *opaque)
+{
+    memset(ks, 0, sizeof(*ks));
+
+    ks->hold = hold;
+    ks->repeat = repeat;
+    ks->send = send;
+    ks->opaque = opaque;
+
+    return timer_wheel_init(&ks->wheel, el, KEY_STATE_TICK);
+}
+
+void key_state_deinit(struct key_state *ks)
+{
+    key_state_release_all(ks);
+    timer_wheel_deinit(&ks->wheel);
+}
+
+int key_state_report_add(
+    struct key_state *ks,
+    uint8_t report_id,
+    enum key_state_mode mode)
+{
+    struct key_state_report *r;
+
+    if (ks->report_count == KEY_STATE_REPORT_MAX)
+        return -1;
+
+    r = &ks->reports[ks->report_count];
+    r->owner = ks;
+    r->mode = mode;
+    r->report_id = report_id;
+    r->usage = 0;
+    timer_wheel_timer_init(&r->release, release_cb);
+    timer_wheel_timer_init(&r->repeat, repeat_cb);
+
+    return ks->report_count++;
+}
+
+void key_state_press(struct key_state *ks, size_t report, uint32_t usage)
+{
+    struct key_state_report *r;
+    uint64_t now = timer_wheel_now();
+    size_t i;
+
+    if (report >= ks->report_count || !usage)
+        return;
+
+    r = &ks->reports[report];
+
+    /* Repeat of the key already down */
+    if (r->usage == usage && r->mode != KEY_STATE_PULSE) {
+        timer_wheel_add(&ks->wheel, &r->release, now + ks->hold);
+        if (r->mode == KEY_STATE_REPEAT && !timer_wheel_pending(&r->repeat))
+            timer_wheel_add(&ks->wheel, &r->repeat, now + ks->repeat);
+        return;
+    }
+
+    for (i = 0; i < ks->report_count; ++i)
+        report_release(&ks->reports[i]);
+
+    ks->send(ks->opaque, r->report_id, usage);
+    r->usage = usage;
+    timer_wheel_add(&ks->wheel, &r->release, now + ks->hold);
+}
+
+void key_state_release_all(struct key_state *ks)
+{
+    size_t i;
+
+    for (i = 0; i < ks->report_count; ++i)
+        report_release(&ks->reports[i]);
+}
@@ -0,0 +1,90 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#ifndef KEY_STATE_H_
+#define KEY_STATE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <ela/ela.h>
+
+#include "timer_wheel.h"
+
+/*
+  Press and release tracking for single-usage reports.
+
+  Terminals only give key presses, possibly repeated.  Each press is
+  turned into a press report and a release report scheduled on the
+  timer wheel.  Only one key is down at a time, pressing a key
+  releases the others first.
+ */
+
+enum key_state_mode
+{
+    /* Every press is reported, for text */
+    KEY_STATE_PULSE,
+    /* Repeated presses keep the key down, host repeats by itself */
+    KEY_STATE_HOLD,
+    /* Repeated presses keep the key down, and it is pressed again
+       every repeat period */
+    KEY_STATE_REPEAT,
+};
+
+/* Report usage, 0 is a release */
+typedef void key_state_send_func_t(void *opaque, uint8_t report_id, uint32_t usage);
+
+#define KEY_STATE_REPORT_MAX 8
+
+struct key_state;
+
+struct key_state_report
+{
+    struct key_state *owner;
+    struct timer_wheel_timer release;
+    struct timer_wheel_timer repeat;
+    enum key_state_mode mode;
+    uint8_t report_id;
+    /* Usage down, 0 when released */
+    uint32_t usage;
+};
+
+struct key_state
+{
+    struct timer_wheel wheel;
+    key_state_send_func_t *send;
+    void *opaque;
+    /* Time a key stays down after its last press, in ns */
+    uint64_t hold;
+    /* Time between presses generated in repeat mode, in ns */
+    uint64_t repeat;
+    struct key_state_report reports[KEY_STATE_REPORT_MAX];
+    size_t report_count;
+};
+
+int key_state_init(
+    struct key_state *ks,
+    struct ela_el *el,
+    uint64_t hold, uint64_t repeat,
+    key_state_send_func_t *send, void *opaque);
+
+void key_state_deinit(struct key_state *ks);
+
+/* Returns report index, or -1 when full */
+int key_state_report_add(
+    struct key_state *ks,
+    uint8_t report_id,
+    enum key_state_mode mode);
+
+void key_state_press(struct key_state *ks, size_t report, uint32_t usage);
+
+void key_state_release_all(struct key_state *ks);
+
+#endif
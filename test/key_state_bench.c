@@ -0,0 +1,390 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Key timer accuracy benchmark.
+
+  Simulates keys pressed with terminal autorepeat: each repeat
+  postpones the release, which eventually expires.  The same schedule
+  runs on the timer wheel and on per-key libela timeouts removed and
+  re-added on every postpone, as remote used to.  Busy threads can be
+  added to load the machine.  Expiry lateness is reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <ela/ela.h>
+
+#include "timer_wheel.h"
+
+#define HOLD_NS 100000000
+#define REPEAT_NS 33000000
+/* Lateness histogram, 10us buckets up to 100ms */
+#define BUCKET_NS 10000
+#define BUCKET_COUNT 10000
+
+enum mode
+{
+    MODE_WHEEL,
+    MODE_ELA,
+};
+
+struct bench;
+
+struct sim_key
+{
+    struct bench *b;
+    int pressed;
+    unsigned int repeats_left;
+    unsigned int seed;
+
+    struct timer_wheel_timer drive;
+    struct timer_wheel_timer release;
+
+    struct ela_event_source *drive_source;
+    struct ela_event_source *release_source;
+    uint64_t drive_deadline;
+    uint64_t release_deadline;
+};
+
+struct bench
+{
+    enum mode mode;
+    struct ela_el *el;
+    struct timer_wheel wheel;
+    struct ela_event_source *stop;
+    struct sim_key *keys;
+    size_t key_count;
+
+    uint64_t expired;
+    uint64_t late_sum;
+    uint64_t late_max;
+    uint64_t reschedules;
+    uint32_t histogram[BUCKET_COUNT];
+};
+
+static void late_record(struct bench *b, uint64_t deadline, uint64_t now)
+{
+    uint64_t late = now > deadline ? now - deadline : 0;
+    uint64_t bucket = late / BUCKET_NS;
+
+    b->expired++;
+    b->late_sum += late;
+    if (late > b->late_max)
+        b->late_max = late;
+    b->histogram[bucket < BUCKET_COUNT ? bucket : BUCKET_COUNT - 1]++;
+}
+
+static void ela_schedule(
+    struct bench *b,
+    struct ela_event_source *source,
+    uint64_t *deadline, uint64_t delay)
+{
+    struct timeval tv = {
+        .tv_sec = delay / 1000000000,
+        .tv_usec = delay % 1000000000 / 1000,
+    };
+
+    ela_remove(b->el, source);
+    *deadline = timer_wheel_now() + delay;
+    ela_set_timeout(b->el, source, &tv, ELA_EVENT_ONCE);
+    ela_add(b->el, source);
+}
+
+static void key_schedule_drive(struct sim_key *k, uint64_t delay)
+{
+    struct bench *b = k->b;
+
+    b->reschedules++;
+    if (b->mode == MODE_WHEEL)
+        timer_wheel_add(&b->wheel, &k->drive, timer_wheel_now() + delay);
+    else
+        ela_schedule(b, k->drive_source, &k->drive_deadline, delay);
+}
+
+static void key_schedule_release(struct sim_key *k)
+{
+    struct bench *b = k->b;
+
+    b->reschedules++;
+    if (b->mode == MODE_WHEEL)
+        timer_wheel_add(&b->wheel, &k->release, timer_wheel_now() + HOLD_NS);
+    else
+        ela_schedule(b, k->release_source, &k->release_deadline, HOLD_NS);
+}
+
+/* Press, or autorepeat while pressed */
+static void key_drive(struct sim_key *k)
+{
+    if (!k->pressed) {
+        k->pressed = 1;
+        k->repeats_left = rand_r(&k->seed) % 16;
+    } else if (k->repeats_left) {
+        k->repeats_left--;
+    } else {
+        return;
+    }
+
+    key_schedule_release(k);
+    if (k->repeats_left)
+        key_schedule_drive(k, REPEAT_NS);
+}
+
+/* Release, then wait a while before next press */
+static void key_release(struct sim_key *k)
+{
+    k->pressed = 0;
+    key_schedule_drive(k, (10 + rand_r(&k->seed) % 200) * 1000000ull);
+}
+
+static void wheel_drive_cb(struct timer_wheel_timer *timer, uint64_t now)
+{
+    struct sim_key *k = (void*)((char *)timer - __builtin_offsetof(struct sim_key, drive));
+
+    late_record(k->b, timer->deadline, now);
+    key_drive(k);
+}
+
+static void wheel_release_cb(struct timer_wheel_timer *timer, uint64_t now)
+{
+    struct sim_key *k = (void*)((char *)timer - __builtin_offsetof(struct sim_key, release));
+
+    late_record(k->b, timer->deadline, now);
+    key_release(k);
+}
+
+static
+void ela_drive_cb(
+    struct ela_event_source *source, int fd,
+    uint32_t mask, void *data)
+{
+    struct sim_key *k = data;
+
+    late_record(k->b, k->drive_deadline, timer_wheel_now());
+    key_drive(k);
+}
+
+static
+void ela_release_cb(
+    struct ela_event_source *source, int fd,
+    uint32_t mask, void *data)
+{
+    struct sim_key *k = data;
+
+    late_record(k->b, k->release_deadline, timer_wheel_now());
+    key_release(k);
+}
+
+static
+void stop_cb(
+    struct ela_event_source *source, int fd,
+    uint32_t mask, void *data)
+{
+    struct bench *b = data;
+
+    ela_exit(b->el);
+}
+
+static volatile int load_stop;
+
+static void *load_thread(void *opaque)
+{
+    volatile uint64_t x = 0;
+
+    while (!load_stop)
+        x++;
+
+    return NULL;
+}
+
+static uint64_t percentile(const struct bench *b, double p)
+{
+    uint64_t target = b->expired * p, sum = 0;
+    size_t i;
+
+    for (i = 0; i < BUCKET_COUNT; ++i) {
+        sum += b->histogram[i];
+        if (sum > target)
+            return i * BUCKET_NS;
+    }
+
+    return BUCKET_COUNT * BUCKET_NS;
+}
+
+static double cpu_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_run(struct bench *b, enum mode mode, unsigned int duration)
+{
+    struct timeval tv = { duration, 0 };
+    double cpu;
+    size_t i;
+    int err;
+
+    b->mode = mode;
+    b->expired = b->late_sum = b->late_max = b->reschedules = 0;
+    memset(b->histogram, 0, sizeof(b->histogram));
+
+    b->el = ela_create(NULL);
+    if (!b->el)
+        return ENOMEM;
+
+    if (mode == MODE_WHEEL) {
+        err = timer_wheel_init(&b->wheel, b->el, 1000000);
+        if (err)
+            goto close;
+    }
+
+    for (i = 0; i < b->key_count; ++i) {
+        struct sim_key *k = &b->keys[i];
+
+        memset(k, 0, sizeof(*k));
+        k->b = b;
+        k->seed = i + 1;
+        timer_wheel_timer_init(&k->drive, wheel_drive_cb);
+        timer_wheel_timer_init(&k->release, wheel_release_cb);
+
+        if (mode == MODE_ELA) {
+            ela_source_alloc(b->el, ela_drive_cb, k, &k->drive_source);
+            ela_source_alloc(b->el, ela_release_cb, k, &k->release_source);
+        }
+
+        key_schedule_drive(k, rand_r(&k->seed) % 100 * 1000000ull);
+    }
+
+    ela_source_alloc(b->el, stop_cb, b, &b->stop);
+    ela_set_timeout(b->el, b->stop, &tv, ELA_EVENT_ONCE);
+    ela_add(b->el, b->stop);
+
+    cpu = cpu_time();
+    ela_run(b->el);
+    cpu = cpu_time() - cpu;
+
+    printf("%-5s %6llu expiries, %7llu reschedules, late mean %6.1fus"
+           " p50 %5.0fus p99 %6.0fus max %7.1fus, cpu %.3fs",
+           mode == MODE_WHEEL ? "wheel" : "ela",
+           (unsigned long long)b->expired,
+           (unsigned long long)b->reschedules,
+           b->expired ? b->late_sum / 1e3 / b->expired : 0.0,
+           percentile(b, .5) / 1e3, percentile(b, .99) / 1e3,
+           b->late_max / 1e3, cpu);
+    if (mode == MODE_WHEEL)
+        printf(", %llu timerfd arms, %llu wakeups",
+               (unsigned long long)b->wheel.stats.arms,
+               (unsigned long long)b->wheel.stats.wakeups);
+    printf("\n");
+
+    ela_remove(b->el, b->stop);
+    ela_source_free(b->el, b->stop);
+
+    for (i = 0; i < b->key_count; ++i) {
+        struct sim_key *k = &b->keys[i];
+
+        if (mode == MODE_ELA) {
+            ela_remove(b->el, k->drive_source);
+            ela_remove(b->el, k->release_source);
+            ela_source_free(b->el, k->drive_source);
+            ela_source_free(b->el, k->release_source);
+        }
+    }
+
+    if (mode == MODE_WHEEL)
+        timer_wheel_deinit(&b->wheel);
+
+    err = 0;
+close:
+    ela_close(b->el);
+    return err;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-k keys] [-d seconds] [-l threads] [-m wheel|ela]\n"
+            "  -k  simulated keys (default 64)\n"
+            "  -d  duration per run (default 5)\n"
+            "  -l  busy threads loading the machine (default 0)\n"
+            "  -m  only run given implementation\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    static struct bench b;
+    unsigned int duration = 5, load = 0, i;
+    int run_wheel = 1, run_ela = 1;
+    pthread_t *threads;
+    int opt, err = 0;
+
+    b.key_count = 64;
+
+    while ((opt = getopt(argc, argv, "k:d:l:m:h")) != -1) {
+        switch (opt) {
+        case 'k':
+            b.key_count = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            duration = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            load = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            run_wheel = !strcmp(optarg, "wheel");
+            run_ela = !strcmp(optarg, "ela");
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!b.key_count || !duration) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    b.keys = calloc(b.key_count, sizeof(*b.keys));
+    threads = calloc(load + 1, sizeof(*threads));
+    if (!b.keys || !threads)
+        return 1;
+
+    for (i = 0; i < load; ++i)
+        pthread_create(&threads[i], NULL, load_thread, NULL);
+
+    if (run_wheel)
+        err = bench_run(&b, MODE_WHEEL, duration);
+    if (!err && run_ela)
+        err = bench_run(&b, MODE_ELA, duration);
+
+    load_stop = 1;
+    for (i = 0; i < load; ++i)
+        pthread_join(threads[i], NULL);
+
+    if (err)
+        fprintf(stderr, "benchmark failed: %s\n", strerror(err));
+
+    free(threads);
+    free(b.keys);
+    return !!err;
+}
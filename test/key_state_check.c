@@ -0,0 +1,100 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Key state check.
+
+  A key repeated in repeat mode with equal hold and repeat periods
+  gets its release and repeat timers due in the same wheel tick.  The
+  release must cancel the repeat, whatever order they expire in:
+  nothing may be sent once the key is released.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <ela/ela.h>
+
+#include "key_state.h"
+
+#define PERIOD_NS 50000000
+#define SEND_MAX 16
+
+struct check
+{
+    uint32_t usage[SEND_MAX];
+    size_t count;
+};
+
+static void check_send(void *opaque, uint8_t report_id, uint32_t usage)
+{
+    struct check *c = opaque;
+
+    if (c->count < SEND_MAX)
+        c->usage[c->count] = usage;
+    c->count++;
+}
+
+static
+void stop_cb(
+    struct ela_event_source *source, int fd,
+    uint32_t mask, void *data)
+{
+    ela_exit(data);
+}
+
+int main(void)
+{
+    /* Several periods, a repeat left running would show */
+    const struct timeval run = { 0, 6 * PERIOD_NS / 1000 };
+    struct ela_event_source *stop;
+    struct key_state ks;
+    struct check c = { { 0 }, 0 };
+    struct ela_el *el;
+    int report;
+
+    el = ela_create(NULL);
+    if (el == NULL
+        || key_state_init(&ks, el, PERIOD_NS, PERIOD_NS, check_send, &c)
+        || ela_source_alloc(el, stop_cb, el, &stop)) {
+        fprintf(stderr, "init failed\n");
+        return 1;
+    }
+
+    report = key_state_report_add(&ks, 3, KEY_STATE_REPEAT);
+
+    /* Second press arms repeat at the release deadline */
+    key_state_press(&ks, report, 0xe9);
+    key_state_press(&ks, report, 0xe9);
+
+    ela_set_timeout(el, stop, &run, ELA_EVENT_ONCE);
+    ela_add(el, stop);
+    ela_run(el);
+
+    ela_source_free(el, stop);
+    key_state_deinit(&ks);
+    ela_close(el);
+
+    /* Press, then release alone, or repeat and release */
+    if ((c.count != 2 && c.count != 4) || c.usage[c.count - 1]) {
+        size_t i;
+
+        fprintf(stderr, "FAIL: %zu reports sent:", c.count);
+        for (i = 0; i < c.count && i < SEND_MAX; ++i)
+            fprintf(stderr, " %x", c.usage[i]);
+        fprintf(stderr, "\n");
+        return 1;
+    }
+
+    printf("OK: %zu reports sent\n", c.count);
+    return 0;
+}
@@ -0,0 +1,691 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Synthetic load generator.
+
+  Spawns a number of virtual remotes or mice, each one being a full
+  foils_hid client with its own connection, all sharing a single
+  event loop.  Reports are generated at a configurable per-device
+  rate, and aggregate rate, CPU and memory usage are printed every
+  second.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <ela/ela.h>
+#include <foils/hid.h>
+#include <foils/hid_device.h>
+
+static const uint8_t unicode_report_descriptor[] = {
+    0x05, 0x01,         /*  Usage Page (Desktop),               */
+    0x09, 0x06,         /*  Usage (Keyboard),                   */
+
+    0xA1, 0x01,         /*  Collection (Application),           */
+    0x85, 0x01,         /*      Report ID (1),                  */
+    0x05, 0x10,         /*      Usage Page (Unicode),           */
+    0x08,               /*      Usage (00h),                    */
+    0x95, 0x01,         /*      Report Count (1),               */
+    0x75, 0x20,         /*      Report Size (32),               */
+    0x14,               /*      Logical Minimum (0),            */
+    0x27, 0xFF, 0xFF, 0xFF,  /*      Logical Maximum (2**24-1), */
+    0x81, 0x62,         /*      Input (Variable, No pref state, No Null Pos),  */
+    0xC0,               /*  End Collection                      */
+
+    0xA1, 0x01,         /*  Collection (Application),           */
+    0x85, 0x02,         /*      Report ID (2),                  */
+    0x95, 0x01,         /*      Report Count (1),               */
+    0x75, 0x08,         /*      Report Size (8),                */
+    0x15, 0x00,         /*      Logical Minimum (0),            */
+    0x26, 0xFF, 0x00,   /*      Logical Maximum (255),          */
+    0x05, 0x07,         /*      Usage Page (Keyboard),          */
+    0x19, 0x00,         /*      Usage Minimum (None),           */
+    0x2A, 0xFF, 0x00,   /*      Usage Maximum (FFh),            */
+    0x80,               /*      Input,                          */
+    0xC0,               /*  End Collection                      */
+
+    0x05, 0x0C,         /* Usage Page (Consumer),               */
+    0x09, 0x01,         /* Usage (Consumer Control),            */
+    0xA1, 0x01,         /* Collection (Application),            */
+    0x85, 0x03,         /*  Report ID (3),                      */
+    0x95, 0x01,         /*  Report Count (1),                   */
+    0x75, 0x10,         /*  Report Size (16),                   */
+    0x19, 0x00,         /*  Usage Minimum (Consumer Control),   */
+    0x2A, 0xB0, 0x0F,   /*  Usage Maximum (AC Debug Overlay),   */
+    0x15, 0x00,         /*  Logical Minimum (0),                */
+    0x26, 0xB0, 0x0F,   /*  Logical Maximum (4016),             */
+    0x80,               /*  Input,                              */
+    0xC0,               /* End Collection,                      */
+};
+
+static const uint8_t mouse_report_descriptor[] = {
+    0x05, 0x01,                     /*  Usage Page (Desktop),           */
+    0x09, 0x02,                     /*  Usage (Mouse),                  */
+    0xA1, 0x01,                     /*  Collection (Application),       */
+    0x05, 0x09,                     /*      Usage Page (Button),        */
+    0x19, 0x01,                     /*      Usage Minimum (01h),        */
+    0x29, 0x03,                     /*      Usage Maximum (03h),        */
+    0x15, 0x00,                     /*      Logical Minimum (0),        */
+    0x25, 0x01,                     /*      Logical Maximum (1),        */
+    0x75, 0x01,                     /*      Report Size (1),            */
+    0x95, 0x03,                     /*      Report Count (3),           */
+    0x81, 0x02,                     /*      Input (Variable),           */
+    0x75, 0x05,                     /*      Report Size (5),            */
+    0x95, 0x01,                     /*      Report Count (1),           */
+    0x81, 0x01,                     /*      Input (Constant),           */
+    0x05, 0x01,                     /*      Usage Page (Desktop),       */
+    0x09, 0x30,                     /*      Usage (X),                  */
+    0x09, 0x31,                     /*      Usage (Y),                  */
+    0x09, 0x38,                     /*      Usage (Wheel),              */
+    0x15, 0x81,                     /*      Logical Minimum (-127),     */
+    0x26, 0x80, 0x00,               /*      Logical Maximum (128),      */
+    0x75, 0x08,                     /*      Report Size (8),            */
+    0x95, 0x03,                     /*      Report Count (3),           */
+    0x81, 0x06,                     /*      Input (Variable, Relative), */
+    0xC0,                           /*  End Collection,                 */
+};
+
+struct mouse_report
+{
+    uint8_t buttons;
+    int8_t x;
+    int8_t y;
+    int8_t wheel;
+};
+
+static const
+struct foils_hid_device_descriptor remote_descriptors[] =
+{
+    { "Unicode", 0x0100,
+      (void*)unicode_report_descriptor, sizeof(unicode_report_descriptor),
+      NULL, 0, NULL, 0
+    },
+};
+
+static const
+struct foils_hid_device_descriptor mouse_descriptors[] =
+{
+    { "Mouse", 0x0100,
+      (void*)mouse_report_descriptor, sizeof(mouse_report_descriptor),
+      NULL, 0, NULL, 0
+    },
+};
+
+enum vdev_kind
+{
+    VDEV_REMOTE,
+    VDEV_MOUSE,
+};
+
+/*
+  Remote key-press pattern.  Each step is a press, immediately
+  followed by a release on the next step.
+ */
+struct remote_key
+{
+    uint8_t report_id;
+    uint8_t size;
+    uint32_t usage;
+};
+
+static const struct remote_key remote_pattern[] =
+{
+    { 2, 1, 0x52 },             /* Up */
+    { 2, 1, 0x51 },             /* Down */
+    { 1, 4, 'a' },              /* Unicode */
+    { 3, 2, 0xe9 },             /* Vol+ */
+    { 2, 1, 0x50 },             /* Left */
+    { 2, 1, 0x4f },             /* Right */
+    { 1, 4, 'z' },              /* Unicode */
+    { 3, 2, 0xea },             /* Vol- */
+    { 2, 1, 0x28 },             /* Enter */
+};
+
+#define REMOTE_PATTERN_COUNT \
+    (sizeof(remote_pattern) / sizeof(remote_pattern[0]))
+
+struct vdev
+{
+    /* Must stay first, status callback casts the client back */
+    struct foils_hid client;
+    struct loadgen *lg;
+    double credit;
+    uint32_t step;
+    float theta;
+    uint8_t connected;
+    unsigned int acks;
+};
+
+struct loadgen
+{
+    struct ela_el *el;
+    struct ela_event_source *tick;
+    struct ela_event_source *report;
+    struct vdev *vdev;
+    size_t count;
+    enum vdev_kind kind;
+    double rate;
+    unsigned int limit;
+    unsigned int ack_window;
+    unsigned int reliable_percent;
+    unsigned int duration;
+    unsigned int seed;
+    int share;
+    struct foils_hid_desc_store store;
+
+    size_t connected;
+    uint64_t attempted;
+    uint64_t sent;
+    uint64_t reliable;
+    uint64_t held;
+    uint64_t acked;
+    uint64_t ack_failed;
+    uint64_t rtt_sum;
+    uint64_t rtt_max;
+
+    struct timespec last_tick;
+    struct timespec start;
+    struct timespec last_report;
+    struct rusage last_usage;
+    uint64_t last_sent;
+    long rss_base;
+};
+
+static
+double ts_diff(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+static
+double tv_sec(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static
+long rss_kb(void)
+{
+    long size, resident;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f == NULL)
+        return 0;
+
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static
+void status(
+    struct foils_hid *client,
+    enum foils_hid_state state)
+{
+    struct vdev *vd = (struct vdev *)client;
+    uint8_t connected = state == FOILS_HID_CONNECTED;
+
+    if (connected == vd->connected)
+        return;
+
+    vd->connected = connected;
+    if (connected)
+        vd->lg->connected++;
+    else
+        vd->lg->connected--;
+}
+
+static
+void feature_report(
+    struct foils_hid *client,
+    uint32_t device_id, uint8_t report_id,
+    const void *data, size_t datalen)
+{
+}
+
+static
+void output_report(
+    struct foils_hid *client,
+    uint32_t device_id, uint8_t report_id,
+    const void *data, size_t datalen)
+{
+}
+
+static
+void feature_report_sollicit(
+    struct foils_hid *client,
+    uint32_t device_id, uint8_t report_id)
+{
+}
+
+static
+int8_t motion_add(int8_t a, int8_t b)
+{
+    int sum = a + b;
+
+    return sum > 127 ? 127 : sum < -127 ? -127 : sum;
+}
+
+/* Mouse reports over rate limit add up their motion */
+static
+int merge(
+    struct foils_hid *client,
+    uint32_t device_id, uint8_t report_id,
+    void *pending, const void *data, size_t datalen)
+{
+    struct mouse_report *p = pending;
+    const struct mouse_report *r = data;
+
+    if (datalen != sizeof(*r) || p->buttons != r->buttons)
+        return 1;
+
+    p->x = motion_add(p->x, r->x);
+    p->y = motion_add(p->y, r->y);
+    p->wheel = motion_add(p->wheel, r->wheel);
+    return 0;
+}
+
+static
+void ack(
+    struct foils_hid *client,
+    uint32_t token, int status, uint64_t rtt)
+{
+    struct vdev *vd = (struct vdev *)client;
+    struct loadgen *lg = vd->lg;
+
+    vd->acks--;
+
+    if (status) {
+        lg->ack_failed++;
+        return;
+    }
+
+    lg->acked++;
+    lg->rtt_sum += rtt;
+    if (rtt > lg->rtt_max)
+        lg->rtt_max = rtt;
+}
+
+static const struct foils_hid_handler handler =
+{
+    .status = status,
+    .feature_report = feature_report,
+    .output_report = output_report,
+    .feature_report_sollicit = feature_report_sollicit,
+    .merge = merge,
+    .ack = ack,
+};
+
+static
+int pick_reliable(struct loadgen *lg)
+{
+    if (lg->reliable_percent >= 100)
+        return 1;
+    if (lg->reliable_percent == 0)
+        return 0;
+    return (unsigned int)(rand_r(&lg->seed) % 100) < lg->reliable_percent;
+}
+
+static
+void vdev_step(struct loadgen *lg, struct vdev *vd)
+{
+    int reliable = pick_reliable(lg);
+    uint64_t submitted;
+    uint32_t token;
+
+    lg->attempted++;
+
+    /* Wait for acknowledgements before sending more reliably */
+    if (reliable && lg->ack_window && vd->acks >= lg->ack_window) {
+        lg->held++;
+        return;
+    }
+
+    submitted = foils_hid_stats_get(&vd->client)->input_reports;
+
+    if (lg->kind == VDEV_REMOTE) {
+        const struct remote_key *key =
+            &remote_pattern[(vd->step / 2) % REMOTE_PATTERN_COUNT];
+        uint32_t usage = vd->step & 1 ? 0 : key->usage;
+        uint8_t buf[4];
+
+        /* Reports are little-endian, as in test/remote.c */
+        buf[0] = usage;
+        buf[1] = usage >> 8;
+        buf[2] = usage >> 16;
+        buf[3] = usage >> 24;
+
+        foils_hid_input_report_send(&vd->client, 0, key->report_id,
+                                    reliable, buf, key->size);
+    } else {
+        struct mouse_report report;
+
+        vd->theta += M_PI / 16.f;
+        report.buttons = 0;
+        report.x = cosf(vd->theta) * 32.;
+        report.y = sinf(vd->theta) * 16.;
+        report.wheel = 0;
+
+        foils_hid_input_report_send(&vd->client, 0, 0,
+                                    reliable, &report, sizeof(report));
+    }
+
+    vd->step++;
+
+    /* Not counted by the client when not connected or not grabbed,
+       then it was dropped */
+    if (foils_hid_stats_get(&vd->client)->input_reports == submitted)
+        return;
+
+    lg->sent++;
+    if (!reliable)
+        return;
+
+    lg->reliable++;
+    if (lg->ack_window && !foils_hid_ack_request(&vd->client, &token))
+        vd->acks++;
+}
+
+static
+void tick_cb(
+    struct ela_event_source *source, int fd,
+    uint32_t mask, void *data)
+{
+    struct loadgen *lg = data;
+    struct timespec now;
+    double credit;
+    size_t i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    credit = ts_diff(&now, &lg->last_tick) * lg->rate;
+    lg->last_tick = now;
+
+    for (i = 0; i < lg->count; ++i) {
+        struct vdev *vd = &lg->vdev[i];
+
+        vd->credit += credit;
+        while (vd->credit >= 1.) {
+            vd->credit -= 1.;
+            vdev_step(lg, vd);
+        }
+    }
+}
+
+static
+void report_cb(
+    struct ela_event_source *source, int fd,
+    uint32_t mask, void *data)
+{
+    struct loadgen *lg = data;
+    struct timespec now;
+    struct rusage usage;
+    double wall, cpu;
+    long rss;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &usage);
+
+    wall = ts_diff(&now, &lg->last_report);
+    cpu = tv_sec(&usage.ru_utime) - tv_sec(&lg->last_usage.ru_utime)
+        + tv_sec(&usage.ru_stime) - tv_sec(&lg->last_usage.ru_stime);
+    rss = rss_kb() - lg->rss_base;
+
+    printf("%6.1fs: %zu/%zu connected, %.0f reports/s"
+           " (requested %.0f), cpu %.1f%% (%.2f us/s/device),"
+           " mem %ld kB (%.0f B/device)\n",
+           ts_diff(&now, &lg->start),
+           lg->connected, lg->count,
+           (lg->sent - lg->last_sent) / wall,
+           lg->rate * lg->count,
+           100. * cpu / wall,
+           1e6 * cpu / wall / lg->count,
+           rss, 1024. * rss / lg->count);
+
+    if (lg->limit) {
+        uint64_t deferred = 0, merged = 0, dropped = 0;
+        size_t i;
+
+        for (i = 0; i < lg->count; ++i) {
+            const struct foils_hid_stats *st =
+                foils_hid_stats_get(&lg->vdev[i].client);
+
+            deferred += st->input_deferred;
+            merged += st->input_merged;
+            dropped += st->input_dropped;
+        }
+
+        printf("        over limit: %llu deferred, %llu merged,"
+               " %llu dropped\n",
+               (unsigned long long)deferred, (unsigned long long)merged,
+               (unsigned long long)dropped);
+    }
+
+    if (lg->ack_window) {
+        printf("        %.0f acks/s, rtt mean %.2f ms max %.2f ms,"
+               " %llu failed, %llu held by window\n",
+               lg->acked / wall,
+               lg->acked ? lg->rtt_sum / 1e6 / lg->acked : 0.,
+               lg->rtt_max / 1e6,
+               (unsigned long long)lg->ack_failed,
+               (unsigned long long)lg->held);
+        lg->acked = 0;
+        lg->rtt_sum = 0;
+        lg->rtt_max = 0;
+    }
+
+    lg->last_report = now;
+    lg->last_usage = usage;
+    lg->last_sent = lg->sent;
+
+    if (lg->duration && ts_diff(&now, &lg->start) >= lg->duration)
+        ela_exit(lg->el);
+}
+
+static
+void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] host port\n"
+            "  -n count     Virtual device count (default 100)\n"
+            "  -t type      Device type, remote or mouse (default remote)\n"
+            "  -r rate      Reports per second per device (default 10)\n"
+            "  -l rate      Reports per second limit per device\n"
+            "               (default none)\n"
+            "  -a count     Reliable reports waiting for delivery\n"
+            "               acknowledgement per device, at most\n"
+            "               (default none, no acknowledgement)\n"
+            "  -R percent   Reliable reports percentage\n"
+            "               (default 100 for remotes, 0 for mice)\n"
+            "  -s           Share device announce packets between\n"
+            "               devices\n"
+            "  -i ms        Generation tick period (default 1)\n"
+            "  -d seconds   Run duration, 0 is forever (default 0)\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    struct loadgen lg;
+    const struct foils_hid_device_descriptor *descriptors;
+    long tick_ms = 1;
+    int reliable_percent = -1;
+    size_t i;
+    int opt;
+    int err;
+
+    memset(&lg, 0, sizeof(lg));
+    lg.count = 100;
+    lg.kind = VDEV_REMOTE;
+    lg.rate = 10.;
+    lg.seed = getpid();
+
+    while ((opt = getopt(argc, argv, "n:t:r:l:a:R:si:d:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            lg.count = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            if (!strcmp(optarg, "remote"))
+                lg.kind = VDEV_REMOTE;
+            else if (!strcmp(optarg, "mouse"))
+                lg.kind = VDEV_MOUSE;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'r':
+            lg.rate = strtod(optarg, NULL);
+            break;
+        case 'l':
+            lg.limit = strtoul(optarg, NULL, 0);
+            break;
+        case 'a':
+            lg.ack_window = strtoul(optarg, NULL, 0);
+            break;
+        case 'R':
+            reliable_percent = atoi(optarg);
+            break;
+        case 's':
+            lg.share = 1;
+            break;
+        case 'i':
+            tick_ms = strtol(optarg, NULL, 0);
+            break;
+        case 'd':
+            lg.duration = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind < 2 || lg.count == 0 || tick_ms <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (reliable_percent < 0)
+        reliable_percent = lg.kind == VDEV_REMOTE ? 100 : 0;
+    lg.reliable_percent = reliable_percent;
+
+    descriptors = lg.kind == VDEV_REMOTE
+        ? remote_descriptors : mouse_descriptors;
+
+    lg.el = ela_create(NULL);
+    if (lg.el == NULL) {
+        fprintf(stderr, "Event loop creation failed\n");
+        return 1;
+    }
+
+    lg.rss_base = rss_kb();
+    foils_hid_desc_store_init(&lg.store);
+
+    lg.vdev = calloc(lg.count, sizeof(*lg.vdev));
+    if (lg.vdev == NULL) {
+        fprintf(stderr, "Cannot allocate %zu devices\n", lg.count);
+        return 1;
+    }
+
+    for (i = 0; i < lg.count; ++i) {
+        struct vdev *vd = &lg.vdev[i];
+
+        vd->lg = &lg;
+
+        err = foils_hid_init(&vd->client, lg.el, &handler, descriptors, 1);
+        if (err) {
+            fprintf(stderr, "Error creating client %zu: %s\n",
+                    i, strerror(err));
+            lg.count = i;
+            break;
+        }
+
+        if (lg.share)
+            foils_hid_desc_store_use(&vd->client, &lg.store);
+
+        /* Limits take per device state, only set them when asked
+           for, so that memory figures hold */
+        if (lg.limit) {
+            /* Bursts up to a tenth of a second */
+            err = foils_hid_rate_limit_set(&vd->client, 0, lg.limit,
+                                           lg.limit / 10 + 1);
+            if (!err && lg.kind == VDEV_MOUSE)
+                err = foils_hid_rate_policy_set(&vd->client, 0, 0,
+                                                FOILS_HID_RATE_MERGE);
+            if (err) {
+                fprintf(stderr, "Error limiting client %zu: %s\n",
+                        i, strerror(err));
+                foils_hid_deinit(&vd->client);
+                lg.count = i;
+                break;
+            }
+        }
+
+        foils_hid_client_connect_hostname(&vd->client, argv[optind],
+                                          atoi(argv[optind + 1]), 0);
+        foils_hid_device_enable(&vd->client, 0);
+    }
+
+    printf("%zu virtual %s, %.1f reports/s each, %u%% reliable\n",
+           lg.count, lg.kind == VDEV_REMOTE ? "remotes" : "mice",
+           lg.rate, lg.reliable_percent);
+
+    clock_gettime(CLOCK_MONOTONIC, &lg.start);
+    lg.last_tick = lg.start;
+    lg.last_report = lg.start;
+    getrusage(RUSAGE_SELF, &lg.last_usage);
+
+    const struct timeval tick_tv = {
+        tick_ms / 1000, (tick_ms % 1000) * 1000
+    };
+    ela_source_alloc(lg.el, tick_cb, &lg, &lg.tick);
+    ela_set_timeout(lg.el, lg.tick, &tick_tv, 0);
+    ela_add(lg.el, lg.tick);
+
+    const struct timeval report_tv = {1, 0};
+    ela_source_alloc(lg.el, report_cb, &lg, &lg.report);
+    ela_set_timeout(lg.el, lg.report, &report_tv, 0);
+    ela_add(lg.el, lg.report);
+
+    ela_run(lg.el);
+
+    printf("Total: %llu reports generated, %llu sent (%llu reliable)\n",
+           (unsigned long long)lg.attempted,
+           (unsigned long long)lg.sent,
+           (unsigned long long)lg.reliable);
+    if (lg.share)
+        printf("%zu shared announce packets for %zu devices\n",
+               foils_hid_desc_store_count(&lg.store), lg.count);
+
+    ela_remove(lg.el, lg.report);
+    ela_source_free(lg.el, lg.report);
+    ela_remove(lg.el, lg.tick);
+    ela_source_free(lg.el, lg.tick);
+
+    for (i = 0; i < lg.count; ++i)
+        foils_hid_deinit(&lg.vdev[i].client);
+    free(lg.vdev);
+    foils_hid_desc_store_deinit(&lg.store);
+
+    ela_close(lg.el);
+    return 0;
+}
@@ -12,6 +12,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/inotify.h>
 #include "mapping.h"
 #include "term_input.h"
 
@@ -116,9 +120,9 @@ char * const target_name[TERM_INPUT_COUNT] =
     [TERM_INPUT_LEFT] = "Left",
     [TERM_INPUT_RIGHT] = "Right",
     [TERM_INPUT_SHIFT_UP] = "Shift+Up",
-    [TERM_INPUT_SHIFT_DOWN] = "Shif+Down",
-    [TERM_INPUT_SHIFT_LEFT] = "Shif+Left",
-    [TERM_INPUT_SHIFT_RIGHT] = "Shif+Right",
+    [TERM_INPUT_SHIFT_DOWN] = "Shift+Down",
+    [TERM_INPUT_SHIFT_LEFT] = "Shift+Left",
+    [TERM_INPUT_SHIFT_RIGHT] = "Shift+Right",
     [TERM_INPUT_CTRL_UP] = "Ctrl+Up",
     [TERM_INPUT_CTRL_DOWN] = "Ctrl+Down",
     [TERM_INPUT_CTRL_LEFT] = "Ctrl+Left",
@@ -155,8 +159,9 @@ char * const target_name[TERM_INPUT_COUNT] =
     [TERM_INPUT_PAGE_DOWN] = "PageDown",
 };
 
+/* Mapping used when no file is given, and overridden by file entries */
 static const
-struct target_code targets[TERM_INPUT_COUNT] =
+struct target_code builtin_targets[TERM_INPUT_COUNT] =
 {
     [TERM_INPUT_CTRL('j')] = {TARGET_KEYBOARD, HID_KEYBOARD_ENTER, "Enter"},
     [TERM_INPUT_CTRL('m')] = {TARGET_KEYBOARD, HID_KEYBOARD_ENTER, "Enter"},
@@ -201,40 +206,387 @@ struct target_code targets[TERM_INPUT_COUNT] =
     [TERM_INPUT_PAGE_DOWN] = {TARGET_CONSUMER, HID_CONSUMER_CHANNEL_DECREMENT, "Chan-"},
 };
 
+/* Unicode code points below this one get their own table entry */
+#define MAPPING_UNICODE_COUNT 0x800
+
+/*
+  Compiled mapping: one entry per input code, with its display name
+  already formatted.  Lookups are plain indexing.
+ */
+struct keymap
+{
+    struct target_code keys[TERM_INPUT_COUNT];
+    struct target_code unicode[MAPPING_UNICODE_COUNT];
+};
+
+struct mapping_watch
+{
+    struct ela_el *el;
+    struct ela_event_source *source;
+    int fd;
+    char *dir;
+    const char *file;
+};
+
+/*
+  Current keymap.  Reloads happen in the event loop that also handles
+  input, so replacing the pointer is atomic with respect to lookups.
+ */
+static struct keymap *keymap;
+static struct mapping_watch watch = { .fd = -1 };
+
+static const char * const report_name[] =
+{
+    [TARGET_NONE] = "none",
+    [TARGET_UNICODE] = "unicode",
+    [TARGET_KEYBOARD] = "keyboard",
+    [TARGET_CONSUMER] = "consumer",
+    [TARGET_DESKTOP] = "desktop",
+};
+
+static size_t utf8_encode(char *out, uint32_t code)
+{
+    if (code < 0x0080) {
+        out[0] = code;
+        return 1;
+    } else if (code < 0x0800) {
+        out[0] = 0xc0 | (code >> 6);
+        out[1] = 0x80 | (code & 0x3f);
+        return 2;
+    } else if (code < 0x10000) {
+        out[0] = 0xe0 | (code >> 12);
+        out[1] = 0x80 | ((code >> 6) & 0x3f);
+        out[2] = 0x80 | ((code >> 0) & 0x3f);
+        return 3;
+    }
+
+    out[0] = 0xf0 | (code >> 18);
+    out[1] = 0x80 | ((code >> 12) & 0x3f);
+    out[2] = 0x80 | ((code >> 6) & 0x3f);
+    out[3] = 0x80 | ((code >> 0) & 0x3f);
+    return 4;
+}
+
+static struct keymap *keymap_builtin(void)
+{
+    struct keymap *map = calloc(1, sizeof(*map));
+    uint32_t code;
+
+    if (!map)
+        return NULL;
+
+    memcpy(map->keys, builtin_targets, sizeof(map->keys));
+
+    for (code = 0; code < MAPPING_UNICODE_COUNT; ++code) {
+        struct target_code *target = &map->unicode[code];
+
+        target->report = TARGET_UNICODE;
+        target->usage = code;
+        utf8_encode(target->name, code);
+    }
+
+    return map;
+}
+
+/* Parses a key name, a single character or U+XXXX */
+static bool key_parse(const char *key, bool *is_unicode, uint32_t *code)
+{
+    char utf8[4];
+    char *end;
+    uint32_t i;
+
+    for (i = 0; i < TERM_INPUT_COUNT; ++i) {
+        if (target_name[i] && !strcmp(target_name[i], key)) {
+            *is_unicode = false;
+            *code = i;
+            return true;
+        }
+    }
+
+    *is_unicode = true;
+
+    if (!strncmp(key, "U+", 2)) {
+        *code = strtoul(key + 2, &end, 16);
+        return !*end && end != key + 2;
+    }
+
+    for (i = 1; i < MAPPING_UNICODE_COUNT; ++i) {
+        size_t len = utf8_encode(utf8, i);
+
+        if (strlen(key) == len && !memcmp(key, utf8, len)) {
+            *code = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool report_parse(const char *name, enum target_code_type *report)
+{
+    uint32_t i;
+
+    for (i = 0; i < sizeof(report_name) / sizeof(report_name[0]); ++i) {
+        if (!strcmp(report_name[i], name)) {
+            *report = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+  Compiles a mapping file on top of the builtin mapping.  Each line is
+
+    <key> <none|unicode|keyboard|consumer|desktop> <usage> [name]
+
+  where key is a key name as listed by mapping_dump(), a character or
+  U+XXXX.  Empty lines and lines starting with '#' are ignored.
+ */
+static struct keymap *keymap_load(const char *path)
+{
+    struct keymap *map;
+    char line[256];
+    unsigned int lineno = 0;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return NULL;
+    }
+
+    map = keymap_builtin();
+    if (!map)
+        goto close;
+
+    while (fgets(line, sizeof(line), file)) {
+        char key[32], report[16], usage[16], name[sizeof(map->keys[0].name)];
+        struct target_code *target;
+        enum target_code_type type;
+        bool is_unicode;
+        uint32_t code;
+        char *end;
+        int fields;
+
+        lineno++;
+        name[0] = 0;
+        fields = sscanf(line, " %31s %15s %15s %31[^\n]", key, report, usage, name);
+
+        if (fields <= 0 || key[0] == '#')
+            continue;
+
+        if (fields < 3) {
+            fprintf(stderr, "%s:%u: expected key, report and usage\n", path, lineno);
+            goto fail;
+        }
+
+        if (!key_parse(key, &is_unicode, &code)
+            || (is_unicode && code >= MAPPING_UNICODE_COUNT)) {
+            fprintf(stderr, "%s:%u: unknown key '%s'\n", path, lineno, key);
+            goto fail;
+        }
+
+        if (!report_parse(report, &type)) {
+            fprintf(stderr, "%s:%u: unknown report '%s'\n", path, lineno, report);
+            goto fail;
+        }
+
+        target = is_unicode ? &map->unicode[code] : &map->keys[code];
+        target->report = type;
+        target->usage = strtoul(usage, &end, 0);
+        if (*end) {
+            fprintf(stderr, "%s:%u: bad usage '%s'\n", path, lineno, usage);
+            goto fail;
+        }
+
+        memset(target->name, 0, sizeof(target->name));
+        strncpy(target->name, name[0] ? name : key, sizeof(target->name) - 1);
+    }
+
+    fclose(file);
+    return map;
+
+fail:
+    free(map);
+close:
+    fclose(file);
+    return NULL;
+}
+
+static void keymap_set(struct keymap *map)
+{
+    struct keymap *old = keymap;
+
+    keymap = map;
+    free(old);
+}
+
+static void mapping_reload(void)
+{
+    char path[PATH_MAX];
+    struct keymap *map;
+
+    snprintf(path, sizeof(path), "%s/%s", watch.dir, watch.file);
+
+    map = keymap_load(path);
+    if (!map) {
+        fprintf(stderr, "Keeping previous mapping\n");
+        return;
+    }
+
+    keymap_set(map);
+    printf("Reloaded mapping from %s\n", path);
+}
+
+static
+void mapping_watch_cb(
+    struct ela_event_source *source, int fd,
+    uint32_t mask, void *data)
+{
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    bool changed = false;
+    ssize_t len;
+    char *ptr;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (ptr = buf; ptr < buf + len; ptr += sizeof(*event) + event->len) {
+            event = (const struct inotify_event *)ptr;
+
+            if (event->len && !strcmp(event->name, watch.file))
+                changed = true;
+        }
+    }
+
+    /* Editors save in several steps, reload once per wakeup */
+    if (changed)
+        mapping_reload();
+}
+
+/*
+  Watches the directory rather than the file, editors usually replace
+  the file by renaming a new one over it.  Creation is not watched: a
+  new file is still empty then, it is loaded once closed after
+  writing.
+ */
+static int mapping_watch_init(struct ela_el *el, const char *path)
+{
+    char *slash;
+    int err;
+
+    watch.dir = strdup(path);
+    if (!watch.dir)
+        return ENOMEM;
+
+    slash = strrchr(watch.dir, '/');
+    if (slash) {
+        *slash = 0;
+        watch.file = slash + 1;
+        if (!watch.dir[0])
+            strcpy(watch.dir, "/");
+    } else {
+        watch.file = path;
+        strcpy(watch.dir, ".");
+    }
+
+    watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch.fd < 0) {
+        err = errno;
+        goto free_dir;
+    }
+
+    if (inotify_add_watch(watch.fd, watch.dir,
+                          IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        err = errno;
+        goto close_fd;
+    }
+
+    watch.el = el;
+    ela_source_alloc(el, mapping_watch_cb, NULL, &watch.source);
+    ela_set_fd(el, watch.source, watch.fd, ELA_EVENT_READABLE);
+    ela_add(el, watch.source);
+
+    return 0;
+
+close_fd:
+    close(watch.fd);
+    watch.fd = -1;
+free_dir:
+    free(watch.dir);
+    watch.dir = NULL;
+    return err;
+}
+
+int mapping_init(struct ela_el *el, const char *path)
+{
+    struct keymap *map;
+    int err;
+
+    if (!path) {
+        map = keymap_builtin();
+        if (!map)
+            return ENOMEM;
+        keymap_set(map);
+        return 0;
+    }
+
+    map = keymap_load(path);
+    if (!map)
+        return EINVAL;
+    keymap_set(map);
+
+    err = mapping_watch_init(el, path);
+    if (err)
+        fprintf(stderr, "Cannot watch %s, no reload: %s\n", path, strerror(err));
+
+    return 0;
+}
+
+void mapping_deinit(void)
+{
+    if (watch.fd >= 0) {
+        ela_remove(watch.el, watch.source);
+        ela_source_free(watch.el, watch.source);
+        close(watch.fd);
+        watch.fd = -1;
+        free(watch.dir);
+        watch.dir = NULL;
+    }
+
+    keymap_set(NULL);
+}
+
 bool mapping_get(bool is_unicode, uint32_t code, struct target_code *out_target)
 {
-    if (!out_target)
-        return false;
+    const struct target_code *target;
 
-    memset(out_target, 0, sizeof (*out_target));
+    if (!out_target || !keymap)
+        return false;
 
     if (is_unicode) {
-        /* dumb utf-32 to utf-8 conversion */
-        if (code < 0x0080) {
-            out_target->name[0] = code;
-        } else if (code < 0x0800) {
-            out_target->name[0] = 0xc0 | (code >> 6);
-            out_target->name[1] = 0x80 | (code & 0x3f);
-        } else if (code < 0x10000) {
-            out_target->name[0] = 0xe0 | (code >> 12);
-            out_target->name[1] = 0x80 | ((code >> 6) & 0x3f);
-            out_target->name[2] = 0x80 | ((code >> 0) & 0x3f);
-        } else if (code < 0x200000) {
-            out_target->name[0] = 0xf0 | (code >> 18);
-            out_target->name[1] = 0x80 | ((code >> 12) & 0x3f);
-            out_target->name[2] = 0x80 | ((code >> 6) & 0x3f);
-            out_target->name[3] = 0x80 | ((code >> 0) & 0x3f);
-        } else {
+        if (code >= 0x200000)
             return false;
+
+        /* Past the table, code points are named after themselves */
+        if (code >= MAPPING_UNICODE_COUNT) {
+            memset(out_target, 0, sizeof (*out_target));
+            out_target->report = TARGET_UNICODE;
+            out_target->usage = code;
+            utf8_encode(out_target->name, code);
+            return true;
         }
-        out_target->report = TARGET_UNICODE;
-        out_target->usage = code;
+
+        target = &keymap->unicode[code];
     } else {
         if (code >= TERM_INPUT_COUNT)
             return false;
-        *out_target = targets[code];
+        target = &keymap->keys[code];
     }
 
+    *out_target = *target;
     return true;
 }
 
@@ -242,15 +594,26 @@ void mapping_dump()
 {
     uint32_t i;
 
+    if (!keymap)
+        return;
+
     printf("Input mapping:\n");
     for (i=0; i<TERM_INPUT_COUNT; ++i) {
         const char *name = target_name[i];
-        const struct target_code *code = &targets[i];
+        const struct target_code *code = &keymap->keys[i];
 
         if (code->report == TARGET_NONE)
             continue;
 
         printf("  %s: %s\n", name, code->name);
     }
-}
 
+    for (i=0; i<MAPPING_UNICODE_COUNT; ++i) {
+        const struct target_code *code = &keymap->unicode[i];
+
+        if (code->report == TARGET_UNICODE && code->usage == i)
+            continue;
+
+        printf("  U+%04X: %s\n", i, code->report == TARGET_NONE ? "(none)" : code->name);
+    }
+}
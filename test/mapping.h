@@ -32,6 +32,19 @@ struct target_code
     char name[32];
 };
 
+/*
+  Loads the mapping, builtin when path is NULL.  A mapping file is
+  watched, and reloaded whenever it changes.  Returns 0 when done, or
+  an error taken from errno(7).
+ */
+int mapping_init(struct ela_el *el, const char *path);
+void mapping_deinit(void);
+
+/*
+  Looks a code up in the current mapping.  Keys and code points below
+  U+0800 are plain table reads, code points past the table get their
+  name UTF-8 encoded on each lookup.
+ */
 bool mapping_get(bool is_unicode, uint32_t code,struct target_code *out_target);
 void mapping_dump_target(const struct target_code *target);
 void mapping_dump(void);
@@ -9,10 +9,28 @@
   See AUTHORS for details
  */
 
+/*
+  Mouse example, and pointer motion benchmark.
+
+  Circular motion reports are generated from a periodic timerfd at
+  a configurable rate, up to the 8 kHz of gaming mice.  Missed timer
+  periods are accounted as overruns, their motion is merged in the
+  next report.  Every second, achieved rate, wakeup jitter and CPU
+  time per report are printed.
+ */
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <math.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
 #include <ela/ela.h>
 #include <foils/hid.h>
 #include <foils/hid_device.h>
@@ -123,33 +141,258 @@ static const struct foils_hid_handler handler =
     .feature_report_sollicit = feature_report_sollicit,
 };
 
+/* Motion speed, as initially sent at 50 Hz */
+#define MOTION_RATE 50.f
+/* Wakeup jitter histogram, 1 us buckets up to 10 ms */
+#define JITTER_BUCKET_NS 1000
+#define JITTER_BUCKET_COUNT 10000
+
+struct mouse_stats
+{
+    uint64_t wakeups;
+    uint64_t reports;
+    /* Not sent, client not connected or report not grabbed */
+    uint64_t dropped;
+    uint64_t overruns;
+    uint64_t jitter_sum;
+    uint64_t jitter_max;
+    uint32_t jitter[JITTER_BUCKET_COUNT];
+};
+
 struct mouse_state
 {
     struct foils_hid *client;
+    struct ela_el *el;
     float theta;
+    /* Angle and motion scale of one report period */
+    float step;
+    float scale;
+    /* Sub-count motion left from previous reports */
+    float x_left;
+    float y_left;
+
+    int fd;
+    unsigned int rate;
+    uint64_t period;
+    uint64_t last_wakeup;
+
+    struct timespec start;
+    struct timespec last_print;
+    struct rusage last_usage;
+    unsigned int duration;
+
+    /* Since last print, and since start */
+    struct mouse_stats window;
+    struct mouse_stats total;
 };
 
-static
-void do_mouse_update(
-    struct ela_event_source *source, int fd, uint32_t mask, void *data)
+static uint64_t ts_ns(const struct timespec *ts)
 {
-    struct mouse_state *ms = data;
+    return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static double tv_sec(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static void stats_jitter(struct mouse_stats *st, uint64_t jitter)
+{
+    uint64_t bucket = jitter / JITTER_BUCKET_NS;
 
+    st->jitter_sum += jitter;
+    if (jitter > st->jitter_max)
+        st->jitter_max = jitter;
+    st->jitter[bucket < JITTER_BUCKET_COUNT
+               ? bucket : JITTER_BUCKET_COUNT - 1]++;
+}
+
+static double stats_percentile(const struct mouse_stats *st, double p)
+{
+    uint64_t count = 0, target, sum = 0;
+    size_t i;
+
+    for (i = 0; i < JITTER_BUCKET_COUNT; ++i)
+        count += st->jitter[i];
+    target = count * p;
+
+    for (i = 0; i < JITTER_BUCKET_COUNT; ++i) {
+        sum += st->jitter[i];
+        if (sum > target)
+            break;
+    }
+
+    return i * JITTER_BUCKET_NS / 1e3;
+}
+
+/* Returns whether the report was sent */
+static
+int mouse_report_send(struct mouse_state *ms, uint64_t periods)
+{
+    uint64_t submitted = foils_hid_stats_get(ms->client)->input_reports;
     /* anchor sending */
     float angle;
     /* anchor end */
+    float x, y;
 
-    ms->theta += M_PI/16.f;
+    ms->theta += ms->step * periods;
     angle = ms->theta;
 
+    /* Missed periods are merged, as a mouse sensor would */
+    x = ms->x_left + cosf(angle) * 32. * ms->scale * periods;
+    y = ms->y_left + sinf(angle) * 16. * ms->scale * periods;
+    x = fmaxf(-127.f, fminf(127.f, x));
+    y = fmaxf(-127.f, fminf(127.f, y));
+
     /* anchor sending */
     struct mouse_report report = {
-        .x = cosf(angle) * 32.,
-        .y = sinf(angle) * 16.,
+        .x = x,
+        .y = y,
     };
 
     foils_hid_input_report_send(ms->client, 0, 0, 0, &report, sizeof(report));
     /* anchor end */
+
+    ms->x_left = x - report.x;
+    ms->y_left = y - report.y;
+
+    return foils_hid_stats_get(ms->client)->input_reports != submitted;
+}
+
+static
+void do_mouse_update(
+    struct ela_event_source *source, int fd, uint32_t mask, void *data)
+{
+    struct mouse_state *ms = data;
+    struct timespec ts;
+    uint64_t expirations, now, interval;
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts_ns(&ts);
+
+    ms->window.wakeups++;
+    ms->window.overruns += expirations - 1;
+
+    /* Jitter is the distance of wakeup interval to period */
+    if (ms->last_wakeup) {
+        interval = now - ms->last_wakeup;
+        stats_jitter(&ms->window, interval > ms->period
+                     ? interval - ms->period : ms->period - interval);
+    }
+    ms->last_wakeup = now;
+
+    if (mouse_report_send(ms, expirations))
+        ms->window.reports++;
+    else
+        ms->window.dropped++;
+}
+
+static
+void stats_merge(struct mouse_stats *to, const struct mouse_stats *from)
+{
+    size_t i;
+
+    to->wakeups += from->wakeups;
+    to->reports += from->reports;
+    to->dropped += from->dropped;
+    to->overruns += from->overruns;
+    to->jitter_sum += from->jitter_sum;
+    if (from->jitter_max > to->jitter_max)
+        to->jitter_max = from->jitter_max;
+    for (i = 0; i < JITTER_BUCKET_COUNT; ++i)
+        to->jitter[i] += from->jitter[i];
+}
+
+static
+void stats_print(
+    const char *prefix,
+    const struct mouse_stats *st,
+    unsigned int rate, double wall, double cpu)
+{
+    uint64_t jitters = st->wakeups ? st->wakeups - 1 : 0;
+
+    printf("%s: %.0f reports/s (requested %u), %llu dropped, %llu overruns,"
+           " jitter mean %.1f us p99 %.0f us max %.1f us,"
+           " cpu %.1f%% (%.2f us/report)\n",
+           prefix,
+           st->reports / wall, rate,
+           (unsigned long long)st->dropped,
+           (unsigned long long)st->overruns,
+           jitters ? st->jitter_sum / 1e3 / jitters : 0.,
+           stats_percentile(st, .99),
+           st->jitter_max / 1e3,
+           100. * cpu / wall,
+           st->reports ? 1e6 * cpu / st->reports : 0.);
+}
+
+static
+void do_print(
+    struct ela_event_source *source, int fd, uint32_t mask, void *data)
+{
+    struct mouse_state *ms = data;
+    struct timespec now;
+    struct rusage usage;
+    double wall, cpu, elapsed;
+    char prefix[32];
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &usage);
+
+    wall = (ts_ns(&now) - ts_ns(&ms->last_print)) / 1e9;
+    cpu = tv_sec(&usage.ru_utime) - tv_sec(&ms->last_usage.ru_utime)
+        + tv_sec(&usage.ru_stime) - tv_sec(&ms->last_usage.ru_stime);
+    elapsed = (ts_ns(&now) - ts_ns(&ms->start)) / 1e9;
+
+    snprintf(prefix, sizeof(prefix), "%6.1fs", elapsed);
+    stats_print(prefix, &ms->window, ms->rate, wall, cpu);
+
+    stats_merge(&ms->total, &ms->window);
+    memset(&ms->window, 0, sizeof(ms->window));
+    ms->last_print = now;
+    ms->last_usage = usage;
+
+    if (ms->duration && elapsed >= ms->duration)
+        ela_exit(ms->el);
+}
+
+static
+int mouse_timer_start(struct mouse_state *ms)
+{
+    struct itimerspec its = {
+        .it_interval = {
+            .tv_sec = ms->period / 1000000000,
+            .tv_nsec = ms->period % 1000000000,
+        },
+    };
+
+    its.it_value = its.it_interval;
+
+    ms->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (ms->fd < 0)
+        return errno;
+
+    if (timerfd_settime(ms->fd, 0, &its, NULL)) {
+        close(ms->fd);
+        return errno;
+    }
+
+    return 0;
+}
+
+static
+void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] ip\n"
+            "  -p port      Server port (default 904)\n"
+            "  -r rate      Reports per second, 1 to 8000 (default 125)\n"
+            "  -d seconds   Run duration, 0 is forever (default 0)\n"
+            "  -k count     Previous reports sent along each one (default 0)\n"
+            "  -l percent   Packet loss of the link, picks -k for it\n",
+            name);
 }
 
 int main(int argc, char **argv)
@@ -159,8 +402,45 @@ int main(int argc, char **argv)
     /* anchor end */
     assert(el && "Event loop creation failed");
 
-    if ( argc < 2 ) {
-        fprintf(stderr, "Usage: %s ip\n", argv[0]);
+    struct mouse_state ms = {
+        .theta = 0.f,
+        .rate = 125,
+    };
+    struct rusage start_usage, end_usage;
+    struct timespec end;
+    uint16_t port = 904;
+    unsigned int redundancy = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:r:d:k:l:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'r':
+            ms.rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            ms.duration = strtoul(optarg, NULL, 0);
+            break;
+        case 'k':
+            redundancy = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            /* One report lost every 10000 at most */
+            redundancy = foils_hid_redundancy_for_loss(
+                strtod(optarg, NULL) / 100., 1e-4);
+            printf("Sending %u previous reports along each one\n",
+                   redundancy);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( argc - optind < 1 || ms.rate < 1 || ms.rate > 8000 ) {
+        usage(argv[0]);
         return 1;
     }
 
@@ -174,32 +454,66 @@ int main(int argc, char **argv)
     }
     /* anchor end */
 
-    struct mouse_state ms = {
-        .client = &client,
-        .theta = 0.f,
-    };
+    err = foils_hid_redundancy_set(&client, 0, redundancy);
+    if (err) {
+        fprintf(stderr, "Error setting redundancy: %s\n", strerror(err));
+        return 1;
+    }
 
-    struct ela_event_source *source;
+    ms.client = &client;
+    ms.el = el;
+    ms.period = 1000000000 / ms.rate;
+    ms.step = M_PI/16.f * MOTION_RATE / ms.rate;
+    ms.scale = MOTION_RATE / ms.rate;
+
+    err = mouse_timer_start(&ms);
+    if (err) {
+        fprintf(stderr, "Error creating timer: %s\n", strerror(err));
+        return 1;
+    }
+
+    struct ela_event_source *source, *print;
 
     ela_source_alloc(el, do_mouse_update, &ms, &source);
-    const struct timeval tv = {0, 20000};
-    ela_set_timeout(el, source, &tv, 0);
+    ela_set_fd(el, source, ms.fd, ELA_EVENT_READABLE);
     ela_add(el, source);
 
+    ela_source_alloc(el, do_print, &ms, &print);
+    const struct timeval tv = {1, 0};
+    ela_set_timeout(el, print, &tv, 0);
+    ela_add(el, print);
+
+    clock_gettime(CLOCK_MONOTONIC, &ms.start);
+    ms.last_print = ms.start;
+    getrusage(RUSAGE_SELF, &ms.last_usage);
+
     /* anchor client_connect */
-    foils_hid_client_connect_hostname(&client, argv[1], 904, 0);
+    foils_hid_client_connect_hostname(&client, argv[optind], port, 0);
     /* anchor end */
 
     /* anchor device_enable */
     foils_hid_device_enable(&client, 0);
     /* anchor end */
 
+    start_usage = ms.last_usage;
+
     /* anchor run */
     ela_run(el);
     /* anchor end */
 
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &end_usage);
+    stats_merge(&ms.total, &ms.window);
+    stats_print("total", &ms.total, ms.rate,
+                (ts_ns(&end) - ts_ns(&ms.start)) / 1e9,
+                tv_sec(&end_usage.ru_utime) - tv_sec(&start_usage.ru_utime)
+                + tv_sec(&end_usage.ru_stime) - tv_sec(&start_usage.ru_stime));
+
+    ela_remove(el, print);
+    ela_source_free(el, print);
     ela_remove(el, source);
     ela_source_free(el, source);
+    close(ms.fd);
 
     /* anchor cleanup */
     foils_hid_deinit(&client);
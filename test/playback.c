@@ -0,0 +1,745 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Report script player.
+
+  Plays a timestamped script of input reports against a server,
+  either at recorded pace, at a scaled pace, or as fast as possible,
+  and reports achieved rate and timing drift.
+
+  Script is either a capture file (see foils/capture.h), from which
+  input reports are played, or a text file with one report per line:
+
+    # time_ms device report_id reliable payload
+    0     0 2 1 52
+    100   0 2 1 00
+    120   1 0 0 00f8fc00
+
+  Payload is in hex.  Device 0 is the remote of test/remote.c, device
+  1 is the mouse of test/mouse.c.
+
+  Captures are played with the devices announced in them, they must
+  have been recorded from before connection.  Captures with input
+  reports of devices never announced, or with devices replaced while
+  recording, are refused.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ela/ela.h>
+#include <foils/hid.h>
+#include <foils/hid_device.h>
+#include <foils/capture.h>
+
+static const uint8_t unicode_report_descriptor[] = {
+    0x05, 0x01,         /*  Usage Page (Desktop),               */
+    0x09, 0x06,         /*  Usage (Keyboard),                   */
+
+    0xA1, 0x01,         /*  Collection (Application),           */
+    0x85, 0x01,         /*      Report ID (1),                  */
+    0x05, 0x10,         /*      Usage Page (Unicode),           */
+    0x08,               /*      Usage (00h),                    */
+    0x95, 0x01,         /*      Report Count (1),               */
+    0x75, 0x20,         /*      Report Size (32),               */
+    0x14,               /*      Logical Minimum (0),            */
+    0x27, 0xFF, 0xFF, 0xFF,  /*      Logical Maximum (2**24-1), */
+    0x81, 0x62,         /*      Input (Variable, No pref state, No Null Pos),  */
+    0xC0,               /*  End Collection                      */
+
+    0xA1, 0x01,         /*  Collection (Application),           */
+    0x85, 0x02,         /*      Report ID (2),                  */
+    0x95, 0x01,         /*      Report Count (1),               */
+    0x75, 0x08,         /*      Report Size (8),                */
+    0x15, 0x00,         /*      Logical Minimum (0),            */
+    0x26, 0xFF, 0x00,   /*      Logical Maximum (255),          */
+    0x05, 0x07,         /*      Usage Page (Keyboard),          */
+    0x19, 0x00,         /*      Usage Minimum (None),           */
+    0x2A, 0xFF, 0x00,   /*      Usage Maximum (FFh),            */
+    0x80,               /*      Input,                          */
+    0xC0,               /*  End Collection                      */
+
+    0x05, 0x0C,         /* Usage Page (Consumer),               */
+    0x09, 0x01,         /* Usage (Consumer Control),            */
+    0xA1, 0x01,         /* Collection (Application),            */
+    0x85, 0x03,         /*  Report ID (3),                      */
+    0x95, 0x01,         /*  Report Count (1),                   */
+    0x75, 0x10,         /*  Report Size (16),                   */
+    0x19, 0x00,         /*  Usage Minimum (Consumer Control),   */
+    0x2A, 0xB0, 0x0F,   /*  Usage Maximum (AC Debug Overlay),   */
+    0x15, 0x00,         /*  Logical Minimum (0),                */
+    0x26, 0xB0, 0x0F,   /*  Logical Maximum (4016),             */
+    0x80,               /*  Input,                              */
+    0xC0,               /* End Collection,                      */
+
+    0x05, 0x01,         /* Usage Page (Desktop),                */
+    0x0a, 0x80, 0x00,   /* Usage (System Control),              */
+    0xA1, 0x01,         /* Collection (Application),            */
+    0x85, 0x04,         /*  Report ID (4),                      */
+    0x75, 0x01,         /*  Report Size (1),                    */
+    0x95, 0x04,         /*  Report Count (4),                   */
+    0x1a, 0x81, 0x00,   /*  Usage Minimum (System Power Down),  */
+    0x2a, 0x84, 0x00,   /*  Usage Maximum (System Context menu),*/
+    0x81, 0x02,         /*  Input (Variable),                   */
+    0x75, 0x01,         /*  Report Size (1),                    */
+    0x95, 0x04,         /*  Report Count (4),                   */
+    0x81, 0x01,         /*  Input (Constant),                   */
+    0xC0,               /* End Collection,                      */
+};
+
+static const uint8_t mouse_report_descriptor[] = {
+    0x05, 0x01,                     /*  Usage Page (Desktop),           */
+    0x09, 0x02,                     /*  Usage (Mouse),                  */
+    0xA1, 0x01,                     /*  Collection (Application),       */
+    0x05, 0x09,                     /*      Usage Page (Button),        */
+    0x19, 0x01,                     /*      Usage Minimum (01h),        */
+    0x29, 0x03,                     /*      Usage Maximum (03h),        */
+    0x15, 0x00,                     /*      Logical Minimum (0),        */
+    0x25, 0x01,                     /*      Logical Maximum (1),        */
+    0x75, 0x01,                     /*      Report Size (1),            */
+    0x95, 0x03,                     /*      Report Count (3),           */
+    0x81, 0x02,                     /*      Input (Variable),           */
+    0x75, 0x05,                     /*      Report Size (5),            */
+    0x95, 0x01,                     /*      Report Count (1),           */
+    0x81, 0x01,                     /*      Input (Constant),           */
+    0x05, 0x01,                     /*      Usage Page (Desktop),       */
+    0x09, 0x30,                     /*      Usage (X),                  */
+    0x09, 0x31,                     /*      Usage (Y),                  */
+    0x09, 0x38,                     /*      Usage (Wheel),              */
+    0x15, 0x81,                     /*      Logical Minimum (-127),     */
+    0x26, 0x80, 0x00,               /*      Logical Maximum (128),      */
+    0x75, 0x08,                     /*      Report Size (8),            */
+    0x95, 0x03,                     /*      Report Count (3),           */
+    0x81, 0x06,                     /*      Input (Variable, Relative), */
+    0xC0,                           /*  End Collection,                 */
+};
+
+static const
+struct foils_hid_device_descriptor descriptors[] =
+{
+    { "Unicode", 0x0100,
+      (void*)unicode_report_descriptor, sizeof(unicode_report_descriptor),
+      NULL, 0, NULL, 0
+    },
+    { "Mouse", 0x0100,
+      (void*)mouse_report_descriptor, sizeof(mouse_report_descriptor),
+      NULL, 0, NULL, 0
+    },
+};
+
+#define DEVICE_COUNT (sizeof(descriptors) / sizeof(descriptors[0]))
+#define CAPTURE_DEVICE_MAX 64
+
+#define PAYLOAD_MAX 512
+#define FAST_BURST 256
+
+struct script_entry
+{
+    uint64_t time;              /* ns from script start */
+    uint32_t device_id;
+    uint8_t report_id;
+    uint8_t reliable;
+    const uint8_t *data;
+    size_t size;
+};
+
+struct script
+{
+    const uint8_t *map;
+    size_t size;
+    int binary;
+    /* Iteration */
+    const uint8_t *cursor;
+    const uint8_t *end;
+    uint64_t origin;
+    uint8_t payload[PAYLOAD_MAX];
+    /* Devices to announce */
+    const struct foils_hid_device_descriptor *device;
+    size_t device_count;
+    struct foils_hid_device_descriptor captured[CAPTURE_DEVICE_MAX];
+};
+
+struct player
+{
+    /* Must stay first, status callback casts the client back */
+    struct foils_hid client;
+    struct ela_el *el;
+    struct ela_event_source *timer;
+    struct script script;
+    double speed;
+    int fast;
+    int dedup;
+    long settle_ms;
+    int started;
+
+    struct script_entry next;
+    int has_next;
+    struct timespec start;
+
+    uint64_t played;
+    uint64_t skipped;
+    uint64_t dropped;
+    double drift_sum;
+    double drift_max;
+};
+
+static
+double ts_diff(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+/*
+  Takes devices from announces recorded in a capture, and checks
+  every input report has its device.
+ */
+static
+int capture_devices(struct script *s)
+{
+    const struct foils_hid_capture_header *header = (const void *)s->map;
+    const uint8_t *cursor = s->map + header->header_size;
+    uint8_t input[CAPTURE_DEVICE_MAX] = { 0 };
+    size_t i;
+
+    while (cursor + sizeof(struct foils_hid_capture_record) <= s->end) {
+        const struct foils_hid_capture_record *r = (const void *)cursor;
+        const uint8_t *payload = (const uint8_t *)(r + 1);
+        struct foils_hid_device_descriptor desc;
+        struct foils_hid_device_descriptor *known;
+        const uint8_t *name_end;
+        uint16_t version;
+
+        if (r->type == FOILS_HID_CAPTURE_NONE
+            || cursor + foils_hid_capture_record_size(r->size) > s->end)
+            break;
+        cursor += foils_hid_capture_record_size(r->size);
+
+        switch (r->type & FOILS_HID_CAPTURE_TYPE_MASK) {
+        case FOILS_HID_CAPTURE_INPUT:
+            if (r->device_id >= CAPTURE_DEVICE_MAX) {
+                fprintf(stderr, "Device %u out of range\n", r->device_id);
+                return EINVAL;
+            }
+            input[r->device_id] = 1;
+            continue;
+        case FOILS_HID_CAPTURE_DEVICE:
+            break;
+        default:
+            continue;
+        }
+
+        name_end = r->size > 2 ? memchr(payload + 2, 0, r->size - 2) : NULL;
+        if (name_end == NULL || r->device_id >= CAPTURE_DEVICE_MAX) {
+            fprintf(stderr, "Bad announce of device %u\n", r->device_id);
+            return EINVAL;
+        }
+
+        memcpy(&version, payload, 2);
+        memset(&desc, 0, sizeof(desc));
+        snprintf(desc.name, sizeof(desc.name), "%s",
+                 (const char *)payload + 2);
+        desc.version = version;
+        desc.descriptor = (void *)(name_end + 1);
+        desc.descriptor_size = payload + r->size - (name_end + 1);
+
+        /* Devices are announced again on each connection */
+        known = &s->captured[r->device_id];
+        if (known->descriptor
+            && (strcmp(known->name, desc.name)
+                || known->version != desc.version
+                || known->descriptor_size != desc.descriptor_size
+                || memcmp(known->descriptor, desc.descriptor,
+                          desc.descriptor_size))) {
+            fprintf(stderr, "Device %u replaced while recording\n",
+                    r->device_id);
+            return ENOTSUP;
+        }
+        *known = desc;
+
+        if (s->device_count <= r->device_id)
+            s->device_count = r->device_id + 1;
+    }
+
+    for (i = 0; i < CAPTURE_DEVICE_MAX; ++i) {
+        if (s->captured[i].descriptor)
+            continue;
+        /* Slot numbers must be kept, holes cannot be announced */
+        if (input[i] || i < s->device_count) {
+            fprintf(stderr, "Device %zu never announced, capture must"
+                    " be started before connection\n", i);
+            return ENOENT;
+        }
+    }
+
+    s->device = s->captured;
+    return 0;
+}
+
+static
+int script_open(struct script *s, const char *path)
+{
+    const struct foils_hid_capture_header *header;
+    struct stat st;
+    int fd, err;
+
+    memset(s, 0, sizeof(*s));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return errno;
+
+    if (fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return EINVAL;
+    }
+
+    s->size = st.st_size;
+    s->map = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (s->map == MAP_FAILED)
+        return errno;
+
+    madvise((void *)s->map, s->size, MADV_SEQUENTIAL);
+
+    header = (const void *)s->map;
+    if (s->size >= sizeof(*header)
+        && !memcmp(header->magic, FOILS_HID_CAPTURE_MAGIC,
+                   sizeof(FOILS_HID_CAPTURE_MAGIC))) {
+        if (header->version != FOILS_HID_CAPTURE_VERSION) {
+            munmap((void *)s->map, s->size);
+            return ENOTSUP;
+        }
+        s->binary = 1;
+        s->cursor = s->map + header->header_size;
+        s->end = s->cursor + header->used;
+        if (s->end > s->map + s->size)
+            s->end = s->map + s->size;
+
+        err = capture_devices(s);
+        if (err) {
+            munmap((void *)s->map, s->size);
+            return err;
+        }
+    } else {
+        s->cursor = s->map;
+        s->end = s->map + s->size;
+        s->device = descriptors;
+        s->device_count = DEVICE_COUNT;
+    }
+
+    return 0;
+}
+
+static
+void script_close(struct script *s)
+{
+    munmap((void *)s->map, s->size);
+}
+
+static
+int binary_next(struct script *s, struct script_entry *e)
+{
+    while (s->cursor + sizeof(struct foils_hid_capture_record) <= s->end) {
+        const struct foils_hid_capture_record *r = (const void *)s->cursor;
+        size_t size = foils_hid_capture_record_size(r->size);
+
+        if (r->type == FOILS_HID_CAPTURE_NONE
+            || s->cursor + size > s->end)
+            return 0;
+
+        s->cursor += size;
+
+        if ((r->type & FOILS_HID_CAPTURE_TYPE_MASK)
+            != FOILS_HID_CAPTURE_INPUT)
+            continue;
+
+        if (!s->origin)
+            s->origin = r->timestamp;
+
+        e->time = r->timestamp - s->origin;
+        e->device_id = r->device_id;
+        e->report_id = r->report_id;
+        e->reliable = !!(r->type & FOILS_HID_CAPTURE_RELIABLE);
+        e->data = (const uint8_t *)(r + 1);
+        e->size = r->size;
+        return 1;
+    }
+
+    return 0;
+}
+
+static
+int hex_value(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static
+const uint8_t *parse_uint(const uint8_t *p, const uint8_t *end,
+                          unsigned long long *value)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+
+    if (p == end || !isdigit(*p))
+        return NULL;
+
+    *value = 0;
+    while (p < end && isdigit(*p))
+        *value = *value * 10 + (*p++ - '0');
+
+    return p;
+}
+
+static
+int text_next(struct script *s, struct script_entry *e)
+{
+    while (s->cursor < s->end) {
+        const uint8_t *line = s->cursor;
+        const uint8_t *eol = memchr(line, '\n', s->end - line);
+        unsigned long long time, device, report, reliable;
+        const uint8_t *p;
+        size_t size = 0;
+
+        if (eol == NULL)
+            eol = s->end;
+        s->cursor = eol + 1;
+
+        p = parse_uint(line, eol, &time);
+        if (p)
+            p = parse_uint(p, eol, &device);
+        if (p)
+            p = parse_uint(p, eol, &report);
+        if (p)
+            p = parse_uint(p, eol, &reliable);
+        if (p == NULL)
+            continue;
+
+        while (p < eol && size < PAYLOAD_MAX) {
+            int hi, lo;
+
+            if (isspace(*p)) {
+                p++;
+                continue;
+            }
+
+            if (p + 1 >= eol
+                || (hi = hex_value(p[0])) < 0
+                || (lo = hex_value(p[1])) < 0)
+                break;
+
+            s->payload[size++] = (hi << 4) | lo;
+            p += 2;
+        }
+
+        e->time = time * 1000000ull;
+        e->device_id = device;
+        e->report_id = report;
+        e->reliable = !!reliable;
+        e->data = s->payload;
+        e->size = size;
+        return 1;
+    }
+
+    return 0;
+}
+
+static
+int script_next(struct script *s, struct script_entry *e)
+{
+    if (s->binary)
+        return binary_next(s, e);
+    return text_next(s, e);
+}
+
+static
+void player_done(struct player *p)
+{
+    /* Drift is measured on every entry, sent or not */
+    uint64_t entries = p->played + p->skipped + p->dropped;
+    struct timespec now;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = ts_diff(&now, &p->start);
+
+    printf("Played %llu reports in %.3fs (%.0f reports/s), %llu skipped,"
+           " %llu dropped\n",
+           (unsigned long long)p->played, elapsed,
+           elapsed > 0 ? p->played / elapsed : 0.,
+           (unsigned long long)p->skipped,
+           (unsigned long long)p->dropped);
+    if (!p->fast && entries)
+        printf("Drift: mean %.3f ms, max %.3f ms\n",
+               1e3 * p->drift_sum / entries, 1e3 * p->drift_max);
+    if (p->dedup) {
+        const struct foils_hid_stats *st = foils_hid_stats_get(&p->client);
+
+        printf("Duplicates: %llu of %llu reliable reports suppressed"
+               " (%.1f%%)\n",
+               (unsigned long long)st->input_duplicates,
+               (unsigned long long)st->input_reliable,
+               st->input_reliable
+               ? 100. * st->input_duplicates / st->input_reliable : 0.);
+    }
+
+    ela_exit(p->el);
+}
+
+static
+void player_send(struct player *p, const struct script_entry *e)
+{
+    const struct foils_hid_stats *st = foils_hid_stats_get(&p->client);
+    uint64_t submitted = st->input_reports;
+
+    if (e->device_id >= p->script.device_count) {
+        p->skipped++;
+        return;
+    }
+
+    foils_hid_input_report_send(&p->client, e->device_id, e->report_id,
+                                e->reliable, e->data, e->size);
+
+    /* Not counted by the client when not connected or not grabbed */
+    if (st->input_reports == submitted)
+        p->dropped++;
+    else
+        p->played++;
+}
+
+static
+void player_arm(struct player *p, double delay)
+{
+    struct timeval tv;
+
+    if (delay < 0)
+        delay = 0;
+
+    tv.tv_sec = delay;
+    tv.tv_usec = (delay - tv.tv_sec) * 1e6;
+
+    ela_set_timeout(p->el, p->timer, &tv, ELA_EVENT_ONCE);
+    ela_add(p->el, p->timer);
+}
+
+static
+void player_cb(
+    struct ela_event_source *source, int fd,
+    uint32_t mask, void *data)
+{
+    struct player *p = data;
+    struct timespec now;
+    double late = 0;
+    size_t burst = 0;
+
+    if (!p->started) {
+        p->started = 1;
+        p->has_next = script_next(&p->script, &p->next);
+        clock_gettime(CLOCK_MONOTONIC, &p->start);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    while (p->has_next) {
+        if (p->fast) {
+            if (burst++ == FAST_BURST) {
+                /* Let event loop breathe */
+                player_arm(p, 0);
+                return;
+            }
+        } else {
+            late = ts_diff(&now, &p->start) - p->next.time / 1e9 / p->speed;
+            if (late < 0) {
+                player_arm(p, -late);
+                return;
+            }
+        }
+
+        player_send(p, &p->next);
+
+        p->drift_sum += late;
+        if (late > p->drift_max)
+            p->drift_max = late;
+
+        p->has_next = script_next(&p->script, &p->next);
+    }
+
+    player_done(p);
+}
+
+static
+void status(
+    struct foils_hid *client,
+    enum foils_hid_state state)
+{
+    struct player *p = (struct player *)client;
+    const char *st = NULL;
+
+    switch (state) {
+    case FOILS_HID_IDLE:
+        st = "idle";
+        break;
+    case FOILS_HID_CONNECTING:
+        st = "connecting";
+        break;
+    case FOILS_HID_CONNECTED:
+        st = "connected";
+        break;
+    case FOILS_HID_RESOLVE_FAILED:
+        st = "resolve failed";
+        break;
+    case FOILS_HID_DROPPED:
+        st = "dropped";
+        break;
+    }
+
+    printf("Status: %s\n", st);
+
+    /* Give the server some time to grab reports */
+    if (state == FOILS_HID_CONNECTED && !p->started)
+        player_arm(p, p->settle_ms / 1e3);
+}
+
+static
+void feature_report(
+    struct foils_hid *client,
+    uint32_t device_id, uint8_t report_id,
+    const void *data, size_t datalen)
+{
+}
+
+static
+void output_report(
+    struct foils_hid *client,
+    uint32_t device_id, uint8_t report_id,
+    const void *data, size_t datalen)
+{
+}
+
+static
+void feature_report_sollicit(
+    struct foils_hid *client,
+    uint32_t device_id, uint8_t report_id)
+{
+}
+
+static const struct foils_hid_handler handler =
+{
+    .status = status,
+    .feature_report = feature_report,
+    .output_report = output_report,
+    .feature_report_sollicit = feature_report_sollicit,
+};
+
+static
+void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] script host port\n"
+            "  -s speed     Time scale, 2 plays twice as fast (default 1)\n"
+            "  -f           Play as fast as possible\n"
+            "  -d           Suppress duplicate reliable reports\n"
+            "  -w ms        Delay between connection and playback"
+            " (default 1000)\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    struct player p;
+    size_t i;
+    int opt;
+    int err;
+
+    memset(&p, 0, sizeof(p));
+    p.speed = 1.;
+    p.settle_ms = 1000;
+
+    while ((opt = getopt(argc, argv, "s:fdw:h")) != -1) {
+        switch (opt) {
+        case 's':
+            p.speed = strtod(optarg, NULL);
+            break;
+        case 'f':
+            p.fast = 1;
+            break;
+        case 'd':
+            p.dedup = 1;
+            break;
+        case 'w':
+            p.settle_ms = strtol(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind < 3 || p.speed <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    err = script_open(&p.script, argv[optind]);
+    if (err) {
+        fprintf(stderr, "Cannot open script %s: %s\n",
+                argv[optind], strerror(err));
+        return 1;
+    }
+
+    p.el = ela_create(NULL);
+    if (p.el == NULL) {
+        fprintf(stderr, "Event loop creation failed\n");
+        return 1;
+    }
+
+    err = foils_hid_init(&p.client, p.el, &handler,
+                         p.script.device, p.script.device_count);
+    if (err) {
+        fprintf(stderr, "Error creating client: %s\n", strerror(err));
+        return 1;
+    }
+
+    ela_source_alloc(p.el, player_cb, &p, &p.timer);
+
+    foils_hid_client_connect_hostname(&p.client, argv[optind + 1],
+                                      atoi(argv[optind + 2]), 0);
+    for (i = 0; i < p.script.device_count; ++i) {
+        if (p.dedup)
+            foils_hid_dedup_enable(&p.client, i);
+        foils_hid_device_enable(&p.client, i);
+    }
+
+    ela_run(p.el);
+
+    ela_remove(p.el, p.timer);
+    ela_source_free(p.el, p.timer);
+    foils_hid_deinit(&p.client);
+    ela_close(p.el);
+    script_close(&p.script);
+
+    return 0;
+}
@@ -0,0 +1,357 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Send scheduler benchmark.
+
+  Sends key events while text bursts and feature reports load the
+  link, and measures how long key events take to get through.  Link
+  is a FIFO draining at a given rate, standing for librudp queue and
+  the network.  Each link rate is run once with every packet sent
+  directly, once through the scheduler, and once through the
+  scheduler with a budget of 80% of the link rate.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <foils/send_sched.h>
+
+#define MS 1000000ULL
+
+/* IP, UDP and rudp headers */
+#define LINK_OVERHEAD 40
+
+enum kind
+{
+    KIND_KEY,
+    KIND_TEXT,
+    KIND_FEATURE,
+};
+
+/* Sizes as foils_hid sends them */
+#define KEY_SIZE (8 + 8)
+#define TEXT_BATCH_INTERVAL (2 * MS)
+
+struct latency
+{
+    uint64_t *sample;
+    size_t count;
+    size_t size;
+};
+
+struct link
+{
+    double ns_per_byte;
+    uint64_t free_at;
+    uint64_t now;
+    struct latency latency[3];
+    unsigned long long bytes;
+};
+
+struct load
+{
+    unsigned int text_chars;
+    uint64_t text_period;
+    size_t feature_size;
+    uint64_t feature_period;
+    uint64_t key_period;
+    uint64_t duration;
+};
+
+struct pace
+{
+    size_t budget;
+    uint64_t interval;
+    uint64_t hold;
+    uint64_t starve;
+};
+
+static void latency_add(struct latency *l, uint64_t value)
+{
+    if (l->count == l->size) {
+        l->size = l->size ? l->size * 2 : 1024;
+        l->sample = realloc(l->sample, l->size * sizeof(*l->sample));
+        if (l->sample == NULL)
+            abort();
+    }
+
+    l->sample[l->count++] = value;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void latency_print(struct latency *l)
+{
+    unsigned long long sum = 0;
+    size_t i;
+
+    if (!l->count) {
+        printf(" %7s %7s %7s", "-", "-", "-");
+        return;
+    }
+
+    qsort(l->sample, l->count, sizeof(*l->sample), u64_cmp);
+    for (i = 0; i < l->count; ++i)
+        sum += l->sample[i];
+
+    printf(" %7.2f %7.2f %7.2f",
+           (double)sum / l->count / MS,
+           (double)l->sample[l->count * 99 / 100] / MS,
+           (double)l->sample[l->count - 1] / MS);
+}
+
+/* Packets carry their kind and creation time */
+static void link_send(
+    void *opaque, int reliable, int command,
+    const void *data, size_t size)
+{
+    struct link *link = opaque;
+    uint64_t created, start;
+
+    memcpy(&created, data, sizeof(created));
+
+    start = link->free_at > link->now ? link->free_at : link->now;
+    link->free_at = start
+        + (uint64_t)((size + LINK_OVERHEAD) * link->ns_per_byte);
+    link->bytes += size + LINK_OVERHEAD;
+
+    latency_add(&link->latency[command], link->free_at - created);
+}
+
+static void packet_send(
+    struct foils_hid_sched *sched, struct link *link,
+    enum kind kind, size_t size)
+{
+    uint8_t packet[size];
+
+    memset(packet, 0, size);
+    memcpy(packet, &link->now, sizeof(link->now));
+
+    foils_hid_sched_send(
+        sched, link->now,
+        kind == KIND_KEY ? FOILS_HID_PRIORITY_INTERACTIVE
+        : kind == KIND_TEXT ? FOILS_HID_PRIORITY_BULK
+        : FOILS_HID_PRIORITY_BACKGROUND,
+        kind, 1, kind, packet, size);
+}
+
+static uint64_t min(uint64_t a, uint64_t b)
+{
+    return a < b ? a : b;
+}
+
+static void run(
+    struct link *link, const struct load *load,
+    double mbps, const struct pace *pace)
+{
+    struct foils_hid_sched sched;
+    uint64_t next_key = 0, next_burst = 0, next_batch = UINT64_MAX;
+    uint64_t next_feature = 0, next_run, jitter;
+    unsigned int seed = 1;
+    size_t text_left = 0, reports;
+
+    memset(link, 0, sizeof(*link));
+    link->ns_per_byte = 8000. / mbps;
+
+    foils_hid_sched_init(&sched, link_send, link);
+    foils_hid_sched_pace_set(&sched, pace->budget, pace->interval,
+                             pace->hold, pace->starve);
+
+    while (link->now < load->duration) {
+        if (link->now == next_key) {
+            /* Press and release */
+            packet_send(&sched, link, KIND_KEY, KEY_SIZE);
+            packet_send(&sched, link, KIND_KEY, KEY_SIZE);
+            jitter = rand_r(&seed) % load->key_period;
+            next_key += load->key_period / 2 + jitter;
+        }
+
+        if (load->text_chars && link->now == next_burst) {
+            text_left += load->text_chars * 2;
+            next_batch = link->now;
+            next_burst += load->text_period;
+        }
+
+        if (link->now == next_batch) {
+            reports = text_left < 128 ? text_left : 128;
+            packet_send(&sched, link, KIND_TEXT, 12 + reports * 4);
+            text_left -= reports;
+            next_batch = text_left ? link->now + TEXT_BATCH_INTERVAL
+                : UINT64_MAX;
+        }
+
+        if (load->feature_size && link->now == next_feature) {
+            packet_send(&sched, link, KIND_FEATURE, load->feature_size);
+            next_feature += load->feature_period;
+        }
+
+        next_run = foils_hid_sched_run(&sched, link->now);
+
+        link->now = min(next_key, next_batch);
+        if (load->text_chars)
+            link->now = min(link->now, next_burst);
+        if (load->feature_size)
+            link->now = min(link->now, next_feature);
+        if (next_run)
+            link->now = min(link->now, next_run);
+    }
+
+    foils_hid_sched_clear(&sched);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [options] [link Mbit/s...]\n"
+            "  -t  characters per text burst (default 1000, 0 for none)\n"
+            "  -p  text burst period, in ms (default 200)\n"
+            "  -f  feature report size (default 1024, 0 for none)\n"
+            "  -F  feature report period, in ms (default 5)\n"
+            "  -k  mean key event period, in ms (default 50)\n"
+            "  -d  simulated duration, in s (default 60)\n"
+            "  -B  scheduler budget, in bytes per interval (default %d)\n"
+            "  -I  scheduler interval, in us (default %d)\n"
+            "  -H  scheduler hold, in us (default %d)\n"
+            "  -S  scheduler starvation delay, in us (default %d)\n",
+            name, FOILS_HID_SCHED_BUDGET, FOILS_HID_SCHED_INTERVAL / 1000,
+            FOILS_HID_SCHED_HOLD / 1000, FOILS_HID_SCHED_STARVE / 1000);
+}
+
+int main(int argc, char **argv)
+{
+    static const double default_rates[] = { 2, 5, 10, 20 };
+    struct load load = {
+        .text_chars = 1000,
+        .text_period = 200 * MS,
+        .feature_size = 1024,
+        .feature_period = 5 * MS,
+        .key_period = 50 * MS,
+        .duration = 60000 * MS,
+    };
+    struct pace direct = { 0 };
+    struct pace sched = {
+        .budget = FOILS_HID_SCHED_BUDGET,
+        .interval = FOILS_HID_SCHED_INTERVAL,
+        .hold = FOILS_HID_SCHED_HOLD,
+        .starve = FOILS_HID_SCHED_STARVE,
+    };
+    static const char *const mode[] = { "direct", "sched", "fit" };
+    struct pace fit;
+    const struct pace *pace[] = { &direct, &sched, &fit };
+    size_t rate_count, r, k;
+    struct link link;
+    double mbps;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:p:f:F:k:d:B:I:H:S:h")) != -1) {
+        switch (opt) {
+        case 't':
+            load.text_chars = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            load.text_period = strtoull(optarg, NULL, 0) * MS;
+            break;
+        case 'f':
+            load.feature_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'F':
+            load.feature_period = strtoull(optarg, NULL, 0) * MS;
+            break;
+        case 'k':
+            load.key_period = strtoull(optarg, NULL, 0) * MS;
+            break;
+        case 'd':
+            load.duration = strtoull(optarg, NULL, 0) * 1000 * MS;
+            break;
+        case 'B':
+            sched.budget = strtoul(optarg, NULL, 0);
+            break;
+        case 'I':
+            sched.interval = strtoull(optarg, NULL, 0) * 1000;
+            break;
+        case 'H':
+            sched.hold = strtoull(optarg, NULL, 0) * 1000;
+            break;
+        case 'S':
+            sched.starve = strtoull(optarg, NULL, 0) * 1000;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (load.key_period < 2 || !load.text_period || !load.feature_period
+        || (load.feature_size && load.feature_size < 8) || !sched.interval) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    rate_count = optind < argc ? (size_t)(argc - optind)
+        : sizeof(default_rates) / sizeof(default_rates[0]);
+
+    printf("text: %u chars every %llu ms, feature: %zu bytes every %llu ms,"
+           " key every %llu ms\n",
+           load.text_chars, (unsigned long long)(load.text_period / MS),
+           load.feature_size, (unsigned long long)(load.feature_period / MS),
+           (unsigned long long)(load.key_period / MS));
+    printf("scheduler: %zu bytes per %llu us, hold %llu us, starve %llu us\n\n",
+           sched.budget, (unsigned long long)(sched.interval / 1000),
+           (unsigned long long)(sched.hold / 1000),
+           (unsigned long long)(sched.starve / 1000));
+    printf("%7s %6s |%24s |%24s |%24s | %6s\n", "", "",
+           "key latency, ms   ", "text latency, ms   ",
+           "feature latency, ms  ", "");
+    printf("%7s %6s | %7s %7s %7s | %7s %7s %7s | %7s %7s %7s | %6s\n",
+           "Mbit/s", "mode", "mean", "p99", "max",
+           "mean", "p99", "max", "mean", "p99", "max", "load%");
+
+    for (r = 0; r < rate_count; ++r) {
+        mbps = optind < argc ? strtod(argv[optind + r], NULL)
+            : default_rates[r];
+        if (mbps <= 0) {
+            fprintf(stderr, "link rate must be positive\n");
+            return 1;
+        }
+
+        fit = sched;
+        fit.budget = mbps * 1e6 / 8 * 0.8 * fit.interval / 1e9;
+
+        for (k = 0; k < 3; ++k) {
+            run(&link, &load, mbps, pace[k]);
+
+            printf("%7.1f %6s |", mbps, mode[k]);
+            latency_print(&link.latency[KIND_KEY]);
+            printf(" |");
+            latency_print(&link.latency[KIND_TEXT]);
+            printf(" |");
+            latency_print(&link.latency[KIND_FEATURE]);
+            printf(" | %6.1f\n",
+                   100. * link.bytes * 8 / (mbps * 1e6)
+                   / ((double)load.duration / 1e9));
+
+            free(link.latency[KIND_KEY].sample);
+            free(link.latency[KIND_TEXT].sample);
+            free(link.latency[KIND_FEATURE].sample);
+        }
+        printf("\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,257 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Redundant report benchmark.
+
+  Sends a mouse motion stream through a lossy link model, as
+  DATA_REDUNDANT packets carrying the previous reports, and measures
+  how much motion the server gets for each redundancy count.  Losses
+  are independent, or come in bursts of a given mean length.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include <foils/hid.h>
+
+#define HEADER_SIZE 8
+#define REDUNDANT_HEADER_SIZE 4
+
+struct mouse_report
+{
+    int8_t buttons;
+    int8_t x;
+    int8_t y;
+    int8_t wheel;
+};
+
+struct link
+{
+    unsigned int seed;
+    double loss;
+    double burst;
+    int bad;
+};
+
+struct server
+{
+    uint16_t last;
+    int started;
+    unsigned long delivered;
+    unsigned long long motion;
+};
+
+struct result
+{
+    unsigned long lost_packets;
+    unsigned long lost_reports;
+    unsigned long long motion;
+    unsigned long long bytes;
+};
+
+static double uniform(unsigned int *seed)
+{
+    return rand_r(seed) / ((double)RAND_MAX + 1);
+}
+
+/*
+  Gilbert model: a lost packet starts a burst lasting burst packets
+  on average.  A burst of 1 gives independent losses.
+ */
+static int link_drops(struct link *l)
+{
+    double enter, leave;
+
+    if (l->burst <= 1)
+        return uniform(&l->seed) < l->loss;
+
+    leave = 1. / l->burst;
+    enter = l->loss * leave / (1. - l->loss);
+
+    if (l->bad)
+        l->bad = uniform(&l->seed) >= leave;
+    else
+        l->bad = uniform(&l->seed) < enter;
+
+    return l->bad;
+}
+
+static unsigned int report_motion(const struct mouse_report *r)
+{
+    return abs(r->x) + abs(r->y);
+}
+
+static size_t packet_build(
+    uint8_t *packet, uint16_t seq,
+    const struct mouse_report *history, size_t count)
+{
+    uint16_t v[2] = { htons(seq), htons(count) };
+
+    memset(packet, 0, HEADER_SIZE);
+    memcpy(packet + HEADER_SIZE, v, sizeof(v));
+    memcpy(packet + HEADER_SIZE + sizeof(v), history,
+           count * sizeof(*history));
+
+    return HEADER_SIZE + sizeof(v) + count * sizeof(*history);
+}
+
+/* Delivers reports newer than the last delivered one, in order */
+static void server_receive(struct server *s, const uint8_t *packet, size_t len)
+{
+    struct mouse_report r;
+    uint16_t v[2], seq;
+    size_t count, i;
+
+    memcpy(v, packet + HEADER_SIZE, sizeof(v));
+    seq = ntohs(v[0]);
+    count = ntohs(v[1]);
+
+    if (!count || len != HEADER_SIZE + sizeof(v) + count * sizeof(r))
+        return;
+
+    for (i = 0; i < count; ++i) {
+        uint16_t s_seq = seq - (count - 1 - i);
+
+        if (s->started && (int16_t)(s_seq - s->last) <= 0)
+            continue;
+
+        memcpy(&r, packet + HEADER_SIZE + sizeof(v) + i * sizeof(r),
+               sizeof(r));
+        s->started = 1;
+        s->last = s_seq;
+        s->delivered++;
+        s->motion += report_motion(&r);
+    }
+}
+
+static void run(
+    struct result *res, const struct mouse_report *reports, size_t count,
+    unsigned int redundancy, double loss, double burst)
+{
+    struct mouse_report history[FOILS_HID_REDUNDANCY_MAX + 1];
+    uint8_t packet[HEADER_SIZE + REDUNDANT_HEADER_SIZE + sizeof(history)];
+    struct link link = { .seed = 1, .loss = loss, .burst = burst };
+    struct server server = { 0 };
+    size_t i, kept = 0, len;
+
+    memset(res, 0, sizeof(*res));
+
+    for (i = 0; i < count; ++i) {
+        if (kept > redundancy) {
+            memmove(history, history + 1, redundancy * sizeof(*history));
+            kept = redundancy;
+        }
+        history[kept++] = reports[i];
+
+        len = packet_build(packet, i, history, kept);
+
+        /* Plain DATA packets need no sequence number */
+        res->bytes += redundancy ? len : HEADER_SIZE + sizeof(*history);
+
+        if (link_drops(&link)) {
+            res->lost_packets++;
+            continue;
+        }
+
+        server_receive(&server, packet, len);
+    }
+
+    res->lost_reports = count - server.delivered;
+    res->motion = server.motion;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n reports] [-b burst] [loss%%...]\n"
+            "  -n  reports sent per run (default 1000000)\n"
+            "  -b  mean loss burst length, in packets (default 1,"
+            " independent losses)\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    static const double default_losses[] = { 0.5, 1, 2, 5, 10, 20 };
+    struct mouse_report *reports;
+    unsigned long long total = 0;
+    size_t count = 1000000, i, l, loss_count;
+    double burst = 1, loss;
+    unsigned int k;
+    struct result res;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:b:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            burst = strtod(optarg, NULL);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    loss_count = optind < argc ? (size_t)(argc - optind)
+        : sizeof(default_losses) / sizeof(default_losses[0]);
+
+    if (!count) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    reports = malloc(count * sizeof(*reports));
+    if (reports == NULL)
+        return 1;
+
+    /* Circles, as test/mouse.c draws them */
+    for (i = 0; i < count; ++i) {
+        reports[i].buttons = 0;
+        reports[i].x = (int8_t)(((i / 8) % 4 < 2 ? 1 : -1) * (int)(i % 13));
+        reports[i].y = (int8_t)(((i / 8 + 2) % 4 < 2 ? 1 : -1)
+                                * (int)((i + 5) % 11));
+        reports[i].wheel = 0;
+        total += report_motion(reports + i);
+    }
+
+    printf("%zu reports, loss bursts of %.1f packets\n\n", count, burst);
+    printf("%6s %3s %10s %10s %9s %8s\n",
+           "loss%", "k", "lost pkts", "lost rpts", "motion%", "bytes/r");
+
+    for (l = 0; l < loss_count; ++l) {
+        loss = (optind < argc ? strtod(argv[optind + l], NULL)
+                : default_losses[l]) / 100.;
+        if (loss < 0 || loss >= 1) {
+            fprintf(stderr, "loss must be from 0 to 100%%\n");
+            return 1;
+        }
+
+        for (k = 0; k <= FOILS_HID_REDUNDANCY_MAX; ++k) {
+            run(&res, reports, count, k, loss, burst);
+            printf("%6.1f %3u %10lu %10lu %9.4f %8.2f%s\n",
+                   loss * 100, k, res.lost_packets, res.lost_reports,
+                   100. * res.motion / total, (double)res.bytes / count,
+                   k == foils_hid_redundancy_for_loss(loss, 1e-4)
+                   ? "  <- picked for 1e-4" : "");
+        }
+        printf("\n");
+    }
+
+    free(reports);
+    return 0;
+}
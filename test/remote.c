@@ -21,6 +21,7 @@
 
 #include "term_input.h"
 #include "mapping.h"
+#include "key_state.h"
 
 static const uint8_t unicode_report_descriptor[] = {
     0x05, 0x01,         /*  Usage Page (Desktop),               */
@@ -144,54 +145,19 @@ static const struct foils_hid_handler handler =
     .feature_report_sollicit = feature_report_sollicit,
 };
 
-struct unicode_state;
-
-typedef void code_sender_t(struct unicode_state *ks, uint32_t code);
+/* A key stays down that long after its last terminal repeat */
+#define RELEASE_DELAY_NS 100000000
+/* Consumer controls held down are pressed again that often */
+#define REPEAT_PERIOD_NS 100000000
 
 struct unicode_state {
     struct term_input_state input_state;
     struct ela_el *el;
     struct foils_hid *client;
-    struct ela_event_source *release;
-    code_sender_t *release_sender;
-    uint32_t current_code;
-    uint32_t release_code;
+    struct key_state keys;
 };
 
-static void release_send(struct unicode_state *ks)
-{
-    if (ks->release_sender) {
-        ks->release_sender(ks, ks->release_code);
-        ks->release_sender = NULL;
-    }
-}
-
-static
-void release_cb(
-    struct ela_event_source *source, int fd,
-    uint32_t mask, void *data)
-{
-    struct unicode_state *ks = data;
-    release_send(ks);
-}
-
-static void release_post(
-    struct unicode_state *ks,
-    code_sender_t *release_sender,
-    uint32_t release_code)
-{
-    if (ks->release_sender) {
-        release_send(ks);
-        ela_remove(ks->el, ks->release);
-    }
-
-    ks->release_sender = release_sender;
-    ks->release_code = release_code;
-
-    struct timeval tv = {0, 100000};
-    ela_set_timeout(ks->el, ks->release, &tv, ELA_EVENT_ONCE);
-    ela_add(ks->el, ks->release);
-}
+typedef void code_sender_t(struct unicode_state *ks, uint32_t code);
 
 static void send_unicode(struct unicode_state *ks, uint32_t code)
 {
@@ -216,34 +182,41 @@ static void send_sysctl(struct unicode_state *ks, uint32_t _code)
     foils_hid_input_report_send(ks->client, 0, 4, 1, &code, sizeof(code));
 }
 
+/* Indexed by target type, key state reports are added in that order */
+static const struct {
+    code_sender_t *sender;
+    enum key_state_mode mode;
+} report_setup[] = {
+    [TARGET_UNICODE] = { send_unicode, KEY_STATE_PULSE },
+    [TARGET_KEYBOARD] = { send_kbd, KEY_STATE_HOLD },
+    [TARGET_CONSUMER] = { send_cons, KEY_STATE_REPEAT },
+    [TARGET_DESKTOP] = { send_sysctl, KEY_STATE_PULSE },
+};
+
+static void key_send(void *opaque, uint8_t report_id, uint32_t usage)
+{
+    struct unicode_state *ks = opaque;
+
+    /* Report ids match target types */
+    report_setup[report_id].sender(ks, usage);
+}
+
 static
-void input_handler(
-    struct term_input_state *input,
+void input_code_handle(
+    struct unicode_state *ks,
     uint8_t is_unicode,
     uint32_t code)
 {
-    struct unicode_state *ks = (void*)input;
     struct target_code target;
 
     if (!mapping_get(is_unicode, code, &target))
         return;
 
-    code_sender_t *sender;
-    uint8_t repeatable = 0;
-
     switch (target.report) {
     case TARGET_UNICODE:
-        sender = send_unicode;
-        break;
     case TARGET_KEYBOARD:
-        sender = send_kbd;
-        repeatable = 1;
-        break;
     case TARGET_CONSUMER:
-        sender = send_cons;
-        break;
     case TARGET_DESKTOP:
-        sender = send_sysctl;
         break;
     default:
         return;
@@ -251,16 +224,51 @@ void input_handler(
 
     printf("Sending %s\n", target.name);
 
-    if (repeatable
-        && target.usage == ks->current_code
-        && sender == ks->release_sender) {
-        ela_remove(ks->el, ks->release);
-        ela_add(ks->el, ks->release);
-    } else {
-        sender(ks, target.usage);
-        release_post(ks, sender, 0);
-        ks->current_code = target.usage;
+    key_state_press(&ks->keys, target.report - TARGET_UNICODE, target.usage);
+}
+
+static
+void text_send(
+    struct unicode_state *ks,
+    const uint32_t *text,
+    size_t count)
+{
+    if (!count)
+        return;
+
+    printf("Sending %zu characters\n", count);
+
+    key_state_release_all(&ks->keys);
+    foils_hid_unicode_send(ks->client, 0, TARGET_UNICODE, text, count);
+}
+
+static
+void input_handler(
+    struct term_input_state *input,
+    const struct term_input_code *codes,
+    size_t count)
+{
+    struct unicode_state *ks = (void*)input;
+    uint32_t text[TERM_INPUT_BATCH];
+    struct target_code target;
+    size_t i, len = 0;
+
+    /* Pasted text comes as many characters in one chunk */
+    for (i = 0; i < count; i++) {
+        if (count > 1
+            && mapping_get(codes[i].is_unicode, codes[i].code, &target)
+            && target.report == TARGET_UNICODE) {
+            text[len++] = target.usage;
+            continue;
+        }
+
+        text_send(ks, text, len);
+        len = 0;
+
+        input_code_handle(ks, codes[i].is_unicode, codes[i].code);
     }
+
+    text_send(ks, text, len);
 }
 
 int main(int argc, char **argv)
@@ -269,13 +277,18 @@ int main(int argc, char **argv)
     assert(el && "Event loop creation failed");
 
     struct foils_hid client;
+    int err;
 
     if ( argc < 3 ) {
-        fprintf(stderr, "Usage: %s ip port\n", argv[0]);
+        fprintf(stderr, "Usage: %s ip port [mapping_file]\n", argv[0]);
         return 1;
     }
 
-    int err = foils_hid_init(&client, el, &handler, descriptors, 1);
+    err = mapping_init(el, argc > 3 ? argv[3] : NULL);
+    if (err)
+        return 1;
+
+    err = foils_hid_init(&client, el, &handler, descriptors, 1);
     if (err) {
         fprintf(stderr, "Error creating client: %s\n", strerror(err));
         return 1;
@@ -288,16 +301,28 @@ int main(int argc, char **argv)
 
     mapping_dump();
 
+    err = key_state_init(&ks.keys, el, RELEASE_DELAY_NS, REPEAT_PERIOD_NS,
+                         key_send, &ks);
+    if (err) {
+        fprintf(stderr, "Error creating key state: %s\n", strerror(err));
+        return 1;
+    }
+
+    enum target_code_type type;
+    for (type = TARGET_UNICODE; type <= TARGET_DESKTOP; ++type)
+        key_state_report_add(&ks.keys, type, report_setup[type].mode);
+
     term_input_init(&ks.input_state, input_handler, el);
+    foils_hid_dedup_enable(&client, 0);
     foils_hid_client_connect_hostname(&client, argv[1], atoi(argv[2]), 0);
     foils_hid_device_enable(&client, 0);
 
-    ela_source_alloc(el, release_cb, &ks, &ks.release);
-
     ela_run(el);
 
+    key_state_deinit(&ks.keys);
     term_input_deinit(&ks.input_state);
     foils_hid_deinit(&client);
+    mapping_deinit();
 
     ela_close(el);
     return 0;
@@ -47,70 +47,208 @@ int tty_break(void)
 #define KEY_CTRL(x) (x-'a'+1)
 #define SHIFT(x) (ks->control_arg2 == 2 ? x : 0)
 
+/* Bytes read from the terminal at once */
+#define TERM_INPUT_READ_SIZE 4096
+
+/*
+  UTF-8 decoding DFA, after Bjoern Hoehrmann.  Bytes are mapped to a
+  class, and (state + class) indexes the next state.  States are
+  multiples of 12.
+ */
+#define UTF8_ACCEPT 0
+#define UTF8_REJECT 12
+
+static const uint8_t utf8_class[256] = {
+    [0x00 ... 0x7f] = 0,
+    [0x80 ... 0x8f] = 1,
+    [0x90 ... 0x9f] = 9,
+    [0xa0 ... 0xbf] = 7,
+    [0xc0 ... 0xc1] = 8,
+    [0xc2 ... 0xdf] = 2,
+    [0xe0] = 10,
+    [0xe1 ... 0xec] = 3,
+    [0xed] = 4,
+    [0xee ... 0xef] = 3,
+    [0xf0] = 11,
+    [0xf1 ... 0xf3] = 6,
+    [0xf4] = 5,
+    [0xf5 ... 0xff] = 8,
+};
+
+static const uint8_t utf8_transition[108] = {
+     0,12,24,36,60,96,84,12,12,12,48,72,
+    12,12,12,12,12,12,12,12,12,12,12,12,
+    12, 0,12,12,12,12,12, 0,12, 0,12,12,
+    12,24,12,12,12,12,12,24,12,24,12,12,
+    12,12,12,12,12,12,12,24,12,12,12,12,
+    12,24,12,12,12,12,12,12,12,24,12,12,
+    12,12,12,12,12,12,12,36,12,36,12,12,
+    12,36,12,12,12,12,12,36,12,36,12,12,
+    12,36,12,12,12,12,12,12,12,12,12,12,
+};
+
+/*
+  Escape sequence parser.  Decoded code points are mapped to a class,
+  and each (state, class) entry holds an action and the next state.
+ */
+enum state
+{
+    IDLE, ESCAPE, CONTROL, CONTROL2,
+};
+
+enum code_class
+{
+    C_OTHER, C_ESC, C_BRACKET, C_O, C_DIGIT, C_SEMICOLON, C_BACKSPACE, C_CTRL,
+    C_COUNT,
+};
+
+enum action
+{
+    A_NONE, A_UNICODE, A_BACKSPACE, A_CTRL, A_ESCAPE, A_ARG_O,
+    A_DIGIT, A_DIGIT2, A_FINAL,
+};
+
+static const uint8_t ascii_class[0x80] = {
+    [KEY_CTRL('a') ... KEY_CTRL('z')] = C_CTRL,
+    [0x1b] = C_ESC,
+    ['['] = C_BRACKET,
+    ['O'] = C_O,
+    ['0' ... '9'] = C_DIGIT,
+    [';'] = C_SEMICOLON,
+    [0x7f] = C_BACKSPACE,
+};
+
+#define T(action, state) ((action) << 2 | (state))
+
+static const uint8_t sequence_transition[][C_COUNT] = {
+    [IDLE] = {
+        [C_OTHER] = T(A_UNICODE, IDLE),
+        [C_ESC] = T(A_ESCAPE, ESCAPE),
+        [C_BRACKET] = T(A_UNICODE, IDLE),
+        [C_O] = T(A_UNICODE, IDLE),
+        [C_DIGIT] = T(A_UNICODE, IDLE),
+        [C_SEMICOLON] = T(A_UNICODE, IDLE),
+        [C_BACKSPACE] = T(A_BACKSPACE, IDLE),
+        [C_CTRL] = T(A_CTRL, IDLE),
+    },
+    [ESCAPE] = {
+        [C_OTHER] = T(A_NONE, IDLE),
+        [C_ESC] = T(A_ESCAPE, ESCAPE),
+        [C_BRACKET] = T(A_NONE, CONTROL),
+        [C_O] = T(A_ARG_O, CONTROL),
+        [C_DIGIT] = T(A_NONE, IDLE),
+        [C_SEMICOLON] = T(A_NONE, IDLE),
+        [C_BACKSPACE] = T(A_NONE, IDLE),
+        [C_CTRL] = T(A_NONE, IDLE),
+    },
+    [CONTROL] = {
+        [C_OTHER] = T(A_FINAL, IDLE),
+        [C_ESC] = T(A_FINAL, IDLE),
+        [C_BRACKET] = T(A_FINAL, IDLE),
+        [C_O] = T(A_FINAL, IDLE),
+        [C_DIGIT] = T(A_DIGIT, CONTROL),
+        [C_SEMICOLON] = T(A_NONE, CONTROL2),
+        [C_BACKSPACE] = T(A_FINAL, IDLE),
+        [C_CTRL] = T(A_FINAL, IDLE),
+    },
+    [CONTROL2] = {
+        [C_OTHER] = T(A_FINAL, IDLE),
+        [C_ESC] = T(A_FINAL, IDLE),
+        [C_BRACKET] = T(A_FINAL, IDLE),
+        [C_O] = T(A_FINAL, IDLE),
+        [C_DIGIT] = T(A_DIGIT2, CONTROL2),
+        [C_SEMICOLON] = T(A_FINAL, IDLE),
+        [C_BACKSPACE] = T(A_FINAL, IDLE),
+        [C_CTRL] = T(A_FINAL, IDLE),
+    },
+};
+
+#undef T
+
+static void flush_codes(struct term_input_state *ks)
+{
+    if (!ks->count)
+        return;
+
+    ks->handler(ks, ks->batch, ks->count);
+    ks->count = 0;
+}
+
+static void emit_code(struct term_input_state *ks, uint8_t is_unicode, uint32_t code)
+{
+    struct term_input_code *c = &ks->batch[ks->count++];
+
+    c->is_unicode = is_unicode;
+    c->code = code;
+
+    if (ks->count == TERM_INPUT_BATCH)
+        flush_codes(ks);
+}
+
 static void handle_control(struct term_input_state *ks, uint8_t code)
 {
     switch (code) {
     case '~':
         switch (ks->control_arg) {
         case 2: // Insert
-            return ks->handler(ks, 0, TERM_INPUT_INS);
+            return emit_code(ks, 0, TERM_INPUT_INS);
         case 3: // Delete
-            return ks->handler(ks, 0, TERM_INPUT_DEL);
+            return emit_code(ks, 0, TERM_INPUT_DEL);
         case 5: // Page up
-            return ks->handler(ks, 0, TERM_INPUT_PAGE_UP);
+            return emit_code(ks, 0, TERM_INPUT_PAGE_UP);
         case 6: // Page down
-            return ks->handler(ks, 0, TERM_INPUT_PAGE_DOWN);
+            return emit_code(ks, 0, TERM_INPUT_PAGE_DOWN);
         case (11) ... (15): // F1-F5
-            return ks->handler(ks, 0, TERM_INPUT_F(
+            return emit_code(ks, 0, TERM_INPUT_F(
                                    ks->control_arg - 11 + 1
                                    + SHIFT(12)));
         case (17) ... (21): // F6-F10
-            return ks->handler(ks, 0, TERM_INPUT_F(
+            return emit_code(ks, 0, TERM_INPUT_F(
                                    ks->control_arg - 17 + 6
                                    + SHIFT(12)));
         case (23) ... (24): // F11-F12
-            return ks->handler(ks, 0, TERM_INPUT_F(
+            return emit_code(ks, 0, TERM_INPUT_F(
                                    ks->control_arg - 23 + 11
                                    + SHIFT(12)));
         }
         break;
     case 'A': // UP
         if (ks->control_arg == 1 && ks->control_arg2 == 2)
-            return ks->handler(ks, 0, TERM_INPUT_SHIFT_UP);
+            return emit_code(ks, 0, TERM_INPUT_SHIFT_UP);
         else if (ks->control_arg == 1 && ks->control_arg2 == 5)
-            return ks->handler(ks, 0, TERM_INPUT_CTRL_UP);
-        return ks->handler(ks, 0, TERM_INPUT_UP);
+            return emit_code(ks, 0, TERM_INPUT_CTRL_UP);
+        return emit_code(ks, 0, TERM_INPUT_UP);
     case 'B': // Down
         if (ks->control_arg == 1 && ks->control_arg2 == 2)
-            return ks->handler(ks, 0, TERM_INPUT_SHIFT_DOWN);
+            return emit_code(ks, 0, TERM_INPUT_SHIFT_DOWN);
         else if (ks->control_arg == 1 && ks->control_arg2 == 5)
-            return ks->handler(ks, 0, TERM_INPUT_CTRL_DOWN);
-        return ks->handler(ks, 0, TERM_INPUT_DOWN);
+            return emit_code(ks, 0, TERM_INPUT_CTRL_DOWN);
+        return emit_code(ks, 0, TERM_INPUT_DOWN);
     case 'C': // Right
         if (ks->control_arg == 1 && ks->control_arg2 == 2)
-            return ks->handler(ks, 0, TERM_INPUT_SHIFT_RIGHT);
+            return emit_code(ks, 0, TERM_INPUT_SHIFT_RIGHT);
         else if (ks->control_arg == 1 && ks->control_arg2 == 5)
-            return ks->handler(ks, 0, TERM_INPUT_CTRL_RIGHT);
-        return ks->handler(ks, 0, TERM_INPUT_RIGHT);
+            return emit_code(ks, 0, TERM_INPUT_CTRL_RIGHT);
+        return emit_code(ks, 0, TERM_INPUT_RIGHT);
     case 'D': // Left
         if (ks->control_arg == 1 && ks->control_arg2 == 2)
-            return ks->handler(ks, 0, TERM_INPUT_SHIFT_LEFT);
+            return emit_code(ks, 0, TERM_INPUT_SHIFT_LEFT);
         else if (ks->control_arg == 1 && ks->control_arg2 == 5)
-            return ks->handler(ks, 0, TERM_INPUT_CTRL_LEFT);
-        return ks->handler(ks, 0, TERM_INPUT_LEFT);
+            return emit_code(ks, 0, TERM_INPUT_CTRL_LEFT);
+        return emit_code(ks, 0, TERM_INPUT_LEFT);
     case 'H': // Home
-        return ks->handler(ks, 0, TERM_INPUT_HOME);
+        return emit_code(ks, 0, TERM_INPUT_HOME);
     case 'F': // End
-        return ks->handler(ks, 0, TERM_INPUT_END);
+        return emit_code(ks, 0, TERM_INPUT_END);
     case 'P'...'S':
         switch (ks->control_arg) {
         case 'O':
             // F1-F4
-            return ks->handler(ks, 0, TERM_INPUT_F(code - 'P' + 1));
+            return emit_code(ks, 0, TERM_INPUT_F(code - 'P' + 1));
         case 1:
             if (ks->control_arg2 == 2)
                 // F13-F16
-                return ks->handler(ks, 0, TERM_INPUT_F(code - 'P' + 13));
+                return emit_code(ks, 0, TERM_INPUT_F(code - 'P' + 13));
         }
         break;
     }
@@ -121,112 +259,93 @@ static void handle_control(struct term_input_state *ks, uint8_t code)
         printf("Unknown control '%d%c'\n", ks->control_arg, code);
 }
 
+static void sequence_step(struct term_input_state *ks, uint32_t code)
+{
+    uint8_t class = code < 0x80 ? ascii_class[code] : C_OTHER;
+    uint8_t t = sequence_transition[ks->state][class];
+
+    ks->state = t & 3;
+
+    switch (t >> 2) {
+    case A_NONE:
+        break;
+    case A_UNICODE:
+        emit_code(ks, 1, code);
+        break;
+    case A_BACKSPACE:
+        emit_code(ks, 0, TERM_INPUT_BACKSPACE);
+        break;
+    case A_CTRL:
+        emit_code(ks, 0, TERM_INPUT_CTRL(code - KEY_CTRL('a') + 'a'));
+        break;
+    case A_ESCAPE:
+        ks->control_arg = 0;
+        ks->control_arg2 = 0;
+        break;
+    case A_ARG_O:
+        ks->control_arg = 'O';
+        break;
+    case A_DIGIT:
+        ks->control_arg = ks->control_arg * 10 + code - '0';
+        break;
+    case A_DIGIT2:
+        ks->control_arg2 = ks->control_arg2 * 10 + code - '0';
+        break;
+    case A_FINAL:
+        handle_control(ks, code);
+        break;
+    }
+}
+
+void term_input_decode(
+    struct term_input_state *ks,
+    const uint8_t *data, size_t size)
+{
+    const uint8_t *end = data + size;
+
+    while (data < end) {
+        uint8_t byte = *data;
+        uint8_t class = utf8_class[byte];
+        uint8_t prev = ks->utf8_state;
+
+        ks->code = prev != UTF8_ACCEPT
+            ? (ks->code << 6) | (byte & 0x3f)
+            : (0xff >> class) & byte;
+        ks->utf8_state = utf8_transition[prev + class];
+
+        if (ks->utf8_state == UTF8_REJECT) {
+            /* Drop broken sequence, byte may start a new one */
+            ks->utf8_state = UTF8_ACCEPT;
+            if (prev == UTF8_ACCEPT)
+                data++;
+            continue;
+        }
+
+        data++;
+
+        if (ks->utf8_state == UTF8_ACCEPT)
+            sequence_step(ks, ks->code);
+    }
+
+    flush_codes(ks);
+}
+
 static
 void term_input_update(
     struct ela_event_source *source,
     int fd, uint32_t mask, void *data)
 {
     struct term_input_state *ks = data;
+    uint8_t buf[TERM_INPUT_READ_SIZE];
+    ssize_t len;
 
-    int c;
-
-    for (c = getchar(); c >= 0; c = getchar()) {
-        if (ks->left == 0) {
-            if (c & 0x80) {
-                for (ks->left=1; ks->left<=5; ks->left++)
-                    if (!(c & (1<<(6 - ks->left))))
-                        break;
-                ks->code = c & ((1<<(6 - ks->left)) - 1);
-            } else {
-                ks->code = c;
-            }
-        } else {
-            ks->code <<= 6;
-            ks->code |= c & 0x3f;
-            ks->left--;
-        }
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+        term_input_decode(ks, buf, len);
 
-        if (ks->left)
-            continue;
-
-        /* printf("Handling... code: %02x, state: %02x, ca: %02x, ca2: %02x\n", */
-        /*        ks->code, ks->state, ks->control_arg, ks->control_arg2); */
-
-        switch (ks->state) {
-        case IDLE:
-            switch (ks->code) {
-            default:
-                ks->handler(ks, 1, ks->code);
-                break;
-
-            case 0x1b: // esc
-                ks->state = ESCAPE;
-                ks->control_arg = 0;
-                ks->control_arg2 = 0;
-                break;
-
-            case 0x7f: // Backspace
-                ks->handler(ks, 0, TERM_INPUT_BACKSPACE);
-                break;
-
-            case KEY_CTRL('a')...KEY_CTRL('z'):
-                ks->handler(
-                    ks, 0,
-                    TERM_INPUT_CTRL(ks->code - KEY_CTRL('a') + 'a'));
-                break;
-            }
-            break;
-
-        case ESCAPE:
-            switch (ks->code) {
-            case 0x1b: // esc
-                ks->state = ESCAPE;
-                ks->control_arg = 0;
-                ks->control_arg2 = 0;
-                break;
-            case '[':
-                ks->state = CONTROL;
-                break;
-            case 'O':
-                ks->control_arg = 'O';
-                ks->state = CONTROL;
-                break;
-            default:
-                ks->state = IDLE;
-                break;
-            }
-            break;
-
-        case CONTROL:
-            switch (ks->code) {
-            case ';':
-                ks->state = CONTROL2;
-                break;
-            case '0'...'9':
-                ks->control_arg *= 10;
-                ks->control_arg += ks->code - '0';
-                break;
-            default:
-                handle_control(ks, ks->code);
-                ks->state = IDLE;
-                break;
-            }
-            break;
-
-        case CONTROL2:
-            switch (ks->code) {
-            case '0'...'9':
-                ks->control_arg2 *= 10;
-                ks->control_arg2 += ks->code - '0';
-                break;
-            default:
-                handle_control(ks, ks->code);
-                ks->state = IDLE;
-                break;
-            }
-            break;
-        }
-        ks->code = 0;
+    if (len == 0) {
+        /* End of scripted input, do not spin on a readable EOF */
+        ela_remove(ks->el, ks->source);
+        ks->closed = 1;
     }
 }
 
@@ -253,6 +372,7 @@ int term_input_init(
 void term_input_deinit(
     struct term_input_state *state)
 {
-    ela_remove(state->el, state->source);
+    if (!state->closed)
+        ela_remove(state->el, state->source);
     ela_source_free(state->el, state->source);
 }
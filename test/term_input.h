@@ -1,6 +1,8 @@
 #ifndef TERM_INPUT_H_
 #define TERM_INPUT_H_
 
+#include <stddef.h>
+#include <stdint.h>
 #include <ela/ela.h>
 
 enum term_input_key
@@ -34,12 +36,18 @@ enum term_input_key
 
 struct term_input_state;
 
-enum state
+/* Codes decoded from one read() chunk are passed in batches */
+#define TERM_INPUT_BATCH 256
+
+struct term_input_code
 {
-    IDLE, ESCAPE, CONTROL, CONTROL2,
+    uint8_t is_unicode;
+    uint32_t code;
 };
 
-typedef void input_handler_func_t(struct term_input_state *input, uint8_t is_unicode, uint32_t code);
+typedef void input_handler_func_t(
+    struct term_input_state *input,
+    const struct term_input_code *codes, size_t count);
 
 struct term_input_state
 {
@@ -47,10 +55,13 @@ struct term_input_state
     struct ela_event_source *source;
     input_handler_func_t *handler;
     uint32_t code;
-    enum state state;
-    int left;
+    uint8_t utf8_state;
+    uint8_t state;
+    uint8_t closed;
     int control_arg;
     int control_arg2;
+    size_t count;
+    struct term_input_code batch[TERM_INPUT_BATCH];
 };
 
 int term_input_init(
@@ -61,4 +72,12 @@ int term_input_init(
 void term_input_deinit(
     struct term_input_state *state);
 
+/*
+ * Decodes a chunk of terminal input and passes resulting codes to
+ * the handler.  Sequences may span chunks.
+ */
+void term_input_decode(
+    struct term_input_state *state,
+    const uint8_t *data, size_t size);
+
 #endif
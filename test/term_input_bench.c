@@ -0,0 +1,430 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Terminal input decoding benchmark.
+
+  Feeds scripted input through a pipe to both the former getchar()
+  based decoder and the table-driven decoder, and compares throughput
+  and decoded codes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "term_input.h"
+
+struct result
+{
+    uint64_t count;
+    uint64_t hash;
+};
+
+static void result_add(struct result *r, uint8_t is_unicode, uint32_t code)
+{
+    r->count++;
+    r->hash = r->hash * 31 + ((uint64_t)is_unicode << 32 | code);
+}
+
+/*
+  Former decoder, as it was in term_input.c: getchar() per byte and a
+  switch based state machine.
+ */
+enum legacy_state_id
+{
+    LEGACY_IDLE, LEGACY_ESCAPE, LEGACY_CONTROL, LEGACY_CONTROL2,
+};
+
+struct legacy_state
+{
+    struct result result;
+    uint32_t code;
+    enum legacy_state_id state;
+    int left;
+    int control_arg;
+    int control_arg2;
+};
+
+#define KEY_CTRL(x) (x-'a'+1)
+#define SHIFT(x) (ks->control_arg2 == 2 ? x : 0)
+
+static void legacy_emit(struct legacy_state *ks, uint8_t is_unicode, uint32_t code)
+{
+    result_add(&ks->result, is_unicode, code);
+}
+
+static void legacy_handle_control(struct legacy_state *ks, uint8_t code)
+{
+    switch (code) {
+    case '~':
+        switch (ks->control_arg) {
+        case 2: // Insert
+            return legacy_emit(ks, 0, TERM_INPUT_INS);
+        case 3: // Delete
+            return legacy_emit(ks, 0, TERM_INPUT_DEL);
+        case 5: // Page up
+            return legacy_emit(ks, 0, TERM_INPUT_PAGE_UP);
+        case 6: // Page down
+            return legacy_emit(ks, 0, TERM_INPUT_PAGE_DOWN);
+        case (11) ... (15): // F1-F5
+            return legacy_emit(ks, 0, TERM_INPUT_F(
+                                   ks->control_arg - 11 + 1
+                                   + SHIFT(12)));
+        case (17) ... (21): // F6-F10
+            return legacy_emit(ks, 0, TERM_INPUT_F(
+                                   ks->control_arg - 17 + 6
+                                   + SHIFT(12)));
+        case (23) ... (24): // F11-F12
+            return legacy_emit(ks, 0, TERM_INPUT_F(
+                                   ks->control_arg - 23 + 11
+                                   + SHIFT(12)));
+        }
+        break;
+    case 'A': // UP
+        if (ks->control_arg == 1 && ks->control_arg2 == 2)
+            return legacy_emit(ks, 0, TERM_INPUT_SHIFT_UP);
+        else if (ks->control_arg == 1 && ks->control_arg2 == 5)
+            return legacy_emit(ks, 0, TERM_INPUT_CTRL_UP);
+        return legacy_emit(ks, 0, TERM_INPUT_UP);
+    case 'B': // Down
+        if (ks->control_arg == 1 && ks->control_arg2 == 2)
+            return legacy_emit(ks, 0, TERM_INPUT_SHIFT_DOWN);
+        else if (ks->control_arg == 1 && ks->control_arg2 == 5)
+            return legacy_emit(ks, 0, TERM_INPUT_CTRL_DOWN);
+        return legacy_emit(ks, 0, TERM_INPUT_DOWN);
+    case 'C': // Right
+        if (ks->control_arg == 1 && ks->control_arg2 == 2)
+            return legacy_emit(ks, 0, TERM_INPUT_SHIFT_RIGHT);
+        else if (ks->control_arg == 1 && ks->control_arg2 == 5)
+            return legacy_emit(ks, 0, TERM_INPUT_CTRL_RIGHT);
+        return legacy_emit(ks, 0, TERM_INPUT_RIGHT);
+    case 'D': // Left
+        if (ks->control_arg == 1 && ks->control_arg2 == 2)
+            return legacy_emit(ks, 0, TERM_INPUT_SHIFT_LEFT);
+        else if (ks->control_arg == 1 && ks->control_arg2 == 5)
+            return legacy_emit(ks, 0, TERM_INPUT_CTRL_LEFT);
+        return legacy_emit(ks, 0, TERM_INPUT_LEFT);
+    case 'H': // Home
+        return legacy_emit(ks, 0, TERM_INPUT_HOME);
+    case 'F': // End
+        return legacy_emit(ks, 0, TERM_INPUT_END);
+    case 'P'...'S':
+        switch (ks->control_arg) {
+        case 'O':
+            // F1-F4
+            return legacy_emit(ks, 0, TERM_INPUT_F(code - 'P' + 1));
+        case 1:
+            if (ks->control_arg2 == 2)
+                // F13-F16
+                return legacy_emit(ks, 0, TERM_INPUT_F(code - 'P' + 13));
+        }
+        break;
+    }
+}
+
+static void legacy_decode(struct legacy_state *ks)
+{
+    int c;
+
+    for (c = getchar(); c >= 0; c = getchar()) {
+        if (ks->left == 0) {
+            if (c & 0x80) {
+                for (ks->left=1; ks->left<=5; ks->left++)
+                    if (!(c & (1<<(6 - ks->left))))
+                        break;
+                ks->code = c & ((1<<(6 - ks->left)) - 1);
+            } else {
+                ks->code = c;
+            }
+        } else {
+            ks->code <<= 6;
+            ks->code |= c & 0x3f;
+            ks->left--;
+        }
+
+        if (ks->left)
+            continue;
+
+        switch (ks->state) {
+        case LEGACY_IDLE:
+            switch (ks->code) {
+            default:
+                legacy_emit(ks, 1, ks->code);
+                break;
+
+            case 0x1b: // esc
+                ks->state = LEGACY_ESCAPE;
+                ks->control_arg = 0;
+                ks->control_arg2 = 0;
+                break;
+
+            case 0x7f: // Backspace
+                legacy_emit(ks, 0, TERM_INPUT_BACKSPACE);
+                break;
+
+            case KEY_CTRL('a')...KEY_CTRL('z'):
+                legacy_emit(
+                    ks, 0,
+                    TERM_INPUT_CTRL(ks->code - KEY_CTRL('a') + 'a'));
+                break;
+            }
+            break;
+
+        case LEGACY_ESCAPE:
+            switch (ks->code) {
+            case 0x1b: // esc
+                ks->state = LEGACY_ESCAPE;
+                ks->control_arg = 0;
+                ks->control_arg2 = 0;
+                break;
+            case '[':
+                ks->state = LEGACY_CONTROL;
+                break;
+            case 'O':
+                ks->control_arg = 'O';
+                ks->state = LEGACY_CONTROL;
+                break;
+            default:
+                ks->state = LEGACY_IDLE;
+                break;
+            }
+            break;
+
+        case LEGACY_CONTROL:
+            switch (ks->code) {
+            case ';':
+                ks->state = LEGACY_CONTROL2;
+                break;
+            case '0'...'9':
+                ks->control_arg *= 10;
+                ks->control_arg += ks->code - '0';
+                break;
+            default:
+                legacy_handle_control(ks, ks->code);
+                ks->state = LEGACY_IDLE;
+                break;
+            }
+            break;
+
+        case LEGACY_CONTROL2:
+            switch (ks->code) {
+            case '0'...'9':
+                ks->control_arg2 *= 10;
+                ks->control_arg2 += ks->code - '0';
+                break;
+            default:
+                legacy_handle_control(ks, ks->code);
+                ks->state = LEGACY_IDLE;
+                break;
+            }
+            break;
+        }
+        ks->code = 0;
+    }
+}
+
+/* Table-driven decoder, fed by large read()s */
+struct table_state
+{
+    struct term_input_state input;
+    struct result result;
+};
+
+static void table_handler(
+    struct term_input_state *input,
+    const struct term_input_code *codes, size_t count)
+{
+    struct table_state *ts = (void*)input;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        result_add(&ts->result, codes[i].is_unicode, codes[i].code);
+}
+
+static void table_decode(struct table_state *ts, int fd, size_t chunk)
+{
+    uint8_t *buf = malloc(chunk);
+    ssize_t len;
+
+    while ((len = read(fd, buf, chunk)) > 0)
+        term_input_decode(&ts->input, buf, len);
+
+    free(buf);
+}
+
+/* Typical stress script material: text, UTF-8, keys and controls */
+static const char *const tokens[] = {
+    "hello world ", "The quick brown fox ", "0123456789", ";[O",
+    "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80",
+    "\x1b[A", "\x1b[B", "\x1b[C", "\x1b[D",
+    "\x1b[1;5A", "\x1b[1;2D", "\x1b[H", "\x1b[F",
+    "\x1b[2~", "\x1b[3~", "\x1b[5~", "\x1b[6~",
+    "\x1b[15~", "\x1b[24;2~", "\x1bOP", "\x1b[1;2Q",
+    "\x7f", "\x01", "\t", "\r",
+};
+
+static size_t script_fill(uint8_t *buf, size_t size)
+{
+    unsigned int seed = 1;
+    size_t used = 0;
+
+    while (1) {
+        const char *token = tokens[rand_r(&seed) % (sizeof(tokens) / sizeof(tokens[0]))];
+        size_t len = strlen(token);
+
+        if (used + len > size)
+            return used;
+
+        memcpy(buf + used, token, len);
+        used += len;
+    }
+}
+
+struct writer
+{
+    int fd;
+    const uint8_t *data;
+    size_t size;
+};
+
+static void *writer_thread(void *opaque)
+{
+    struct writer *w = opaque;
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < w->size) {
+        ret = write(w->fd, w->data + done, w->size - done);
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+
+    close(w->fd);
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Runs one decoder with the script piped on fd 0 */
+static double run(
+    const uint8_t *script, size_t size, int legacy, size_t chunk,
+    struct result *result)
+{
+    struct writer w = { .data = script, .size = size };
+    pthread_t thread;
+    int fds[2];
+    double start;
+
+    if (pipe(fds)) {
+        perror("pipe");
+        exit(1);
+    }
+
+    dup2(fds[0], 0);
+    close(fds[0]);
+    clearerr(stdin);
+    w.fd = fds[1];
+
+    start = now();
+    pthread_create(&thread, NULL, writer_thread, &w);
+
+    if (legacy) {
+        struct legacy_state ks;
+
+        memset(&ks, 0, sizeof(ks));
+        legacy_decode(&ks);
+        *result = ks.result;
+    } else {
+        static struct table_state ts;
+
+        memset(&ts, 0, sizeof(ts));
+        ts.input.handler = table_handler;
+        table_decode(&ts, 0, chunk);
+        *result = ts.result;
+    }
+
+    pthread_join(thread, NULL);
+    return now() - start;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s megabytes] [-c chunk]\n"
+            "  -s  scripted input size (default 64)\n"
+            "  -c  read() size of table decoder (default 4096)\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    struct result legacy, table;
+    double legacy_time, table_time;
+    size_t size = 64, chunk = 4096;
+    uint8_t *script;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:c:h")) != -1) {
+        switch (opt) {
+        case 's':
+            size = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            chunk = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!size || !chunk) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    size <<= 20;
+    script = malloc(size);
+    if (!script)
+        return 1;
+    size = script_fill(script, size);
+
+    legacy_time = run(script, size, 1, chunk, &legacy);
+    table_time = run(script, size, 0, chunk, &table);
+
+    printf("getchar: %10llu codes in %.3fs, %7.1f MB/s\n",
+           (unsigned long long)legacy.count, legacy_time,
+           size / legacy_time / 1e6);
+    printf("table:   %10llu codes in %.3fs, %7.1f MB/s, %.2fx\n",
+           (unsigned long long)table.count, table_time,
+           size / table_time / 1e6, legacy_time / table_time);
+
+    free(script);
+
+    if (legacy.count != table.count || legacy.hash != table.hash) {
+        printf("Decoded codes differ\n");
+        return 1;
+    }
+
+    return 0;
+}
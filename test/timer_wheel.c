@@ -0,0 +1,242 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "timer_wheel.h"
+
+uint64_t timer_wheel_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void wheel_arm(struct timer_wheel *wheel, uint64_t deadline)
+{
+    struct itimerspec its = {
+        .it_value = {
+            .tv_sec = deadline / 1000000000,
+            .tv_nsec = deadline % 1000000000,
+        },
+    };
+
+    /* A zero it_value would disarm instead */
+    if (!deadline)
+        its.it_value.tv_nsec = 1;
+
+    timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &its, NULL);
+    wheel->armed = deadline;
+    wheel->stats.arms++;
+}
+
+static void list_push(
+    struct timer_wheel_timer **slot,
+    struct timer_wheel_timer *timer)
+{
+    timer->next = *slot;
+    if (timer->next)
+        timer->next->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static void wheel_insert(
+    struct timer_wheel *wheel,
+    struct timer_wheel_timer *timer)
+{
+    uint64_t tick = timer->deadline / wheel->tick;
+
+    /* Late timers go in the slot processed next */
+    if (tick < wheel->current)
+        tick = wheel->current;
+
+    list_push(&wheel->slots[tick % TIMER_WHEEL_SLOTS], timer);
+}
+
+void timer_wheel_del(struct timer_wheel_timer *timer)
+{
+    if (!timer->pprev)
+        return;
+
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+void timer_wheel_add(
+    struct timer_wheel *wheel,
+    struct timer_wheel_timer *timer,
+    uint64_t deadline)
+{
+    timer_wheel_del(timer);
+
+    timer->deadline = deadline;
+    wheel_insert(wheel, timer);
+
+    /* Later deadlines are picked up when the armed one fires */
+    if (!wheel->expiring && (!wheel->armed || deadline < wheel->armed))
+        wheel_arm(wheel, deadline);
+}
+
+/* Earliest pending deadline, 0 when there is none */
+static uint64_t wheel_earliest(struct timer_wheel *wheel)
+{
+    struct timer_wheel_timer *timer;
+    uint64_t earliest = 0;
+    uint64_t i;
+
+    /* Timers due within one round are found in tick order */
+    for (i = 0; i < TIMER_WHEEL_SLOTS; ++i) {
+        uint64_t tick = wheel->current + i;
+
+        for (timer = wheel->slots[tick % TIMER_WHEEL_SLOTS]; timer; timer = timer->next) {
+            if (timer->deadline / wheel->tick > tick)
+                continue;
+            if (!earliest || timer->deadline < earliest)
+                earliest = timer->deadline;
+        }
+
+        if (earliest)
+            return earliest;
+    }
+
+    /* Only timers more than a round away, look at them all */
+    for (i = 0; i < TIMER_WHEEL_SLOTS; ++i)
+        for (timer = wheel->slots[i]; timer; timer = timer->next)
+            if (!earliest || timer->deadline < earliest)
+                earliest = timer->deadline;
+
+    return earliest;
+}
+
+/*
+  Moves due timers to the expired list.  They stay pending there, so
+  that a callback may still delete the ones after it.
+ */
+static void wheel_expire(
+    struct timer_wheel *wheel,
+    struct timer_wheel_timer **slot,
+    uint64_t now)
+{
+    struct timer_wheel_timer *timer, *next;
+
+    for (timer = *slot; timer; timer = next) {
+        next = timer->next;
+
+        if (timer->deadline > now)
+            continue;
+
+        timer_wheel_del(timer);
+        list_push(&wheel->expired, timer);
+    }
+}
+
+static
+void timer_wheel_cb(
+    struct ela_event_source *source, int fd,
+    uint32_t mask, void *data)
+{
+    struct timer_wheel *wheel = data;
+    struct timer_wheel_timer *timer;
+    uint64_t count, now, now_tick, tick, earliest;
+
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return;
+
+    now = timer_wheel_now();
+    now_tick = now / wheel->tick;
+    wheel->stats.wakeups++;
+
+    /*
+      Detach everything due first, callbacks may add timers to the
+      slots being walked.
+     */
+    if (now_tick - wheel->current >= TIMER_WHEEL_SLOTS) {
+        for (tick = 0; tick < TIMER_WHEEL_SLOTS; ++tick)
+            wheel_expire(wheel, &wheel->slots[tick], now);
+    } else {
+        for (tick = wheel->current; tick <= now_tick; ++tick)
+            wheel_expire(wheel, &wheel->slots[tick % TIMER_WHEEL_SLOTS],
+                         now);
+    }
+
+    wheel->current = now_tick;
+    wheel->armed = 0;
+    wheel->expiring = 1;
+
+    while ((timer = wheel->expired)) {
+        uint64_t late = now - timer->deadline;
+
+        timer_wheel_del(timer);
+
+        wheel->stats.expired++;
+        wheel->stats.late_sum += late;
+        if (late > wheel->stats.late_max)
+            wheel->stats.late_max = late;
+
+        timer->func(timer, now);
+    }
+
+    wheel->expiring = 0;
+
+    earliest = wheel_earliest(wheel);
+    if (earliest)
+        wheel_arm(wheel, earliest);
+}
+
+int timer_wheel_init(
+    struct timer_wheel *wheel,
+    struct ela_el *el,
+    uint64_t tick)
+{
+    memset(wheel, 0, sizeof(*wheel));
+
+    wheel->el = el;
+    wheel->tick = tick;
+    wheel->current = timer_wheel_now() / tick;
+
+    wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wheel->fd < 0)
+        return errno;
+
+    if (ela_source_alloc(el, timer_wheel_cb, wheel, &wheel->source)) {
+        close(wheel->fd);
+        return ENOMEM;
+    }
+
+    ela_set_fd(el, wheel->source, wheel->fd, ELA_EVENT_READABLE);
+    ela_add(el, wheel->source);
+
+    return 0;
+}
+
+void timer_wheel_deinit(struct timer_wheel *wheel)
+{
+    uint64_t i;
+
+    for (i = 0; i < TIMER_WHEEL_SLOTS; ++i)
+        while (wheel->slots[i])
+            timer_wheel_del(wheel->slots[i]);
+    while (wheel->expired)
+        timer_wheel_del(wheel->expired);
+
+    ela_remove(wheel->el, wheel->source);
+    ela_source_free(wheel->el, wheel->source);
+    close(wheel->fd);
+}
@@ -0,0 +1,107 @@
+/*
+  Foils_hid, HID device client for Foils
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <stdint.h>
+#include <ela/ela.h>
+
+/*
+  Timers hashed by tick in a fixed wheel, all driven by one timerfd.
+
+  The timerfd is armed at the exact deadline of the earliest timer,
+  and only re-armed when a timer becomes the new earliest one.
+  Postponing a timer costs no syscall, the wheel just wakes up at the
+  former deadline and re-arms.
+ */
+
+#define TIMER_WHEEL_SLOTS 256
+
+struct timer_wheel_timer;
+
+/* now is the monotonic time expiry was processed at, in ns */
+typedef void timer_wheel_func_t(struct timer_wheel_timer *timer, uint64_t now);
+
+struct timer_wheel_timer
+{
+    struct timer_wheel_timer *next;
+    /* NULL when not pending */
+    struct timer_wheel_timer **pprev;
+    uint64_t deadline;
+    timer_wheel_func_t *func;
+};
+
+struct timer_wheel_stats
+{
+    uint64_t expired;
+    uint64_t wakeups;
+    uint64_t arms;
+    /* Expiry lateness relative to deadline, in ns */
+    uint64_t late_sum;
+    uint64_t late_max;
+};
+
+struct timer_wheel
+{
+    struct ela_el *el;
+    struct ela_event_source *source;
+    int fd;
+    /* ns per slot */
+    uint64_t tick;
+    /* Last tick processed */
+    uint64_t current;
+    /* Deadline timerfd is armed for, 0 when idle */
+    uint64_t armed;
+    /* Set while running callbacks, arming is done once after them */
+    int expiring;
+    struct timer_wheel_timer *slots[TIMER_WHEEL_SLOTS];
+    /* Due timers not run yet, still pending and deletable */
+    struct timer_wheel_timer *expired;
+    struct timer_wheel_stats stats;
+};
+
+/* CLOCK_MONOTONIC, in ns */
+uint64_t timer_wheel_now(void);
+
+int timer_wheel_init(
+    struct timer_wheel *wheel,
+    struct ela_el *el,
+    uint64_t tick);
+
+void timer_wheel_deinit(struct timer_wheel *wheel);
+
+static inline
+void timer_wheel_timer_init(
+    struct timer_wheel_timer *timer,
+    timer_wheel_func_t *func)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->deadline = 0;
+    timer->func = func;
+}
+
+static inline
+int timer_wheel_pending(const struct timer_wheel_timer *timer)
+{
+    return timer->pprev != NULL;
+}
+
+/* Schedules timer at absolute deadline, rescheduling it if pending */
+void timer_wheel_add(
+    struct timer_wheel *wheel,
+    struct timer_wheel_timer *timer,
+    uint64_t deadline);
+
+void timer_wheel_del(struct timer_wheel_timer *timer);
+
+#endif